@@ -0,0 +1,606 @@
+/*
+Unit tests for tmpl, built and run by make test.
+
+tmpl.cpp is compiled into this file without its main, so the tests call its
+functions directly. make test points HOME at a scratch directory, so the
+template store the tests touch is not the user's.
+*/
+#define TMPL_NO_MAIN
+#include "../tmpl.cpp"
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(condition)                                                                                                   \
+    do {                                                                                                                   \
+        if (!(condition)) {                                                                                                \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": check failed: " #condition "\n";                                \
+            failures++;                                                                                                    \
+        }                                                                                                                  \
+    } while (0)
+
+#define CHECK_EQ(actual, expected)                                                                                         \
+    do {                                                                                                                   \
+        const auto& actual_value = (actual);                                                                               \
+        const auto& expected_value = (expected);                                                                           \
+        if (!(actual_value == expected_value)) {                                                                           \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " #actual " is " << actual_value << ", expected " << expected_value \
+                      << "\n";                                                                                             \
+            failures++;                                                                                                    \
+        }                                                                                                                  \
+    } while (0)
+
+/**
+ * @brief A directory under the system temporary directory, removed when it goes out of scope.
+ */
+class ScratchDir {
+public:
+    explicit ScratchDir(const std::string& name) {
+        static unsigned counter = 0;
+        path = fs::temp_directory_path() / ("tmpl-test-" + std::to_string(process_id()) + "-" + std::to_string(counter++) + "-" + name);
+        fs::remove_all(path);
+        fs::create_directories(path);
+    }
+    ~ScratchDir() {
+        std::error_code ec;
+        fs::remove_all(path, ec);
+    }
+    ScratchDir(const ScratchDir&) = delete;
+    ScratchDir& operator=(const ScratchDir&) = delete;
+
+    fs::path path;
+};
+
+/**
+ * @brief Discards what tmpl prints to stdout while in scope, so test output stays readable.
+ */
+class QuietStdout {
+public:
+    QuietStdout() : previous(std::cout.rdbuf(discarded.rdbuf())) {}
+    ~QuietStdout() { std::cout.rdbuf(previous); }
+    QuietStdout(const QuietStdout&) = delete;
+    QuietStdout& operator=(const QuietStdout&) = delete;
+
+private:
+    std::ostringstream discarded;
+    std::streambuf* previous;
+};
+
+// Captures std::cerr, where the commands report errors, for the lifetime of the object
+class CapturedStderr {
+public:
+    CapturedStderr() : previous(std::cerr.rdbuf(captured.rdbuf())) {}
+    ~CapturedStderr() { std::cerr.rdbuf(previous); }
+    CapturedStderr(const CapturedStderr&) = delete;
+    CapturedStderr& operator=(const CapturedStderr&) = delete;
+    std::string text() const { return captured.str(); }
+
+private:
+    std::ostringstream captured;
+    std::streambuf* previous;
+};
+
+// Known answers from FIPS 180-2 and the NIST examples
+const std::pair<std::string, const char*> SHA256_VECTORS[] = {
+    {"", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855"},
+    {"abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"},
+    {"abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+     "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1"},
+    {"abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+     "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1"},
+    {std::string(1000000, 'a'), "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"},
+};
+
+// Hashes text in pieces of the given size, so block boundaries fall inside update calls
+std::string sha256_in_pieces(const std::string& text, size_t piece, bool extensions) {
+    Sha256 sha(extensions);
+    for (size_t i = 0; i < text.size(); i += piece)
+        sha.update(text.data() + i, std::min(piece, text.size() - i));
+    return sha.hex_digest();
+}
+
+void test_sha256_known_answers() {
+    for (bool extensions : {false, true}) {
+        for (const auto& [text, expected] : SHA256_VECTORS) {
+            for (size_t piece : {text.size() + 1, size_t(1), size_t(63), size_t(64), size_t(65), size_t(1000)})
+                CHECK_EQ(sha256_in_pieces(text, piece, extensions), std::string(expected));
+        }
+    }
+#ifdef TMPL_X86
+    if (!sha_extensions_supported())
+        std::cout << "  (this CPU has no SHA extensions; both passes used the portable rounds)\n";
+#endif
+}
+
+void test_sha256_paths_agree() {
+    // Every length around the padding boundaries, through both compression paths
+    std::string text;
+    for (size_t length = 0; length < 300; ++length) {
+        CHECK_EQ(sha256_in_pieces(text, 7, true), sha256_in_pieces(text, 7, false));
+        text += static_cast<char>(length * 31 + 7);
+    }
+}
+
+void test_hash_file_matches_hash_text() {
+    ScratchDir dir("hash");
+    std::string contents(3 * COPY_BUFFER_SIZE + 17, 'x');
+    for (size_t i = 0; i < contents.size(); i += 97)
+        contents[i] = static_cast<char>(i);
+    std::ofstream(dir.path / "file", std::ios::binary) << contents;
+    std::error_code ec;
+    CHECK_EQ(hash_file(dir.path / "file", ec), hash_text(contents));
+    CHECK(!ec);
+}
+
+/**
+ * @brief Fills root with a tree of text, binary and empty files in nested directories.
+ *
+ * There are more small files than one asynchronous batch holds, some files
+ * above the asynchronous size limit, and files with different modes.
+ */
+void generate_test_tree(const fs::path& root) {
+    const uintmax_t sizes[] = {0, 1, 100, 4095, 4096, 4097, 65536, 100000, ASYNC_COPY_MAX_SIZE, ASYNC_COPY_MAX_SIZE + 1, 0};
+    const fs::perms modes[] = {fs::perms(0644), fs::perms(0755), fs::perms(0600)};
+    unsigned seed = 1;
+    for (size_t i = 0; i < 3 * ASYNC_COPY_DEPTH; ++i) {
+        fs::path dir = root / ("d" + std::to_string(i % 5)) / (i % 2 ? "nested" : "");
+        fs::create_directories(dir);
+        uintmax_t size = sizes[i % std::size(sizes)];
+        std::string contents(static_cast<size_t>(size), '\0');
+        bool text = i % 3 != 0;
+        // Text is made of a few words, like source code; binary contents are noise
+        const std::string_view words[] = {"int ", "return ", "value", " = ", "(", ");\n", "    ", "{{name}}", "}\n", "if "};
+        for (size_t at = 0; at < contents.size();) {
+            seed = seed * 1103515245 + 12345;
+            std::string_view piece = text ? words[(seed >> 16) % std::size(words)] : std::string_view(reinterpret_cast<const char*>(&seed), 2);
+            size_t take = std::min(piece.size(), contents.size() - at);
+            contents.replace(at, take, piece.data(), take);
+            at += take;
+        }
+        fs::path file = dir / ("f" + std::to_string(i) + (text ? ".txt" : ".bin"));
+        std::ofstream(file, std::ios::binary) << contents;
+        fs::permissions(file, modes[i % std::size(modes)]);
+    }
+    fs::create_directories(root / "empty" / "dir");
+}
+
+/**
+ * @brief Describes every entry under root by its relative path, kind, permissions and contents.
+ */
+std::map<std::string, std::string> describe_tree(const fs::path& root) {
+    std::map<std::string, std::string> tree;
+    for (const auto& entry : fs::recursive_directory_iterator(root)) {
+        std::string description = entry.is_directory() ? "dir " : "file ";
+        std::ostringstream mode;
+        mode << std::oct << (static_cast<unsigned>(entry.status().permissions()) & 0777);
+        description += mode.str();
+        if (!entry.is_directory()) {
+            std::string contents;
+            read_file(entry.path(), contents);
+            description += " " + std::to_string(contents.size()) + " " + hash_text(contents);
+        }
+        tree[entry.path().lexically_relative(root).generic_string()] = description;
+    }
+    return tree;
+}
+
+// Checks that two trees hold the same entries, reporting each entry that differs
+void check_same_tree(const fs::path& actual, const fs::path& expected) {
+    auto actual_tree = describe_tree(actual);
+    auto expected_tree = describe_tree(expected);
+    for (const auto& [path, description] : expected_tree) {
+        auto found = actual_tree.find(path);
+        CHECK_EQ(path + ": " + (found == actual_tree.end() ? "missing" : found->second), path + ": " + description);
+    }
+    CHECK_EQ(actual_tree.size(), expected_tree.size());
+}
+
+void test_async_copier_copies_small_files() {
+#ifdef TMPL_ASYNC_COPY
+    AsyncCopier copier;
+    if (!copier.open()) {
+        std::cout << "  (io_uring is not available here; skipped)\n";
+        return;
+    }
+    ScratchDir dir("async");
+    generate_test_tree(dir.path / "src");
+    std::vector<AsyncCopyJob> jobs;
+    for (const auto& entry : fs::recursive_directory_iterator(dir.path / "src")) {
+        fs::path dst = dir.path / "dst" / entry.path().lexically_relative(dir.path / "src");
+        if (entry.is_directory())
+            fs::create_directories(dst);
+        else if (entry.file_size() <= ASYNC_COPY_MAX_SIZE)
+            jobs.push_back({entry.path(), dst, entry.status().permissions(), entry.file_size(), dst.string()});
+    }
+    CHECK(jobs.size() > ASYNC_COPY_DEPTH);
+    CHECK(std::any_of(jobs.begin(), jobs.end(), [](const AsyncCopyJob& job) { return job.size == 0; }));
+    std::vector<int> results = copier.copy(jobs);
+    CHECK_EQ(results.size(), jobs.size());
+    for (size_t i = 0; i < results.size(); ++i)
+        CHECK_EQ(jobs[i].report_path + ": " + std::to_string(results[i]), jobs[i].report_path + ": 0");
+    // The files too large for the ring are the only ones missing
+    for (const auto& entry : fs::recursive_directory_iterator(dir.path / "src")) {
+        if (!entry.is_directory() && entry.file_size() > ASYNC_COPY_MAX_SIZE)
+            fs::copy_file(entry.path(), dir.path / "dst" / entry.path().lexically_relative(dir.path / "src"));
+    }
+    check_same_tree(dir.path / "dst", dir.path / "src");
+#else
+    std::cout << "  (no io_uring on this platform; skipped)\n";
+#endif
+}
+
+void test_uring_and_pool_copies_match() {
+    ScratchDir dir("io");
+    generate_test_tree(dir.path / "src");
+    CopyOptions options;
+    options.io = IoBackend::Pool;
+    CHECK(copy_template(dir.path / "src", dir.path / "pool", options));
+    options.io = IoBackend::Uring;
+    CHECK(copy_template(dir.path / "src", dir.path / "uring", options));
+    check_same_tree(dir.path / "pool", dir.path / "src");
+    check_same_tree(dir.path / "uring", dir.path / "pool");
+}
+
+#ifdef TMPL_REGISTRY
+/**
+ * @brief A loopback HTTP server that answers each request with the next canned response.
+ *
+ * A response that ends with the connection closing (Connection: close, or no
+ * length at all) is followed by closing the socket, as a server would.
+ */
+class CannedHttpServer {
+public:
+    explicit CannedHttpServer(std::vector<std::string> responses) : responses(std::move(responses)) {
+        listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t length = sizeof(address);
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || listen(listener, 4) != 0 ||
+            getsockname(listener, reinterpret_cast<sockaddr*>(&address), &length) != 0)
+            return;
+        url.host = "127.0.0.1";
+        url.port = std::to_string(ntohs(address.sin_port));
+        url.prefix = "/registry";
+        server = std::thread([this] { serve(); });
+    }
+    ~CannedHttpServer() {
+        stop();
+        close(listener);
+    }
+
+    /**
+     * @brief Stops the server and returns the heads of the requests it received.
+     */
+    const std::vector<std::string>& stop() {
+        shutdown(listener, SHUT_RDWR);
+        if (server.joinable())
+            server.join();
+        return requests;
+    }
+
+    RegistryUrl url;
+
+private:
+    void serve() {
+        size_t next = 0;
+        while (next < responses.size()) {
+            int connection = accept(listener, nullptr, nullptr);
+            if (connection < 0)
+                return;
+            std::string received;
+            while (next < responses.size()) {
+                size_t end;
+                char chunk[4096];
+                ssize_t count = 0;
+                while ((end = received.find("\r\n\r\n")) == std::string::npos && (count = recv(connection, chunk, sizeof(chunk), 0)) > 0)
+                    received.append(chunk, static_cast<size_t>(count));
+                if (end == std::string::npos)
+                    break; // The client closed the connection
+                requests.push_back(received.substr(0, end));
+                received.erase(0, end + 4);
+                const std::string& response = responses[next++];
+                send(connection, response.data(), response.size(), MSG_NOSIGNAL);
+                std::string lower = response.substr(0, response.find("\r\n\r\n"));
+                std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+                if (lower.find("connection: close") != std::string::npos ||
+                    (lower.find("content-length") == std::string::npos && lower.find("chunked") == std::string::npos))
+                    break;
+            }
+            close(connection);
+        }
+    }
+
+    std::vector<std::string> responses;
+    std::vector<std::string> requests;
+    int listener = -1;
+    std::thread server;
+};
+
+void test_http_response_parsing() {
+    CannedHttpServer server({
+        // A range sent in chunks, with a trailer field
+        "HTTP/1.1 206 Partial Content\r\nTransfer-Encoding: chunked\r\nContent-Range: bytes 2-7/10\r\n\r\n"
+        "2\r\n23\r\n4;name=value\r\n4567\r\n0\r\nExpires: never\r\n\r\n",
+        // A range with a Content-Length, on the same keep-alive connection
+        "HTTP/1.1 206 Partial Content\r\ncontent-length: 3\r\ncontent-range: bytes 0-2/10\r\n\r\n012",
+        // The whole file, ended by closing the connection
+        "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n\r\n0123456789",
+        // A server that ignores Range and sends the whole file
+        "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n0123456789",
+        // The same on HTTP/1.0, which closes the connection
+        "HTTP/1.0 200 OK\r\nContent-Length: 10\r\n\r\n0123456789",
+        // A range beyond the end of a file sent whole
+        "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n0123456789",
+        // A range of the wrong length
+        "HTTP/1.1 206 Partial Content\r\nContent-Length: 2\r\n\r\n01",
+        "HTTP/1.1 404 Not Found\r\nContent-Length: 9\r\n\r\nnot found",
+        "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\nConnection: close\r\n\r\n",
+    });
+    std::string body;
+    std::string error;
+    uint64_t total = 0;
+    {
+        HttpConnection connection(server.url);
+        CHECK(connection.get("t/.pack", 2, 6, body, error, &total));
+        CHECK_EQ(body, std::string("234567"));
+        CHECK_EQ(total, uint64_t(10));
+        CHECK(connection.get("t/.pack", 0, 3, body, error, &total));
+        CHECK_EQ(body, std::string("012"));
+        CHECK(connection.get("t/.pack", 0, std::nullopt, body, error, &total));
+        CHECK_EQ(body, std::string("0123456789"));
+        CHECK_EQ(total, uint64_t(10));
+        CHECK(connection.get("t/.pack", 3, 4, body, error, &total));
+        CHECK_EQ(body, std::string("3456"));
+        CHECK_EQ(total, uint64_t(10));
+        CHECK(connection.get("t/.pack", 5, 5, body, error));
+        CHECK_EQ(body, std::string("56789"));
+        CHECK(!connection.get("t/.pack", 8, 4, body, error));
+        CHECK_EQ(error, std::string("the file is shorter than expected"));
+        CHECK(!connection.get("t/.pack", 0, 4, body, error));
+        CHECK_EQ(error, std::string("the server returned a different range"));
+        CHECK(!connection.get("missing/.pack", 0, 4, body, error));
+        CHECK_EQ(error, std::string()); // A missing file is not an error
+        CHECK(!connection.get("t/.pack", 0, 4, body, error));
+        CHECK_EQ(error, std::string("HTTP status 500"));
+    }
+    const std::vector<std::string>& requests = server.stop();
+    CHECK_EQ(requests.size(), size_t(9));
+    if (requests.size() > 2) {
+        CHECK(requests[0].find("GET /registry/t/.pack HTTP/1.1\r\n") == 0);
+        CHECK(requests[0].find("\r\nRange: bytes=2-7") != std::string::npos);
+        CHECK(requests[2].find("Range:") == std::string::npos);
+    }
+}
+#endif
+
+void test_scan_placeholders_skips_links() {
+    ScratchDir dir("scan");
+    fs::create_directories(dir.path / "src" / "d");
+    std::ofstream(dir.path / "src" / "d" / "main.txt") << "{{name}}\n";
+    std::ofstream(dir.path / "outside.txt") << "{{secret}}\n";
+    fs::create_symlink("..", dir.path / "src" / "d" / "up"); // A loop
+    fs::create_symlink(dir.path / "outside.txt", dir.path / "src" / "outside.txt");
+    std::vector<std::pair<std::string, RenderEntry>> files;
+    CHECK(scan_placeholders(dir.path / "src", 2, nullptr, files));
+    CHECK_EQ(files.size(), size_t(1));
+    if (!files.empty())
+        CHECK_EQ(files[0].first, std::string("d/main.txt"));
+}
+
+void test_write_meta_replaces_meta() {
+    ScratchDir dir("meta");
+    fs::create_directories(dir.path / "t");
+    std::ofstream(dir.path / "t" / ".meta") << META_HEADER << "\nTags:old\n";
+    CHECK(write_meta(dir.path / "t", {{"Tags", "new"}, {"Link", ""}}));
+    std::string text;
+    read_file(dir.path / "t" / ".meta", text);
+    CHECK_EQ(text, META_HEADER + "\nTags:new\n");
+    CHECK_EQ(std::distance(fs::directory_iterator(dir.path / "t"), fs::directory_iterator()), std::ptrdiff_t(1));
+    // A failed write reports it and leaves nothing behind
+    CHECK(!write_meta(dir.path / "missing", {{"Tags", "new"}}));
+    CHECK(!fs::exists(dir.path / "missing"));
+}
+
+void test_pack_and_objects_refuse_links() {
+    ScratchDir dir("pack-links");
+    fs::create_directories(dir.path / "src" / "d");
+    std::ofstream(dir.path / "src" / "d" / "main.txt") << "main\n";
+    fs::create_symlink("..", dir.path / "src" / "d" / "up"); // A loop
+    fs::create_symlink("d/main.txt", dir.path / "src" / "main.txt");
+    CapturedStderr errors;
+    {
+        QuietStdout quiet;
+        CHECK(!write_pack(dir.path / "src", dir.path / "template", CopyOptions(), Compression::None));
+    }
+    CHECK(!fs::exists(dir.path / "template" / ".pack"));
+    {
+        QuietStdout quiet;
+        CHECK(!store_objects(dir.path / "src", dir.path / "template", CopyOptions()));
+    }
+    CHECK(!fs::exists(dir.path / "template" / ".manifest"));
+    CHECK(errors.text().find("Cannot pack " + (dir.path / "src" / "main.txt").string()) != std::string::npos);
+    CHECK(errors.text().find("Cannot store " + (dir.path / "src" / "d" / "up").string()) != std::string::npos);
+}
+
+void test_pack_round_trip() {
+    ScratchDir dir("pack");
+    generate_test_tree(dir.path / "src");
+    for (Compression compression : {Compression::None, Compression::Auto, Compression::Zstd, Compression::Lz4}) {
+        fs::path template_path = dir.path / ("template" + std::to_string(static_cast<int>(compression)));
+        fs::path project = dir.path / ("project" + std::to_string(static_cast<int>(compression)));
+        {
+            QuietStdout quiet;
+            CHECK(write_pack(dir.path / "src", template_path, CopyOptions(), compression));
+        }
+        std::vector<PackEntry> entries;
+        CHECK(read_pack_table(template_path / ".pack", entries));
+        size_t files = 0;
+        for (const auto& entry : entries) {
+            if (entry.directory)
+                continue;
+            files++;
+            std::string contents;
+            read_file(dir.path / "src" / entry.path, contents);
+            CHECK_EQ(entry.path + " " + std::to_string(entry.size) + " " + entry.hash,
+                     entry.path + " " + std::to_string(contents.size()) + " " + hash_text(contents));
+            CHECK(pack_codec_available(entry.codec));
+        }
+        CHECK_EQ(files, size_t(3 * ASYNC_COPY_DEPTH));
+        // Builds with a codec must actually use it for the text files
+        auto uses = [&](uint8_t codec) {
+            return std::any_of(entries.begin(), entries.end(), [&](const PackEntry& entry) { return entry.codec == codec; });
+        };
+#ifdef TMPL_WITH_ZSTD
+        if (compression == Compression::Zstd)
+            CHECK(uses(PACK_ZSTD));
+#endif
+#ifdef TMPL_WITH_LZ4
+        if (compression == Compression::Lz4)
+            CHECK(uses(PACK_LZ4));
+#endif
+        if (compression == Compression::None)
+            CHECK(!uses(PACK_ZSTD) && !uses(PACK_LZ4));
+
+        TemplateListing listing;
+        CHECK(load_template_listing(template_path, 1, listing));
+        CHECK(listing.packed());
+        CHECK(copy_listing(listing, project));
+        check_same_tree(project, dir.path / "src");
+    }
+}
+
+#ifndef OS_WINDOWS
+/**
+ * @brief Runs a tmpl command line in this process and returns what it printed to stdout.
+ */
+std::string run_tmpl(std::vector<std::string> args) {
+    args.insert(args.begin(), "tmpl");
+    std::vector<char*> argv;
+    for (auto& arg : args)
+        argv.push_back(&arg[0]);
+    argv.push_back(nullptr);
+    // Commands print with both iostreams and printf, so stdout is captured at the descriptor
+    std::cout.flush();
+    fflush(stdout);
+    FILE* captured = tmpfile();
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(captured), STDOUT_FILENO);
+    run_command(static_cast<int>(args.size()), argv.data());
+    std::cout.flush();
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    std::string output;
+    rewind(captured);
+    char chunk[4096];
+    for (size_t count; (count = fread(chunk, 1, sizeof(chunk), captured)) > 0;)
+        output.append(chunk, count);
+    fclose(captured);
+    return output;
+}
+
+bool contains(const std::string& text, const std::string& part) {
+    return text.find(part) != std::string::npos;
+}
+
+// store() is opened once per process, so this is the only test that calls it
+void test_memory_store_commands() {
+    setenv("TMPL_STORE", "memory", 1);
+    CHECK_EQ(store().location(), std::string("memory"));
+    if (store().location() != "memory")
+        return;
+    CHECK(store().directory().empty());
+
+    // A template staged as save stages one, with tags and the offsets of its placeholders
+    ScratchDir dir("memory");
+    fs::path staged = dir.path / "staged";
+    fs::create_directories(staged / "src" / "{{name}}");
+    std::ofstream(staged / "src" / "{{name}}" / "main.txt") << "hello {{name}}\n";
+    std::ofstream(staged / "empty.txt").close();
+    fs::permissions(staged / "empty.txt", fs::perms(0600));
+    fs::create_symlink("src", staged / "link");
+    MetaEntries entries = {{"Tags", "cpp,cli"}};
+    std::vector<std::pair<std::string, RenderEntry>> rendered;
+    CHECK(scan_placeholders(staged, 1, nullptr, rendered));
+    for (const auto& [path, found] : rendered)
+        entries.emplace_back("Render", format_render_entry(path, found));
+    write_meta(staged, entries);
+
+    std::error_code ec;
+    CHECK(store().publish(staged, "app", false, ec));
+    CHECK(!fs::exists(staged)); // Consumed, as a rename into the store would
+    fs::create_directories(staged);
+    CHECK(!store().publish(staged, "app", false, ec));
+    CHECK(ec == std::errc::file_exists);
+
+    std::string listed = run_tmpl({"list"});
+    CHECK(contains(listed, "Available templates in \"memory\""));
+    CHECK(contains(listed, "app") && contains(listed, "cpp, cli"));
+    CHECK(contains(run_tmpl({"list", "--tags", "cli"}), "app"));
+    CHECK(!contains(run_tmpl({"list", "--tags", "rust"}), "app"));
+
+    std::string files = run_tmpl({"files", "app"});
+    CHECK(contains(files, "src/{{name}}/main.txt"));
+    CHECK(contains(files, "0600            0 empty.txt"));
+    CHECK(contains(files, "link -> src"));
+
+    fs::path project = dir.path / "project";
+    CHECK(contains(run_tmpl({"make", "app", project.string(), "--set", "name=demo"}), "Template created successfully!"));
+    std::string contents;
+    CHECK(read_file(project / "src" / "demo" / "main.txt", contents));
+    CHECK_EQ(contents, std::string("hello demo\n"));
+    CHECK(fs::is_symlink(project / "link"));
+    CHECK(fs::status(project / "empty.txt").permissions() == fs::perms(0600));
+    CHECK(contains(run_tmpl({"make", "missing", (dir.path / "other").string()}), "Template does not exist."));
+
+    CHECK(contains(run_tmpl({"save", "copy", project.string()}), "needs templates stored in a local directory"));
+    CHECK(contains(run_tmpl({"delete", "app"}), "Template deleted successfully!"));
+    CHECK(contains(run_tmpl({"delete", "app"}), "Template doesn't exist!"));
+    CHECK(contains(run_tmpl({"list"}), "No templates found"));
+}
+#endif
+
+struct TestCase {
+    const char* name;
+    void (*run)();
+};
+
+const TestCase TESTS[] = {
+    {"sha256 known answers", test_sha256_known_answers},
+    {"sha256 paths agree", test_sha256_paths_agree},
+    {"hash_file matches hash_text", test_hash_file_matches_hash_text},
+    {"async copier copies small files", test_async_copier_copies_small_files},
+    {"uring and pool copies match", test_uring_and_pool_copies_match},
+    {"scan placeholders skips links", test_scan_placeholders_skips_links},
+    {"write_meta replaces .meta", test_write_meta_replaces_meta},
+    {"pack and objects refuse links", test_pack_and_objects_refuse_links},
+    {"pack round trip", test_pack_round_trip},
+#ifdef TMPL_REGISTRY
+    {"http response parsing", test_http_response_parsing},
+#endif
+#ifndef OS_WINDOWS
+    {"memory store commands", test_memory_store_commands},
+#endif
+};
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    // Runs the tests whose names contain the first argument, or all of them
+    std::string_view filter = argc > 1 ? argv[1] : "";
+    int failed_tests = 0;
+    for (const auto& test : TESTS) {
+        if (std::string_view(test.name).find(filter) == std::string_view::npos)
+            continue;
+        int before = failures;
+        test.run();
+        bool passed = failures == before;
+        failed_tests += !passed;
+        std::cout << (passed ? "ok   " : "FAIL ") << test.name << std::endl;
+    }
+    if (failed_tests > 0)
+        std::cout << failed_tests << " tests failed.\n";
+    return failed_tests == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
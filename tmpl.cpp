@@ -1,15 +1,82 @@
 #include <iostream>
 #include <filesystem>
 #include <string>
+#include <string_view>
+#include <charconv>
 #include <cstring>
 #include <vector>
 #include <fstream>
 #include <sstream>
 #include <algorithm>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <map>
+#include <unordered_map>
+#include <set>
+#include <cstdint>
+#include <chrono>
+#include <ctime>
+#include <cmath>
+#include <cctype>
+#include <cstdlib>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    #define TMPL_X86
+    #include <immintrin.h>
+#elif defined(__aarch64__) || defined(_M_ARM64)
+    #define TMPL_NEON
+    #include <arm_neon.h>
+#endif
+#ifdef _MSC_VER
+    #include <intrin.h>
+#endif
+
+#ifdef TMPL_WITH_ZSTD
+    #include <zstd.h>
+#endif
+#ifdef TMPL_WITH_LZ4
+    #include <lz4frame.h>
+#endif
 
 #if defined(_WIN32) || defined(_WIN64)
     #define OS_WINDOWS
     #include <windows.h>
+    #include <winioctl.h>
+#else
+    #include <fcntl.h>
+    #include <unistd.h>
+    #include <sys/stat.h>
+    #include <sys/ioctl.h>
+    #include <sys/file.h>
+    #include <sys/mman.h>
+    #include <sys/wait.h>
+    #include <signal.h>
+    #include <sys/socket.h>
+    #include <netdb.h>
+    #include <netinet/in.h>
+    #include <netinet/tcp.h>
+    #define TMPL_REGISTRY // registry:// templates are fetched over plain sockets
+    #if defined(__linux__)
+        #include <linux/fs.h>
+        #include <sys/sendfile.h>
+        #include <sys/syscall.h>
+        #include <linux/io_uring.h>
+        #include <sys/inotify.h>
+        #include <sys/un.h>
+        #include <poll.h>
+        #include <csignal>
+        #define TMPL_DAEMON // tmpl daemon needs inotify and Unix sockets
+    #elif defined(__APPLE__)
+        #include <sys/clonefile.h>
+        #include <copyfile.h>
+    #endif
 #endif
 
 /*
@@ -17,21 +84,122 @@ Template Manager (tmpl):
 A command-line tool for saving, creating, listing, and deleting file system templates with tag support.
 
 Usage:
-  tmpl save <template_name> <directory_to_save> [--tags tag1,tag2,...]
+  tmpl save <template_name> <directory_to_save> [--tags tag1,tag2,...] [--dedup|--pack] [--compress[=auto|zstd|lz4|none]] [--update [--checksum]] [--gitignore] [--dry-run] [copy options]
       - Saves the contents of the specified directory as a template with optional tags.
+        --dedup stores the files in the shared object store (~/.templates/.objects), writing
+        only contents that are not stored yet. Deleting such a template removes the objects
+        no other template uses. --pack stores the files in a single pack file, which make
+        reads through a memory mapping. --compress implies --pack and compresses each blob,
+        picking stored, lz4 or zstd from its size and entropy unless a codec is given;
+        zstd and lz4 require building with ZSTD=1 and LZ4=1.
+        --update replaces an existing template, keeping its layout and .meta entries unless
+        given again. Files whose size, permissions and modification time (or with --checksum,
+        contents) did not change are reused; the new version is swapped in atomically.
+        Paths matched by the source's .tmplignore (gitignore syntax) are not saved, and with
+        --gitignore neither are .git and what the source's .gitignore ignores.
+        --dry-run prints what would be saved, reused and copied and how long it should take.
 
-  tmpl make <template_name> <destination>
+  tmpl make <template_name> <destination> [--set key=value]... [--vars file] [--dry-run] [copy options]
       - Creates a new project from the specified template in the given destination directory.
+        --set and --vars (a file of key=value lines) give values for {{key}} placeholders in
+        file contents and path names. save records where each file's placeholders are, so
+        only files that have them are rendered; the rest are copied or linked as usual.
+        Directory templates are replayed from a cached plan (~/.templates/.tmpl/plans) while
+        none of their directories changed; symbolic links, directory modes and modification
+        times are restored after the files are written. --dry-run prints the plan instead:
+        what would be rendered, linked and copied, and an estimate from earlier runs.
+
+  tmpl make registry://<template_name> <destination> [--set key=value]... [--vars file] [copy options]
+      - Creates a project from a packed or deduplicated template served over http:// from
+        the registry in TMPL_REGISTRY (laid out like ~/.templates). Only blobs missing from
+        the object store and the blob cache (~/.templates/.tmpl/blobs) are downloaded, with
+        parallel range requests, and written into the project as they arrive (POSIX only).
 
-  tmpl list [--tags tag1,tag2,...]
+  tmpl make <base+layer+...> <destination> [--merge glob1,glob2,...] [--set key=value]... [copy options]
+      - Creates a project from templates laid over each other, bottom first. Their listings are
+        resolved in memory: a later layer's file replaces an earlier one at the same path and
+        directories are merged, so every file is written once. Files matching --merge (such as
+        .gitignore) are concatenated across layers instead. Each layer keeps its link policy.
+
+  tmpl make --batch <file|-> [--set key=value]... [--vars file] [copy options]
+      - Creates one project per "<template_name> <destination>" line of the file (or stdin).
+        Each template is enumerated once and all destinations are written in parallel.
+
+  Copy options:
+    --jobs N                 Number of copy threads (defaults to the hardware concurrency).
+    --copy-strategy=S        auto (default), reflink, kernel or buffered. auto tries a
+                             copy-on-write clone, then an in-kernel copy, then a buffered copy.
+                             Sparse files that cannot be cloned are copied extent by extent.
+    --report                 Print the strategy used for each file.
+    --io=B                   auto (default), pool, uring or iocp. auto copies small files
+                             through io_uring (Linux) or I/O completion ports (Windows) in
+                             batches, and falls back to the thread pool where neither works.
+    --link=copy|hard|sym     Hard-link or symlink files back into the stored template instead
+                             of copying them. On save, stores the template's default policy.
+    --mutable=glob1,...      Files matching these globs are always copied when linking.
+    --exclude=rule1,...      Leave out paths matching these .gitignore-style rules.
+    --include=glob1,...      Keep only files matching these globs or inside matching directories.
+
+  tmpl list [--tags tag1,tag2,... [--all]] [--not tag1,...] [--query EXPR] [--long] [--sort=KEY [--reverse]]
       - Lists all available templates, optionally filtering by tags.
+        --tags matches templates with any of the tags, or all of them with --all.
+        --not hides templates with any of the tags. --query takes a boolean
+        expression of tags with & (and), | (or), ! (not) and parentheses.
+        --long (-l) shows each template's files, size, stored size, save time, last
+        make and make count, all read from the index. --sort orders by name, files,
+        size, stored, saved, used or makes, largest or newest first; --reverse flips it.
+
+  tmpl files <template_name>
+      - Lists the files of a template (mode, size and path, and the target of each link).
 
   tmpl delete <template_name>
       - Deletes the specified template.
 
+  tmpl reindex [--check]
+      - Rescans every template into the index that list reads, or only checks whether it is
+        stale. list itself rescans just the templates whose top directory or .meta changed.
+        reindex also drops the cached plans of directory templates.
+
+  tmpl verify <template_name>...|--all [--quick] [--jobs N]
+      - Rehashes a template's files and reports those that are damaged, missing or unexpected.
+        --quick compares sizes and modification times instead of contents.
+
   tmpl tag add|remove <template_name> <tag1,tag2,...>
       - Adds or removes tags from a specified template.
 
+  tmpl link <template_name> copy|hard|sym [--mutable glob1,glob2,...]
+      - Sets how make materializes the template's immutable files.
+
+  tmpl bench [--shapes tiny,huge,deep,wide] [--strategies auto,reflink,...] [--runs N] [--scale F] [--keep]
+      - Times save, make and list on synthetic templates under every copy strategy and
+        prints the results as JSON (progress goes to stderr).
+
+  tmpl bench scan [--size MiB] [file...]
+      - Compares the scalar and SIMD placeholder scanners on generated template content
+        (64 MiB by default) or on the given files.
+
+  tmpl daemon start|run|stop|status
+      - Keeps the template index and template listings in memory, refreshed through inotify,
+        and answers list and make for tmpl processes using the same store (Linux only).
+        start runs it in the background, run in the foreground. TMPL_NO_DAEMON=1 bypasses it.
+
+  Global options (any command):
+    --stats                  Print wall time, time per phase, file, byte and system call
+                             counts and the copy method of each file to stderr.
+    --trace FILE             Write the phases of every worker as Chrome trace events to FILE,
+                             for Perfetto or chrome://tracing.
+
+  Environment:
+    TMPL_STORE=dir|registry|memory
+                             Where list, files, make and delete find templates: the directory
+                             ~/.templates (default), or read-only, the registry in TMPL_REGISTRY.
+                             memory keeps templates in the process, for the unit tests.
+
+  tmpl complete --script bash|zsh|fish|powershell
+      - Prints a shell completion script. The script runs "tmpl complete <words>..." for each
+        completion, which prints only the matching commands, template names or tags. Names
+        are looked up in the index with a binary search, reading nothing else while it is current.
+
   tmpl help
       - Displays help instructions.
 
@@ -63,256 +231,10137 @@ fs::path get_home_directory() {
         std::cerr << "Unable to determine home directory." << std::endl;
         exit(EXIT_FAILURE);
     }
-#endif
+#endif
+}
+
+// Directory where templates are stored
+const fs::path TEMPLATE_DIR = get_home_directory() / ".templates";
+
+/**
+ * @brief Reads a whole file with one read call.
+ *
+ * @param path The file to read.
+ * @param text Receives the contents; empty if the file is missing or empty.
+ * @return False if the file cannot be read.
+ */
+bool read_file(const fs::path& path, std::string& text) {
+    text.clear();
+    std::ifstream in(path, std::ios::binary | std::ios::ate);
+    if (!in)
+        return false;
+    std::streamoff size = in.tellg();
+    if (size <= 0)
+        return size == 0;
+    text.resize(static_cast<size_t>(size));
+    in.seekg(0);
+    if (!in.read(text.data(), size)) {
+        text.clear();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief A template's .meta file as ordered "Key:value" entries.
+ */
+using MetaEntries = std::vector<std::pair<std::string, std::string>>;
+
+// First line of a versioned .meta file; older files hold only the "Key:value" lines
+const std::string META_HEADER = "tmpl-meta 1";
+
+/**
+ * @brief A template's .meta file, read in one call and parsed on demand.
+ *
+ * Lookups walk the buffer and pass string_views into it, so reading one key
+ * such as Tags allocates nothing per line. Files that start with a
+ * "tmpl-meta <version>" line and older files of bare "Key:value" lines are
+ * both read; lines without a key are skipped.
+ */
+class MetaView {
+public:
+    MetaView() = default;
+
+    /**
+     * @brief Reads a template's .meta file; a missing file has no entries.
+     */
+    explicit MetaView(const fs::path& template_path) {
+        read_file(template_path / ".meta", text);
+        skip_header();
+    }
+
+    /**
+     * @brief Takes the contents of a .meta file, such as one fetched from a registry.
+     */
+    explicit MetaView(std::string contents) : text(std::move(contents)) { skip_header(); }
+
+    /**
+     * @brief Calls visit(key, value) for every entry, in file order.
+     */
+    template <typename Visitor>
+    void for_each(Visitor&& visit) const {
+        std::string_view rest(text);
+        rest.remove_prefix(body);
+        while (!rest.empty()) {
+            size_t end = rest.find('\n');
+            std::string_view line = rest.substr(0, end);
+            rest.remove_prefix(end == std::string_view::npos ? rest.size() : end + 1);
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos && colon != 0)
+                visit(line.substr(0, colon), line.substr(colon + 1));
+        }
+    }
+
+    /**
+     * @brief Calls visit(value) for every entry with the given key, in file order.
+     */
+    template <typename Visitor>
+    void for_each(std::string_view key, Visitor&& visit) const {
+        for_each([&](std::string_view entry_key, std::string_view value) {
+            if (entry_key == key)
+                visit(value);
+        });
+    }
+
+    /**
+     * @brief Returns the value of the first entry with the given key, or an empty view.
+     */
+    std::string_view value(std::string_view key) const {
+        std::string_view found;
+        bool seen = false;
+        for_each(key, [&](std::string_view value) {
+            if (!seen)
+                found = value;
+            seen = true;
+        });
+        return found;
+    }
+
+    /**
+     * @brief Copies the entries out for editing.
+     */
+    MetaEntries entries() const {
+        MetaEntries copied;
+        for_each([&](std::string_view key, std::string_view value) { copied.emplace_back(key, value); });
+        return copied;
+    }
+
+private:
+    void skip_header() {
+        if (text.compare(0, 10, "tmpl-meta ") == 0) {
+            size_t end = text.find('\n');
+            body = end == std::string::npos ? text.size() : end + 1;
+        }
+    }
+
+    std::string text;
+    size_t body = 0; // Where the entries start, past the version line
+};
+
+/**
+ * @brief Reads the entries of a template's .meta file.
+ *
+ * @param template_path Path to the template directory.
+ * @return The entries in file order; empty if there is no .meta file.
+ */
+MetaEntries read_meta(const fs::path& template_path) {
+    return MetaView(template_path).entries();
+}
+
+/**
+ * @brief Returns the id of this process, which names its temporary and staging paths.
+ */
+unsigned long process_id() {
+#ifdef OS_WINDOWS
+    return GetCurrentProcessId();
+#else
+    return static_cast<unsigned long>(getpid());
+#endif
+}
+
+/**
+ * @brief Writes a template's .meta file in the versioned format, dropping entries with empty values.
+ *
+ * The entries are written to a temporary file that is renamed over .meta, so
+ * a failed write leaves the previous .meta in place.
+ *
+ * @param template_path Path to the template directory.
+ * @param entries The entries to write.
+ * @return False if the file could not be written.
+ */
+bool write_meta(const fs::path& template_path, const MetaEntries& entries) {
+    std::string text = META_HEADER + "\n";
+    for (const auto& [key, value] : entries) {
+        if (!value.empty())
+            text += key + ":" + value + "\n";
+    }
+    fs::path meta_path = template_path / ".meta";
+    fs::path temp = meta_path;
+    temp += ".tmp" + std::to_string(process_id());
+    std::error_code ec;
+    std::ofstream meta_file(temp, std::ios::binary | std::ios::trunc);
+    meta_file.write(text.data(), static_cast<std::streamsize>(text.size()));
+    meta_file.flush();
+    meta_file.close(); // Fails if the open, a write or the close failed
+    if (meta_file.fail())
+        ec = std::make_error_code(std::errc::io_error);
+    if (!ec)
+        fs::rename(temp, meta_path, ec);
+    if (ec) {
+        fs::remove(temp, ec);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Replaces every entry with the given key by a single entry.
+ *
+ * @param entries Entries read from a .meta file.
+ * @param key The key to set.
+ * @param value The new value; an empty value removes the key when the file is written.
+ */
+void set_meta_value(MetaEntries& entries, const std::string& key, const std::string& value) {
+    auto it = std::find_if(entries.begin(), entries.end(), [&](const auto& entry) { return entry.first == key; });
+    if (it == entries.end()) {
+        entries.emplace_back(key, value);
+        return;
+    }
+    it->second = value;
+    entries.erase(std::remove_if(std::next(it), entries.end(), [&](const auto& entry) { return entry.first == key; }),
+                  entries.end());
+}
+
+/**
+ * @brief Splits a comma-separated .meta value, removing whitespace.
+ *
+ * @param value The value of a list entry such as Tags.
+ * @return The list items.
+ */
+std::vector<std::string> split_meta_list(std::string_view value) {
+    std::vector<std::string> items;
+    while (!value.empty()) {
+        size_t comma = value.find(',');
+        std::string& item = items.emplace_back();
+        for (char c : value.substr(0, comma)) {
+            if (!std::isspace(static_cast<unsigned char>(c))) // Trim whitespace
+                item += c;
+        }
+        value.remove_prefix(comma == std::string_view::npos ? value.size() : comma + 1);
+    }
+    return items;
+}
+
+/**
+ * @brief Joins list items into a comma-separated .meta value.
+ */
+std::string join_meta_list(const std::vector<std::string>& items) {
+    std::string value;
+    for (size_t i = 0; i < items.size(); ++i) {
+        value += items[i];
+        if (i < items.size() - 1)
+            value += ",";
+    }
+    return value;
+}
+
+/**
+ * @brief Reads the tags of a template's .meta.
+ *
+ * @param meta The template's metadata.
+ * @return A vector of tags.
+ */
+std::vector<std::string> read_tags(const MetaView& meta) {
+    std::vector<std::string> tags;
+    meta.for_each("Tags", [&](std::string_view value) {
+        std::vector<std::string> line_tags = split_meta_list(value);
+        tags.insert(tags.end(), line_tags.begin(), line_tags.end());
+    });
+    return tags;
+}
+
+/**
+ * @brief Reads tags from a template's .meta file.
+ *
+ * @param template_path Path to the template directory.
+ * @return A vector of tags.
+ */
+std::vector<std::string> read_tags(const fs::path& template_path) {
+    return read_tags(MetaView(template_path));
+}
+
+/**
+ * @brief Writes tags to a template's .meta file, keeping its other entries.
+ *
+ * @param template_path Path to the template directory.
+ * @param tags A vector of tags to write.
+ * @return False if the .meta file could not be written.
+ */
+bool write_tags(const fs::path& template_path, const std::vector<std::string>& tags) {
+    MetaEntries entries = read_meta(template_path);
+    set_meta_value(entries, "Tags", join_meta_list(tags));
+    return write_meta(template_path, entries);
+}
+
+// Matches the rest of a glob pattern against the rest of a path.
+bool glob_match_at(const char* p, const char* t) {
+    while (*p) {
+        if (*p == '*') {
+            bool crosses = p[1] == '*';
+            const char* rest = p + (crosses ? 2 : 1);
+            if (crosses && *rest == '/' && glob_match_at(rest + 1, t))
+                return true; // "**/" also matches zero directories
+            for (const char* s = t;; ++s) {
+                if (glob_match_at(rest, s))
+                    return true;
+                if (!*s || (!crosses && *s == '/'))
+                    return false;
+            }
+        }
+        if (!*t)
+            return false;
+        if (*p == '?') {
+            if (*t == '/')
+                return false;
+        } else if (*p == '[' && p[1] && std::strchr(p + 2, ']')) {
+            const char* close = std::strchr(p + 2, ']'); // A ']' right after '[' is literal
+            bool negate = p[1] == '!' || p[1] == '^';
+            bool found = false;
+            for (const char* c = p + 1 + (negate ? 1 : 0); c < close; ++c) {
+                if (c + 2 < close && c[1] == '-') {
+                    found = found || (*t >= c[0] && *t <= c[2]);
+                    c += 2;
+                } else {
+                    found = found || *t == *c;
+                }
+            }
+            if (found == negate || *t == '/')
+                return false;
+            p = close;
+        } else if (*p != *t) {
+            return false;
+        }
+        p++;
+        t++;
+    }
+    return !*t;
+}
+
+/**
+ * @brief Matches a path against a glob pattern.
+ *
+ * '*' and '?' do not match '/', "**" matches any number of directories, and
+ * [...] matches a character class. A pattern without '/' is matched against
+ * the file name only, like in .gitignore.
+ *
+ * @param pattern The glob pattern.
+ * @param path A relative path using '/' separators.
+ * @return True if the path matches.
+ */
+bool glob_match(const std::string& pattern, const std::string& path) {
+    if (pattern.find('/') == std::string::npos) {
+        size_t slash = path.rfind('/');
+        if (slash != std::string::npos)
+            return glob_match(pattern, path.substr(slash + 1)) || glob_match("**/" + pattern, path);
+    }
+    return glob_match_at(pattern.c_str(), path.c_str());
+}
+
+/**
+ * @brief Checks whether a path matches any of the given glob patterns.
+ */
+bool glob_match_any(const std::vector<std::string>& patterns, const std::string& path) {
+    return std::any_of(patterns.begin(), patterns.end(), [&](const std::string& pattern) { return glob_match(pattern, path); });
+}
+
+/**
+ * @brief Parses a comma-separated list of glob patterns, trimming surrounding whitespace.
+ *
+ * @param globs_arg String containing comma-separated patterns.
+ * @return A vector of patterns.
+ */
+std::vector<std::string> parse_globs(const std::string& globs_arg) {
+    std::vector<std::string> globs;
+    std::stringstream ss(globs_arg);
+    std::string glob;
+    while (std::getline(ss, glob, ',')) {
+        size_t first = glob.find_first_not_of(" \t");
+        if (first != std::string::npos)
+            globs.push_back(glob.substr(first, glob.find_last_not_of(" \t") - first + 1));
+    }
+    return globs;
+}
+
+/**
+ * @brief Gitignore-style rules that decide which paths of a tree are visited.
+ *
+ * The rules are compiled once. Patterns without wildcards or '/' (node_modules,
+ * .git, build/) are looked up by file name in a hash map; the other patterns
+ * are globs. As in .gitignore the last matching rule wins, '!' re-includes a
+ * path, a trailing '/' only matches directories and a '/' anywhere else
+ * anchors the pattern to the root. Include globs, when there are any, keep
+ * only the files they match or that lie in a directory they match.
+ */
+class PathFilter {
+public:
+    /**
+     * @brief Adds one line in .gitignore syntax; blank lines and '#' comments are ignored.
+     */
+    void add_rule(std::string line) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        while (!line.empty() && line.back() == ' ' && (line.size() < 2 || line[line.size() - 2] != '\\'))
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            return;
+        Rule rule;
+        if (line[0] == '!') {
+            rule.negate = true;
+            line.erase(0, 1);
+        } else if (line[0] == '\\') {
+            line.erase(0, 1); // \# and \! start literal names
+        }
+        if (!line.empty() && line.back() == '/') {
+            rule.directory_only = true;
+            line.pop_back();
+        }
+        rule.anchored = line.find('/') != std::string::npos;
+        if (!line.empty() && line[0] == '/')
+            line.erase(0, 1);
+        if (line.empty())
+            return;
+        rule.pattern = line;
+        add(std::move(rule));
+    }
+
+    /**
+     * @brief Adds every rule of a .gitignore-style file.
+     *
+     * @return False if the file cannot be read.
+     */
+    bool add_rules_file(const fs::path& path) {
+        std::ifstream file(path);
+        if (!file)
+            return false;
+        std::string line;
+        while (std::getline(file, line))
+            add_rule(line);
+        return true;
+    }
+
+    /**
+     * @brief Restricts the kept files to those matching glob or lying in a directory matching it.
+     */
+    void add_include(const std::string& glob) { includes.push_back(glob); }
+
+    /**
+     * @brief Appends the rules and include globs of another filter, which then take precedence.
+     */
+    void add_filter(const PathFilter& other) {
+        for (const Rule& rule : other.rules)
+            add(rule);
+        includes.insert(includes.end(), other.includes.begin(), other.includes.end());
+    }
+
+    bool has_includes() const { return !includes.empty(); }
+
+    /**
+     * @brief Checks whether the rules exclude a path, ignoring its parent directories.
+     *
+     * Walks call this for each entry, since excluded directories are never entered.
+     *
+     * @param rel '/'-separated path relative to the root.
+     * @param directory Whether the path is a directory.
+     */
+    bool excluded(const std::string& rel, bool directory) const {
+        size_t slash = rel.rfind('/');
+        std::string name = slash == std::string::npos ? rel : rel.substr(slash + 1);
+        const Rule* last = nullptr;
+        size_t last_index = 0;
+        auto named = names.find(name);
+        if (named != names.end()) {
+            for (size_t index : named->second) {
+                if (!rules[index].directory_only || directory) {
+                    last = &rules[index];
+                    last_index = index;
+                }
+            }
+        }
+        // Later globs override earlier rules, so try them from the end down to the last matching name
+        for (auto it = globs.rbegin(); it != globs.rend() && (!last || *it > last_index); ++it) {
+            const Rule& rule = rules[*it];
+            bool matched = rule.anchored ? glob_match_at(rule.pattern.c_str(), rel.c_str()) : glob_match(rule.pattern, rel);
+            if ((!rule.directory_only || directory) && matched) {
+                last = &rule;
+                break;
+            }
+        }
+        return last && !last->negate;
+    }
+
+    /**
+     * @brief Checks whether the include globs keep a file.
+     */
+    bool included(const std::string& rel) const {
+        if (includes.empty())
+            return true;
+        for (size_t end = rel.find('/'); end != std::string::npos; end = rel.find('/', end + 1)) {
+            if (glob_match_any(includes, rel.substr(0, end)))
+                return true;
+        }
+        return glob_match_any(includes, rel);
+    }
+
+    /**
+     * @brief Checks whether a walk keeps an entry whose parent directories were kept.
+     */
+    bool keeps(const std::string& rel, bool directory) const {
+        return !excluded(rel, directory) && (directory || included(rel));
+    }
+
+    /**
+     * @brief Checks whether a path and every directory above it are kept, for listings that are not walked.
+     */
+    bool keeps_path(const std::string& rel, bool directory) const {
+        for (size_t end = rel.find('/'); end != std::string::npos; end = rel.find('/', end + 1)) {
+            if (excluded(rel.substr(0, end), true))
+                return false;
+        }
+        return keeps(rel, directory);
+    }
+
+private:
+    struct Rule {
+        std::string pattern;
+        bool negate = false;
+        bool directory_only = false;
+        bool anchored = false; // Matched against the whole path rather than any trailing part
+    };
+
+    void add(Rule rule) {
+        size_t index = rules.size();
+        if (!rule.anchored && rule.pattern.find_first_of("*?[\\") == std::string::npos)
+            names[rule.pattern].push_back(index);
+        else
+            globs.push_back(index);
+        rules.push_back(std::move(rule));
+    }
+
+    std::vector<Rule> rules;
+    std::unordered_map<std::string, std::vector<size_t>> names; // Rules matching a plain file name, in order
+    std::vector<size_t> globs;                                  // The other rules, in order
+    std::vector<std::string> includes;
+};
+
+/**
+ * @brief Returns the default number of copy threads.
+ *
+ * @return The hardware concurrency, or 1 if it cannot be determined.
+ */
+unsigned default_jobs() {
+    unsigned jobs = std::thread::hardware_concurrency();
+    return jobs == 0 ? 1 : jobs;
+}
+
+/**
+ * @brief Checks whether a process with the given id is still running.
+ */
+bool process_alive(unsigned long pid) {
+#ifdef OS_WINDOWS
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, static_cast<DWORD>(pid));
+    if (!process)
+        return GetLastError() == ERROR_ACCESS_DENIED;
+    bool running = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return running;
+#else
+    return kill(static_cast<pid_t>(pid), 0) == 0 || errno == EPERM;
+#endif
+}
+
+/**
+ * @brief Escapes a string for use inside a JSON string literal.
+ */
+std::string json_escape(const std::string& text) {
+    std::string escaped;
+    escaped.reserve(text.size());
+    for (unsigned char c : text) {
+        if (c == '"' || c == '\\') {
+            escaped += '\\';
+            escaped += static_cast<char>(c);
+        } else if (c < 0x20) {
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", c);
+            escaped += code;
+        } else {
+            escaped += static_cast<char>(c);
+        }
+    }
+    return escaped;
+}
+
+/**
+ * @brief Phase timings, I/O counters and trace events for --stats and --trace.
+ *
+ * Everything is off until main calls enable(), so each probe costs one branch
+ * in normal runs. Counters are kept at tmpl's own call sites: a std::filesystem
+ * call that makes several system calls counts once.
+ */
+class Instrumentation {
+public:
+    enum Counter {
+        Files,        // Regular files written
+        Bytes,        // Bytes of file data written
+        Directories,  // Directories created
+        Links,        // Hard links and symlinks created
+        Opens,        // open/CreateFile, including io_uring opens
+        Reads,        // read/ReadFile, including io_uring reads
+        Writes,       // write/WriteFile, including io_uring writes
+        KernelCopies, // copy_file_range, sendfile, fcopyfile and CopyFileEx calls
+        Clones,       // FICLONE, clonefile and block cloning calls
+        Metadata,     // stat, chmod, mkdir and similar calls
+        UringEnters,  // io_uring_enter calls, each submitting a batch of operations
+        Holes,        // Bytes of sparse-file holes left unwritten
+        COUNTER_COUNT
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    /**
+     * @brief Turns instrumentation on for the rest of the process.
+     *
+     * @param stats Collect phase totals and counters for print_stats().
+     * @param trace_path Where write_trace() writes Chrome trace events; empty for none.
+     */
+    void enable(bool stats, const fs::path& trace_path) {
+        collect_stats = stats;
+        trace = trace_path;
+        started = Clock::now();
+        thread_index(); // The calling thread becomes thread 0
+        on = stats || !trace_path.empty();
+    }
+
+    bool enabled() const { return on; }
+
+    bool tracing() const { return !trace.empty(); }
+
+    void count(Counter counter, uint64_t n = 1) {
+        if (on)
+            counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // Counts a file that was written by the given method (a copy strategy, link, pack codec or render)
+    void count_method(const char* method) {
+        if (!on)
+            return;
+        std::lock_guard<std::mutex> lock(mutex);
+        methods[method]++;
+    }
+
+    // Records a finished scope; a non-empty detail shows up as the event's argument in the trace
+    void add_span(const char* name, Clock::time_point begin, Clock::time_point end, std::string detail) {
+        auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count();
+        unsigned thread = thread_index();
+        std::lock_guard<std::mutex> lock(mutex);
+        auto phase = std::find_if(phases.begin(), phases.end(), [&](const Phase& p) { return std::strcmp(p.name, name) == 0; });
+        if (phase == phases.end())
+            phase = phases.insert(phases.end(), Phase{name, 0, 0});
+        phase->nanoseconds += static_cast<uint64_t>(elapsed);
+        phase->calls++;
+        if (!trace.empty()) {
+            auto start = std::chrono::duration_cast<std::chrono::nanoseconds>(begin - started).count();
+            spans.push_back({name, start, elapsed, thread, std::move(detail)});
+        }
+    }
+
+    /**
+     * @brief Prints wall time, time per phase, counters and copy methods.
+     */
+    void print_stats(std::ostream& out) {
+        if (!collect_stats)
+            return;
+        double wall = std::chrono::duration<double, std::milli>(Clock::now() - started).count();
+        std::lock_guard<std::mutex> lock(mutex);
+        char line[256];
+        snprintf(line, sizeof(line), "Wall time: %.2f ms on %u threads\n", wall, thread_count.load());
+        out << line << "Phases (time summed over threads; phases nest):\n";
+        std::vector<Phase> sorted = phases;
+        std::stable_sort(sorted.begin(), sorted.end(), [](const Phase& a, const Phase& b) { return a.nanoseconds > b.nanoseconds; });
+        for (const Phase& phase : sorted) {
+            snprintf(line, sizeof(line), "  %-20s %10.2f ms %9llu calls\n", phase.name, phase.nanoseconds / 1e6,
+                     static_cast<unsigned long long>(phase.calls));
+            out << line;
+        }
+        auto value = [&](Counter counter) { return static_cast<unsigned long long>(counters[counter].load()); };
+        snprintf(line, sizeof(line), "Files: %llu (%.1f MB), %llu directories, %llu links\n", value(Files),
+                 value(Bytes) / 1048576.0, value(Directories), value(Links));
+        out << line;
+        if (value(Holes) > 0) {
+            snprintf(line, sizeof(line), "Holes: %.1f MB of sparse files left unwritten\n", value(Holes) / 1048576.0);
+            out << line;
+        }
+        snprintf(line, sizeof(line), "Syscalls: %llu open, %llu read, %llu write, %llu kernel copy, %llu clone, %llu metadata, %llu io_uring_enter\n",
+                 value(Opens), value(Reads), value(Writes), value(KernelCopies), value(Clones), value(Metadata), value(UringEnters));
+        out << line;
+        if (!methods.empty()) {
+            out << "Methods:";
+            const char* separator = " ";
+            for (const auto& [method, files] : methods) {
+                out << separator << files << " " << method;
+                separator = ", ";
+            }
+            out << "\n";
+        }
+    }
+
+    /**
+     * @brief Writes the recorded scopes as Chrome trace events (JSON), loadable in Perfetto or chrome://tracing.
+     *
+     * @return False if the file cannot be written.
+     */
+    bool write_trace() {
+        if (trace.empty())
+            return true;
+        std::ofstream out(trace, std::ios::binary | std::ios::trunc);
+        std::lock_guard<std::mutex> lock(mutex);
+        out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        for (unsigned thread = 0; thread < thread_count.load(); ++thread) {
+            out << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << thread << ",\"args\":{\"name\":\""
+                << (thread == 0 ? "main" : "worker " + std::to_string(thread)) << "\"}},\n";
+        }
+        char times[96];
+        for (const Span& span : spans) {
+            snprintf(times, sizeof(times), "\"ts\":%.3f,\"dur\":%.3f", span.start / 1e3, span.duration / 1e3);
+            out << "{\"name\":\"" << span.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << span.thread << "," << times;
+            if (!span.detail.empty())
+                out << ",\"args\":{\"path\":\"" << json_escape(span.detail) << "\"}";
+            out << "},\n";
+        }
+        out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"tmpl\"}}\n]}\n";
+        out.close();
+        if (!out) {
+            std::cerr << "Cannot write trace to " << trace << "\n";
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Phase {
+        const char* name;
+        uint64_t nanoseconds;
+        uint64_t calls;
+    };
+
+    struct Span {
+        const char* name;
+        int64_t start; // Nanoseconds since enable()
+        int64_t duration;
+        unsigned thread;
+        std::string detail;
+    };
+
+    unsigned thread_index() {
+        thread_local unsigned index = thread_count.fetch_add(1);
+        return index;
+    }
+
+    bool on = false;
+    bool collect_stats = false;
+    fs::path trace;
+    Clock::time_point started;
+    std::atomic<unsigned> thread_count{0};
+    std::atomic<uint64_t> counters[COUNTER_COUNT] = {};
+    std::mutex mutex;
+    std::vector<Phase> phases;             // Guarded by mutex
+    std::vector<Span> spans;               // Guarded by mutex; only kept with a trace path
+    std::map<std::string, uint64_t> methods; // Guarded by mutex
+};
+
+/**
+ * @brief Returns the process-wide instrumentation.
+ */
+Instrumentation& instrumentation() {
+    static Instrumentation instance;
+    return instance;
+}
+
+/**
+ * @brief Times the enclosing scope as one phase for --stats and one event for --trace.
+ *
+ * name must be a string literal, or otherwise outlive the process's instrumentation.
+ */
+class TraceScope {
+public:
+    explicit TraceScope(const char* name, const fs::path* path = nullptr) : TraceScope(name, path, nullptr) {}
+    TraceScope(const char* name, const std::string* path) : TraceScope(name, nullptr, path) {}
+    ~TraceScope() {
+        if (!name)
+            return;
+        Instrumentation& instance = instrumentation();
+        // Paths are only turned into strings when they end up in a trace
+        std::string detail;
+        if (instance.tracing())
+            detail = path ? path->generic_string() : text ? *text : std::string();
+        instance.add_span(name, begin, Instrumentation::Clock::now(), std::move(detail));
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    TraceScope(const char* name, const fs::path* path, const std::string* text) {
+        if (instrumentation().enabled()) {
+            this->name = name;
+            this->path = path;
+            this->text = text;
+            begin = Instrumentation::Clock::now();
+        }
+    }
+
+    const char* name = nullptr;
+    const fs::path* path = nullptr;
+    const std::string* text = nullptr;
+    Instrumentation::Clock::time_point begin;
+};
+
+/**
+ * @brief A {{name}} placeholder found in a template file.
+ */
+struct Placeholder {
+    uint64_t offset = 0; // Offset of the opening braces
+    std::string name;
+    uint64_t length() const { return name.size() + 4; }
+};
+
+using Variables = std::map<std::string, std::string>;
+
+const size_t MAX_PLACEHOLDER_NAME = 64;
+
+/**
+ * @brief Implementations of the "{{" search, from plain C++ to vector instructions.
+ */
+enum class ScanKernel {
+    Scalar, // One byte at a time
+    Memchr, // The C library's memchr for '{', then a check of the next byte
+    Sse2,   // 16 bytes per step
+    Avx2,   // 32 bytes per step
+    Neon,   // 16 bytes per step on ARM
+};
+
+const char* scan_kernel_name(ScanKernel kernel) {
+    switch (kernel) {
+    case ScanKernel::Scalar: return "scalar";
+    case ScanKernel::Memchr: return "memchr";
+    case ScanKernel::Sse2: return "sse2";
+    case ScanKernel::Avx2: return "avx2";
+    case ScanKernel::Neon: return "neon";
+    }
+    return "unknown";
+}
+
+// Returns the first p with p[0] == p[1] == '{' before end - 1, or end
+using BraceFinder = const char* (*)(const char* p, const char* end);
+
+const char* find_double_brace_scalar(const char* p, const char* end) {
+    for (; end - p >= 2; ++p) {
+        if (p[0] == '{' && p[1] == '{')
+            return p;
+    }
+    return end;
+}
+
+const char* find_double_brace_memchr(const char* p, const char* end) {
+    while (end - p >= 2) {
+        const char* brace = static_cast<const char*>(std::memchr(p, '{', static_cast<size_t>(end - p) - 1));
+        if (!brace)
+            break;
+        if (brace[1] == '{')
+            return brace;
+        p = brace + 2; // brace[1] is not a brace, so no pair starts there
+    }
+    return end;
+}
+
+unsigned count_trailing_zeros(uint32_t mask) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+#ifdef TMPL_X86
+// Compares each block and the block one byte later against '{'; a set bit in both marks a "{{"
+const char* find_double_brace_sse2(const char* p, const char* end) {
+    const __m128i brace = _mm_set1_epi8('{');
+    for (; end - p >= 17; p += 16) {
+        __m128i here = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+        __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 1));
+        uint32_t mask = static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(here, brace), _mm_cmpeq_epi8(next, brace))));
+        if (mask)
+            return p + count_trailing_zeros(mask);
+    }
+    return find_double_brace_scalar(p, end);
+}
+
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx2")))
+#endif
+const char* find_double_brace_avx2(const char* p, const char* end) {
+    const __m256i brace = _mm256_set1_epi8('{');
+    for (; end - p >= 33; p += 32) {
+        __m256i here = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + 1));
+        uint32_t mask = static_cast<uint32_t>(
+            _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(here, brace), _mm256_cmpeq_epi8(next, brace))));
+        if (mask)
+            return p + count_trailing_zeros(mask);
+    }
+    return find_double_brace_sse2(p, end);
+}
+#endif
+
+#ifdef TMPL_NEON
+const char* find_double_brace_neon(const char* p, const char* end) {
+    const uint8x16_t brace = vdupq_n_u8('{');
+    for (; end - p >= 17; p += 16) {
+        uint8x16_t here = vld1q_u8(reinterpret_cast<const uint8_t*>(p));
+        uint8x16_t next = vld1q_u8(reinterpret_cast<const uint8_t*>(p + 1));
+        uint8x16_t both = vandq_u8(vceqq_u8(here, brace), vceqq_u8(next, brace));
+        // Narrow each byte to 4 bits so the 16 results fit in one 64-bit lane
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(both), 4)), 0);
+        if (mask) {
+#ifdef _MSC_VER
+            unsigned long index;
+            _BitScanForward64(&index, mask);
+            return p + index / 4;
+#else
+            return p + __builtin_ctzll(mask) / 4;
+#endif
+        }
+    }
+    return find_double_brace_scalar(p, end);
+}
+#endif
+
+/**
+ * @brief Checks whether this CPU can run a scan kernel.
+ */
+bool scan_kernel_supported(ScanKernel kernel) {
+    switch (kernel) {
+    case ScanKernel::Scalar:
+    case ScanKernel::Memchr:
+        return true;
+#ifdef TMPL_X86
+    case ScanKernel::Sse2:
+        return true; // Part of every x86-64 CPU
+    case ScanKernel::Avx2:
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_cpu_supports("avx2");
+#elif defined(OS_WINDOWS)
+        return IsProcessorFeaturePresent(PF_AVX2_INSTRUCTIONS_AVAILABLE);
+#else
+        return false;
+#endif
+#endif
+#ifdef TMPL_NEON
+    case ScanKernel::Neon:
+        return true;
+#endif
+    default:
+        return false;
+    }
+}
+
+BraceFinder brace_finder(ScanKernel kernel) {
+    switch (kernel) {
+#ifdef TMPL_X86
+    case ScanKernel::Sse2: return find_double_brace_sse2;
+    case ScanKernel::Avx2: return find_double_brace_avx2;
+#endif
+#ifdef TMPL_NEON
+    case ScanKernel::Neon: return find_double_brace_neon;
+#endif
+    case ScanKernel::Memchr: return find_double_brace_memchr;
+    default: return find_double_brace_scalar;
+    }
+}
+
+/**
+ * @brief Returns the fastest scan kernel this CPU supports, chosen once at first use.
+ */
+ScanKernel best_scan_kernel() {
+    static const ScanKernel best = [] {
+        for (ScanKernel kernel : {ScanKernel::Avx2, ScanKernel::Sse2, ScanKernel::Neon}) {
+            if (scan_kernel_supported(kernel))
+                return kernel;
+        }
+        return ScanKernel::Memchr;
+    }();
+    return best;
+}
+
+// How much of a file is checked for NUL bytes to tell binary files from text
+const size_t BINARY_SNIFF_SIZE = 8192;
+
+/**
+ * @brief Checks whether a file looks binary, i.e. has a NUL byte in its first block.
+ */
+bool looks_binary(const char* data, size_t size) {
+    return std::memchr(data, 0, std::min(size, BINARY_SNIFF_SIZE)) != nullptr;
+}
+
+
+bool is_placeholder_name_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '-';
+}
+
+/**
+ * @brief Finds the {{name}} placeholders in a buffer.
+ *
+ * Names are 1 to MAX_PLACEHOLDER_NAME letters, digits, '_', '.' or '-', with no
+ * spaces inside the braces; anything else is left alone.
+ *
+ * @param data The bytes to scan.
+ * @param size Number of bytes.
+ * @param base Offset of data within the file, added to each offset found.
+ * @param found Receives the placeholders in order.
+ * @param kernel How to search for "{{"; defaults to the fastest one the CPU supports.
+ */
+void find_placeholders(const char* data, size_t size, uint64_t base, std::vector<Placeholder>& found,
+                       ScanKernel kernel = best_scan_kernel()) {
+    BraceFinder find_braces = brace_finder(kernel);
+    const char* end = data + size;
+    for (const char* p = data;;) {
+        const char* brace = find_braces(p, end);
+        // The shortest placeholder is "{{x}}"
+        if (end - brace < 5)
+            break;
+        p = brace + 1;
+        const char* name = brace + 2;
+        const char* q = name;
+        while (q < end && static_cast<size_t>(q - name) <= MAX_PLACEHOLDER_NAME && is_placeholder_name_char(*q))
+            ++q;
+        if (q > name && static_cast<size_t>(q - name) <= MAX_PLACEHOLDER_NAME && end - q >= 2 && q[0] == '}' && q[1] == '}') {
+            found.push_back({base + static_cast<uint64_t>(brace - data), std::string(name, q)});
+            p = q + 2;
+        }
+    }
+}
+
+/**
+ * @brief Replaces the placeholders of a short string such as a path name.
+ *
+ * @param text The text to render.
+ * @param vars Placeholder values; placeholders without a value are kept.
+ */
+std::string render_text(const std::string& text, const Variables& vars) {
+    std::vector<Placeholder> found;
+    find_placeholders(text.data(), text.size(), 0, found);
+    std::string rendered;
+    size_t pos = 0;
+    for (const auto& placeholder : found) {
+        auto value = vars.find(placeholder.name);
+        if (value == vars.end())
+            continue;
+        rendered.append(text, pos, placeholder.offset - pos);
+        rendered += value->second;
+        pos = placeholder.offset + placeholder.length();
+    }
+    rendered.append(text, pos, std::string::npos);
+    return rendered;
+}
+
+/**
+ * @brief Finds the placeholders of a file whose offsets in .meta no longer describe it.
+ *
+ * @return The placeholders; none if the contents now look binary.
+ */
+std::vector<Placeholder> rescan_placeholders(const std::string& contents) {
+    std::vector<Placeholder> found;
+    if (!looks_binary(contents.data(), contents.size()))
+        find_placeholders(contents.data(), contents.size(), 0, found);
+    return found;
+}
+
+/**
+ * @brief Where a file's placeholders are, and the file they were found in.
+ */
+struct RenderEntry {
+    uintmax_t size = 0;
+    int64_t mtime = 0; // In stat_entry's units; 0 in entries written before it was recorded
+    std::string hash;  // SHA-256 of the contents; empty in entries written before it was recorded
+    std::vector<Placeholder> placeholders;
+
+    /**
+     * @brief Checks whether the offsets still hold for a file, by its hash if both are known or else its modification time.
+     */
+    bool describes(uintmax_t file_size, int64_t file_mtime, const std::string& file_hash) const {
+        if (file_size != size)
+            return false;
+        if (!hash.empty() && !file_hash.empty())
+            return file_hash == hash;
+        return mtime != 0 && file_mtime == mtime;
+    }
+};
+
+/**
+ * @brief What make needs to render a template: the values and where each file's placeholders are.
+ */
+struct RenderContext {
+    Variables vars;
+    std::map<std::string, RenderEntry> files; // By '/'-separated template path, from the .meta Render entries
+};
+
+/**
+ * @brief Output stream buffer that substitutes known placeholders in a stream written through it.
+ *
+ * The placeholder offsets are known in advance, so the filter only counts
+ * bytes: runs between placeholders are forwarded as they are written and
+ * nothing is buffered or allocated per line.
+ */
+class PlaceholderFilter : public std::streambuf {
+public:
+    PlaceholderFilter(std::ostream& out, const std::vector<Placeholder>& placeholders, const Variables& vars)
+        : out(out), placeholders(placeholders) {
+        for (const auto& placeholder : placeholders) {
+            auto value = vars.find(placeholder.name);
+            values.push_back(value == vars.end() ? nullptr : &value->second);
+        }
+    }
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        uint64_t left = static_cast<uint64_t>(n);
+        while (left > 0) {
+            uint64_t run = left;
+            bool keep = true;
+            if (next < placeholders.size()) {
+                const Placeholder& placeholder = placeholders[next];
+                if (position < placeholder.offset) {
+                    run = std::min(left, placeholder.offset - position);
+                } else {
+                    // Inside the placeholder: write its value once and drop the original bytes
+                    run = std::min(left, placeholder.offset + placeholder.length() - position);
+                    keep = values[next] == nullptr;
+                    if (!keep && position == placeholder.offset)
+                        out.write(values[next]->data(), static_cast<std::streamsize>(values[next]->size()));
+                }
+            }
+            if (keep)
+                out.write(s, static_cast<std::streamsize>(run));
+            s += run;
+            left -= run;
+            position += run;
+            if (next < placeholders.size() && position == placeholders[next].offset + placeholders[next].length())
+                next++;
+        }
+        return out ? n : 0;
+    }
+
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        char c = traits_type::to_char_type(ch);
+        return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+    }
+
+private:
+    std::ostream& out;
+    const std::vector<Placeholder>& placeholders;
+    std::vector<const std::string*> values; // Null for placeholders without a value, which are kept
+    size_t next = 0;       // First placeholder not yet passed
+    uint64_t position = 0; // Bytes written through the filter so far
+};
+
+/**
+ * @brief Reads the per-file placeholder offsets saved in a template's .meta Render entries.
+ *
+ * Each entry is "Render:<path>\t<size>\t<mtime>\t<sha256>\t<offset>:<name>,<offset>:<name>...".
+ * Entries from older saves have only the path and the offsets.
+ */
+std::map<std::string, RenderEntry> read_render_entries(const MetaView& meta) {
+    std::map<std::string, RenderEntry> files;
+    meta.for_each("Render", [&](std::string_view value) {
+        size_t tab = value.rfind('\t');
+        if (tab == std::string_view::npos)
+            return;
+        std::string_view items_field = value.substr(tab + 1);
+        // The file's attributes precede the offsets; split them off from the right, as paths come first
+        std::string_view fields[3];
+        size_t path_end = tab;
+        for (int i = 2; i >= 0 && path_end != std::string_view::npos; --i) {
+            size_t previous = path_end == 0 ? std::string_view::npos : value.rfind('\t', path_end - 1);
+            if (previous == std::string_view::npos) {
+                path_end = std::string_view::npos;
+                break;
+            }
+            fields[i] = value.substr(previous + 1, path_end - previous - 1);
+            path_end = previous;
+        }
+        RenderEntry file;
+        if (path_end != std::string_view::npos) {
+            std::from_chars(fields[0].data(), fields[0].data() + fields[0].size(), file.size);
+            std::from_chars(fields[1].data(), fields[1].data() + fields[1].size(), file.mtime);
+            file.hash = std::string(fields[2]);
+        } else {
+            path_end = tab;
+        }
+        RenderEntry& entry = files[std::string(value.substr(0, path_end))];
+        entry = std::move(file);
+        std::vector<Placeholder>& placeholders = entry.placeholders;
+        for (std::string_view items = items_field; !items.empty();) {
+            size_t comma = items.find(',');
+            std::string_view item = items.substr(0, comma);
+            items.remove_prefix(comma == std::string_view::npos ? items.size() : comma + 1);
+            size_t colon = item.find(':');
+            uint64_t offset = 0;
+            if (colon != std::string_view::npos) {
+                std::from_chars(item.data(), item.data() + colon, offset);
+                placeholders.push_back({offset, std::string(item.substr(colon + 1))});
+            }
+        }
+    });
+    return files;
+}
+
+/**
+ * @brief Formats the value of a .meta Render entry.
+ */
+std::string format_render_entry(const std::string& path, const RenderEntry& file) {
+    std::string value = path + "\t" + std::to_string(file.size) + "\t" + std::to_string(file.mtime) + "\t" + file.hash + "\t";
+    for (size_t i = 0; i < file.placeholders.size(); ++i)
+        value += (i == 0 ? "" : ",") + std::to_string(file.placeholders[i].offset) + ":" + file.placeholders[i].name;
+    return value;
+}
+
+/**
+ * @brief Parses a vars file of "key=value" lines; blank lines and lines starting with '#' are skipped.
+ *
+ * Whitespace around the key and before the value is ignored.
+ *
+ * @param path The vars file.
+ * @param vars Receives the values, replacing earlier ones with the same key.
+ * @return False if the file cannot be read or has a line without '='.
+ */
+bool read_vars_file(const fs::path& path, Variables& vars) {
+    std::ifstream file(path);
+    if (!file) {
+        std::cout << "Cannot read vars file: " << path.string() << "\n";
+        return false;
+    }
+    std::string line;
+    for (size_t line_number = 1; std::getline(file, line); ++line_number) {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        size_t start = line.find_first_not_of(" \t");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+        size_t equals = line.find('=', start);
+        std::string key = equals == std::string::npos ? "" : line.substr(start, equals - start);
+        key.erase(key.find_last_not_of(" \t") + 1);
+        if (key.empty()) {
+            std::cout << path.string() << ":" << line_number << ": expected key=value\n";
+            return false;
+        }
+        size_t value_start = line.find_first_not_of(" \t", equals + 1);
+        vars[key] = value_start == std::string::npos ? "" : line.substr(value_start);
+    }
+    return true;
+}
+
+/**
+ * @brief How the contents of a file are copied.
+ */
+enum class CopyStrategy {
+    Auto,     // Try reflink, then kernel, then buffered
+    Reflink,  // Copy-on-write clone (FICLONE, clonefile, ReFS block cloning)
+    Kernel,   // In-kernel copy (copy_file_range/sendfile, fcopyfile, CopyFileEx)
+    Buffered, // Userspace read/write loop
+};
+
+/**
+ * @brief Returns the command-line name of a copy strategy.
+ */
+const char* copy_strategy_name(CopyStrategy strategy) {
+    switch (strategy) {
+    case CopyStrategy::Auto: return "auto";
+    case CopyStrategy::Reflink: return "reflink";
+    case CopyStrategy::Kernel: return "kernel";
+    case CopyStrategy::Buffered: return "buffered";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Parses a --copy-strategy value.
+ *
+ * @param value One of auto, reflink, kernel or buffered.
+ * @param strategy Receives the parsed strategy.
+ * @return False if the value is not a known strategy.
+ */
+bool parse_copy_strategy(const std::string& value, CopyStrategy& strategy) {
+    for (CopyStrategy candidate : {CopyStrategy::Auto, CopyStrategy::Reflink, CopyStrategy::Kernel, CopyStrategy::Buffered}) {
+        if (value == copy_strategy_name(candidate)) {
+            strategy = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief How make materializes files that are not matched by the mutable globs.
+ */
+enum class LinkMode {
+    Copy,     // Copy every file
+    Hard,     // Hard-link immutable files to the stored template
+    Symbolic, // Symlink immutable files to the stored template
+};
+
+/**
+ * @brief Returns the command-line and .meta name of a link mode.
+ */
+const char* link_mode_name(LinkMode mode) {
+    switch (mode) {
+    case LinkMode::Copy: return "copy";
+    case LinkMode::Hard: return "hard";
+    case LinkMode::Symbolic: return "sym";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Parses a --link value or a .meta Link entry.
+ *
+ * @param value One of copy, hard or sym.
+ * @param mode Receives the parsed mode.
+ * @return False if the value is not a known mode.
+ */
+bool parse_link_mode(const std::string& value, LinkMode& mode) {
+    for (LinkMode candidate : {LinkMode::Copy, LinkMode::Hard, LinkMode::Symbolic}) {
+        if (value == link_mode_name(candidate)) {
+            mode = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief How file copies are issued: one blocking call chain per file on the worker threads, or batched asynchronous I/O.
+ */
+enum class IoBackend {
+    Auto,  // The platform's asynchronous backend when it is available, else the pool
+    Pool,  // Blocking copies on the worker threads
+    Uring, // io_uring (Linux)
+    Iocp,  // I/O completion ports (Windows)
+};
+
+const char* io_backend_name(IoBackend backend) {
+    switch (backend) {
+    case IoBackend::Auto: return "auto";
+    case IoBackend::Pool: return "pool";
+    case IoBackend::Uring: return "uring";
+    case IoBackend::Iocp: return "iocp";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Parses an --io value.
+ *
+ * @param value One of auto, pool, uring or iocp.
+ * @param backend Receives the parsed backend.
+ * @return False if the value is not known.
+ */
+bool parse_io_backend(const std::string& value, IoBackend& backend) {
+    for (IoBackend candidate : {IoBackend::Auto, IoBackend::Pool, IoBackend::Uring, IoBackend::Iocp}) {
+        if (value == io_backend_name(candidate)) {
+            backend = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * @brief Options controlling how a template tree is copied.
+ */
+struct CopyOptions {
+    unsigned jobs = default_jobs(); // Number of worker threads
+    CopyStrategy strategy = CopyStrategy::Auto;
+    bool report = false; // Print the strategy used for each file
+    IoBackend io = IoBackend::Auto;
+    std::optional<LinkMode> link; // Unset means the template's .meta policy
+    std::optional<std::vector<std::string>> mutable_globs; // Files that are always copied when linking
+    bool preserve_times = false; // Give copies the modification time of their source
+    const RenderContext* render = nullptr; // Placeholders to substitute; null copies files verbatim
+    std::shared_ptr<const PathFilter> filter; // Paths to leave out; null keeps everything
+};
+
+const size_t COPY_BUFFER_SIZE = 128 * 1024;
+
+/**
+ * @brief Hands out COPY_BUFFER_SIZE buffers for streaming file data, reusing them from file to file.
+ *
+ * A buffer returns to the pool when its lease ends. The pool keeps a bounded
+ * number of spares, so memory stays proportional to the copies running at
+ * once; buffers are not zeroed, unlike a std::vector per file.
+ */
+class BufferPool {
+public:
+    /**
+     * @brief A buffer taken from the pool for as long as it is in scope.
+     */
+    class Lease {
+    public:
+        explicit Lease(BufferPool& pool) : pool(pool), buffer(pool.take()) {}
+        ~Lease() { pool.give(std::move(buffer)); }
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+
+        char* data() const { return buffer.get(); }
+        size_t size() const { return COPY_BUFFER_SIZE; }
+
+    private:
+        BufferPool& pool;
+        std::unique_ptr<char[]> buffer;
+    };
+
+private:
+    static constexpr size_t MAX_SPARE = 64;
+
+    std::unique_ptr<char[]> take() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!spare.empty()) {
+                std::unique_ptr<char[]> buffer = std::move(spare.back());
+                spare.pop_back();
+                return buffer;
+            }
+        }
+        return std::unique_ptr<char[]>(new char[COPY_BUFFER_SIZE]);
+    }
+
+    void give(std::unique_ptr<char[]> buffer) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (spare.size() < MAX_SPARE)
+            spare.push_back(std::move(buffer));
+    }
+
+    std::mutex mutex;
+    std::vector<std::unique_ptr<char[]>> spare;
+};
+
+/**
+ * @brief The pool every streaming copy takes its buffer from.
+ */
+BufferPool& copy_buffers() {
+    static BufferPool pool;
+    return pool;
+}
+
+#ifdef OS_WINDOWS
+// Clones the file's extents on volumes with block cloning (ReFS).
+bool reflink_copy(HANDLE in, HANDLE out, LONGLONG size, std::error_code& ec) {
+    DWORD flags = 0;
+    if (!GetVolumeInformationByHandleW(out, nullptr, 0, nullptr, nullptr, &flags, nullptr, 0) ||
+        !(flags & FILE_SUPPORTS_BLOCK_REFCOUNTING)) {
+        ec = std::make_error_code(std::errc::operation_not_supported);
+        return false;
+    }
+    FILE_END_OF_FILE_INFO end_of_file;
+    end_of_file.EndOfFile.QuadPart = size;
+    if (!SetFileInformationByHandle(out, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file))) {
+        ec = std::error_code(GetLastError(), std::system_category());
+        return false;
+    }
+    // Regions must be cluster aligned; 64 KiB is a multiple of every ReFS cluster size.
+    const LONGLONG alignment = 64 * 1024;
+    const LONGLONG chunk = 1LL << 30;
+    LONGLONG padded = (size + alignment - 1) / alignment * alignment;
+    for (LONGLONG offset = 0; offset < padded; offset += chunk) {
+        DUPLICATE_EXTENTS_DATA extents = {};
+        extents.FileHandle = in;
+        extents.SourceFileOffset.QuadPart = offset;
+        extents.TargetFileOffset.QuadPart = offset;
+        extents.ByteCount.QuadPart = std::min(chunk, padded - offset);
+        DWORD returned = 0;
+        instrumentation().count(Instrumentation::Clones);
+        if (!DeviceIoControl(out, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), nullptr, 0, &returned, nullptr)) {
+            DWORD error = GetLastError();
+            if (offset == 0 && (error == ERROR_NOT_SUPPORTED || error == ERROR_INVALID_FUNCTION))
+                ec = std::make_error_code(std::errc::operation_not_supported);
+            else
+                ec = std::error_code(error, std::system_category());
+            return false;
+        }
+    }
+    return true;
+}
+
+// Copies through ReadFile/WriteFile.
+bool buffered_copy(HANDLE in, HANDLE out, std::error_code& ec) {
+    BufferPool::Lease buffer(copy_buffers());
+    for (;;) {
+        DWORD read = 0;
+        instrumentation().count(Instrumentation::Reads);
+        if (!ReadFile(in, buffer.data(), static_cast<DWORD>(buffer.size()), &read, nullptr)) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            return false;
+        }
+        if (read == 0)
+            return true;
+        DWORD written = 0;
+        instrumentation().count(Instrumentation::Writes);
+        if (!WriteFile(out, buffer.data(), read, &written, nullptr) || written != read) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            return false;
+        }
+    }
+}
+
+// Copies only the allocated ranges of a sparse file, found with FSCTL_QUERY_ALLOCATED_RANGES;
+// dst is made sparse so the rest stays unallocated, and holes receives its size.
+bool sparse_copy(HANDLE in, HANDLE out, LONGLONG size, uint64_t& holes, std::error_code& ec) {
+    DWORD returned = 0;
+    instrumentation().count(Instrumentation::Metadata, 2);
+    FILE_END_OF_FILE_INFO end_of_file;
+    end_of_file.EndOfFile.QuadPart = size;
+    if (!DeviceIoControl(out, FSCTL_SET_SPARSE, nullptr, 0, nullptr, 0, &returned, nullptr)) {
+        ec = std::make_error_code(std::errc::operation_not_supported);
+        return false;
+    }
+    if (!SetFileInformationByHandle(out, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file))) {
+        ec = std::error_code(GetLastError(), std::system_category());
+        return false;
+    }
+    BufferPool::Lease buffer(copy_buffers());
+    FILE_ALLOCATED_RANGE_BUFFER query = {};
+    FILE_ALLOCATED_RANGE_BUFFER ranges[64];
+    query.Length.QuadPart = size;
+    LONGLONG allocated = 0;
+    for (;;) {
+        instrumentation().count(Instrumentation::Metadata);
+        BOOL complete = DeviceIoControl(in, FSCTL_QUERY_ALLOCATED_RANGES, &query, sizeof(query), ranges, sizeof(ranges), &returned, nullptr);
+        if (!complete && GetLastError() != ERROR_MORE_DATA) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            return false;
+        }
+        DWORD count = returned / sizeof(ranges[0]);
+        for (DWORD i = 0; i < count; ++i) {
+            LONGLONG offset = ranges[i].FileOffset.QuadPart;
+            LONGLONG end = std::min(size, offset + ranges[i].Length.QuadPart);
+            allocated += end - offset;
+            while (offset < end) {
+                OVERLAPPED at = {};
+                at.Offset = static_cast<DWORD>(offset);
+                at.OffsetHigh = static_cast<DWORD>(offset >> 32);
+                DWORD read = 0;
+                instrumentation().count(Instrumentation::Reads);
+                if (!ReadFile(in, buffer.data(), static_cast<DWORD>(std::min<LONGLONG>(end - offset, buffer.size())), &read, &at) ||
+                    read == 0) {
+                    ec = std::error_code(read == 0 ? ERROR_HANDLE_EOF : GetLastError(), std::system_category());
+                    return false;
+                }
+                DWORD written = 0;
+                instrumentation().count(Instrumentation::Writes);
+                if (!WriteFile(out, buffer.data(), read, &written, &at) || written != read) {
+                    ec = std::error_code(GetLastError(), std::system_category());
+                    return false;
+                }
+                offset += read;
+            }
+        }
+        if (complete || count == 0)
+            break;
+        // More ranges follow the last one returned
+        LONGLONG next = ranges[count - 1].FileOffset.QuadPart + ranges[count - 1].Length.QuadPart;
+        query.FileOffset.QuadPart = next;
+        query.Length.QuadPart = size - next;
+    }
+    holes = static_cast<uint64_t>(size - allocated);
+    return true;
+}
+
+/**
+ * @brief Copies a regular file using the given strategy, overwriting dst.
+ *
+ * Sparse files are copied range by range when they cannot be cloned, so
+ * their holes are not written out.
+ *
+ * @param src Source file.
+ * @param dst Destination file.
+ * @param strategy Auto tries each strategy in turn; any other value is used alone.
+ * @param ec Receives the error; operation_not_supported if a forced strategy is unavailable.
+ * @return The strategy that copied the file, or CopyStrategy::Auto on failure.
+ */
+CopyStrategy copy_file_contents(const fs::path& src, const fs::path& dst, CopyStrategy strategy, std::error_code& ec) {
+    enum class HandleCopy { Reflink, Sparse, Buffered };
+    // Opens both files and runs one of the handle-based copies.
+    auto copy_handles = [&](HandleCopy method) {
+        instrumentation().count(Instrumentation::Opens, 2);
+        HANDLE in = CreateFileW(src.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (in == INVALID_HANDLE_VALUE) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            return false;
+        }
+        HANDLE out = CreateFileW(dst.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (out == INVALID_HANDLE_VALUE) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            CloseHandle(in);
+            return false;
+        }
+        bool ok = false;
+        uint64_t holes = 0;
+        LARGE_INTEGER size;
+        instrumentation().count(Instrumentation::Metadata);
+        if (!GetFileSizeEx(in, &size))
+            ec = std::error_code(GetLastError(), std::system_category());
+        else if (method == HandleCopy::Reflink)
+            ok = reflink_copy(in, out, size.QuadPart, ec);
+        else if (method == HandleCopy::Sparse)
+            ok = sparse_copy(in, out, size.QuadPart, holes, ec);
+        else
+            ok = buffered_copy(in, out, ec);
+        if (ok) {
+            instrumentation().count(Instrumentation::Files);
+            instrumentation().count(Instrumentation::Bytes, static_cast<uint64_t>(size.QuadPart) - holes);
+            instrumentation().count(Instrumentation::Holes, holes);
+        }
+        CloseHandle(out);
+        CloseHandle(in);
+        return ok;
+    };
+
+    if (strategy == CopyStrategy::Auto || strategy == CopyStrategy::Reflink) {
+        if (copy_handles(HandleCopy::Reflink))
+            return CopyStrategy::Reflink;
+        if (strategy == CopyStrategy::Reflink || ec != std::errc::operation_not_supported)
+            return CopyStrategy::Auto;
+        ec.clear();
+    }
+    instrumentation().count(Instrumentation::Metadata);
+    DWORD attributes = GetFileAttributesW(src.c_str());
+    if (attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_SPARSE_FILE)) {
+        if (copy_handles(HandleCopy::Sparse))
+            return strategy == CopyStrategy::Buffered ? CopyStrategy::Buffered : CopyStrategy::Kernel;
+        if (ec != std::errc::operation_not_supported)
+            return CopyStrategy::Auto;
+        ec.clear();
+    }
+    if (strategy == CopyStrategy::Auto || strategy == CopyStrategy::Kernel) {
+        instrumentation().count(Instrumentation::KernelCopies);
+        if (CopyFileExW(src.c_str(), dst.c_str(), nullptr, nullptr, nullptr, 0)) {
+            if (instrumentation().enabled()) {
+                std::error_code size_ec;
+                uintmax_t size = fs::file_size(dst, size_ec);
+                instrumentation().count(Instrumentation::Files);
+                instrumentation().count(Instrumentation::Bytes, size_ec ? 0 : size);
+            }
+            return CopyStrategy::Kernel;
+        }
+        ec = std::error_code(GetLastError(), std::system_category());
+        if (strategy == CopyStrategy::Kernel)
+            return CopyStrategy::Auto;
+        ec.clear();
+    }
+    if (copy_handles(HandleCopy::Buffered))
+        return CopyStrategy::Buffered;
+    return CopyStrategy::Auto;
+}
+#else
+/**
+ * @brief Closes a file descriptor when it goes out of scope.
+ */
+struct FileDescriptor {
+    int fd = -1;
+    explicit FileDescriptor(int fd) : fd(fd) {}
+    ~FileDescriptor() {
+        if (fd >= 0)
+            close(fd);
+    }
+    FileDescriptor(const FileDescriptor&) = delete;
+    FileDescriptor& operator=(const FileDescriptor&) = delete;
+};
+
+// umask can only be read by setting it, so it is read once, before any worker creates files
+std::atomic<int> cached_umask{-1};
+
+mode_t process_umask() {
+    int mask = cached_umask.load();
+    if (mask < 0) {
+        mode_t current = umask(0);
+        umask(current);
+        cached_umask = mask = static_cast<int>(current);
+    }
+    return static_cast<mode_t>(mask);
+}
+
+// Sets the umask for files created from now on; tmpl daemon takes each client's
+void set_process_umask(mode_t mask) {
+    umask(mask);
+    cached_umask = static_cast<int>(mask);
+}
+
+// True when errno means the file system or kernel cannot copy this way.
+bool copy_unsupported(int error) {
+    return error == EOPNOTSUPP || error == ENOTSUP || error == EXDEV || error == EINVAL || error == ENOSYS || error == ENOTTY;
+}
+
+// Clones the whole file with a copy-on-write reflink.
+bool reflink_copy(int in, int out, std::error_code& ec) {
+#if defined(__linux__) && defined(FICLONE)
+    instrumentation().count(Instrumentation::Clones);
+    if (ioctl(out, FICLONE, in) == 0)
+        return true;
+    if (copy_unsupported(errno))
+        ec = std::make_error_code(std::errc::operation_not_supported);
+    else
+        ec = std::error_code(errno, std::generic_category());
+#else
+    (void)in;
+    (void)out;
+    ec = std::make_error_code(std::errc::operation_not_supported);
+#endif
+    return false;
+}
+
+// Copies in the kernel with copy_file_range, then sendfile (Linux) or fcopyfile (macOS).
+bool kernel_copy(int in, int out, off_t size, std::error_code& ec) {
+#if defined(__linux__)
+    off_t copied = 0;
+    bool use_sendfile = false;
+    while (copied < size) {
+        instrumentation().count(Instrumentation::KernelCopies);
+        ssize_t n = use_sendfile ? sendfile(out, in, nullptr, static_cast<size_t>(size - copied))
+                                 : copy_file_range(in, nullptr, out, nullptr, static_cast<size_t>(size - copied), 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (copied == 0 && copy_unsupported(errno)) {
+                if (!use_sendfile) {
+                    use_sendfile = true;
+                    continue;
+                }
+                ec = std::make_error_code(std::errc::operation_not_supported);
+                return false;
+            }
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+        if (n == 0)
+            break; // The file shrank while it was being copied
+        copied += n;
+    }
+    return true;
+#elif defined(__APPLE__)
+    (void)size;
+    instrumentation().count(Instrumentation::KernelCopies);
+    if (fcopyfile(in, out, nullptr, COPYFILE_DATA) == 0)
+        return true;
+    ec = std::error_code(errno, std::generic_category());
+    return false;
+#else
+    (void)in;
+    (void)out;
+    (void)size;
+    ec = std::make_error_code(std::errc::operation_not_supported);
+    return false;
+#endif
+}
+
+// Copies through a userspace buffer with read/write.
+bool buffered_copy(int in, int out, std::error_code& ec) {
+    BufferPool::Lease buffer(copy_buffers());
+    for (;;) {
+        instrumentation().count(Instrumentation::Reads);
+        ssize_t n = read(in, buffer.data(), buffer.size());
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+        if (n == 0)
+            return true;
+        for (ssize_t done = 0; done < n;) {
+            instrumentation().count(Instrumentation::Writes);
+            ssize_t written = write(out, buffer.data() + done, static_cast<size_t>(n - done));
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                ec = std::error_code(errno, std::generic_category());
+                return false;
+            }
+            done += written;
+        }
+    }
+}
+
+// Copies length bytes at offset with copy_file_range (Linux, unless buffered) or pread/pwrite.
+bool copy_range(int in, int out, off_t offset, off_t length, bool kernel, std::error_code& ec) {
+#if defined(__linux__)
+    while (kernel && length > 0) {
+        instrumentation().count(Instrumentation::KernelCopies);
+        loff_t in_offset = offset;
+        loff_t out_offset = offset;
+        ssize_t n = copy_file_range(in, &in_offset, out, &out_offset, static_cast<size_t>(length), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && copy_unsupported(errno))
+            break; // Finish this range through the buffer
+        if (n <= 0) {
+            ec = std::error_code(n < 0 ? errno : EIO, std::generic_category());
+            return false;
+        }
+        offset += n;
+        length -= n;
+    }
+#else
+    (void)kernel;
+#endif
+    BufferPool::Lease buffer(copy_buffers());
+    while (length > 0) {
+        instrumentation().count(Instrumentation::Reads);
+        ssize_t n = pread(in, buffer.data(), static_cast<size_t>(std::min<off_t>(length, buffer.size())), offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            ec = std::error_code(n < 0 ? errno : EIO, std::generic_category());
+            return false;
+        }
+        for (ssize_t done = 0; done < n;) {
+            instrumentation().count(Instrumentation::Writes);
+            ssize_t written = pwrite(out, buffer.data() + done, static_cast<size_t>(n - done), offset + done);
+            if (written < 0) {
+                if (errno == EINTR)
+                    continue;
+                ec = std::error_code(errno, std::generic_category());
+                return false;
+            }
+            done += written;
+        }
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+// Copies only the data extents of a sparse file, found with SEEK_DATA/SEEK_HOLE; the holes
+// stay unallocated in dst, and holes receives their size. Fails with operation_not_supported
+// where holes cannot be found.
+bool sparse_copy(int in, int out, off_t size, bool kernel, uint64_t& holes, std::error_code& ec) {
+#ifdef SEEK_DATA
+    instrumentation().count(Instrumentation::Metadata);
+    if (ftruncate(out, size) != 0) {
+        ec = std::error_code(errno, std::generic_category());
+        return false;
+    }
+    off_t offset = 0;
+    holes = 0;
+    while (offset < size) {
+        instrumentation().count(Instrumentation::Metadata, 2);
+        off_t data = lseek(in, offset, SEEK_DATA);
+        if (data < 0 && errno == ENXIO)
+            data = size; // Only a hole is left
+        if (data < 0) {
+            ec = offset == 0 && copy_unsupported(errno) ? std::make_error_code(std::errc::operation_not_supported)
+                                                        : std::error_code(errno, std::generic_category());
+            return false;
+        }
+        holes += static_cast<uint64_t>(std::min(data, size) - offset);
+        if (data >= size)
+            break;
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        if (hole < 0) {
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+        if (!copy_range(in, out, data, std::min(hole, size) - data, kernel, ec))
+            return false;
+        offset = hole;
+    }
+    return true;
+#else
+    (void)in;
+    (void)out;
+    (void)size;
+    (void)kernel;
+    (void)holes;
+    ec = std::make_error_code(std::errc::operation_not_supported);
+    return false;
+#endif
+}
+
+/**
+ * @brief Copies a regular file using the given strategy, overwriting dst.
+ *
+ * Sparse files, whose allocated blocks cover less than their size, are
+ * copied extent by extent when they cannot be cloned, so their holes are
+ * not written out.
+ *
+ * @param src Source file.
+ * @param dst Destination file.
+ * @param strategy Auto tries each strategy in turn; any other value is used alone.
+ * @param ec Receives the error; operation_not_supported if a forced strategy is unavailable.
+ * @return The strategy that copied the file, or CopyStrategy::Auto on failure.
+ */
+CopyStrategy copy_file_contents(const fs::path& src, const fs::path& dst, CopyStrategy strategy, std::error_code& ec) {
+    Instrumentation& counters = instrumentation();
+    counters.count(Instrumentation::Opens);
+    counters.count(Instrumentation::Metadata);
+    FileDescriptor in(open(src.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    if (in.fd < 0 || fstat(in.fd, &st) != 0) {
+        ec = std::error_code(errno, std::generic_category());
+        return CopyStrategy::Auto;
+    }
+    // Counts the copied file and returns the strategy that copied it
+    uint64_t holes = 0;
+    auto copied = [&](CopyStrategy used) {
+        counters.count(Instrumentation::Files);
+        counters.count(Instrumentation::Bytes, static_cast<uint64_t>(st.st_size) - holes);
+        counters.count(Instrumentation::Holes, holes);
+        return used;
+    };
+#if defined(__APPLE__)
+    if (strategy == CopyStrategy::Auto || strategy == CopyStrategy::Reflink) {
+        // clonefile refuses to replace an existing file
+        unlink(dst.c_str());
+        counters.count(Instrumentation::Metadata);
+        counters.count(Instrumentation::Clones);
+        if (clonefile(src.c_str(), dst.c_str(), 0) == 0)
+            return copied(CopyStrategy::Reflink);
+        if (strategy == CopyStrategy::Reflink) {
+            ec = copy_unsupported(errno) ? std::make_error_code(std::errc::operation_not_supported)
+                                         : std::error_code(errno, std::generic_category());
+            return CopyStrategy::Auto;
+        }
+    }
+#endif
+    counters.count(Instrumentation::Opens);
+    counters.count(Instrumentation::Metadata);
+    FileDescriptor out(open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777));
+    if (out.fd < 0 || fchmod(out.fd, st.st_mode & 07777) != 0) {
+        ec = std::error_code(errno, std::generic_category());
+        return CopyStrategy::Auto;
+    }
+
+    if (strategy == CopyStrategy::Auto || strategy == CopyStrategy::Reflink) {
+        if (reflink_copy(in.fd, out.fd, ec))
+            return copied(CopyStrategy::Reflink);
+        if (strategy == CopyStrategy::Reflink || ec != std::errc::operation_not_supported)
+            return CopyStrategy::Auto;
+        ec.clear();
+    }
+    if (static_cast<off_t>(st.st_blocks) * 512 < st.st_size) {
+        bool kernel = strategy != CopyStrategy::Buffered;
+        if (sparse_copy(in.fd, out.fd, st.st_size, kernel, holes, ec))
+            return copied(kernel ? CopyStrategy::Kernel : CopyStrategy::Buffered);
+        if (ec != std::errc::operation_not_supported)
+            return CopyStrategy::Auto;
+        ec.clear();
+    }
+    if (strategy == CopyStrategy::Auto || strategy == CopyStrategy::Kernel) {
+        if (kernel_copy(in.fd, out.fd, st.st_size, ec))
+            return copied(CopyStrategy::Kernel);
+        if (strategy == CopyStrategy::Kernel || ec != std::errc::operation_not_supported)
+            return CopyStrategy::Auto;
+        ec.clear();
+    }
+    if (buffered_copy(in.fd, out.fd, ec))
+        return copied(CopyStrategy::Buffered);
+    return CopyStrategy::Auto;
+}
+#endif
+
+// Larger files keep the copy strategies, which can clone or copy in the kernel
+const uintmax_t ASYNC_COPY_MAX_SIZE = 256 * 1024;
+// Files copied concurrently by an asynchronous backend
+const size_t ASYNC_COPY_DEPTH = 64;
+
+/**
+ * @brief One file for an asynchronous backend to copy.
+ */
+struct AsyncCopyJob {
+    fs::path src;
+    fs::path dst;
+    fs::perms mode;
+    uintmax_t size;
+    std::string report_path; // Where the result shows up in --report
+};
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+#define TMPL_ASYNC_COPY
+/**
+ * @brief Copies many small files through one io_uring, driven by raw system calls.
+ *
+ * Each file moves through open, read, write and close steps; the steps of up
+ * to ASYNC_COPY_DEPTH files are queued and submitted together, so a whole
+ * batch costs a few io_uring_enter calls instead of a syscall chain per file.
+ */
+class AsyncCopier {
+public:
+    AsyncCopier() = default;
+    ~AsyncCopier() {
+        if (sq_ring != MAP_FAILED)
+            munmap(sq_ring, sq_ring_size);
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+            munmap(cq_ring, cq_ring_size);
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (ring_fd >= 0)
+            close(ring_fd);
+    }
+    AsyncCopier(const AsyncCopier&) = delete;
+    AsyncCopier& operator=(const AsyncCopier&) = delete;
+
+    static IoBackend backend() { return IoBackend::Uring; }
+
+    /**
+     * @brief Sets up the ring.
+     *
+     * @return False if io_uring or one of the needed operations is not available.
+     */
+    bool open() {
+        io_uring_params params = {};
+        ring_fd = static_cast<int>(syscall(__NR_io_uring_setup, static_cast<unsigned>(ASYNC_COPY_DEPTH * 4), &params));
+        if (ring_fd < 0)
+            return false;
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+            return false;
+        cq_ring = (params.features & IORING_FEAT_SINGLE_MMAP)
+                      ? sq_ring
+                      : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (cq_ring == MAP_FAILED || sqes == MAP_FAILED)
+            return false;
+
+        char* sq = static_cast<char*>(sq_ring);
+        char* cq = static_cast<char*>(cq_ring);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        local_tail = *sq_tail;
+        return supports({IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE, IORING_OP_ASYNC_CANCEL});
+    }
+
+    /**
+     * @brief Copies the jobs, giving each destination its job's mode.
+     *
+     * @return For each job, 0 on success or the errno of the step that failed.
+     *         Failed jobs are left for the caller to copy another way.
+     */
+    std::vector<int> copy(const std::vector<AsyncCopyJob>& jobs) {
+        std::vector<int> results(jobs.size(), 0);
+        std::vector<Slot> slots(std::min(jobs.size(), ASYNC_COPY_DEPTH));
+        size_t next_job = 0;
+        size_t active = 0;
+        for (size_t s = 0; s < slots.size(); ++s) {
+            slots[s].buffer.reset(new char[COPY_BUFFER_SIZE]);
+            start(slots[s], s, jobs[next_job], next_job);
+            next_job++;
+            active++;
+        }
+        while (active > 0) {
+            if (!submit_and_wait()) {
+                // The ring itself failed; report everything unfinished so it is copied another way
+                int error = errno ? errno : EIO;
+                for (const Slot& slot : slots) {
+                    if (slot.job != SIZE_MAX)
+                        results[slot.job] = error;
+                }
+                for (size_t j = next_job; j < jobs.size(); ++j)
+                    results[j] = EIO;
+                abandon(slots);
+                return results;
+            }
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                size_t s = static_cast<size_t>(cqe.user_data >> 8);
+                Slot& slot = slots[s];
+                step(slot, s, jobs[slot.job], static_cast<Op>(cqe.user_data & 0xff), cqe.res);
+                if (slot.pending == 0 && slot.stage == Stage::Done) {
+                    results[slot.job] = slot.error;
+                    slot.job = SIZE_MAX;
+                    if (next_job < jobs.size()) {
+                        start(slot, s, jobs[next_job], next_job);
+                        next_job++;
+                    } else {
+                        active--;
+                    }
+                }
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        return results;
+    }
+
+private:
+    enum Op : uint8_t { OPEN_SRC = 1, OPEN_DST, READ, WRITE, CLOSE, CANCEL };
+    enum class Stage { Opening, Copying, Closing, Done };
+
+    struct Slot {
+        size_t job = SIZE_MAX;
+        Stage stage = Stage::Done;
+        int pending = 0; // Operations in flight
+        int in = -1;
+        int out = -1;
+        int error = 0;
+        uint64_t offset = 0;  // Bytes copied so far
+        uint32_t chunk = 0;   // Bytes read into the buffer
+        uint32_t written = 0; // Bytes of the chunk written
+        std::unique_ptr<char[]> buffer;
+    };
+
+    bool supports(std::initializer_list<int> ops) {
+        const unsigned count = 256;
+        std::vector<char> storage(sizeof(io_uring_probe) + count * sizeof(io_uring_probe_op), 0);
+        io_uring_probe* probe = reinterpret_cast<io_uring_probe*>(storage.data());
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, count) < 0)
+            return false;
+        for (int op : ops) {
+            if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED))
+                return false;
+        }
+        return true;
+    }
+
+    // Returns a cleared submission queue entry; submitted on the next submit_and_wait
+    io_uring_sqe* next_sqe(size_t s, Op op) {
+        // Each slot has at most two operations in flight, and abandon two cancels, so the queue never fills
+        unsigned index = local_tail & sq_mask;
+        io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes) + index;
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = (static_cast<uint64_t>(s) << 8) | op;
+        sq_array[index] = index;
+        local_tail++;
+        to_submit++;
+        if (op == OPEN_SRC || op == OPEN_DST)
+            instrumentation().count(Instrumentation::Opens);
+        else if (op == READ || op == WRITE)
+            instrumentation().count(op == READ ? Instrumentation::Reads : Instrumentation::Writes);
+        return sqe;
+    }
+
+    void queue_open(size_t s, Op op, const fs::path& path, int flags, mode_t mode) {
+        io_uring_sqe* sqe = next_sqe(s, op);
+        sqe->opcode = IORING_OP_OPENAT;
+        sqe->fd = AT_FDCWD;
+        sqe->addr = reinterpret_cast<uint64_t>(path.c_str());
+        sqe->open_flags = static_cast<uint32_t>(flags);
+        sqe->len = mode;
+    }
+
+    void queue_rw(Slot& slot, size_t s, Op op) {
+        io_uring_sqe* sqe = next_sqe(s, op);
+        sqe->opcode = op == READ ? IORING_OP_READ : IORING_OP_WRITE;
+        sqe->fd = op == READ ? slot.in : slot.out;
+        sqe->addr = reinterpret_cast<uint64_t>(slot.buffer.get() + (op == READ ? 0 : slot.written));
+        sqe->len = op == READ ? static_cast<uint32_t>(COPY_BUFFER_SIZE) : slot.chunk - slot.written;
+        sqe->off = slot.offset + (op == READ ? 0 : slot.written);
+        slot.pending++;
+    }
+
+    void queue_close(Slot& slot, size_t s) {
+        slot.stage = Stage::Closing;
+        for (int* fd : {&slot.in, &slot.out}) {
+            if (*fd < 0)
+                continue;
+            io_uring_sqe* sqe = next_sqe(s, CLOSE);
+            sqe->opcode = IORING_OP_CLOSE;
+            sqe->fd = *fd;
+            *fd = -1;
+            slot.pending++;
+        }
+        if (slot.pending == 0)
+            slot.stage = Stage::Done;
+    }
+
+    void start(Slot& slot, size_t s, const AsyncCopyJob& job, size_t index) {
+        slot.job = index;
+        slot.stage = Stage::Opening;
+        slot.pending = 2;
+        slot.error = 0;
+        slot.offset = 0;
+        queue_open(s, OPEN_SRC, job.src, O_RDONLY | O_CLOEXEC, 0);
+        queue_open(s, OPEN_DST, job.dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, static_cast<mode_t>(job.mode));
+    }
+
+    // Reads the next chunk, or finishes the file once all of it is copied
+    void read_or_finish(Slot& slot, size_t s, const AsyncCopyJob& job) {
+        if (slot.offset < job.size) {
+            slot.chunk = slot.written = 0;
+            queue_rw(slot, s, READ);
+            return;
+        }
+        // open() applies the umask; set the exact mode like the other copy paths
+        mode_t mode = static_cast<mode_t>(job.mode);
+        if ((mode & process_umask()) != 0) {
+            instrumentation().count(Instrumentation::Metadata);
+            if (fchmod(slot.out, mode) != 0)
+                slot.error = errno;
+        }
+        queue_close(slot, s);
+    }
+
+    void step(Slot& slot, size_t s, const AsyncCopyJob& job, Op op, int result) {
+        slot.pending--;
+        if (result < 0 && slot.error == 0)
+            slot.error = -result;
+        switch (op) {
+        case OPEN_SRC:
+        case OPEN_DST:
+            if (result >= 0)
+                (op == OPEN_SRC ? slot.in : slot.out) = result;
+            if (slot.pending > 0)
+                return; // Wait for the other open
+            if (slot.error) {
+                queue_close(slot, s);
+                return;
+            }
+            slot.stage = Stage::Copying;
+            read_or_finish(slot, s, job);
+            return;
+        case READ:
+            if (result <= 0) {
+                // An early end of file means the file changed; the caller copies it again
+                if (result == 0)
+                    slot.error = ENODATA;
+                queue_close(slot, s);
+                return;
+            }
+            slot.chunk = static_cast<uint32_t>(result);
+            queue_rw(slot, s, WRITE);
+            return;
+        case WRITE:
+            if (result < 0) {
+                queue_close(slot, s);
+                return;
+            }
+            slot.written += static_cast<uint32_t>(result);
+            if (slot.written < slot.chunk) {
+                queue_rw(slot, s, WRITE); // Short write: write the rest
+                return;
+            }
+            slot.offset += slot.chunk;
+            read_or_finish(slot, s, job);
+            return;
+        case CLOSE:
+            if (slot.pending == 0)
+                slot.stage = Stage::Done;
+            return;
+        case CANCEL:
+            return; // Only queued by abandon, which reads its own completions
+        }
+    }
+
+    // Asks the kernel to cancel the operation op of slot s, if it is still in flight
+    void queue_cancel(size_t s, Op op) {
+        io_uring_sqe* sqe = next_sqe(s, CANCEL);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = (static_cast<uint64_t>(s) << 8) | op;
+    }
+
+    // After the ring failed mid-copy: cancels what is in flight, waits for every slot to drain and closes
+    // the files left open. A read may still land in a buffer the ring could not drain, so those are leaked.
+    void abandon(std::vector<Slot>& slots) {
+        for (size_t s = 0; s < slots.size(); ++s) {
+            const Slot& slot = slots[s];
+            if (slot.pending == 0 || slot.stage == Stage::Closing)
+                continue; // Closes finish quickly on their own
+            if (slot.stage == Stage::Opening) {
+                queue_cancel(s, OPEN_SRC);
+                queue_cancel(s, OPEN_DST);
+            } else {
+                queue_cancel(s, slot.chunk == 0 ? READ : WRITE);
+            }
+        }
+        auto in_flight = [&] { return std::any_of(slots.begin(), slots.end(), [](const Slot& slot) { return slot.pending > 0; }); };
+        while (in_flight()) {
+            if (!submit_and_wait()) {
+                for (Slot& slot : slots) {
+                    if (slot.pending > 0)
+                        slot.buffer.release();
+                }
+                break;
+            }
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head) {
+                const io_uring_cqe& cqe = cqes[head & cq_mask];
+                Op op = static_cast<Op>(cqe.user_data & 0xff);
+                if (op == CANCEL)
+                    continue;
+                Slot& slot = slots[static_cast<size_t>(cqe.user_data >> 8)];
+                slot.pending--;
+                if ((op == OPEN_SRC || op == OPEN_DST) && cqe.res >= 0)
+                    (op == OPEN_SRC ? slot.in : slot.out) = cqe.res;
+            }
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+        for (Slot& slot : slots) {
+            for (int* fd : {&slot.in, &slot.out}) {
+                if (*fd >= 0)
+                    close(*fd);
+                *fd = -1;
+            }
+        }
+    }
+
+    bool submit_and_wait() {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        for (;;) {
+            instrumentation().count(Instrumentation::UringEnters);
+            long submitted = syscall(__NR_io_uring_enter, ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (submitted >= 0) {
+                to_submit -= static_cast<unsigned>(submitted);
+                return true;
+            }
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                return false;
+        }
+    }
+
+    int ring_fd = -1;
+    void* sq_ring = MAP_FAILED;
+    void* cq_ring = MAP_FAILED;
+    void* sqes = MAP_FAILED;
+    size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned sq_mask = 0, sq_entries = 0, cq_mask = 0;
+    io_uring_cqe* cqes = nullptr;
+    unsigned local_tail = 0; // Tail including entries not yet published to the kernel
+    unsigned to_submit = 0;
+};
+#elif defined(OS_WINDOWS)
+#define TMPL_ASYNC_COPY
+/**
+ * @brief Copies many small files with overlapped reads and writes on one I/O completion port.
+ *
+ * Up to ASYNC_COPY_DEPTH files are open at a time; each completion queues the
+ * file's next read or write, so one thread keeps all of them busy.
+ */
+class AsyncCopier {
+public:
+    AsyncCopier() = default;
+    ~AsyncCopier() {
+        if (port)
+            CloseHandle(port);
+    }
+    AsyncCopier(const AsyncCopier&) = delete;
+    AsyncCopier& operator=(const AsyncCopier&) = delete;
+
+    static IoBackend backend() { return IoBackend::Iocp; }
+
+    bool open() {
+        port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 1);
+        return port != nullptr;
+    }
+
+    std::vector<int> copy(const std::vector<AsyncCopyJob>& jobs) {
+        std::vector<int> results(jobs.size(), 0);
+        std::vector<Slot> slots(std::min(jobs.size(), ASYNC_COPY_DEPTH));
+        size_t next_job = 0;
+        size_t active = 0;
+        // Starts jobs in a free slot until one is in flight; jobs that fail to open, and empty
+        // files, which need no I/O and so never complete on the port, finish at once
+        auto fill = [&](size_t s) {
+            while (next_job < jobs.size()) {
+                size_t index = next_job++;
+                int error = start(slots[s], s, jobs[index]);
+                if (error == 0 && !slots[s].done) {
+                    slots[s].job = index;
+                    slots[s].in_flight = true;
+                    active++;
+                    return;
+                }
+                results[index] = error != 0 ? error : finish(slots[s], jobs[index], 0);
+            }
+        };
+        for (size_t s = 0; s < slots.size(); ++s) {
+            slots[s].buffer.reset(new char[COPY_BUFFER_SIZE]);
+            fill(s);
+        }
+        while (active > 0) {
+            DWORD bytes = 0;
+            ULONG_PTR key = 0;
+            OVERLAPPED* overlapped = nullptr;
+            BOOL ok = GetQueuedCompletionStatus(port, &bytes, &key, &overlapped, INFINITE);
+            if (!overlapped) {
+                // The port itself failed; report everything unfinished so it is copied another way
+                int error = static_cast<int>(GetLastError());
+                for (Slot& slot : slots) {
+                    if (!slot.in_flight)
+                        continue;
+                    CancelIoEx(slot.in, nullptr);
+                    CancelIoEx(slot.out, nullptr);
+                    CloseHandle(slot.in);
+                    CloseHandle(slot.out);
+                    slot.in_flight = false;
+                    results[slot.job] = error != 0 ? error : ERROR_OPERATION_ABORTED;
+                }
+                for (size_t j = next_job; j < jobs.size(); ++j)
+                    results[j] = ERROR_OPERATION_ABORTED;
+                return results;
+            }
+            Slot& slot = slots[key];
+            const AsyncCopyJob& job = jobs[slot.job];
+            int error = ok ? 0 : static_cast<int>(GetLastError());
+            if (error == 0)
+                error = step(slot, job, bytes);
+            if (error != 0 || slot.done) {
+                results[slot.job] = finish(slot, job, error);
+                slot.in_flight = false;
+                active--;
+                fill(key);
+            }
+        }
+        return results;
+    }
+
+private:
+    struct Slot {
+        size_t job = 0;
+        HANDLE in = INVALID_HANDLE_VALUE;
+        HANDLE out = INVALID_HANDLE_VALUE;
+        OVERLAPPED overlapped = {};
+        bool in_flight = false; // Has an operation queued on the port
+        bool reading = false;
+        bool done = false;
+        uint64_t offset = 0;
+        DWORD chunk = 0;
+        DWORD written = 0;
+        std::unique_ptr<char[]> buffer;
+    };
+
+    int start(Slot& slot, size_t s, const AsyncCopyJob& job) {
+        instrumentation().count(Instrumentation::Opens, 2);
+        slot.in = CreateFileW(job.src.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, nullptr);
+        if (slot.in == INVALID_HANDLE_VALUE)
+            return static_cast<int>(GetLastError());
+        slot.out = CreateFileW(job.dst.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_FLAG_OVERLAPPED, nullptr);
+        if (slot.out == INVALID_HANDLE_VALUE) {
+            int error = static_cast<int>(GetLastError());
+            CloseHandle(slot.in);
+            return error;
+        }
+        if (!CreateIoCompletionPort(slot.in, port, s, 0) || !CreateIoCompletionPort(slot.out, port, s, 0)) {
+            int error = static_cast<int>(GetLastError());
+            CloseHandle(slot.in);
+            CloseHandle(slot.out);
+            return error;
+        }
+        slot.offset = 0;
+        slot.done = false;
+        int error = read_next(slot, job);
+        if (error != 0) {
+            CloseHandle(slot.in);
+            CloseHandle(slot.out);
+        }
+        return error;
+    }
+
+    // Closes a job's files and, if it succeeded, gives the copy the source's read-only attribute
+    static int finish(Slot& slot, const AsyncCopyJob& job, int error) {
+        CloseHandle(slot.in);
+        CloseHandle(slot.out);
+        if (error == 0 && !SetFileAttributesW(job.dst.c_str(), (job.mode & fs::perms::owner_write) == fs::perms::none
+                                                                 ? FILE_ATTRIBUTE_READONLY
+                                                                 : FILE_ATTRIBUTE_NORMAL))
+            error = static_cast<int>(GetLastError());
+        return error;
+    }
+
+    int read_next(Slot& slot, const AsyncCopyJob& job) {
+        if (slot.offset >= job.size) {
+            slot.done = true;
+            return 0;
+        }
+        slot.reading = true;
+        instrumentation().count(Instrumentation::Reads);
+        return issue(slot, ReadFile(slot.in, slot.buffer.get(), static_cast<DWORD>(COPY_BUFFER_SIZE), nullptr, prepare(slot, 0)));
+    }
+
+    int step(Slot& slot, const AsyncCopyJob& job, DWORD bytes) {
+        if (slot.reading) {
+            if (bytes == 0)
+                return ERROR_HANDLE_EOF; // The file changed; the caller copies it again
+            slot.reading = false;
+            slot.chunk = bytes;
+            slot.written = 0;
+        } else {
+            slot.written += bytes;
+            if (slot.written == slot.chunk) {
+                slot.offset += slot.chunk;
+                return read_next(slot, job);
+            }
+        }
+        instrumentation().count(Instrumentation::Writes);
+        return issue(slot, WriteFile(slot.out, slot.buffer.get() + slot.written, slot.chunk - slot.written, nullptr,
+                                     prepare(slot, slot.written)));
+    }
+
+    OVERLAPPED* prepare(Slot& slot, DWORD extra) {
+        slot.overlapped = {};
+        uint64_t offset = slot.offset + extra;
+        slot.overlapped.Offset = static_cast<DWORD>(offset);
+        slot.overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+        return &slot.overlapped;
+    }
+
+    static int issue(Slot&, BOOL ok) {
+        DWORD error = ok ? 0 : GetLastError();
+        return error == 0 || error == ERROR_IO_PENDING ? 0 : static_cast<int>(error);
+    }
+
+    HANDLE port = nullptr;
+};
+#endif
+
+// SHA-256 round constants
+alignas(16) const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#ifdef TMPL_X86
+/**
+ * @brief Checks whether the CPU has the SHA extensions (SHA-NI).
+ */
+bool sha_extensions_supported() {
+    static const bool supported = [] {
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 29)) != 0;
+#elif defined(__GNUC__) || defined(__clang__)
+        unsigned a, b, c, d;
+        __asm__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "a"(7), "c"(0));
+        return (b & (1u << 29)) != 0 && __builtin_cpu_supports("sse4.1");
+#else
+        return false;
+#endif
+    }();
+    return supported;
+}
+
+// Runs the SHA-256 compression over whole 64-byte blocks with the SHA extensions. The state
+// is kept as ABEF/CDGH halves; each group of four rounds also extends the message schedule.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("sha,sse4.1")))
+#endif
+void sha256_blocks_shani(uint32_t state[8], const unsigned char* data, size_t blocks) {
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[0])), 0xB1); // CDAB
+    __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(&state[4])), 0x1B); // EFGH
+    __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);      // CDGH
+    for (; blocks > 0; --blocks, data += 64) {
+        __m128i abef = state0;
+        __m128i cdgh = state1;
+        __m128i msg[4];
+        for (int i = 0; i < 4; ++i)
+            msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(data + 16 * i)), byte_swap);
+        for (int group = 0; group < 16; ++group) {
+            __m128i& current = msg[group & 3];
+            __m128i& previous = msg[(group + 3) & 3];
+            __m128i& next = msg[(group + 1) & 3];
+            __m128i words = _mm_add_epi32(current, _mm_load_si128(reinterpret_cast<const __m128i*>(&SHA256_K[4 * group])));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, words);
+            if (group >= 3 && group <= 14) // Finishes the schedule words of the next group
+                next = _mm_sha256msg2_epu32(_mm_add_epi32(next, _mm_alignr_epi8(current, previous, 4)), current);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(words, 0x0E));
+            if (group >= 1 && group <= 12) // Starts the schedule words three groups ahead
+                previous = _mm_sha256msg1_epu32(previous, current);
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+    }
+    tmp = _mm_shuffle_epi32(state0, 0x1B);       // FEBA
+    state1 = _mm_shuffle_epi32(state1, 0xB1);    // DCHG
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+    state1 = _mm_alignr_epi8(state1, tmp, 8);    // HGFE
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[0]), state0);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(&state[4]), state1);
+}
+#endif
+
+/**
+ * @brief Incremental SHA-256, used to address blobs in the object store.
+ *
+ * Whole blocks go through the SHA extensions on x86 CPUs that have them.
+ */
+class Sha256 {
+public:
+    /**
+     * @param extensions Use the SHA extensions if the CPU has them; false always runs the portable rounds.
+     */
+    explicit Sha256(bool extensions = true) : extensions(extensions) { reset(); }
+
+    void reset() {
+        static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                            0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        std::memcpy(state, initial, sizeof(state));
+        total = 0;
+        buffered = 0;
+    }
+
+    void update(const void* data, size_t length) {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        total += length;
+        if (buffered > 0) {
+            size_t take = std::min(length, sizeof(block) - buffered);
+            std::memcpy(block + buffered, bytes, take);
+            buffered += take;
+            bytes += take;
+            length -= take;
+            if (buffered < sizeof(block))
+                return;
+            compress_blocks(block, 1);
+            buffered = 0;
+        }
+        size_t blocks = length / sizeof(block);
+        compress_blocks(bytes, blocks);
+        bytes += blocks * sizeof(block);
+        length -= blocks * sizeof(block);
+        std::memcpy(block, bytes, length);
+        buffered = length;
+    }
+
+    /**
+     * @brief Finishes the hash and returns it as 64 lowercase hex digits.
+     */
+    std::string hex_digest() {
+        uint64_t bits = total * 8;
+        unsigned char padding[72] = {0x80};
+        size_t pad = (buffered < 56 ? 56 : 120) - buffered;
+        update(padding, pad);
+        unsigned char length[8];
+        for (int i = 0; i < 8; ++i)
+            length[i] = static_cast<unsigned char>(bits >> (56 - 8 * i));
+        update(length, 8);
+        static const char digits[] = "0123456789abcdef";
+        std::string hex;
+        for (uint32_t word : state) {
+            for (int shift = 28; shift >= 0; shift -= 4)
+                hex += digits[(word >> shift) & 0xf];
+        }
+        return hex;
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+
+    void compress_blocks(const unsigned char* data, size_t blocks) {
+#ifdef TMPL_X86
+        if (extensions && sha_extensions_supported()) {
+            sha256_blocks_shani(state, data, blocks);
+            return;
+        }
+#endif
+        for (; blocks > 0; --blocks, data += sizeof(block))
+            compress(data);
+    }
+
+    void compress(const unsigned char* chunk) {
+        const uint32_t* k = SHA256_K;
+        uint32_t w[64];
+        for (int i = 0; i < 16; ++i)
+            w[i] = uint32_t(chunk[4 * i]) << 24 | uint32_t(chunk[4 * i + 1]) << 16 | uint32_t(chunk[4 * i + 2]) << 8 | chunk[4 * i + 3];
+        for (int i = 16; i < 64; ++i) {
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+        uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+        for (int i = 0; i < 64; ++i) {
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+    }
+
+    uint32_t state[8];
+    unsigned char block[64];
+    uint64_t total;
+    size_t buffered;
+    bool extensions;
+};
+
+/**
+ * @brief Computes the SHA-256 of a file's contents.
+ *
+ * @param path The file to hash.
+ * @param ec Receives the error if the file cannot be read.
+ * @return The hash as 64 hex digits, or an empty string on error.
+ */
+std::string hash_file(const fs::path& path, std::error_code& ec) {
+    TraceScope scope("hash", &path);
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        ec = std::make_error_code(std::errc::no_such_file_or_directory);
+        return "";
+    }
+    Sha256 sha;
+    BufferPool::Lease buffer(copy_buffers());
+    while (file) {
+        file.read(buffer.data(), buffer.size());
+        sha.update(buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+    if (file.bad()) {
+        ec = std::make_error_code(std::errc::io_error);
+        return "";
+    }
+    return sha.hex_digest();
+}
+
+/**
+ * @brief Fixed-size thread pool where each worker owns a task deque.
+ *
+ * Workers take tasks from the back of their own deque and, when it runs dry,
+ * steal from the front of the other workers' deques. Tasks submitted from a
+ * worker go to that worker's deque, so a directory's files are usually copied
+ * by the thread that enumerated it.
+ */
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(unsigned jobs) {
+        if (jobs == 0)
+            jobs = 1;
+        for (unsigned i = 0; i < jobs; ++i)
+            queues.push_back(std::make_unique<Queue>());
+        for (unsigned i = 0; i < jobs; ++i)
+            workers.emplace_back([this, i] { worker_loop(i); });
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    /**
+     * @brief Queues a task. Tasks must not throw.
+     *
+     * @param task The task to run on a worker thread.
+     */
+    void submit(std::function<void()> task) {
+        size_t index = current_worker;
+        if (current_pool != this)
+            index = next_queue++ % queues.size();
+        pending++;
+        {
+            std::lock_guard<std::mutex> lock(queues[index]->mutex);
+            queues[index]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(idle_mutex);
+            queued++;
+        }
+        idle_cv.notify_one();
+    }
+
+    /**
+     * @brief Blocks until every submitted task, including tasks submitted by tasks, has finished.
+     */
+    void wait() {
+        std::unique_lock<std::mutex> lock(idle_mutex);
+        done_cv.wait(lock, [this] { return pending == 0; });
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    // Pops from the worker's own deque first, then tries to steal from the others.
+    bool take_task(size_t index, std::function<void()>& task) {
+        for (size_t n = 0; n < queues.size(); ++n) {
+            Queue& queue = *queues[(index + n) % queues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (queue.tasks.empty())
+                continue;
+            if (n == 0) {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+            } else {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+            }
+            return true;
+        }
+        return false;
+    }
+
+    void worker_loop(size_t index) {
+        current_pool = this;
+        current_worker = index;
+        for (;;) {
+            {
+                std::unique_lock<std::mutex> lock(idle_mutex);
+                idle_cv.wait(lock, [this] { return queued > 0 || stopping; });
+                if (queued == 0 && stopping)
+                    return;
+                queued--;
+            }
+            std::function<void()> task;
+            // A task counted in `queued` is always in some deque, so this succeeds.
+            while (!take_task(index, task))
+                std::this_thread::yield();
+            task();
+            if (--pending == 0) {
+                std::lock_guard<std::mutex> lock(idle_mutex);
+                done_cv.notify_all();
+            }
+        }
+    }
+
+    static thread_local WorkStealingPool* current_pool;
+    static thread_local size_t current_worker;
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::atomic<size_t> pending{0};
+    std::atomic<size_t> next_queue{0};
+    size_t queued = 0; // Guarded by idle_mutex
+    bool stopping = false; // Guarded by idle_mutex
+    std::mutex idle_mutex;
+    std::condition_variable idle_cv;
+    std::condition_variable done_cv;
+};
+
+thread_local WorkStealingPool* WorkStealingPool::current_pool = nullptr;
+thread_local size_t WorkStealingPool::current_worker = 0;
+
+// Directory holding the blobs of templates saved with --dedup
+const fs::path OBJECTS_DIR = TEMPLATE_DIR / ".objects";
+// Directory holding tmpl's own state: the index, locks and staged saves
+const fs::path STATE_DIR = TEMPLATE_DIR / ".tmpl";
+
+/**
+ * @brief Checks whether a path inside a template belongs to tmpl rather than to the template.
+ *
+ * @param rel Path relative to the template directory.
+ * @return True for .meta files (at any depth) and the template's .manifest, .pack, .checksums and .meta temporaries.
+ */
+bool is_template_metadata(const fs::path& rel) {
+    if (rel.filename() == ".meta")
+        return true;
+    if (rel.parent_path().empty() && rel.string().rfind(".meta.tmp", 0) == 0)
+        return true; // Left by a write_meta that was interrupted
+    return rel == ".manifest" || rel == ".pack" || rel == ".checksums";
+}
+
+/**
+ * @brief Walks a directory tree on a work-stealing pool, collecting errors from all workers.
+ *
+ * Each directory is visited by the task that enumerates it, before any of the
+ * tasks for its entries are submitted, so a visitor may create the matching
+ * destination directory and rely on it existing when its files are visited.
+ * tmpl's own metadata files and the paths a filter excludes are not visited,
+ * and excluded directories are never enumerated.
+ */
+class ParallelWalker {
+public:
+    // Called with the source directory and its path relative to the root ("" for the root); false skips it.
+    using DirectoryVisitor = std::function<bool(const fs::path& src, const fs::path& rel)>;
+    // Called with the source file and its path relative to the root.
+    using FileVisitor = std::function<void(const fs::path& src, const fs::path& rel)>;
+
+    explicit ParallelWalker(unsigned jobs, std::shared_ptr<const PathFilter> filter = nullptr)
+        : pool(jobs), filter(std::move(filter)) {}
+
+    /**
+     * @brief Reports symbolic links to visitor instead of following them in later runs.
+     */
+    void visit_links(FileVisitor visitor) { on_link = std::move(visitor); }
+
+    /**
+     * @brief Walks src and waits for all workers to finish.
+     *
+     * @return The errors reported by the workers, empty on success.
+     */
+    std::vector<std::string> run(const fs::path& src, DirectoryVisitor directory_visitor, FileVisitor file_visitor) {
+        on_directory = std::move(directory_visitor);
+        on_file = std::move(file_visitor);
+        pool.submit([this, src] { walk_directory(src, fs::path()); });
+        pool.wait();
+        return take_errors();
+    }
+
+    /**
+     * @brief Records an error; safe to call from any worker.
+     */
+    void add_error(const std::string& message) {
+        std::lock_guard<std::mutex> lock(errors_mutex);
+        errors.push_back(message);
+    }
+
+    /**
+     * @brief Returns the errors collected so far and clears them.
+     */
+    std::vector<std::string> take_errors() {
+        std::lock_guard<std::mutex> lock(errors_mutex);
+        return std::move(errors);
+    }
+
+    WorkStealingPool& workers() { return pool; }
+
+private:
+    void walk_directory(const fs::path& src, const fs::path& rel) {
+        if (!on_directory(src, rel))
+            return; // Nothing below this directory is wanted or possible
+        TraceScope scope("enumerate", &src);
+        std::error_code ec;
+        fs::directory_iterator it(src, ec);
+        for (; !ec && it != fs::directory_iterator(); it.increment(ec)) {
+            const auto& entry = *it;
+            fs::path path = entry.path();
+            fs::path entry_rel = rel / path.filename();
+
+            // Tasks must not throw, so a link loop or an unreadable entry is reported instead
+            std::error_code entry_ec;
+            bool link = on_link && fs::is_symlink(entry.symlink_status(entry_ec));
+            fs::file_status status = link || entry_ec ? fs::file_status() : entry.status(entry_ec);
+            if (entry_ec == std::errc::no_such_file_or_directory)
+                continue; // A dangling link, when links are followed
+            if (entry_ec) {
+                add_error("Cannot read " + path.string() + ": " + entry_ec.message());
+                continue;
+            }
+
+            if (link) {
+                if (is_template_metadata(entry_rel) || (filter && !filter->keeps(entry_rel.generic_string(), false)))
+                    continue;
+                pool.submit([this, path, entry_rel] { on_link(path, entry_rel); });
+            } else if (fs::is_directory(status)) {
+                if (filter && !filter->keeps(entry_rel.generic_string(), true))
+                    continue; // Excluded subtrees are never entered
+                pool.submit([this, path, entry_rel] { walk_directory(path, entry_rel); });
+            } else if (fs::is_regular_file(status)) {
+                if (is_template_metadata(entry_rel)) {
+                    continue; // Skip copying .meta files
+                }
+                if (filter && !filter->keeps(entry_rel.generic_string(), false))
+                    continue;
+                pool.submit([this, path, entry_rel] { on_file(path, entry_rel); });
+            }
+        }
+        if (ec)
+            add_error("Cannot read " + src.string() + ": " + ec.message());
+    }
+
+    WorkStealingPool pool;
+    std::shared_ptr<const PathFilter> filter; // Null visits everything
+    DirectoryVisitor on_directory;
+    FileVisitor on_file;
+    FileVisitor on_link; // Unset follows links
+    std::mutex errors_mutex;
+    std::vector<std::string> errors;
+};
+
+/**
+ * @brief One file or directory of a template saved in the object store.
+ */
+struct ManifestEntry {
+    bool directory = false;
+    std::string hash;  // SHA-256 of the contents; empty for directories
+    fs::perms mode = fs::perms::none;
+    uintmax_t size = 0;
+    std::string path;  // Relative to the template root, '/'-separated
+    bool symlink = false;     // A symbolic link to link_target; only directory templates keep links
+    std::string link_target;
+    int64_t mtime = 0;        // Modification time in stat_entry's units; 0 if not recorded
+};
+
+using Manifest = std::vector<ManifestEntry>;
+
+/**
+ * @brief Reads the mode, size and modification time of a template entry without following links.
+ *
+ * On POSIX this is one lstat, with times in nanoseconds since the epoch.
+ *
+ * @param path The file, directory or symbolic link.
+ * @param entry Receives the attributes, and the target of a link.
+ * @param ec Receives the error.
+ * @return False if the entry cannot be read.
+ */
+bool stat_entry(const fs::path& path, ManifestEntry& entry, std::error_code& ec) {
+    instrumentation().count(Instrumentation::Metadata);
+#ifdef OS_WINDOWS
+    fs::file_status status = fs::symlink_status(path, ec);
+    if (ec)
+        return false;
+    entry.mode = status.permissions();
+    entry.symlink = fs::is_symlink(status);
+    entry.size = fs::is_regular_file(status) ? fs::file_size(path, ec) : 0;
+    if (!entry.symlink && !ec)
+        entry.mtime = static_cast<int64_t>(fs::last_write_time(path, ec).time_since_epoch().count());
+#else
+    struct stat st;
+    if (lstat(path.c_str(), &st) != 0) {
+        ec = std::error_code(errno, std::generic_category());
+        return false;
+    }
+    entry.mode = static_cast<fs::perms>(st.st_mode & 07777);
+    entry.symlink = S_ISLNK(st.st_mode);
+    entry.size = S_ISREG(st.st_mode) ? static_cast<uintmax_t>(st.st_size) : 0;
+#if defined(__APPLE__)
+    entry.mtime = static_cast<int64_t>(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+    entry.mtime = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+    if (entry.symlink)
+        entry.link_target = fs::read_symlink(path, ec).string();
+    return !ec;
+}
+
+/**
+ * @brief Gives a path a modification time read by stat_entry; links themselves are changed, not their targets.
+ */
+void set_entry_time(const fs::path& path, int64_t mtime, std::error_code& ec) {
+    instrumentation().count(Instrumentation::Metadata);
+#ifdef OS_WINDOWS
+    fs::last_write_time(path, fs::file_time_type(fs::file_time_type::duration(mtime)), ec);
+#else
+    timespec times[2];
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT; // Keep the access time
+    times[1].tv_sec = static_cast<time_t>(mtime / 1000000000);
+    times[1].tv_nsec = static_cast<long>(mtime % 1000000000);
+    if (utimensat(AT_FDCWD, path.c_str(), times, AT_SYMLINK_NOFOLLOW) != 0)
+        ec = std::error_code(errno, std::generic_category());
+#endif
+}
+
+/**
+ * @brief Returns the object store path of a blob.
+ */
+fs::path object_path(const std::string& hash) {
+    return OBJECTS_DIR / hash;
+}
+
+/**
+ * @brief Parses the contents of a .manifest.
+ *
+ * @param in The manifest.
+ * @param manifest Receives the entries.
+ * @return False if the input is not a manifest.
+ */
+bool parse_manifest(std::istream& in, Manifest& manifest) {
+    std::string line;
+    if (!in || !std::getline(in, line) || line != "tmpl-manifest 1")
+        return false;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        unsigned mode = 0;
+        ManifestEntry entry;
+        fields >> kind;
+        if (kind == "d") {
+            entry.directory = true;
+            fields >> std::oct >> mode;
+        } else if (kind == "f") {
+            fields >> entry.hash >> std::oct >> mode >> std::dec >> entry.size;
+        } else {
+            continue;
+        }
+        fields.get(); // The path is the rest of the line after one space
+        std::getline(fields, entry.path);
+        entry.mode = static_cast<fs::perms>(mode);
+        if (fields && !entry.path.empty())
+            manifest.push_back(std::move(entry));
+    }
+    return true;
+}
+
+/**
+ * @brief Reads a template's .manifest.
+ *
+ * Directory entries come before the entries inside them.
+ *
+ * @param template_path Path to the template directory.
+ * @param manifest Receives the entries.
+ * @return False if the template has no manifest, i.e. it stores its files directly.
+ */
+bool read_manifest(const fs::path& template_path, Manifest& manifest) {
+    TraceScope scope("read manifest");
+    std::ifstream manifest_file(template_path / ".manifest");
+    return parse_manifest(manifest_file, manifest);
+}
+
+/**
+ * @brief Writes a template's .manifest, sorted so directories precede their contents.
+ *
+ * @param template_path Path to the template directory.
+ * @param manifest The entries to write.
+ * @return False if the file could not be written in full.
+ */
+bool write_manifest(const fs::path& template_path, Manifest manifest) {
+    std::sort(manifest.begin(), manifest.end(), [](const ManifestEntry& a, const ManifestEntry& b) { return a.path < b.path; });
+    std::ofstream manifest_file(template_path / ".manifest");
+    manifest_file << "tmpl-manifest 1\n";
+    for (const auto& entry : manifest) {
+        unsigned mode = static_cast<unsigned>(entry.mode) & 07777;
+        if (entry.directory)
+            manifest_file << "d " << std::oct << mode << std::dec << " " << entry.path << "\n";
+        else
+            manifest_file << "f " << entry.hash << " " << std::oct << mode << std::dec << " " << entry.size << " " << entry.path << "\n";
+    }
+    manifest_file.flush();
+    return !manifest_file.fail();
+}
+
+/**
+ * @brief A read-only memory mapping of a whole file.
+ */
+class MappedFile {
+public:
+    MappedFile() = default;
+    ~MappedFile() { unmap(); }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    /**
+     * @brief Maps a file.
+     *
+     * @param path The file to map.
+     * @param ec Receives the error if the file cannot be opened or mapped.
+     * @return False on error.
+     */
+    bool map(const fs::path& path, std::error_code& ec) {
+        unmap();
+#ifdef OS_WINDOWS
+        file = CreateFileW(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        LARGE_INTEGER file_size;
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size)) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            return false;
+        }
+        length = static_cast<size_t>(file_size.QuadPart);
+        if (length == 0)
+            return true;
+        mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (mapping)
+            bytes = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (!bytes) {
+            ec = std::error_code(GetLastError(), std::system_category());
+            return false;
+        }
+#else
+        FileDescriptor in(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st;
+        if (in.fd < 0 || fstat(in.fd, &st) != 0) {
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+        length = static_cast<size_t>(st.st_size);
+        if (length == 0)
+            return true;
+        void* address = mmap(nullptr, length, PROT_READ, MAP_SHARED, in.fd, 0);
+        if (address == MAP_FAILED) {
+            ec = std::error_code(errno, std::generic_category());
+            return false;
+        }
+        bytes = static_cast<const unsigned char*>(address);
+#endif
+        return true;
+    }
+
+    const unsigned char* data() const { return bytes; }
+    size_t size() const { return length; }
+
+private:
+    void unmap() {
+#ifdef OS_WINDOWS
+        if (bytes)
+            UnmapViewOfFile(bytes);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+        mapping = nullptr;
+        file = INVALID_HANDLE_VALUE;
+#else
+        if (bytes)
+            munmap(const_cast<unsigned char*>(bytes), length);
+#endif
+        bytes = nullptr;
+        length = 0;
+    }
+
+#ifdef OS_WINDOWS
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+#endif
+    const unsigned char* bytes = nullptr;
+    size_t length = 0;
+};
+
+// Files at least this large are hashed through a memory mapping rather than read into a buffer
+const uintmax_t MAPPED_HASH_THRESHOLD = 1 << 20;
+
+/**
+ * @brief Computes the SHA-256 of a file's contents, mapping large files instead of reading them.
+ *
+ * @param path The file to hash.
+ * @param size The file's size, as found by stat_entry.
+ * @param ec Receives the error if the file cannot be read.
+ * @return The hash as 64 hex digits, or an empty string on error.
+ */
+std::string hash_contents(const fs::path& path, uintmax_t size, std::error_code& ec) {
+    if (size < MAPPED_HASH_THRESHOLD)
+        return hash_file(path, ec);
+    TraceScope scope("hash", &path);
+    MappedFile file;
+    if (!file.map(path, ec))
+        return "";
+    Sha256 sha;
+    sha.update(file.data(), file.size());
+    return sha.hex_digest();
+}
+
+/**
+ * @brief Computes the SHA-256 of a string, such as the target of a symbolic link.
+ */
+std::string hash_text(const std::string& text) {
+    Sha256 sha;
+    sha.update(text.data(), text.size());
+    return sha.hex_digest();
+}
+
+/*
+Checksums (.checksums) of a template that stores its files directly, one line per entry after
+the "tmpl-checksums 1" header:
+
+  f <sha256> <size> <mtime> <path>   a file, with its size and stat_entry modification time
+  l <sha256> <size> <mtime> <path>   a symbolic link; the hash and size are those of its target
+
+Directories are not listed. Templates in the object store or in a pack need no such file:
+their manifest or file table already holds the hash of every file.
+*/
+
+/**
+ * @brief Reads a template's .checksums.
+ *
+ * @param template_path Path to the template directory.
+ * @param checksums Receives the entries, sorted by path.
+ * @return False if the template has no checksums, e.g. because it was saved by an older tmpl.
+ */
+bool read_checksums(const fs::path& template_path, Manifest& checksums) {
+    std::ifstream in(template_path / ".checksums");
+    std::string line;
+    if (!in || !std::getline(in, line) || line != "tmpl-checksums 1")
+        return false;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        ManifestEntry entry;
+        fields >> kind >> entry.hash >> entry.size >> entry.mtime;
+        if (kind != "f" && kind != "l")
+            continue;
+        entry.symlink = kind == "l";
+        fields.get(); // The path is the rest of the line after one space
+        std::getline(fields, entry.path);
+        if (fields && !entry.path.empty())
+            checksums.push_back(std::move(entry));
+    }
+    return true;
+}
+
+/**
+ * @brief Hashes every file and link of a template and writes them to its .checksums.
+ *
+ * Files are hashed on a pool of jobs threads. A file that is a hard link to
+ * the same file of the previous version, with the size and modification time
+ * its checksums recorded, keeps its hash instead of being read again, which
+ * is what keeps save --update cheap.
+ *
+ * @param template_path Path to the template directory.
+ * @param jobs Number of hashing threads.
+ * @param previous_path The version being replaced, or empty.
+ * @return False if an entry could not be read; errors are reported on stderr.
+ */
+bool write_checksums(const fs::path& template_path, unsigned jobs, const fs::path& previous_path = {}) {
+    TraceScope scope("write checksums");
+    Manifest previous;
+    if (!previous_path.empty())
+        read_checksums(previous_path, previous);
+    std::unordered_map<std::string, const ManifestEntry*> known;
+    for (const auto& entry : previous)
+        known.emplace(entry.path, &entry);
+
+    ParallelWalker walker(jobs);
+    std::mutex checksums_mutex;
+    Manifest checksums;
+    auto record = [&](const fs::path& path, const fs::path& rel) {
+        ManifestEntry entry;
+        std::error_code ec, shared_ec;
+        if (stat_entry(path, entry, ec)) {
+            entry.path = rel.generic_string();
+            auto it = known.find(entry.path);
+            if (entry.symlink) {
+                entry.size = entry.link_target.size();
+                entry.hash = hash_text(entry.link_target);
+            } else if (it != known.end() && !it->second->symlink && it->second->size == entry.size && entry.mtime != 0 &&
+                       it->second->mtime == entry.mtime && fs::equivalent(previous_path / rel, path, shared_ec)) {
+                entry.hash = it->second->hash;
+            } else {
+                entry.hash = hash_contents(path, entry.size, ec);
+            }
+        }
+        if (ec) {
+            walker.add_error("Cannot hash " + path.string() + ": " + ec.message());
+            return;
+        }
+        std::lock_guard<std::mutex> lock(checksums_mutex);
+        checksums.push_back(std::move(entry));
+    };
+    walker.visit_links(record);
+    std::vector<std::string> errors = walker.run(template_path, [](const fs::path&, const fs::path&) { return true; }, record);
+    for (const auto& error : errors)
+        std::cerr << error << "\n";
+    if (!errors.empty())
+        return false;
+
+    std::sort(checksums.begin(), checksums.end(), [](const ManifestEntry& a, const ManifestEntry& b) { return a.path < b.path; });
+    std::string text = "tmpl-checksums 1\n";
+    for (const auto& entry : checksums) {
+        text += entry.symlink ? "l " : "f ";
+        text += entry.hash + " " + std::to_string(entry.size) + " " + std::to_string(entry.mtime) + " " + entry.path + "\n";
+    }
+    std::ofstream out(template_path / ".checksums", std::ios::binary);
+    out << text;
+    if (!out.flush()) {
+        std::cerr << "Cannot write " << template_path / ".checksums" << "\n";
+        return false;
+    }
+    return true;
+}
+
+/*
+Pack format (.pack), all integers little-endian:
+
+  Header, PACK_HEADER_SIZE bytes:
+    char[8]  magic "TMPLPACK"
+    u32      version (1)
+    u32      reserved
+    u64      entry count
+    u64      table offset
+    u64      table size
+    padding up to PACK_HEADER_SIZE
+
+  Data: the stored bytes of every file, back to back.
+
+  File table, one record per entry:
+    u8       kind (0 file, 1 directory)
+    u8       codec (0 stored, 1 zstd, 2 lz4)
+    u16      path length
+    u32      mode
+    u64      offset of the stored bytes
+    u64      stored size
+    u64      size
+    u8[32]   SHA-256 of the contents (zero for directories)
+    char[]   path, relative and '/'-separated
+
+The table is written after the data so that packs can be written in one
+pass, and read on its own to list a pack without touching the data.
+*/
+const char PACK_MAGIC[8] = {'T', 'M', 'P', 'L', 'P', 'A', 'C', 'K'};
+const size_t PACK_HEADER_SIZE = 64;
+const size_t PACK_RECORD_SIZE = 64; // Fixed part of a file table record
+
+enum PackCodec : uint8_t {
+    PACK_STORED = 0,
+    PACK_ZSTD = 1, // One zstd frame
+    PACK_LZ4 = 2,  // One LZ4 frame
+};
+
+/**
+ * @brief One entry of a pack's file table.
+ */
+struct PackEntry : ManifestEntry {
+    uint8_t codec = PACK_STORED;
+    uint64_t offset = 0;
+    uint64_t stored_size = 0;
+};
+
+/**
+ * @brief Which codec save --pack uses for each blob.
+ */
+enum class Compression {
+    None, // Store every blob as is
+    Auto, // Choose per blob from its size and entropy
+    Zstd,
+    Lz4,
+};
+
+/**
+ * @brief Parses a --compress value.
+ *
+ * @param value One of none, auto, zstd or lz4.
+ * @param compression Receives the parsed setting.
+ * @return False if the value is not known.
+ */
+bool parse_compression(const std::string& value, Compression& compression) {
+    if (value == "none")
+        compression = Compression::None;
+    else if (value == "auto")
+        compression = Compression::Auto;
+    else if (value == "zstd")
+        compression = Compression::Zstd;
+    else if (value == "lz4")
+        compression = Compression::Lz4;
+    else
+        return false;
+    return true;
+}
+
+const char* pack_codec_name(uint8_t codec) {
+    switch (codec) {
+    case PACK_STORED: return "stored";
+    case PACK_ZSTD: return "zstd";
+    case PACK_LZ4: return "lz4";
+    }
+    return "unknown";
+}
+
+/**
+ * @brief Checks whether this build can encode and decode a codec.
+ */
+bool pack_codec_available(uint8_t codec) {
+    switch (codec) {
+    case PACK_STORED: return true;
+#ifdef TMPL_WITH_ZSTD
+    case PACK_ZSTD: return true;
+#endif
+#ifdef TMPL_WITH_LZ4
+    case PACK_LZ4: return true;
+#endif
+    }
+    return false;
+}
+
+/**
+ * @brief Estimates the Shannon entropy of a sample in bits per byte.
+ */
+double sample_entropy(const char* data, size_t size) {
+    if (size == 0)
+        return 0;
+    size_t counts[256] = {};
+    for (size_t i = 0; i < size; ++i)
+        counts[static_cast<unsigned char>(data[i])]++;
+    double entropy = 0;
+    for (size_t count : counts) {
+        if (count > 0) {
+            double p = static_cast<double>(count) / size;
+            entropy -= p * std::log2(p);
+        }
+    }
+    return entropy;
+}
+
+/**
+ * @brief Picks the codec for one blob.
+ *
+ * Small blobs and blobs that look already compressed are stored. With auto,
+ * text-like blobs get zstd for its ratio and the rest get lz4 for its speed,
+ * limited to the codecs this build has.
+ *
+ * @param compression The requested compression.
+ * @param size Size of the blob.
+ * @param sample The first bytes of the blob.
+ * @param sample_size Number of sample bytes.
+ */
+uint8_t choose_pack_codec(Compression compression, uintmax_t size, const char* sample, size_t sample_size) {
+    const uintmax_t min_size = 512;
+    if (compression == Compression::None || size < min_size)
+        return PACK_STORED;
+    double entropy = sample_entropy(sample, sample_size);
+    if (entropy > 7.5)
+        return PACK_STORED;
+    uint8_t codec = PACK_STORED;
+    if (compression == Compression::Zstd)
+        codec = PACK_ZSTD;
+    else if (compression == Compression::Lz4)
+        codec = PACK_LZ4;
+    else if (entropy < 6.0)
+        codec = pack_codec_available(PACK_ZSTD) ? PACK_ZSTD : PACK_LZ4;
+    else
+        codec = pack_codec_available(PACK_LZ4) ? PACK_LZ4 : PACK_ZSTD;
+    return pack_codec_available(codec) ? static_cast<PackCodec>(codec) : PACK_STORED;
+}
+
+/**
+ * @brief Streams a file into a pack, compressing it with the given codec.
+ *
+ * @param codec Codec to encode with; must be available in this build.
+ * @param in The source file, positioned at its start.
+ * @param out The pack, positioned where the blob starts.
+ * @param sha Receives the uncompressed contents.
+ * @param size Receives the uncompressed size.
+ * @return False if encoding or reading failed.
+ */
+bool encode_blob(uint8_t codec, std::istream& in, std::ostream& out, Sha256& sha, uint64_t& size) {
+    BufferPool::Lease buffer(copy_buffers());
+    size = 0;
+    // Reads the next chunk; returns false at the end of the file.
+    auto read_chunk = [&](size_t& n) {
+        in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        n = static_cast<size_t>(in.gcount());
+        sha.update(buffer.data(), n);
+        size += n;
+        return n > 0;
+    };
+    size_t n = 0;
+    if (codec == PACK_STORED) {
+        while (read_chunk(n))
+            out.write(buffer.data(), static_cast<std::streamsize>(n));
+        return !in.bad() && out.good();
+    }
+#ifdef TMPL_WITH_ZSTD
+    if (codec == PACK_ZSTD) {
+        std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> context(ZSTD_createCCtx(), ZSTD_freeCCtx);
+        ZSTD_CCtx_setParameter(context.get(), ZSTD_c_compressionLevel, 3);
+        std::vector<char> output(ZSTD_CStreamOutSize());
+        bool last = false;
+        while (!last) {
+            last = !read_chunk(n);
+            ZSTD_inBuffer input = {buffer.data(), n, 0};
+            for (bool done = false; !done;) {
+                ZSTD_outBuffer chunk = {output.data(), output.size(), 0};
+                size_t remaining = ZSTD_compressStream2(context.get(), &chunk, &input, last ? ZSTD_e_end : ZSTD_e_continue);
+                if (ZSTD_isError(remaining))
+                    return false;
+                out.write(output.data(), static_cast<std::streamsize>(chunk.pos));
+                done = last ? remaining == 0 : input.pos == input.size;
+            }
+        }
+        return !in.bad() && out.good();
+    }
+#endif
+#ifdef TMPL_WITH_LZ4
+    if (codec == PACK_LZ4) {
+        LZ4F_cctx* raw_context = nullptr;
+        if (LZ4F_isError(LZ4F_createCompressionContext(&raw_context, LZ4F_VERSION)))
+            return false;
+        std::unique_ptr<LZ4F_cctx, LZ4F_errorCode_t (*)(LZ4F_cctx*)> context(raw_context, LZ4F_freeCompressionContext);
+        LZ4F_preferences_t preferences = {};
+        preferences.frameInfo.blockSizeID = LZ4F_max64KB;
+        std::vector<char> output(LZ4F_compressBound(buffer.size(), &preferences) + LZ4F_HEADER_SIZE_MAX);
+        size_t written = LZ4F_compressBegin(context.get(), output.data(), output.size(), &preferences);
+        if (LZ4F_isError(written))
+            return false;
+        out.write(output.data(), static_cast<std::streamsize>(written));
+        while (read_chunk(n)) {
+            written = LZ4F_compressUpdate(context.get(), output.data(), output.size(), buffer.data(), n, nullptr);
+            if (LZ4F_isError(written))
+                return false;
+            out.write(output.data(), static_cast<std::streamsize>(written));
+        }
+        written = LZ4F_compressEnd(context.get(), output.data(), output.size(), nullptr);
+        if (LZ4F_isError(written))
+            return false;
+        out.write(output.data(), static_cast<std::streamsize>(written));
+        return !in.bad() && out.good();
+    }
+#endif
+    return false;
+}
+
+/**
+ * @brief Streams a compressed blob out of a mapped pack, holding at most one output chunk in memory.
+ *
+ * @param codec Codec the blob was encoded with.
+ * @param data The stored bytes.
+ * @param size Number of stored bytes.
+ * @param out Receives the decoded contents.
+ * @return False if the blob is corrupt or the codec is not available in this build.
+ */
+bool decode_blob(uint8_t codec, const unsigned char* data, size_t size, std::ostream& out) {
+    if (codec == PACK_STORED) {
+        out.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+        return out.good();
+    }
+    BufferPool::Lease output(copy_buffers());
+#ifdef TMPL_WITH_ZSTD
+    if (codec == PACK_ZSTD) {
+        std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> context(ZSTD_createDCtx(), ZSTD_freeDCtx);
+        ZSTD_inBuffer input = {data, size, 0};
+        size_t remaining = 1;
+        while (input.pos < input.size || remaining != 0) {
+            ZSTD_outBuffer chunk = {output.data(), output.size(), 0};
+            remaining = ZSTD_decompressStream(context.get(), &chunk, &input);
+            if (ZSTD_isError(remaining) || (chunk.pos == 0 && input.pos == input.size && remaining != 0))
+                return false; // Corrupt or truncated frame
+            out.write(output.data(), static_cast<std::streamsize>(chunk.pos));
+        }
+        return out.good();
+    }
+#endif
+#ifdef TMPL_WITH_LZ4
+    if (codec == PACK_LZ4) {
+        LZ4F_dctx* raw_context = nullptr;
+        if (LZ4F_isError(LZ4F_createDecompressionContext(&raw_context, LZ4F_VERSION)))
+            return false;
+        std::unique_ptr<LZ4F_dctx, LZ4F_errorCode_t (*)(LZ4F_dctx*)> context(raw_context, LZ4F_freeDecompressionContext);
+        size_t hint = 1;
+        while (hint != 0) {
+            size_t consumed = size;
+            size_t produced = output.size();
+            hint = LZ4F_decompress(context.get(), output.data(), &produced, data, &consumed, nullptr);
+            if (LZ4F_isError(hint) || (consumed == 0 && produced == 0))
+                return false; // Corrupt or truncated frame
+            out.write(output.data(), static_cast<std::streamsize>(produced));
+            data += consumed;
+            size -= consumed;
+        }
+        return out.good();
+    }
+#endif
+    (void)data;
+    (void)size;
+    return false;
+}
+
+void put_le(std::string& out, uint64_t value, int bytes) {
+    for (int i = 0; i < bytes; ++i)
+        out += static_cast<char>((value >> (8 * i)) & 0xff);
+}
+
+uint64_t get_le(const unsigned char* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = bytes - 1; i >= 0; --i)
+        value = (value << 8) | in[i];
+    return value;
+}
+
+/**
+ * @brief Parses a pack header.
+ *
+ * @param header PACK_HEADER_SIZE bytes from the start of the pack.
+ * @param count Receives the number of entries.
+ * @param table_offset Receives the offset of the file table.
+ * @param table_size Receives the size of the file table.
+ * @return False if this is not a supported pack.
+ */
+bool parse_pack_header(const unsigned char* header, uint64_t& count, uint64_t& table_offset, uint64_t& table_size) {
+    if (std::memcmp(header, PACK_MAGIC, sizeof(PACK_MAGIC)) != 0 || get_le(header + 8, 4) != 1)
+        return false;
+    count = get_le(header + 16, 8);
+    table_offset = get_le(header + 24, 8);
+    table_size = get_le(header + 32, 8);
+    return true;
+}
+
+/**
+ * @brief Parses a pack's file table.
+ *
+ * @param table The file table bytes.
+ * @param size Size of the file table.
+ * @param count Number of entries, from the header.
+ * @param pack_size Size of the whole pack, used to validate data ranges.
+ * @param entries Receives the entries.
+ * @return False if the table is malformed.
+ */
+bool parse_pack_table(const unsigned char* table, uint64_t size, uint64_t count, uint64_t pack_size, std::vector<PackEntry>& entries) {
+    static const char digits[] = "0123456789abcdef";
+    uint64_t pos = 0;
+    for (uint64_t i = 0; i < count; ++i) {
+        if (size - pos < PACK_RECORD_SIZE)
+            return false;
+        const unsigned char* record = table + pos;
+        PackEntry entry;
+        entry.directory = record[0] == 1;
+        entry.codec = record[1];
+        uint64_t path_length = get_le(record + 2, 2);
+        entry.mode = static_cast<fs::perms>(get_le(record + 4, 4));
+        entry.offset = get_le(record + 8, 8);
+        entry.stored_size = get_le(record + 16, 8);
+        entry.size = get_le(record + 24, 8);
+        if (!entry.directory) {
+            for (int b = 0; b < 32; ++b) {
+                entry.hash += digits[record[32 + b] >> 4];
+                entry.hash += digits[record[32 + b] & 0xf];
+            }
+        }
+        pos += PACK_RECORD_SIZE;
+        if (size - pos < path_length || entry.offset > pack_size || entry.stored_size > pack_size - entry.offset)
+            return false;
+        entry.path.assign(reinterpret_cast<const char*>(table + pos), path_length);
+        pos += path_length;
+        entries.push_back(std::move(entry));
+    }
+    return true;
+}
+
+/**
+ * @brief Reads a pack's file table without reading its data.
+ *
+ * @param pack_path Path to the .pack file.
+ * @param entries Receives the entries.
+ * @return False if the file is missing or not a valid pack.
+ */
+bool read_pack_table(const fs::path& pack_path, std::vector<PackEntry>& entries) {
+    std::ifstream pack(pack_path, std::ios::binary);
+    unsigned char header[PACK_HEADER_SIZE];
+    uint64_t count, table_offset, table_size;
+    if (!pack.read(reinterpret_cast<char*>(header), sizeof(header)) || !parse_pack_header(header, count, table_offset, table_size))
+        return false;
+    std::error_code ec;
+    uint64_t pack_size = fs::file_size(pack_path, ec);
+    if (ec || table_offset > pack_size || table_size > pack_size - table_offset)
+        return false;
+    std::vector<unsigned char> table(static_cast<size_t>(table_size));
+    pack.seekg(static_cast<std::streamoff>(table_offset));
+    if (!pack.read(reinterpret_cast<char*>(table.data()), static_cast<std::streamsize>(table.size())))
+        return false;
+    return parse_pack_table(table.data(), table_size, count, pack_size, entries);
+}
+
+/**
+ * @brief Reads the entry list of a template saved as a pack or in the object store.
+ *
+ * @param template_path Path to the template directory.
+ * @param manifest Receives the entries.
+ * @return False if the template stores its files directly.
+ */
+bool read_template_listing(const fs::path& template_path, Manifest& manifest) {
+    if (read_manifest(template_path, manifest))
+        return true;
+    std::vector<PackEntry> entries;
+    if (!read_pack_table(template_path / ".pack", entries))
+        return false;
+    manifest.assign(entries.begin(), entries.end());
+    return true;
+}
+
+/**
+ * @brief Prints the errors collected while copying a tree.
+ *
+ * @param errors The errors reported by the workers.
+ * @return True if there were no errors.
+ */
+bool report_copy_errors(const std::vector<std::string>& errors) {
+    if (errors.empty())
+        return true;
+    std::cerr << "Failed to copy " << errors.size() << " entr" << (errors.size() == 1 ? "y" : "ies") << ":\n";
+    const size_t max_listed = 20;
+    for (size_t i = 0; i < errors.size() && i < max_listed; ++i)
+        std::cerr << "  " << errors[i] << "\n";
+    if (errors.size() > max_listed)
+        std::cerr << "  ... and " << errors.size() - max_listed << " more\n";
+    return false;
+}
+
+/**
+ * @brief Maps a pack and parses its file table.
+ *
+ * @param pack_path Path to the .pack file.
+ * @param pack Receives the mapping.
+ * @param entries Receives the entries.
+ * @return False if the pack cannot be mapped or is corrupt; errors are reported on stderr.
+ */
+bool map_pack(const fs::path& pack_path, MappedFile& pack, std::vector<PackEntry>& entries) {
+    TraceScope scope("map pack");
+    std::error_code ec;
+    if (!pack.map(pack_path, ec)) {
+        std::cerr << "Cannot open " << pack_path << ": " << ec.message() << "\n";
+        return false;
+    }
+    uint64_t count, table_offset, table_size;
+    if (pack.size() < PACK_HEADER_SIZE || !parse_pack_header(pack.data(), count, table_offset, table_size) ||
+        table_offset > pack.size() || table_size > pack.size() - table_offset ||
+        !parse_pack_table(pack.data() + table_offset, table_size, count, pack.size(), entries)) {
+        std::cerr << "Corrupt pack: " << pack_path << "\n";
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief A template's entries, enumerated once so it can be materialized any number of times.
+ */
+struct TemplateListing {
+    fs::path path;        // Template directory
+    Manifest entries;     // Directories come before their contents; unused for packs
+    bool objects = false; // Files live in the object store rather than under path
+    MappedFile pack;      // The mapped .pack of a packed template
+    std::vector<PackEntry> pack_entries;
+    bool packed() const { return pack.data() != nullptr || !pack_entries.empty(); }
+};
+
+// Directory holding the cached plans of directory templates, one file per template
+const fs::path PLANS_DIR = STATE_DIR / "plans";
+
+/**
+ * @brief Writes the plan of a directory template so later makes can skip the walk.
+ *
+ * The plan records the template root's modification time, and every entry
+ * with its mode, size, modification time and link target, in listing order.
+ * It is written to a temporary file and renamed into place.
+ *
+ * @param listing The walked listing.
+ * @param root The attributes of the template root.
+ */
+void write_plan(const TemplateListing& listing, const ManifestEntry& root) {
+    TraceScope scope("write plan");
+    std::ostringstream out;
+    out << "tmpl-plan 1 " << root.mtime << "\n";
+    for (const auto& entry : listing.entries) {
+        if (entry.symlink)
+            out << "l " << entry.mtime << " " << entry.link_target.size() << " " << entry.link_target << entry.path << "\n";
+        else
+            out << (entry.directory ? "d " : "f ") << std::oct << static_cast<unsigned>(entry.mode) << std::dec << " "
+                << entry.size << " " << entry.mtime << " " << entry.path << "\n";
+    }
+    std::error_code ec;
+    fs::create_directories(PLANS_DIR, ec);
+    fs::path plan_path = PLANS_DIR / listing.path.filename();
+    fs::path temp = plan_path;
+    temp += ".tmp" + std::to_string(process_id());
+    {
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        file << out.str();
+        if (!file)
+            ec = std::make_error_code(std::errc::io_error);
+    }
+    if (!ec)
+        fs::rename(temp, plan_path, ec);
+    if (ec)
+        fs::remove(temp, ec); // The plan is only a cache
+}
+
+/**
+ * @brief Reads the cached plan of a directory template if it is still current.
+ *
+ * A plan is current while the template root and every directory in it keep
+ * their modification times, which change whenever an entry is added,
+ * removed or renamed. That costs one stat per directory instead of a walk.
+ *
+ * @param listing Receives the entries; listing.path must be set.
+ * @return False if there is no current plan.
+ */
+bool read_plan(TemplateListing& listing) {
+    TraceScope scope("read plan", &listing.path);
+    std::ifstream file(PLANS_DIR / listing.path.filename(), std::ios::binary);
+    std::string line;
+    ManifestEntry root;
+    std::error_code ec;
+    if (!file || !std::getline(file, line) || line.compare(0, 12, "tmpl-plan 1 ") != 0 || !stat_entry(listing.path, root, ec) ||
+        std::to_string(root.mtime) != line.substr(12))
+        return false;
+    Manifest entries;
+    while (std::getline(file, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        ManifestEntry entry;
+        fields >> kind;
+        if (kind == "l") {
+            size_t length = 0;
+            entry.symlink = true;
+            fields >> entry.mtime >> length;
+            fields.get();
+            entry.link_target.resize(length);
+            fields.read(&entry.link_target[0], static_cast<std::streamsize>(length));
+        } else {
+            unsigned mode = 0;
+            entry.directory = kind == "d";
+            fields >> std::oct >> mode >> std::dec >> entry.size >> entry.mtime;
+            fields.get();
+            entry.mode = static_cast<fs::perms>(mode);
+        }
+        std::getline(fields, entry.path);
+        if (!fields || entry.path.empty() || (kind != "d" && kind != "f" && kind != "l"))
+            return false;
+        entries.push_back(std::move(entry));
+    }
+    // A chmod does not change the directory's time, so modes are compared too. Files are
+    // edited in place without touching any directory; TreeCopier re-stats those as it copies them.
+    for (const auto& entry : entries) {
+        ManifestEntry current;
+        if (entry.directory && (!stat_entry(listing.path / entry.path, current, ec) || current.mtime != entry.mtime ||
+                                current.mode != entry.mode))
+            return false;
+    }
+    listing.entries = std::move(entries);
+    return true;
+}
+
+/**
+ * @brief Enumerates a stored template for repeated materialization.
+ *
+ * Manifests and pack tables are read as is. Directory templates come from
+ * their cached plan when it is current, and are otherwise walked in parallel,
+ * recording each entry's mode, modification time and link target, and the
+ * plan is written for the next make.
+ *
+ * @param template_path Path to the template directory.
+ * @param jobs Number of threads for walking a directory template.
+ * @param listing Receives the entries.
+ * @return False on error; errors are reported on stderr.
+ */
+bool load_template_listing(const fs::path& template_path, unsigned jobs, TemplateListing& listing) {
+    TraceScope scope("load listing", &template_path);
+    listing.path = template_path;
+    if (read_manifest(template_path, listing.entries)) {
+        listing.objects = true;
+        return true;
+    }
+    if (fs::exists(template_path / ".pack"))
+        return map_pack(template_path / ".pack", listing.pack, listing.pack_entries);
+    if (read_plan(listing))
+        return true;
+
+    ManifestEntry root;
+    std::error_code root_ec;
+    stat_entry(template_path, root, root_ec); // Read before the walk so a change during it invalidates the plan
+    ParallelWalker walker(jobs);
+    std::mutex entries_mutex;
+    auto add_entry = [&](const fs::path& path, const fs::path& rel, bool directory) {
+        std::error_code ec;
+        ManifestEntry entry;
+        entry.directory = directory;
+        entry.path = rel.generic_string();
+        if (!stat_entry(path, entry, ec)) {
+            walker.add_error("Cannot read " + path.string() + ": " + ec.message());
+            return;
+        }
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        listing.entries.push_back(std::move(entry));
+    };
+    walker.visit_links([&](const fs::path& path, const fs::path& rel) { add_entry(path, rel, false); });
+    std::vector<std::string> errors = walker.run(
+        template_path,
+        [&](const fs::path& path, const fs::path& rel) {
+            if (!rel.empty())
+                add_entry(path, rel, true);
+            return true;
+        },
+        [&](const fs::path& path, const fs::path& rel) { add_entry(path, rel, false); });
+    // A parent's path is a prefix of its children's, so sorting puts it first
+    std::sort(listing.entries.begin(), listing.entries.end(),
+              [](const ManifestEntry& a, const ManifestEntry& b) { return a.path < b.path; });
+    if (errors.empty() && !root_ec)
+        write_plan(listing, root);
+    return report_copy_errors(errors);
+}
+
+/**
+ * @brief Checks that a path from a registry, or a rendered path, stays inside the destination.
+ *
+ * The path must be relative and made of names only: no empty, "." or ".." components.
+ */
+bool is_safe_relative_path(const std::string& path) {
+    fs::path rel(path);
+    if (path.empty() || rel.is_absolute() || rel.has_root_name() || rel.has_root_directory())
+        return false;
+    for (size_t start = 0;;) {
+        size_t end = path.find_first_of("/\\", start);
+        std::string_view part(path.data() + start, (end == std::string::npos ? path.size() : end) - start);
+        if (part.empty() || part == "." || part == "..")
+            return false;
+        if (end == std::string::npos)
+            return true;
+        start = end + 1;
+    }
+}
+
+#ifdef TMPL_REGISTRY
+// Largest byte range fetched in one request; neighbouring blobs of a pack are merged up to this size
+const uint64_t REGISTRY_RANGE_SIZE = 4 << 20;
+// Seconds a registry connection may stall before a request fails
+const int REGISTRY_TIMEOUT = 30;
+// Directory holding blobs fetched from a registry, named by their hash like the object store
+const fs::path BLOB_CACHE_DIR = STATE_DIR / "blobs";
+
+/**
+ * @brief The http:// URL of a template registry, split for HttpConnection.
+ */
+struct RegistryUrl {
+    std::string host;
+    std::string port = "80";
+    std::string prefix; // Path of the registry root, without a trailing '/'
+
+    bool operator==(const RegistryUrl& other) const {
+        return host == other.host && port == other.port && prefix == other.prefix;
+    }
+};
+
+/**
+ * @brief Parses a registry URL such as http://host:8080/templates.
+ *
+ * @param url The URL.
+ * @param parsed Receives its parts.
+ * @return False if the URL is not an http:// URL with a host.
+ */
+bool parse_registry_url(const std::string& url, RegistryUrl& parsed) {
+    const std::string scheme = "http://";
+    if (url.compare(0, scheme.size(), scheme) != 0)
+        return false;
+    std::string rest = url.substr(scheme.size());
+    size_t slash = rest.find('/');
+    std::string authority = rest.substr(0, slash);
+    parsed.prefix = slash == std::string::npos ? "" : rest.substr(slash);
+    while (!parsed.prefix.empty() && parsed.prefix.back() == '/')
+        parsed.prefix.pop_back();
+    size_t colon = authority.rfind(':');
+    if (colon != std::string::npos && authority.find(']', colon) == std::string::npos) {
+        parsed.port = authority.substr(colon + 1);
+        authority.resize(colon);
+    }
+    if (authority.size() >= 2 && authority.front() == '[' && authority.back() == ']')
+        authority = authority.substr(1, authority.size() - 2); // IPv6 literal
+    parsed.host = authority;
+    return !parsed.host.empty() && !parsed.port.empty();
+}
+
+/**
+ * @brief Percent-encodes the characters of a URL path that are not unreserved.
+ */
+std::string encode_url_path(const std::string& path) {
+    static const char digits[] = "0123456789ABCDEF";
+    std::string encoded;
+    for (unsigned char c : path) {
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '-' || c == '.' ||
+            c == '_' || c == '~' || c == '/') {
+            encoded += static_cast<char>(c);
+        } else {
+            encoded += '%';
+            encoded += digits[c >> 4];
+            encoded += digits[c & 0xf];
+        }
+    }
+    return encoded;
+}
+
+/**
+ * @brief A keep-alive HTTP/1.1 connection to a registry.
+ *
+ * Requests are sent one at a time. A reused connection that the server
+ * closed in the meantime is reopened once before the request fails.
+ */
+class HttpConnection {
+public:
+    explicit HttpConnection(const RegistryUrl& url) : url(url) {}
+    ~HttpConnection() { close(); }
+    HttpConnection(const HttpConnection&) = delete;
+    HttpConnection& operator=(const HttpConnection&) = delete;
+
+    const RegistryUrl& registry() const { return url; }
+
+    /**
+     * @brief Fetches a file of the registry, or a byte range of it.
+     *
+     * Servers that ignore the Range header still work: the requested bytes
+     * are cut out of the whole file.
+     *
+     * @param path Path relative to the registry root.
+     * @param offset First byte to fetch.
+     * @param length Number of bytes to fetch; unset fetches the whole file.
+     * @param body Receives the bytes.
+     * @param error Receives the reason on failure; left empty when the file does not exist.
+     * @param total Receives the size of the whole file, or 0 if the server does not report it.
+     * @return True if body holds the requested bytes.
+     */
+    bool get(const std::string& path, uint64_t offset, std::optional<uint64_t> length, std::string& body,
+             std::string& error, uint64_t* total = nullptr) {
+        TraceScope scope("http get", &path);
+        error.clear();
+        Response response;
+        for (int attempt = 0; attempt < 2; ++attempt) {
+            bool reused = fd >= 0;
+            if (!reused && !open(error))
+                return false;
+            body.clear();
+            if (request(path, offset, length, body, response, error))
+                break;
+            close();
+            if (!reused || attempt == 1)
+                return false;
+            error.clear();
+        }
+        if (!response.keep_alive)
+            close();
+        if (total)
+            *total = response.status == 200 ? body.size() : response.total;
+        if (response.status == 404 || response.status == 410)
+            return false;
+        if (response.status == 200 && length) {
+            if (offset > body.size() || *length > body.size() - offset) {
+                error = "the file is shorter than expected";
+                return false;
+            }
+            body = body.substr(static_cast<size_t>(offset), static_cast<size_t>(*length));
+        } else if (response.status == 206) {
+            if (!length || body.size() != *length) {
+                error = "the server returned a different range";
+                return false;
+            }
+        } else if (response.status != 200) {
+            error = "HTTP status " + std::to_string(response.status);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Response {
+        int status = 0;
+        bool keep_alive = true;
+        uint64_t total = 0; // From Content-Range
+    };
+
+    bool open(std::string& error) {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        int resolved = getaddrinfo(url.host.c_str(), url.port.c_str(), &hints, &addresses);
+        if (resolved != 0) {
+            error = "cannot resolve " + url.host + ": " + gai_strerror(resolved);
+            return false;
+        }
+        for (addrinfo* address = addresses; address && fd < 0; address = address->ai_next) {
+            fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+            if (fd < 0)
+                continue;
+            timeval timeout = {REGISTRY_TIMEOUT, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            int on = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+#ifdef SO_NOSIGPIPE
+            setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+            if (connect(fd, address->ai_addr, address->ai_addrlen) != 0) {
+                error = "cannot connect to " + url.host + ":" + url.port + ": " + std::strerror(errno);
+                ::close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addresses);
+        if (fd >= 0)
+            error.clear();
+        return fd >= 0;
+    }
+
+    void close() {
+        if (fd >= 0)
+            ::close(fd);
+        fd = -1;
+        buffered.clear();
+        consumed = 0;
+    }
+
+    // Sends one GET and reads the whole response; false if the connection failed
+    bool request(const std::string& path, uint64_t offset, std::optional<uint64_t> length, std::string& body,
+                 Response& response, std::string& error) {
+        std::string head = "GET " + encode_url_path(url.prefix + "/" + path) + " HTTP/1.1\r\nHost: " + url.host +
+                           (url.port == "80" ? "" : ":" + url.port) + "\r\nUser-Agent: tmpl/" VERSION "\r\n";
+        if (length)
+            head += "Range: bytes=" + std::to_string(offset) + "-" + std::to_string(offset + *length - 1) + "\r\n";
+        head += "\r\n";
+        if (!write_all(head.data(), head.size())) {
+            error = std::string("cannot send the request: ") + std::strerror(errno);
+            return false;
+        }
+
+        std::string line;
+        if (!read_line(line) || line.compare(0, 5, "HTTP/") != 0 || line.size() < 12) {
+            error = "the connection was closed";
+            return false;
+        }
+        response = {};
+        response.status = std::atoi(line.c_str() + 9);
+        response.keep_alive = line.compare(0, 8, "HTTP/1.0") != 0;
+        std::optional<uint64_t> content_length;
+        bool chunked = false;
+        while (true) {
+            if (!read_line(line)) {
+                error = "the connection was closed";
+                return false;
+            }
+            if (line.empty())
+                break;
+            size_t colon = line.find(':');
+            if (colon == std::string::npos)
+                continue;
+            std::string name = line.substr(0, colon);
+            std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return std::tolower(c); });
+            std::string value = line.substr(line.find_first_not_of(' ', colon + 1) == std::string::npos
+                                                ? line.size()
+                                                : line.find_first_not_of(' ', colon + 1));
+            std::string lower = value;
+            std::transform(lower.begin(), lower.end(), lower.begin(), [](unsigned char c) { return std::tolower(c); });
+            if (name == "content-length")
+                content_length = std::strtoull(value.c_str(), nullptr, 10);
+            else if (name == "transfer-encoding")
+                chunked = lower.find("chunked") != std::string::npos;
+            else if (name == "connection")
+                response.keep_alive = lower.find("close") == std::string::npos;
+            else if (name == "content-range" && value.find('/') != std::string::npos)
+                response.total = std::strtoull(value.c_str() + value.find('/') + 1, nullptr, 10);
+        }
+
+        if (chunked) {
+            while (true) {
+                if (!read_line(line)) {
+                    error = "the connection was closed";
+                    return false;
+                }
+                uint64_t size = std::strtoull(line.c_str(), nullptr, 16);
+                if (size == 0)
+                    break;
+                if (!read_exact(size, body) || !read_line(line)) {
+                    error = "the connection was closed";
+                    return false;
+                }
+            }
+            while (read_line(line) && !line.empty()) {
+                // Trailer fields are ignored
+            }
+        } else if (content_length) {
+            if (!read_exact(*content_length, body)) {
+                error = "the connection was closed";
+                return false;
+            }
+        } else {
+            // Without a length the body ends when the server closes the connection
+            body.append(buffered, consumed, std::string::npos);
+            buffered.clear();
+            consumed = 0;
+            char chunk[16384];
+            ssize_t received;
+            while ((received = recv(fd, chunk, sizeof(chunk), 0)) > 0)
+                body.append(chunk, static_cast<size_t>(received));
+            response.keep_alive = false;
+        }
+        return true;
+    }
+
+    bool write_all(const char* data, size_t size) {
+#ifdef MSG_NOSIGNAL
+        const int flags = MSG_NOSIGNAL;
+#else
+        const int flags = 0;
+#endif
+        while (size > 0) {
+            ssize_t sent = send(fd, data, size, flags);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                return false;
+            instrumentation().count(Instrumentation::Writes);
+            data += sent;
+            size -= static_cast<size_t>(sent);
+        }
+        return true;
+    }
+
+    // Reads more of the response into the buffer; false at the end of the stream
+    bool fill() {
+        if (consumed > 0) {
+            buffered.erase(0, consumed);
+            consumed = 0;
+        }
+        char chunk[16384];
+        ssize_t received;
+        do {
+            received = recv(fd, chunk, sizeof(chunk), 0);
+        } while (received < 0 && errno == EINTR);
+        if (received <= 0)
+            return false;
+        instrumentation().count(Instrumentation::Reads);
+        buffered.append(chunk, static_cast<size_t>(received));
+        return true;
+    }
+
+    // Reads one line without its CRLF
+    bool read_line(std::string& line) {
+        size_t end;
+        while ((end = buffered.find('\n', consumed)) == std::string::npos) {
+            if (buffered.size() - consumed > 65536 || !fill())
+                return false;
+        }
+        line.assign(buffered, consumed, end - consumed);
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        consumed = end + 1;
+        return true;
+    }
+
+    // Appends exactly size bytes of the body to out, reading large bodies straight into it
+    bool read_exact(uint64_t size, std::string& out) {
+        size_t from_buffer = static_cast<size_t>(std::min<uint64_t>(size, buffered.size() - consumed));
+        out.append(buffered, consumed, from_buffer);
+        consumed += from_buffer;
+        size -= from_buffer;
+        size_t end = out.size();
+        out.resize(end + static_cast<size_t>(size));
+        while (size > 0) {
+            ssize_t received = recv(fd, &out[end], static_cast<size_t>(size), 0);
+            if (received < 0 && errno == EINTR)
+                continue;
+            if (received <= 0)
+                return false;
+            instrumentation().count(Instrumentation::Reads);
+            end += static_cast<size_t>(received);
+            size -= static_cast<uint64_t>(received);
+        }
+        return true;
+    }
+
+    RegistryUrl url;
+    int fd = -1;
+    std::string buffered; // Received bytes not yet consumed start at buffered[consumed]
+    size_t consumed = 0;
+};
+
+/**
+ * @brief A file of a registry template and where its stored bytes are.
+ */
+struct RemoteFile {
+    PackEntry entry;     // Path, mode, codec, sizes and hash of the contents
+    std::string source;  // Registry path holding the stored bytes: the template's .pack or an object
+    uint64_t offset = 0; // Start of the stored bytes in source
+};
+
+/**
+ * @brief The listing of a template in a registry.
+ */
+struct RemoteTemplate {
+    RegistryUrl url;
+    std::vector<RemoteFile> files; // Directories come before their contents
+};
+
+/**
+ * @brief Fetches a template's .meta and file listing from a registry.
+ *
+ * A registry is laid out like ~/.templates: packed templates are read from
+ * <name>/.pack with range requests for its header and file table, and
+ * deduplicated ones from <name>/.manifest, with blobs under .objects/.
+ *
+ * @param url The registry.
+ * @param name Name of the template.
+ * @param remote Receives the listing.
+ * @param meta Receives the template's .meta file.
+ * @param error Receives the reason on failure.
+ * @return False if the template cannot be listed.
+ */
+bool fetch_remote_template(const RegistryUrl& url, const std::string& name, RemoteTemplate& remote, MetaView& meta,
+                           std::string& error) {
+    TraceScope scope("fetch listing", &name);
+    HttpConnection connection(url);
+    remote.url = url;
+    std::string body;
+    if (connection.get(name + "/.meta", 0, std::nullopt, body, error)) {
+        meta = MetaView(std::move(body));
+    } else if (!error.empty()) {
+        return false;
+    }
+
+    uint64_t pack_size = 0;
+    const std::string pack_path = name + "/.pack";
+    if (connection.get(pack_path, 0, PACK_HEADER_SIZE, body, error, &pack_size)) {
+        uint64_t count, table_offset, table_size;
+        const auto* header = reinterpret_cast<const unsigned char*>(body.data());
+        if (!parse_pack_header(header, count, table_offset, table_size) || pack_size == 0 || table_offset > pack_size ||
+            table_size > pack_size - table_offset) {
+            error = "corrupt pack";
+            return false;
+        }
+        std::vector<PackEntry> entries;
+        if (!connection.get(pack_path, table_offset, table_size, body, error))
+            return false;
+        if (!parse_pack_table(reinterpret_cast<const unsigned char*>(body.data()), table_size, count, pack_size, entries)) {
+            error = "corrupt pack";
+            return false;
+        }
+        for (auto& entry : entries) {
+            RemoteFile file;
+            file.offset = entry.offset;
+            file.entry = std::move(entry);
+            file.source = pack_path;
+            remote.files.push_back(std::move(file));
+        }
+    } else if (!error.empty()) {
+        return false;
+    } else if (connection.get(name + "/.manifest", 0, std::nullopt, body, error)) {
+        std::istringstream manifest_file(body);
+        Manifest manifest;
+        if (!parse_manifest(manifest_file, manifest)) {
+            error = "corrupt manifest";
+            return false;
+        }
+        for (auto& entry : manifest) {
+            RemoteFile file;
+            static_cast<ManifestEntry&>(file.entry) = std::move(entry);
+            file.entry.stored_size = file.entry.size;
+            file.source = ".objects/" + file.entry.hash;
+            remote.files.push_back(std::move(file));
+        }
+    } else {
+        if (error.empty())
+            error = "not found (only packed and deduplicated templates can be served)";
+        return false;
+    }
+
+    for (const auto& file : remote.files) {
+        bool hashed = file.entry.directory || (file.entry.hash.size() == 64 &&
+                                               file.entry.hash.find_first_not_of("0123456789abcdef") == std::string::npos);
+        if (!hashed || !is_safe_relative_path(file.entry.path)) {
+            error = "invalid entry: " + file.entry.path;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Returns where a blob is stored locally: in the object store or the blob cache.
+ *
+ * @return The path, or an empty path if the blob has to be fetched.
+ */
+fs::path cached_blob(const std::string& hash) {
+    std::error_code ec;
+    if (fs::is_regular_file(object_path(hash), ec))
+        return object_path(hash);
+    fs::path blob = BLOB_CACHE_DIR / hash;
+    return fs::is_regular_file(blob, ec) ? blob : fs::path();
+}
+
+/**
+ * @brief A stream buffer that hashes what is written to it and forwards it to two others.
+ *
+ * The second target is best effort: once a write to it fails, it is dropped
+ * and failed() reports it.
+ */
+class TeeBuffer : public std::streambuf {
+public:
+    TeeBuffer(std::streambuf* first, std::streambuf* second, Sha256& sha) : first(first), second(second), sha(sha) {}
+
+    bool failed() const { return second_failed; }
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        sha.update(s, static_cast<size_t>(n));
+        if (second && !second_failed && second->sputn(s, n) != n)
+            second_failed = true;
+        return first->sputn(s, n);
+    }
+
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        char c = traits_type::to_char_type(ch);
+        return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+    }
+
+private:
+    std::streambuf* first;
+    std::streambuf* second; // May be null
+    Sha256& sha;
+    bool second_failed = false;
+};
+#endif
+
+/**
+ * @brief Copies or links template files into a destination tree.
+ */
+class TreeCopier {
+public:
+    explicit TreeCopier(const CopyOptions& options) : options(options), walker(options.jobs, options.filter) { open_async(); }
+
+    /**
+     * @brief Copies src into dst and waits for all workers to finish.
+     *
+     * @return The errors reported by the workers, empty on success.
+     */
+    std::vector<std::string> run(const fs::path& src, const fs::path& dst) {
+        // With include globs, directories are only created for the files that are kept
+        bool sparse = options.filter && options.filter->has_includes();
+        walker.visit_links([this, dst, sparse](const fs::path& path, const fs::path& rel) {
+            ManifestEntry entry;
+            std::error_code ec;
+            entry.path = rel.generic_string();
+            if (!stat_entry(path, entry, ec))
+                walker.add_error("Cannot read " + path.string() + ": " + ec.message());
+            else if (!sparse || create_directory((dst / target(rel)).parent_path()))
+                create_link(entry, dst);
+        });
+        std::vector<std::string> errors = walker.run(
+            src, [this, dst, sparse](const fs::path&, const fs::path& rel) { return sparse || create_directory(dst / target(rel)); },
+            [this, dst, sparse](const fs::path& path, const fs::path& rel) {
+                if (!sparse || create_directory((dst / target(rel)).parent_path()))
+                    materialize(path, dst, rel, std::nullopt);
+            });
+        std::vector<std::string> async_errors = finish();
+        errors.insert(errors.end(), async_errors.begin(), async_errors.end());
+        return errors;
+    }
+
+    /**
+     * @brief Materializes a listed template into dst.
+     *
+     * @param mask Which entries to write, by position in the listing; null writes all of them.
+     * @return The errors reported by the workers, empty on success.
+     */
+    std::vector<std::string> run(const TemplateListing& listing, const fs::path& dst, const std::vector<char>* mask = nullptr) {
+        if (listing.packed())
+            submit_pack(listing.pack, listing.pack_entries, dst, mask);
+        else
+            submit_manifest(listing.entries, listing.path, listing.objects, dst, mask);
+        return finish();
+    }
+
+#ifdef TMPL_REGISTRY
+    /**
+     * @brief Materializes a registry template into dst, fetching only the blobs missing locally.
+     *
+     * Blobs found in the object store or the blob cache are copied as usual.
+     * The missing ones are fetched in ranges of neighbouring blobs, one request
+     * per worker at a time, and each is written to dst and the blob cache as
+     * soon as its range arrives while the other workers keep fetching.
+     *
+     * @return The errors reported by the workers, empty on success.
+     */
+    std::vector<std::string> run(const RemoteTemplate& remote, const fs::path& dst) {
+        submit_remote(remote, dst);
+        return finish();
+    }
+
+    uint64_t fetched_files() const { return fetched_count; }
+    uint64_t fetched_bytes() const { return fetched_size; }
+#endif
+
+    /**
+     * @brief Queues the materialization of a listed template into dst without waiting.
+     *
+     * Directories are created before returning; the files are written by the
+     * workers. Report paths include dst so several destinations can share one copier.
+     *
+     * @param shown The path reports name instead of dst, such as the final path of a staging directory.
+     */
+    void enqueue(const TemplateListing& listing, const fs::path& dst, const fs::path& shown = {}) {
+        qualify_report = true;
+        if (!shown.empty())
+            report_roots[dst] = shown;
+        if (listing.packed())
+            submit_pack(listing.pack, listing.pack_entries, dst);
+        else
+            submit_manifest(listing.entries, listing.path, listing.objects, dst);
+    }
+
+    /**
+     * @brief Waits for every queued file, then copies the files set aside for the asynchronous backend.
+     *
+     * @return The errors reported by the workers, empty on success.
+     */
+    std::vector<std::string> finish() {
+        {
+            TraceScope scope("wait");
+            walker.workers().wait();
+        }
+        flush_async();
+        apply_fixups();
+        return walker.take_errors();
+    }
+
+    /**
+     * @brief Prints the strategy used for each copied file, followed by totals per strategy.
+     */
+    void print_report() {
+        std::sort(copied.begin(), copied.end());
+        std::map<std::string, size_t> counts;
+        for (const auto& [path, method] : copied) {
+            printf("%-9s %s\n", method, path.c_str());
+            counts[method]++;
+        }
+        printf("Copied %zu files:", copied.size());
+        const char* methods[] = {"reflink", "kernel", "buffered", "uring", "iocp", "hardlink", "symlink",
+                                 "pack",    "zstd",   "lz4",      "fetch", "render"};
+        for (size_t i = 0; i < std::size(methods); ++i) {
+            // Asynchronous backends, links and packs only show up in the totals when they are used
+            if (i < 3 || counts[methods[i]] > 0)
+                printf("%s%zu %s", i == 0 ? " " : ", ", counts[methods[i]], methods[i]);
+        }
+        printf("\n");
+    }
+
+private:
+    // Checks that no placeholder value moves an entry out of the project, before anything is written
+    template <typename Entries, typename EntryOf>
+    bool check_targets(const Entries& entries, EntryOf entry_of) {
+        if (!options.render)
+            return true;
+        bool safe = true;
+        for (const auto& item : entries) {
+            const std::string& path = entry_of(item).path;
+            if (path.find("{{") == std::string::npos)
+                continue;
+            std::string rendered = render_text(path, options.render->vars);
+            if (!is_safe_relative_path(rendered)) {
+                walker.add_error("Cannot render " + path + ": \"" + rendered + "\" is not a path inside the project");
+                safe = false;
+            }
+        }
+        return safe;
+    }
+
+    // Creates the directories of a listing, then queues its files from the object store or from src
+    bool submit_manifest(const Manifest& manifest, const fs::path& src, bool objects, const fs::path& dst,
+                         const std::vector<char>* mask = nullptr) {
+        if (!check_targets(manifest, [](const ManifestEntry& entry) -> const ManifestEntry& { return entry; }) ||
+            !create_directory(dst))
+            return false;
+        std::vector<char> kept = select(manifest, [](const ManifestEntry& entry) -> const ManifestEntry& { return entry; }, mask);
+        // Directories are created up front, in manifest order, so parents exist first
+        for (size_t i = 0; i < manifest.size(); ++i) {
+            if (manifest[i].directory && (kept.empty() || kept[i]) && !create_directory(dst / target(manifest[i].path)))
+                return false;
+        }
+        for (size_t i = 0; i < manifest.size(); ++i) {
+            const ManifestEntry& entry = manifest[i];
+            if (!kept.empty() && !kept[i])
+                continue;
+            if (entry.mtime != 0 || (entry.directory && entry.mode != fs::perms::none))
+                fixups.emplace_back(dst / target(entry.path), &entry);
+            if (entry.directory)
+                continue;
+            if (entry.symlink)
+                walker.workers().submit([this, &entry, dst] { create_link(entry, dst); });
+            else if (objects)
+                walker.workers().submit(
+                    [this, &entry, dst] { materialize(object_path(entry.hash), dst, entry.path, entry.mode, entry.size, entry.hash); });
+            else
+                walker.workers().submit([this, &entry, src, dst] {
+                    refresh_time(src / entry.path, entry);
+                    materialize(src / entry.path, dst, entry.path, std::nullopt);
+                });
+        }
+        return true;
+    }
+
+    bool submit_pack(const MappedFile& pack, const std::vector<PackEntry>& entries, const fs::path& dst,
+                     const std::vector<char>* mask = nullptr) {
+        if (!check_targets(entries, [](const PackEntry& entry) -> const ManifestEntry& { return entry; }) || !create_directory(dst))
+            return false;
+        std::vector<char> kept = select(entries, [](const PackEntry& entry) -> const ManifestEntry& { return entry; }, mask);
+        for (size_t i = 0; i < entries.size(); ++i) {
+            if (entries[i].directory && (kept.empty() || kept[i]) && !create_directory(dst / target(entries[i].path)))
+                return false;
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const PackEntry& entry = entries[i];
+            if (!kept.empty() && !kept[i])
+                continue;
+            if (entry.directory && entry.mode != fs::perms::none)
+                fixups.emplace_back(dst / target(entry.path), &entry);
+            else if (!entry.directory)
+                walker.workers().submit([this, &pack, &entry, dst] { unpack(pack, entry, dst); });
+        }
+        return true;
+    }
+
+    // Marks the entries of a listing that options.filter and the mask keep; empty if there is neither.
+    // Listings are not walked, so each path's directories are checked too. With include globs,
+    // a directory is kept only if a kept file lies below it.
+    template <typename Entries, typename EntryOf>
+    std::vector<char> select(const Entries& entries, EntryOf entry_of, const std::vector<char>* mask = nullptr) const {
+        std::vector<char> kept;
+        if (!options.filter)
+            return mask ? *mask : kept;
+        TraceScope scope("filter");
+        const PathFilter& filter = *options.filter;
+        kept.resize(entries.size());
+        std::set<std::string> needed;
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const ManifestEntry& entry = entry_of(entries[i]);
+            if (entry.directory || !(kept[i] = (!mask || (*mask)[i]) && filter.keeps_path(entry.path, false)) ||
+                !filter.has_includes())
+                continue;
+            for (size_t end = entry.path.find('/'); end != std::string::npos; end = entry.path.find('/', end + 1))
+                needed.insert(entry.path.substr(0, end));
+        }
+        for (size_t i = 0; i < entries.size(); ++i) {
+            const ManifestEntry& entry = entry_of(entries[i]);
+            if (entry.directory)
+                kept[i] = (!mask || (*mask)[i]) &&
+                          (filter.has_includes() ? needed.count(entry.path) > 0 : filter.keeps_path(entry.path, true));
+        }
+        return kept;
+    }
+
+#ifdef TMPL_REGISTRY
+    bool submit_remote(const RemoteTemplate& remote, const fs::path& dst) {
+        if (!check_targets(remote.files, [](const RemoteFile& file) -> const ManifestEntry& { return file.entry; }) ||
+            !create_directory(dst))
+            return false;
+        std::vector<char> kept = select(remote.files, [](const RemoteFile& file) -> const ManifestEntry& { return file.entry; });
+        for (size_t i = 0; i < remote.files.size(); ++i) {
+            const RemoteFile& file = remote.files[i];
+            if (file.entry.directory && (kept.empty() || kept[i]) && !create_directory(dst / target(file.entry.path)))
+                return false;
+        }
+        std::vector<const RemoteFile*> range;
+        uint64_t range_size = 0;
+        auto submit_range = [&] {
+            if (!range.empty())
+                walker.workers().submit([this, &remote, range, dst] { fetch(remote, range, dst); });
+            range.clear();
+            range_size = 0;
+        };
+        for (size_t i = 0; i < remote.files.size(); ++i) {
+            const RemoteFile& file = remote.files[i];
+            if (!kept.empty() && !kept[i])
+                continue;
+            if (file.entry.directory && file.entry.mode != fs::perms::none)
+                fixups.emplace_back(dst / target(file.entry.path), &file.entry);
+            if (file.entry.directory)
+                continue;
+            fs::path cached = cached_blob(file.entry.hash);
+            if (!cached.empty()) {
+                walker.workers().submit(
+                    [this, &file, cached, dst] { materialize(cached, dst, file.entry.path, file.entry.mode, file.entry.size); });
+                continue;
+            }
+            const RemoteFile* last = range.empty() ? nullptr : range.back();
+            bool adjacent = last && last->source == file.source && last->offset + last->entry.stored_size == file.offset;
+            if (!adjacent || range_size + file.entry.stored_size > REGISTRY_RANGE_SIZE)
+                submit_range();
+            range.push_back(&file);
+            range_size += file.entry.stored_size;
+        }
+        submit_range();
+        return true;
+    }
+
+    // Fetches one range of neighbouring blobs and writes each of its files
+    void fetch(const RemoteTemplate& remote, const std::vector<const RemoteFile*>& files, const fs::path& dst_root) {
+        TraceScope scope("fetch", &files.front()->source);
+        // Each worker keeps its connection open from one range to the next
+        thread_local std::unique_ptr<HttpConnection> connection;
+        if (!connection || !(connection->registry() == remote.url))
+            connection = std::make_unique<HttpConnection>(remote.url);
+        uint64_t begin = files.front()->offset;
+        uint64_t length = files.back()->offset + files.back()->entry.stored_size - begin;
+        std::string body;
+        std::string error;
+        if (length > 0 && !connection->get(files.front()->source, begin, length, body, error)) {
+            for (const RemoteFile* file : files)
+                walker.add_error("Cannot fetch " + file->entry.path + ": " + (error.empty() ? "not in the registry" : error));
+            return;
+        }
+        fetched_count += files.size();
+        fetched_size += length;
+        for (const RemoteFile* file : files)
+            write_fetched(reinterpret_cast<const unsigned char*>(body.data()) + (file->offset - begin), *file, dst_root);
+    }
+
+    // Decodes a fetched blob into dst_root and, once its hash checks out, into the blob cache
+    void write_fetched(const unsigned char* blob, const RemoteFile& file, const fs::path& dst_root) {
+        const PackEntry& entry = file.entry;
+        TraceScope scope("write fetched", &entry.path);
+        fs::path out_rel = target(entry.path);
+        fs::path dst = dst_root / out_rel;
+        const RenderEntry* found = placeholders(entry.path);
+        if (!pack_codec_available(entry.codec)) {
+            walker.add_error("Cannot write " + dst.string() + ": this build has no " + pack_codec_name(entry.codec) + " support");
+            return;
+        }
+        // A blob that is not the one the offsets were recorded for is decoded whole and scanned again
+        std::vector<Placeholder> rescanned;
+        bool stale = found && !found->describes(entry.size, 0, entry.hash);
+        if (stale) {
+            std::ostringstream contents;
+            if (!decode_blob(entry.codec, blob, static_cast<size_t>(entry.stored_size), contents)) {
+                walker.add_error("Cannot write " + dst.string() + ": " + std::make_error_code(std::errc::io_error).message());
+                return;
+            }
+            rescanned = rescan_placeholders(contents.str());
+        }
+        std::ostringstream suffix;
+        suffix << ".part-" << process_id() << "-" << std::this_thread::get_id();
+        fs::path cached = BLOB_CACHE_DIR / entry.hash;
+        fs::path partial = cached;
+        partial += suffix.str();
+        std::error_code ec;
+        bool cache_written = false;
+        {
+            std::ofstream file_out(dst, std::ios::binary | std::ios::trunc);
+            std::ofstream cache_out(partial, std::ios::binary | std::ios::trunc);
+            std::optional<PlaceholderFilter> filter;
+            if (found)
+                filter.emplace(file_out, stale ? rescanned : found->placeholders, options.render->vars);
+            Sha256 sha;
+            TeeBuffer tee(found ? static_cast<std::streambuf*>(&*filter) : file_out.rdbuf(),
+                          cache_out.is_open() ? cache_out.rdbuf() : nullptr, sha);
+            std::ostream out(&tee);
+            instrumentation().count(Instrumentation::Opens, 2);
+            if (!decode_blob(entry.codec, blob, static_cast<size_t>(entry.stored_size), out) || !out.flush() || !file_out) {
+                ec = std::make_error_code(std::errc::io_error);
+            } else if (sha.hex_digest() != entry.hash) {
+                ec = std::make_error_code(std::errc::illegal_byte_sequence);
+            }
+            cache_out.close();
+            cache_written = !ec && cache_out && !tee.failed();
+        }
+        std::error_code cache_ec;
+        if (cache_written)
+            fs::rename(partial, cached, cache_ec);
+        if (!cache_written || cache_ec)
+            fs::remove(partial, cache_ec);
+        if (!ec) {
+            instrumentation().count(Instrumentation::Files);
+            instrumentation().count(Instrumentation::Bytes, entry.size);
+            instrumentation().count(Instrumentation::Metadata);
+            fs::permissions(dst, entry.mode, ec);
+        }
+        if (ec) {
+            walker.add_error("Cannot write " + dst.string() + ": " +
+                             (ec == std::errc::illegal_byte_sequence ? "the fetched contents do not match their hash" : ec.message()));
+            return;
+        }
+        record(dst_root, out_rel, found ? "render" : "fetch");
+    }
+#endif
+
+    std::string report_path(const fs::path& dst, const fs::path& rel) const {
+        if (!qualify_report)
+            return rel.generic_string();
+        auto root = report_roots.find(dst);
+        return ((root == report_roots.end() ? dst : root->second) / rel).generic_string();
+    }
+
+    // Counts the method for --stats and, with --report, remembers which file used it
+    void record(const std::string& path, const char* method) {
+        instrumentation().count_method(method);
+        if (!options.report)
+            return;
+        std::lock_guard<std::mutex> lock(report_mutex);
+        copied.emplace_back(path, method);
+    }
+
+    void record(const fs::path& dst, const fs::path& rel, const char* method) {
+        record(options.report ? report_path(dst, rel) : std::string(), method);
+    }
+
+    // Sets up the asynchronous backend if options.io asks for one and it can be used
+    void open_async() {
+        if (options.io == IoBackend::Pool)
+            return;
+#ifdef TMPL_ASYNC_COPY
+        // Forced strategies and kept modification times are handled per file by the pool
+        if (options.strategy != CopyStrategy::Auto || options.preserve_times)
+            return;
+        bool forced = options.io != IoBackend::Auto;
+        if (forced && options.io != AsyncCopier::backend()) {
+            std::cerr << "--io=" << io_backend_name(options.io) << " is not available on this platform; using the thread pool.\n";
+            return;
+        }
+        async = std::make_unique<AsyncCopier>();
+        if (!async->open()) {
+            if (forced)
+                std::cerr << "--io=" << io_backend_name(options.io) << " is not available; using the thread pool.\n";
+            async.reset();
+        }
+#else
+        if (options.io != IoBackend::Auto)
+            std::cerr << "--io=" << io_backend_name(options.io) << " is not available on this platform; using the thread pool.\n";
+#endif
+    }
+
+    // Sets a small file aside for the asynchronous backend; false if it is copied by the pool instead
+    bool queue_async(const fs::path& src, const fs::path& dst, const std::string& path, std::optional<fs::perms> mode,
+                     std::optional<uintmax_t> size) {
+#ifdef TMPL_ASYNC_COPY
+        if (!async)
+            return false;
+        if (!mode || !size) {
+            std::error_code ec;
+            fs::file_status status = fs::status(src, ec);
+            uintmax_t file_size = ec ? 0 : fs::file_size(src, ec);
+            if (ec)
+                return false; // Let the pool report the error
+            mode = mode.value_or(status.permissions());
+            size = size.value_or(file_size);
+        }
+        if (*size > ASYNC_COPY_MAX_SIZE)
+            return false;
+        std::lock_guard<std::mutex> lock(async_mutex);
+        async_jobs.push_back({src, dst, *mode, *size, path});
+        return true;
+#else
+        (void)src, (void)dst, (void)path, (void)mode, (void)size;
+        return false;
+#endif
+    }
+
+    // Copies the files set aside by queue_async; files the backend cannot copy go through the pool
+    void flush_async() {
+#ifdef TMPL_ASYNC_COPY
+        if (async_jobs.empty())
+            return;
+        TraceScope scope("async copy");
+        std::vector<int> results = async->copy(async_jobs);
+        const char* method = io_backend_name(AsyncCopier::backend());
+        for (size_t i = 0; i < async_jobs.size(); ++i) {
+            const AsyncCopyJob& job = async_jobs[i];
+            if (results[i] != 0) {
+                walker.workers().submit([this, &job] { copy_with_strategy(job.src, job.dst, job.report_path, job.mode); });
+                continue;
+            }
+            instrumentation().count(Instrumentation::Files);
+            instrumentation().count(Instrumentation::Bytes, job.size);
+            record(job.report_path, method);
+        }
+        walker.workers().wait();
+        async_jobs.clear();
+#endif
+    }
+
+    // Copies one file with the configured strategy; mode overrides its permissions
+    void copy_with_strategy(const fs::path& src, const fs::path& dst, const std::string& path, std::optional<fs::perms> mode) {
+        TraceScope scope("copy", &src);
+        std::error_code ec;
+        CopyStrategy used = copy_file_contents(src, dst, options.strategy, ec);
+        if (!ec && mode) {
+            instrumentation().count(Instrumentation::Metadata);
+            fs::permissions(dst, *mode, ec);
+        }
+        if (!ec && options.preserve_times) {
+            instrumentation().count(Instrumentation::Metadata, 2);
+            fs::last_write_time(dst, fs::last_write_time(src, ec), ec);
+        }
+        if (ec) {
+            walker.add_error("Cannot copy " + src.string() + " (" + copy_strategy_name(options.strategy) + "): " + ec.message());
+            return;
+        }
+        record(path, copy_strategy_name(used));
+    }
+
+    // Returns rel with the placeholders in its names rendered
+    fs::path target(const fs::path& rel) const {
+        if (!options.render)
+            return rel;
+        TraceScope scope("render path");
+        std::string path = rel.generic_string();
+        return path.find("{{") == std::string::npos ? rel : fs::path(render_text(path, options.render->vars));
+    }
+
+    // Returns the recorded placeholders of a file, or null to copy it as is
+    const RenderEntry* placeholders(const fs::path& rel) const {
+        if (!options.render)
+            return nullptr;
+        auto it = options.render->files.find(rel.generic_string());
+        return it == options.render->files.end() ? nullptr : &it->second;
+    }
+
+    // Writes src to dst in one streaming pass, substituting placeholders. If src changed since
+    // the offsets were recorded, it is read whole and its placeholders are found again.
+    void render(const fs::path& src, const fs::path& dst, const RenderEntry& file, const std::string& hash, fs::perms mode,
+                std::error_code& ec) {
+        TraceScope scope("render", &src);
+        ManifestEntry current;
+        if (!stat_entry(src, current, ec))
+            return;
+        if (!file.describes(current.size, current.mtime, hash)) {
+            std::string contents;
+            if (!read_file(src, contents)) {
+                ec = std::make_error_code(std::errc::io_error);
+                return;
+            }
+            render_contents(contents, rescan_placeholders(contents), dst, mode, ec);
+            return;
+        }
+        instrumentation().count(Instrumentation::Opens, 2);
+        std::ifstream in(src, std::ios::binary);
+        std::ofstream out(dst, std::ios::binary | std::ios::trunc);
+        PlaceholderFilter filter(out, file.placeholders, options.render->vars);
+        std::ostream rendered(&filter);
+        BufferPool::Lease buffer(copy_buffers());
+        while (in && rendered) {
+            in.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+            rendered.write(buffer.data(), in.gcount());
+        }
+        rendered.flush();
+        std::streamoff written = out.tellp();
+        out.close();
+        if (!in.eof() || !rendered || !out) {
+            ec = std::make_error_code(std::errc::io_error);
+            return;
+        }
+        instrumentation().count(Instrumentation::Files);
+        instrumentation().count(Instrumentation::Bytes, written > 0 ? static_cast<uint64_t>(written) : 0);
+        instrumentation().count(Instrumentation::Metadata);
+        fs::permissions(dst, mode, ec);
+    }
+
+    // Writes contents already in memory to dst, substituting the given placeholders
+    void render_contents(const std::string& contents, const std::vector<Placeholder>& found, const fs::path& dst, fs::perms mode,
+                         std::error_code& ec) {
+        instrumentation().count(Instrumentation::Opens);
+        {
+            std::ofstream out(dst, std::ios::binary | std::ios::trunc);
+            PlaceholderFilter filter(out, found, options.render->vars);
+            filter.sputn(contents.data(), static_cast<std::streamsize>(contents.size()));
+            if (!out.flush()) {
+                ec = std::make_error_code(std::errc::io_error);
+                return;
+            }
+        }
+        instrumentation().count(Instrumentation::Files);
+        instrumentation().count(Instrumentation::Bytes, contents.size());
+        instrumentation().count(Instrumentation::Metadata);
+        fs::permissions(dst, mode, ec);
+    }
+
+    // Notes the time of a directory template's file when it differs from its plan's: editing a file
+    // in place changes no directory, so the plan is still used. Modes are taken from the file as it is copied.
+    void refresh_time(const fs::path& src, const ManifestEntry& entry) {
+        ManifestEntry current;
+        std::error_code ec;
+        if (entry.mtime != 0 && stat_entry(src, current, ec) && current.mtime != entry.mtime) {
+            std::lock_guard<std::mutex> lock(fixups_mutex);
+            changed_times[&entry] = current.mtime;
+        }
+    }
+
+    // Restores directory modes and recorded modification times once every file is written.
+    // Children come after their directory in a listing, so going backwards sets a directory's
+    // time after everything inside it is done, and makes it read-only only then.
+    void apply_fixups() {
+        if (fixups.empty())
+            return;
+        TraceScope scope("fixups");
+        for (auto it = fixups.rbegin(); it != fixups.rend(); ++it) {
+            const auto& [path, entry] = *it;
+            std::error_code ec;
+            if (entry->directory && entry->mode != fs::perms::none) {
+                instrumentation().count(Instrumentation::Metadata);
+                fs::permissions(path, entry->mode, ec);
+            }
+#ifdef OS_WINDOWS
+            if (entry->symlink)
+                continue; // Windows cannot set the time of a link itself
+#endif
+            auto changed = changed_times.find(entry);
+            int64_t mtime = changed == changed_times.end() ? entry->mtime : changed->second;
+            if (!ec && mtime != 0)
+                set_entry_time(path, mtime, ec);
+            if (ec)
+                walker.add_error("Cannot set the attributes of " + path.string() + ": " + ec.message());
+        }
+        fixups.clear();
+    }
+
+    // Recreates a symbolic link of a directory template
+    void create_link(const ManifestEntry& entry, const fs::path& dst_root) {
+        fs::path out_rel = target(entry.path);
+        std::error_code ec;
+        instrumentation().count(Instrumentation::Links);
+        fs::create_symlink(entry.link_target, dst_root / out_rel, ec);
+        if (ec) {
+            walker.add_error("Cannot create link " + (dst_root / out_rel).string() + ": " + ec.message());
+            return;
+        }
+        record(dst_root, out_rel, "symlink");
+    }
+
+    bool create_directory(const fs::path& dst) {
+        TraceScope scope("create_directories", &dst);
+        instrumentation().count(Instrumentation::Directories);
+        std::error_code ec;
+        // Listings create parents first, so one mkdir is usually enough
+        if (!fs::create_directory(dst, ec) && ec) {
+            ec.clear();
+            fs::create_directories(dst, ec);
+        }
+        if (ec)
+            walker.add_error("Cannot create " + dst.string() + ": " + ec.message());
+        return !ec;
+    }
+
+    // Copies or links src to dst_root/rel; mode overrides the permissions of copies, size saves a stat.
+    void materialize(const fs::path& src, const fs::path& dst_root, const fs::path& rel, std::optional<fs::perms> mode,
+                     std::optional<uintmax_t> size = std::nullopt, const std::string& hash = {}) {
+        fs::path out_rel = target(rel);
+        fs::path dst = dst_root / out_rel;
+        std::error_code ec;
+        const char* method = nullptr;
+        // Files with placeholders are never linked: their contents differ from the template's
+        if (const RenderEntry* found = placeholders(rel)) {
+            render(src, dst, *found, hash, mode ? *mode : fs::status(src, ec).permissions(), ec);
+            if (ec) {
+                walker.add_error("Cannot render " + src.string() + ": " + ec.message());
+                return;
+            }
+            method = "render";
+        } else if (link != LinkMode::Copy && !glob_match_any(mutable_globs, rel.generic_string())) {
+            TraceScope scope("link", &rel);
+            instrumentation().count(Instrumentation::Links);
+            if (link == LinkMode::Hard) {
+                fs::create_hard_link(src, dst, ec);
+                method = "hardlink";
+            } else {
+                fs::create_symlink(fs::absolute(src), dst, ec);
+                method = "symlink";
+            }
+            // Hard links cannot cross file systems; copy those files instead
+            if (ec == std::errc::cross_device_link) {
+                ec.clear();
+                method = nullptr;
+            } else if (ec) {
+                walker.add_error("Cannot link " + dst.string() + " (" + method + "): " + ec.message());
+                return;
+            }
+        }
+        if (!method) {
+            std::string path = report_path(dst_root, out_rel);
+            if (!queue_async(src, dst, path, mode, size))
+                copy_with_strategy(src, dst, path, mode);
+            return;
+        }
+        record(dst_root, out_rel, method);
+    }
+
+    // Writes one file straight out of the mapped pack, decompressing it on the way.
+    void unpack(const MappedFile& pack, const PackEntry& entry, const fs::path& dst_root) {
+        TraceScope scope("unpack", &entry.path);
+        fs::path out_rel = target(entry.path);
+        fs::path dst = dst_root / out_rel;
+        const RenderEntry* found = placeholders(entry.path);
+        std::error_code ec;
+        if (!pack_codec_available(entry.codec)) {
+            walker.add_error("Cannot write " + dst.string() + ": this build has no " + pack_codec_name(entry.codec) + " support");
+            return;
+        }
+        // A blob that is not the one the offsets were recorded for is decoded whole and scanned again
+        std::vector<Placeholder> rescanned;
+        if (found && !found->describes(entry.size, 0, entry.hash)) {
+            std::ostringstream contents;
+            if (!decode_blob(entry.codec, pack.data() + entry.offset, static_cast<size_t>(entry.stored_size), contents)) {
+                walker.add_error("Cannot write " + dst.string() + ": " + std::make_error_code(std::errc::io_error).message());
+                return;
+            }
+            rescanned = rescan_placeholders(contents.str());
+        }
+        {
+            std::ofstream file(dst, std::ios::binary | std::ios::trunc);
+            std::optional<PlaceholderFilter> filter;
+            if (found)
+                filter.emplace(file, found->describes(entry.size, 0, entry.hash) ? found->placeholders : rescanned,
+                               options.render->vars);
+            std::ostream out(found ? static_cast<std::streambuf*>(&*filter) : file.rdbuf());
+            instrumentation().count(Instrumentation::Opens);
+            if (!decode_blob(entry.codec, pack.data() + entry.offset, static_cast<size_t>(entry.stored_size), out) || !file)
+                ec = std::make_error_code(std::errc::io_error);
+        }
+        if (!ec) {
+            instrumentation().count(Instrumentation::Files);
+            instrumentation().count(Instrumentation::Bytes, entry.size);
+            instrumentation().count(Instrumentation::Metadata);
+            fs::permissions(dst, entry.mode, ec);
+        }
+        if (ec) {
+            walker.add_error("Cannot write " + dst.string() + ": " + ec.message());
+            return;
+        }
+        record(dst_root, out_rel, found ? "render" : entry.codec == PACK_STORED ? "pack" : pack_codec_name(entry.codec));
+    }
+
+    const CopyOptions& options;
+    LinkMode link = options.link.value_or(LinkMode::Copy);
+    std::vector<std::string> mutable_globs = options.mutable_globs.value_or(std::vector<std::string>{});
+    bool qualify_report = false;
+    std::map<fs::path, fs::path> report_roots; // Destination roots reported under another path
+    std::vector<std::pair<fs::path, const ManifestEntry*>> fixups; // Set by the submit functions, applied by finish
+    std::mutex fixups_mutex;
+    std::map<const ManifestEntry*, int64_t> changed_times; // Times found by refresh_time, guarded by fixups_mutex
+    ParallelWalker walker;
+#ifdef TMPL_ASYNC_COPY
+    std::unique_ptr<AsyncCopier> async; // Null when copies go through the pool
+    std::mutex async_mutex;
+    std::vector<AsyncCopyJob> async_jobs; // Guarded by async_mutex until flush_async
+#endif
+#ifdef TMPL_REGISTRY
+    std::atomic<uint64_t> fetched_count{0};
+    std::atomic<uint64_t> fetched_size{0};
+#endif
+    std::mutex report_mutex;
+    std::vector<std::pair<std::string, const char*>> copied; // Guarded by report_mutex
+};
+
+/**
+ * @brief Custom recursive copy function that excludes .meta files.
+ *
+ * @param src Source path.
+ * @param dst Destination path.
+ * @param options Copy options such as the number of worker threads and the copy strategy.
+ * @return True if every entry was copied; errors are reported on stderr.
+ */
+bool copy_template(const fs::path& src, const fs::path& dst, const CopyOptions& options = {}) {
+    TreeCopier copier(options);
+    std::vector<std::string> errors = copier.run(src, dst);
+    if (options.report)
+        copier.print_report();
+    return report_copy_errors(errors);
+}
+
+/**
+ * @brief Materializes a template from a listing made earlier, without enumerating it again.
+ *
+ * @param listing The template's listing.
+ * @param dst Destination path.
+ * @param options Copy options such as the number of worker threads.
+ * @param mask Which entries to write, by position in the listing; null writes all of them.
+ * @return True if every entry was written; errors are reported on stderr.
+ */
+bool copy_listing(const TemplateListing& listing, const fs::path& dst, const CopyOptions& options = {},
+                  const std::vector<char>* mask = nullptr) {
+    TreeCopier copier(options);
+    std::vector<std::string> errors = copier.run(listing, dst, mask);
+    if (options.report)
+        copier.print_report();
+    return report_copy_errors(errors);
+}
+
+/**
+ * @brief Saves a directory as a single pack file in the template directory.
+ *
+ * The tree is enumerated in parallel; file data is then appended to the pack
+ * in path order, and the file table and header are written last.
+ *
+ * @param src Directory to save.
+ * @param template_path Template directory that receives the .pack.
+ * @param options Copy options such as the number of worker threads used for the walk.
+ * @param compression How to choose each blob's codec.
+ * @return True if every file was packed; errors are reported on stderr.
+ */
+bool write_pack(const fs::path& src, const fs::path& template_path, const CopyOptions& options, Compression compression) {
+    TraceScope scope("write pack");
+    ParallelWalker walker(options.jobs, options.filter);
+    std::mutex entries_mutex;
+    std::vector<PackEntry> entries;
+    auto add_entry = [&](const fs::path& path, const fs::path& rel, bool directory) {
+        std::error_code ec;
+        PackEntry entry;
+        entry.directory = directory;
+        entry.path = rel.generic_string();
+        entry.mode = fs::status(path, ec).permissions();
+        if (ec) {
+            walker.add_error("Cannot read " + path.string() + ": " + ec.message());
+            return;
+        }
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        entries.push_back(std::move(entry));
+    };
+    // The file table has no kind for links, and following them would pack what they point to
+    walker.visit_links([&](const fs::path& path, const fs::path&) {
+        walker.add_error("Cannot pack " + path.string() + ": symbolic links are only kept by plain templates");
+    });
+    std::vector<std::string> errors = walker.run(
+        src,
+        [&](const fs::path& path, const fs::path& rel) {
+            if (!rel.empty())
+                add_entry(path, rel, true);
+            return true;
+        },
+        [&](const fs::path& path, const fs::path& rel) { add_entry(path, rel, false); });
+    if (!report_copy_errors(errors))
+        return false;
+    std::sort(entries.begin(), entries.end(), [](const PackEntry& a, const PackEntry& b) { return a.path < b.path; });
+
+    std::error_code ec;
+    fs::create_directories(template_path, ec);
+    fs::path pack_path = template_path / ".pack";
+    std::ofstream pack(pack_path, std::ios::binary | std::ios::trunc);
+    if (!pack) {
+        report_copy_errors({"Cannot create " + pack_path.string() + (ec ? ": " + ec.message() : "")});
+        return false;
+    }
+    std::string header(PACK_HEADER_SIZE, '\0');
+    pack.write(header.data(), static_cast<std::streamsize>(header.size()));
+
+    uint64_t offset = PACK_HEADER_SIZE;
+    uint64_t data_size = 0;
+    std::vector<char> sample(64 * 1024);
+    for (auto& entry : entries) {
+        if (entry.directory)
+            continue;
+        fs::path path = src / entry.path;
+        TraceScope scope("pack file", &path);
+        instrumentation().count(Instrumentation::Opens);
+        std::ifstream in(path, std::ios::binary);
+        if (!in) {
+            errors.push_back("Cannot read " + path.string());
+            continue;
+        }
+        in.read(sample.data(), static_cast<std::streamsize>(sample.size()));
+        size_t sample_size = static_cast<size_t>(in.gcount());
+        entry.codec = choose_pack_codec(compression, fs::file_size(path, ec), sample.data(), sample_size);
+        for (;;) {
+            in.clear();
+            in.seekg(0);
+            pack.seekp(static_cast<std::streamoff>(offset));
+            Sha256 sha;
+            if (!encode_blob(entry.codec, in, pack, sha, entry.size)) {
+                errors.push_back("Cannot pack " + path.string() + " (" + pack_codec_name(entry.codec) + ")");
+                break;
+            }
+            entry.offset = offset;
+            entry.stored_size = static_cast<uint64_t>(pack.tellp()) - offset;
+            entry.hash = sha.hex_digest();
+            // Keep the compressed blob only if it saves at least 5%
+            if (entry.codec != PACK_STORED && entry.stored_size >= entry.size - entry.size / 20) {
+                entry.codec = PACK_STORED;
+                continue;
+            }
+            break;
+        }
+        offset += entry.stored_size;
+        data_size += entry.size;
+        instrumentation().count(Instrumentation::Files);
+        instrumentation().count(Instrumentation::Bytes, entry.stored_size);
+    }
+    pack.seekp(static_cast<std::streamoff>(offset));
+
+    std::string table;
+    for (const auto& entry : entries) {
+        put_le(table, entry.directory ? 1 : 0, 1);
+        put_le(table, entry.codec, 1);
+        put_le(table, entry.path.size(), 2);
+        put_le(table, static_cast<unsigned>(entry.mode) & 07777, 4);
+        put_le(table, entry.offset, 8);
+        put_le(table, entry.stored_size, 8);
+        put_le(table, entry.size, 8);
+        for (size_t b = 0; b < 32; ++b)
+            put_le(table, entry.hash.empty() ? 0 : std::stoul(entry.hash.substr(2 * b, 2), nullptr, 16), 1);
+        table += entry.path;
+    }
+    pack.write(table.data(), static_cast<std::streamsize>(table.size()));
+
+    header.clear();
+    header.append(PACK_MAGIC, sizeof(PACK_MAGIC));
+    put_le(header, 1, 4);
+    put_le(header, 0, 4);
+    put_le(header, entries.size(), 8);
+    put_le(header, offset, 8);
+    put_le(header, table.size(), 8);
+    header.resize(PACK_HEADER_SIZE, '\0');
+    pack.seekp(0);
+    pack.write(header.data(), static_cast<std::streamsize>(header.size()));
+    if (!pack.flush())
+        errors.push_back("Cannot write " + pack_path.string());
+    pack.close();
+    // Blobs that were re-stored uncompressed may have left bytes past the table
+    fs::resize_file(pack_path, offset + table.size(), ec);
+    if (!report_copy_errors(errors))
+        return false;
+
+    std::cout << "Packed " << entries.size() << " entries (" << data_size << " bytes of data, " << offset - PACK_HEADER_SIZE
+              << " stored).\n";
+    return true;
+}
+
+/**
+ * @brief Finds the placeholders of every file in a directory, reading each file once.
+ *
+ * Files with a NUL byte in their first block are treated as binary and skipped.
+ *
+ * Symbolic links are not followed: they are saved as links, or refused.
+ *
+ * @param src Directory being saved.
+ * @param jobs Number of threads.
+ * @param filter Paths that are not saved and so not scanned; null scans everything.
+ * @param files Receives the files that contain placeholders with their size, modification
+ *        time and hash, sorted by '/'-separated path.
+ * @return False if the directory could not be walked; errors are reported on stderr.
+ */
+bool scan_placeholders(const fs::path& src, unsigned jobs, std::shared_ptr<const PathFilter> filter,
+                       std::vector<std::pair<std::string, RenderEntry>>& files) {
+    TraceScope scope("scan placeholders");
+    ParallelWalker walker(jobs, std::move(filter));
+    std::mutex files_mutex;
+    walker.visit_links([](const fs::path&, const fs::path&) {});
+    std::vector<std::string> errors = walker.run(
+        src, [](const fs::path&, const fs::path&) { return true; },
+        [&](const fs::path& path, const fs::path& rel) {
+            MappedFile file;
+            std::error_code ec;
+            if (!file.map(path, ec) || file.size() == 0)
+                return; // Unreadable files were already reported by the copy
+            const char* data = reinterpret_cast<const char*>(file.data());
+            if (looks_binary(data, file.size()))
+                return; // Never render images, archives and the like
+            RenderEntry entry;
+            find_placeholders(data, file.size(), 0, entry.placeholders);
+            if (entry.placeholders.empty())
+                return;
+            // Lets make tell whether the offsets still hold for the stored file
+            ManifestEntry attributes;
+            if (stat_entry(path, attributes, ec) && attributes.size == file.size())
+                entry.mtime = attributes.mtime;
+            entry.size = file.size();
+            Sha256 sha;
+            sha.update(data, file.size());
+            entry.hash = sha.hex_digest();
+            std::lock_guard<std::mutex> lock(files_mutex);
+            files.emplace_back(rel.generic_string(), std::move(entry));
+        });
+    std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+    return report_copy_errors(errors);
+}
+
+/**
+ * @brief Saves a directory into the object store, writing only blobs that are not stored yet.
+ *
+ * Objects are read-only and shared by every template that contains them; each
+ * is written to a temporary name and renamed into place, so concurrent saves
+ * of the same content are safe.
+ *
+ * @param src Directory to save.
+ * @param template_path Template directory that receives the .manifest.
+ * @param options Copy options used to write new blobs.
+ * @return True if every file was stored; errors are reported on stderr.
+ */
+bool store_objects(const fs::path& src, const fs::path& template_path, const CopyOptions& options) {
+    TraceScope scope("store objects");
+    std::error_code ec;
+    fs::create_directories(OBJECTS_DIR, ec);
+    fs::create_directories(template_path, ec);
+    if (ec) {
+        std::cerr << "Cannot create " << template_path << ": " << ec.message() << "\n";
+        return false;
+    }
+
+    ParallelWalker walker(options.jobs, options.filter);
+    std::mutex manifest_mutex;
+    Manifest manifest;
+    std::atomic<size_t> new_objects{0};
+    std::atomic<uintmax_t> new_bytes{0};
+    std::atomic<unsigned> temp_counter{0};
+    auto add_entry = [&](ManifestEntry entry) {
+        std::lock_guard<std::mutex> lock(manifest_mutex);
+        manifest.push_back(std::move(entry));
+    };
+    // The manifest has no kind for links, and following them would store what they point to
+    walker.visit_links([&](const fs::path& path, const fs::path&) {
+        walker.add_error("Cannot store " + path.string() + ": symbolic links are only kept by plain templates");
+    });
+
+    std::vector<std::string> errors = walker.run(
+        src,
+        [&](const fs::path& path, const fs::path& rel) {
+            if (!rel.empty()) {
+                std::error_code ec;
+                ManifestEntry entry;
+                entry.directory = true;
+                entry.mode = fs::status(path, ec).permissions();
+                if (ec) {
+                    walker.add_error("Cannot read " + path.string() + ": " + ec.message());
+                    return false;
+                }
+                entry.path = rel.generic_string();
+                add_entry(std::move(entry));
+            }
+            return true;
+        },
+        [&](const fs::path& path, const fs::path& rel) {
+            std::error_code ec;
+            ManifestEntry entry;
+            entry.path = rel.generic_string();
+            entry.mode = fs::status(path, ec).permissions();
+            entry.size = fs::file_size(path, ec);
+            entry.hash = hash_file(path, ec);
+            if (ec) {
+                walker.add_error("Cannot read " + path.string() + ": " + ec.message());
+                return;
+            }
+            fs::path object = object_path(entry.hash);
+            if (!fs::exists(object)) {
+                fs::path temp = OBJECTS_DIR / (entry.hash + ".tmp" + std::to_string(temp_counter++));
+                copy_file_contents(path, temp, options.strategy, ec);
+                if (!ec)
+                    fs::permissions(temp, fs::perms::owner_read | fs::perms::group_read | fs::perms::others_read, ec);
+                if (!ec)
+                    fs::rename(temp, object, ec);
+                if (ec) {
+                    fs::remove(temp);
+                    walker.add_error("Cannot store " + path.string() + ": " + ec.message());
+                    return;
+                }
+                new_objects++;
+                new_bytes += entry.size;
+            }
+            add_entry(std::move(entry));
+        });
+    if (!report_copy_errors(errors))
+        return false;
+
+    // Without its manifest the template would be published as an empty directory template
+    if (!write_manifest(template_path, manifest)) {
+        std::cerr << "Cannot write " << template_path / ".manifest" << "\n";
+        return false;
+    }
+    size_t files = std::count_if(manifest.begin(), manifest.end(), [](const ManifestEntry& entry) { return !entry.directory; });
+    std::cout << "Stored " << new_objects << " new objects (" << new_bytes << " bytes); " << files - new_objects
+              << " files were already in the store.\n";
+    return true;
+}
+
+// Directory for tmpl's own state, such as the template index
+const fs::path INDEX_PATH = STATE_DIR / "index";
+
+/**
+ * @brief Holds an advisory lock on the template store, or on one template, while in scope.
+ *
+ * The exclusive store lock serializes read-modify-write updates of the store's
+ * shared files between concurrent tmpl processes. Locking is best effort: if
+ * the lock file cannot be opened the operation goes ahead unlocked.
+ */
+class StoreLock {
+public:
+    /**
+     * @param lock_path The lock file; the default guards the store's shared files.
+     * @param shared Take a shared lock instead of an exclusive one.
+     */
+    explicit StoreLock(const fs::path& lock_path = STATE_DIR / "lock", bool shared = false) {
+        TraceScope scope("lock", &lock_path);
+        std::error_code ec;
+        fs::create_directories(lock_path.parent_path(), ec);
+#ifdef OS_WINDOWS
+        handle = CreateFileW(lock_path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr,
+                             OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle != INVALID_HANDLE_VALUE) {
+            OVERLAPPED overlapped = {};
+            LockFileEx(handle, shared ? 0 : LOCKFILE_EXCLUSIVE_LOCK, 0, MAXDWORD, MAXDWORD, &overlapped);
+        }
+#else
+        fd = open(lock_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            while (flock(fd, shared ? LOCK_SH : LOCK_EX) != 0 && errno == EINTR) {
+            }
+        }
+#endif
+    }
+
+    ~StoreLock() {
+#ifdef OS_WINDOWS
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle); // Closing the handle releases the lock
+#else
+        if (fd >= 0)
+            close(fd); // Closing the descriptor releases the lock
+#endif
+    }
+
+    StoreLock(const StoreLock&) = delete;
+    StoreLock& operator=(const StoreLock&) = delete;
+
+private:
+#ifdef OS_WINDOWS
+    HANDLE handle = INVALID_HANDLE_VALUE;
+#else
+    int fd = -1;
+#endif
+};
+
+/**
+ * @brief Returns the lock file that make holds shared and save --update holds exclusive while swapping a template.
+ */
+fs::path template_lock_path(const std::string& name) {
+    return STATE_DIR / "locks" / name;
+}
+
+// Held shared by dedup saves and exclusively by collect_garbage
+const fs::path OBJECTS_LOCK = STATE_DIR / "locks" / ".objects";
+
+/**
+ * @brief Removes objects that no template's manifest refers to any more.
+ *
+ * Nothing is removed unless every manifest could be read: a directory that
+ * cannot be listed or a .manifest that does not parse could hide references.
+ */
+void collect_garbage() {
+    TraceScope scope("collect garbage");
+    if (!fs::is_directory(OBJECTS_DIR))
+        return;
+    StoreLock lock(OBJECTS_LOCK); // Waits for dedup saves that are still writing or publishing
+    std::vector<std::string> referenced;
+    auto abort = [](const fs::path& path, const std::string& reason) {
+        std::cerr << "Unreferenced objects were not removed: cannot read " << path << ": " << reason << "\n";
+    };
+    // Updates being staged reference objects before they are swapped into the store
+    for (const fs::path& dir : {TEMPLATE_DIR, STATE_DIR / "staging"}) {
+        std::error_code ec;
+        fs::directory_iterator it(dir, ec), end;
+        if (ec == std::errc::no_such_file_or_directory)
+            continue;
+        for (; !ec && it != end; it.increment(ec)) {
+            std::error_code entry_ec;
+            fs::path manifest_path = it->path() / ".manifest";
+            if (!it->is_directory(entry_ec) || !fs::exists(manifest_path, entry_ec)) {
+                if (entry_ec) {
+                    abort(it->path(), entry_ec.message());
+                    return;
+                }
+                continue;
+            }
+            Manifest manifest;
+            if (!read_manifest(it->path(), manifest)) {
+                abort(manifest_path, "not a valid manifest");
+                return;
+            }
+            for (const auto& file : manifest)
+                referenced.push_back(file.hash);
+        }
+        if (ec) {
+            abort(dir, ec.message());
+            return;
+        }
+    }
+    std::sort(referenced.begin(), referenced.end());
+
+    size_t removed = 0;
+    std::error_code ec;
+    for (fs::directory_iterator it(OBJECTS_DIR, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        // Temporary names belong to saves that may still be running
+        if (name.find(".tmp") == std::string::npos && !std::binary_search(referenced.begin(), referenced.end(), name)) {
+            std::error_code remove_ec;
+            removed += fs::remove(it->path(), remove_ec);
+        }
+    }
+    if (removed > 0)
+        std::cout << "Removed " << removed << " unreferenced objects.\n";
+    if (ec)
+        std::cerr << "Cannot list " << OBJECTS_DIR << ": " << ec.message() << "\n";
+}
+
+/**
+ * @brief Returns a directory's modification time as a number, or 0 if it does not exist.
+ *
+ * The template store's stamp changes whenever a template directory is added,
+ * removed or renamed, which is how a stale index is detected.
+ */
+int64_t directory_stamp(const fs::path& path) {
+    std::error_code ec;
+    auto time = fs::last_write_time(path, ec);
+    return ec ? 0 : static_cast<int64_t>(time.time_since_epoch().count());
+}
+
+/**
+ * @brief Size information about a stored template.
+ */
+struct TemplateSize {
+    uintmax_t files = 0;
+    uintmax_t bytes = 0;
+    uintmax_t stored = 0; // Bytes the template's files take in the store, each content counted once
+};
+
+/**
+ * @brief Counts the files and bytes of a stored template.
+ *
+ * The stored size is the pack's size for packed templates, the size of the
+ * distinct objects a deduplicated template uses (objects shared with other
+ * templates count for each of them), and the blocks allocated to the
+ * distinct files of a directory template, so hard links inside it count
+ * once and holes in sparse files not at all.
+ *
+ * @param template_path Path to the template directory.
+ * @return The totals, read from the manifest or pack table if the template has one.
+ */
+TemplateSize measure_template(const fs::path& template_path) {
+    TemplateSize size;
+    Manifest manifest;
+    if (read_template_listing(template_path, manifest)) {
+        std::set<std::string> objects;
+        for (const auto& entry : manifest) {
+            if (!entry.directory) {
+                size.files++;
+                size.bytes += entry.size;
+                if (objects.insert(entry.hash).second)
+                    size.stored += entry.size;
+            }
+        }
+        std::error_code ec;
+        uintmax_t pack_size = fs::file_size(template_path / ".pack", ec);
+        if (!ec)
+            size.stored = pack_size;
+        return size;
+    }
+#ifndef OS_WINDOWS
+    std::set<std::pair<dev_t, ino_t>> inodes;
+#endif
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(template_path, ec), end; !ec && it != end; it.increment(ec)) {
+        // Links are not files of the template, as in count_listing; is_regular_file would follow them
+        std::error_code status_ec;
+        if (fs::is_regular_file(it->symlink_status(status_ec)) && !is_template_metadata(it->path().lexically_relative(template_path))) {
+            uintmax_t file_size = it->file_size(ec);
+            size.files++;
+            size.bytes += file_size;
+#ifndef OS_WINDOWS
+            // Copies keep holes, so a sparse file takes only its allocated blocks
+            struct stat st;
+            if (lstat(it->path().c_str(), &st) == 0) {
+                if (st.st_nlink > 1 && !inodes.insert({st.st_dev, st.st_ino}).second)
+                    continue;
+                size.stored += static_cast<uintmax_t>(st.st_blocks) * 512;
+                continue;
+            }
+#endif
+            size.stored += file_size;
+        }
+    }
+    return size;
+}
+
+/**
+ * @brief One template as recorded in the index.
+ */
+struct IndexEntry {
+    std::string name;
+    std::vector<std::string> tags;
+    uintmax_t files = 0;
+    uintmax_t bytes = 0;
+    uintmax_t stored = 0; // TemplateSize::stored
+    int64_t saved = 0;    // Unix time the template was saved
+    int64_t used = 0;     // Unix time of the last make from it; 0 if it was never made
+    uintmax_t makes = 0;  // Projects made from it since it was first saved
+    int64_t stamp = 0;    // template_stamp() when the entry was scanned
+};
+
+/**
+ * @brief Sorted IDs (positions in the index) of the templates carrying a tag.
+ */
+using PostingList = std::vector<uint32_t>;
+
+PostingList posting_union(const PostingList& a, const PostingList& b) {
+    PostingList result;
+    std::set_union(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+    return result;
+}
+
+PostingList posting_intersection(const PostingList& a, const PostingList& b) {
+    PostingList result;
+    std::set_intersection(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+    return result;
+}
+
+PostingList posting_difference(const PostingList& a, const PostingList& b) {
+    PostingList result;
+    std::set_difference(a.begin(), a.end(), b.begin(), b.end(), std::back_inserter(result));
+    return result;
+}
+
+/**
+ * @brief The persistent template index, so list does not have to open every template.
+ *
+ * Stored in ~/.templates/.tmpl/index as a header line, one tab-separated line
+ * per template sorted by name, and then one line per tag with the IDs of the
+ * templates carrying it. A template's ID is its position in the entry list.
+ */
+struct TemplateIndex {
+    int64_t store_stamp = 0; // directory_stamp(TEMPLATE_DIR) when the index was written
+    std::vector<IndexEntry> entries;
+    std::map<std::string, PostingList> postings; // Inverted tag index, rebuilt by build_postings
+
+    /**
+     * @brief Recomputes the inverted tag index from the entries.
+     */
+    void build_postings() {
+        postings.clear();
+        for (uint32_t id = 0; id < entries.size(); ++id) {
+            for (const auto& tag : entries[id].tags) {
+                PostingList& list = postings[tag];
+                if (list.empty() || list.back() != id)
+                    list.push_back(id);
+            }
+        }
+    }
+
+    /**
+     * @brief Returns the templates carrying a tag.
+     */
+    const PostingList& posting(const std::string& tag) const {
+        static const PostingList empty;
+        auto it = postings.find(tag);
+        return it == postings.end() ? empty : it->second;
+    }
+
+    /**
+     * @brief Returns the IDs of all templates.
+     */
+    PostingList all() const {
+        PostingList ids(entries.size());
+        for (uint32_t id = 0; id < ids.size(); ++id)
+            ids[id] = id;
+        return ids;
+    }
+
+    const IndexEntry* find(const std::string& name) const {
+        auto it = std::lower_bound(entries.begin(), entries.end(), name,
+                                   [](const IndexEntry& entry, const std::string& key) { return entry.name < key; });
+        return it != entries.end() && it->name == name ? &*it : nullptr;
+    }
+
+    IndexEntry* find(const std::string& name) {
+        return const_cast<IndexEntry*>(static_cast<const TemplateIndex*>(this)->find(name));
+    }
+
+    void upsert(IndexEntry entry) {
+        if (IndexEntry* existing = find(entry.name)) {
+            *existing = std::move(entry);
+            return;
+        }
+        auto it = std::lower_bound(entries.begin(), entries.end(), entry.name,
+                                   [](const IndexEntry& e, const std::string& key) { return e.name < key; });
+        entries.insert(it, std::move(entry));
+    }
+
+    void erase(const std::string& name) {
+        entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const IndexEntry& entry) { return entry.name == name; }),
+                      entries.end());
+    }
+};
+
+/**
+ * @brief Parses a template index, such as ~/.templates/.tmpl/index or one fetched from a registry.
+ *
+ * A version 3 index, which has no stored sizes or usage, is read with every
+ * entry's stamp cleared, so load_index rescans the templates once while
+ * keeping their save times. So is a version 4 index, whose stored sizes of
+ * directory templates counted holes in sparse files.
+ *
+ * @param index_file The index.
+ * @param index Receives the index.
+ * @return False if the input is not a complete index.
+ */
+bool parse_index(std::istream& index_file, TemplateIndex& index) {
+    std::string line;
+    if (!index_file || !std::getline(index_file, line))
+        return false;
+    std::istringstream header(line);
+    std::string magic;
+    int version = 0;
+    size_t count = 0;
+    header >> magic >> version >> index.store_stamp >> count;
+    if (magic != "tmpl-index" || version < 3 || version > 5 || !header)
+        return false;
+    while (index.entries.size() < count && std::getline(index_file, line)) {
+        std::istringstream fields(line);
+        IndexEntry entry;
+        std::string tags;
+        std::getline(fields, entry.name, '\t');
+        if (version == 3) {
+            fields >> entry.files >> entry.bytes >> entry.saved >> entry.stamp;
+            entry.stored = entry.bytes;
+            entry.stamp = 0;
+        } else {
+            fields >> entry.files >> entry.bytes >> entry.stored >> entry.saved >> entry.used >> entry.makes >> entry.stamp;
+            if (version == 4)
+                entry.stamp = 0;
+        }
+        fields.get();
+        std::getline(fields, tags);
+        if (entry.name.empty() || fields.bad())
+            return false;
+        if (!tags.empty())
+            entry.tags = split_meta_list(tags);
+        index.entries.push_back(std::move(entry));
+    }
+    if (index.entries.size() != count)
+        return false;
+    while (std::getline(index_file, line)) {
+        std::istringstream fields(line);
+        std::string tag;
+        std::getline(fields, tag, '\t');
+        PostingList& list = index.postings[tag];
+        for (uint32_t id; fields >> id;) {
+            if (id >= count)
+                return false;
+            list.push_back(id);
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Reads the template index.
+ *
+ * @param index Receives the index.
+ * @return False if there is no readable index.
+ */
+bool read_index(TemplateIndex& index) {
+    std::ifstream index_file(INDEX_PATH, std::ios::binary);
+    return parse_index(index_file, index);
+}
+
+/**
+ * @brief Writes the template index atomically, stamping it with the store's current state.
+ *
+ * @param index The index to write; its store_stamp and postings are updated.
+ * @return False if the index could not be written.
+ */
+bool write_index(TemplateIndex& index) {
+    TraceScope scope("write index");
+    std::error_code ec;
+    fs::create_directories(STATE_DIR, ec);
+    index.store_stamp = directory_stamp(TEMPLATE_DIR);
+    fs::path temp = INDEX_PATH;
+    temp += ".tmp";
+    {
+        std::ofstream index_file(temp, std::ios::binary | std::ios::trunc);
+        index_file << "tmpl-index 5 " << index.store_stamp << " " << index.entries.size() << "\n";
+        for (const auto& entry : index.entries) {
+            index_file << entry.name << '\t' << entry.files << '\t' << entry.bytes << '\t' << entry.stored << '\t' << entry.saved
+                       << '\t' << entry.used << '\t' << entry.makes << '\t' << entry.stamp << '\t' << join_meta_list(entry.tags)
+                       << '\n';
+        }
+        index.build_postings();
+        for (const auto& [tag, list] : index.postings) {
+            if (tag.empty())
+                continue;
+            index_file << tag << '\t';
+            for (size_t i = 0; i < list.size(); ++i)
+                index_file << (i == 0 ? "" : " ") << list[i];
+            index_file << '\n';
+        }
+        if (!index_file.flush())
+            return false;
+    }
+    fs::rename(temp, INDEX_PATH, ec);
+    return !ec;
+}
+
+/**
+ * @brief Returns a value that changes whenever a template's top directory or its .meta changes.
+ *
+ * Adding, removing or renaming an entry of the top directory, or replacing the
+ * template with save --update, changes the directory's modification time;
+ * tag and link policy edits rewrite .meta. This is the check list makes for
+ * every template on every run, at two stats each.
+ */
+int64_t template_stamp(const fs::path& template_path) {
+    // Combined in unsigned arithmetic: nanosecond stamps times 31 overflow int64_t
+    uint64_t stamp = static_cast<uint64_t>(directory_stamp(template_path)) * 31 +
+                     static_cast<uint64_t>(directory_stamp(template_path / ".meta"));
+    return static_cast<int64_t>(stamp);
+}
+
+/**
+ * @brief Reads a template's tags and size into an index entry.
+ *
+ * @param name Name of the template.
+ * @param previous The template's current entry, whose save time and usage are kept;
+ *        without one the save time is the template directory's modification time.
+ */
+IndexEntry scan_template(const std::string& name, const IndexEntry* previous = nullptr) {
+    TraceScope scope("scan template");
+    fs::path template_path = TEMPLATE_DIR / name;
+    IndexEntry entry;
+    entry.name = name;
+    entry.stamp = template_stamp(template_path); // Taken first, so a change made during the scan shows up next time
+    entry.tags = read_tags(template_path);
+    TemplateSize size = measure_template(template_path);
+    entry.files = size.files;
+    entry.bytes = size.bytes;
+    entry.stored = size.stored;
+    if (previous) {
+        entry.saved = previous->saved;
+        entry.used = previous->used;
+        entry.makes = previous->makes;
+    }
+    if (entry.saved == 0) {
+        std::error_code ec;
+        auto modified = fs::last_write_time(template_path, ec);
+        if (!ec) {
+            auto system_time = std::chrono::time_point_cast<std::chrono::system_clock::duration>(
+                modified - fs::file_time_type::clock::now() + std::chrono::system_clock::now());
+            entry.saved = std::chrono::system_clock::to_time_t(system_time);
+        }
+    }
+    return entry;
+}
+
+/**
+ * @brief Rebuilds the index by scanning every template in the store.
+ *
+ * @param previous An older index whose save times and usage are kept for templates it lists.
+ */
+TemplateIndex scan_index(const TemplateIndex& previous = {}) {
+    TraceScope scope("scan index");
+    TemplateIndex index;
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(TEMPLATE_DIR, ec)) {
+        std::string name = entry.path().filename().string();
+        if (entry.is_directory() && name[0] != '.') {
+            index.upsert(scan_template(name, previous.find(name)));
+        }
+    }
+    return index;
+}
+
+/**
+ * @brief Checks whether templates were added, removed or changed since the index was written.
+ */
+bool index_is_stale(const TemplateIndex& index) {
+    if (index.store_stamp != directory_stamp(TEMPLATE_DIR))
+        return true;
+    return std::any_of(index.entries.begin(), index.entries.end(),
+                       [](const IndexEntry& entry) { return entry.stamp != template_stamp(TEMPLATE_DIR / entry.name); });
+}
+
+/**
+ * @brief Rescans only the templates whose stamps no longer match their index entries.
+ *
+ * The store directory itself is read only if its own stamp changed, which is
+ * when templates were added or removed.
+ *
+ * @param index The index to update; its postings are rebuilt if anything changed.
+ * @return True if the index changed and should be written.
+ */
+bool refresh_index(TemplateIndex& index) {
+    TraceScope scope("refresh index");
+    bool changed = false;
+    if (index.store_stamp != directory_stamp(TEMPLATE_DIR)) {
+        std::set<std::string> names;
+        std::error_code ec;
+        for (const auto& entry : fs::directory_iterator(TEMPLATE_DIR, ec)) {
+            std::string name = entry.path().filename().string();
+            if (entry.is_directory() && name[0] != '.')
+                names.insert(name);
+        }
+        index.entries.erase(std::remove_if(index.entries.begin(), index.entries.end(),
+                                           [&](const IndexEntry& entry) { return names.count(entry.name) == 0; }),
+                            index.entries.end());
+        for (const auto& name : names) {
+            if (!index.find(name))
+                index.upsert(scan_template(name));
+        }
+        changed = true; // At least the store stamp is new
+    }
+    for (auto& entry : index.entries) {
+        if (entry.stamp != template_stamp(TEMPLATE_DIR / entry.name)) {
+            entry = scan_template(entry.name, &entry);
+            changed = true;
+        }
+    }
+    if (changed)
+        index.build_postings();
+    return changed;
+}
+
+/**
+ * @brief Rebuilds and writes the index, rescanning every template.
+ *
+ * @return The new index.
+ */
+TemplateIndex rebuild_index() {
+    StoreLock lock;
+    TemplateIndex previous;
+    read_index(previous);
+    TemplateIndex index = scan_index(previous);
+    write_index(index);
+    return index;
+}
+
+/**
+ * @brief Loads the index for reading, first rescanning the templates that changed since it was written.
+ */
+TemplateIndex load_index() {
+    TraceScope scope("load index");
+    TemplateIndex index;
+    if (read_index(index) && !index_is_stale(index))
+        return index;
+    StoreLock lock;
+    // Another process may have brought the index up to date while this one waited for the lock
+    index = TemplateIndex();
+    if (!read_index(index))
+        index = scan_index();
+    else if (!refresh_index(index))
+        return index;
+    write_index(index);
+    return index;
+}
+
+/**
+ * @brief Applies a change to the index under the store lock.
+ *
+ * If the index no longer matches the store as it was before the calling
+ * command changed it, the templates that changed are rescanned first, which
+ * also picks up the command's own change.
+ *
+ * @param stamp_before directory_stamp(TEMPLATE_DIR) from before the command changed the store.
+ * @param change Updates the index entries.
+ */
+void update_index(int64_t stamp_before, const std::function<void(TemplateIndex&)>& change) {
+    StoreLock lock;
+    TemplateIndex index;
+    if (!read_index(index))
+        index = scan_index();
+    else if (index.store_stamp != stamp_before)
+        refresh_index(index);
+    change(index);
+    write_index(index);
+}
+
+/**
+ * @brief Reads the template names from the index without parsing the rest of it.
+ *
+ * Only the header is checked: the names change only when the store directory
+ * does, so an index whose store stamp still matches lists exactly the
+ * templates in the store.
+ *
+ * @param text Receives the index file; the names point into it.
+ * @param names Receives the names, sorted as the index stores them.
+ * @return False if there is no readable index or the store changed since it was written.
+ */
+bool read_index_names(std::string& text, std::vector<std::string_view>& names) {
+    if (!read_file(INDEX_PATH, text))
+        return false;
+    std::string_view rest(text);
+    const std::string_view magic = "tmpl-index 5 ";
+    if (rest.substr(0, magic.size()) != magic)
+        return false;
+    rest.remove_prefix(magic.size());
+    int64_t store_stamp = 0;
+    size_t count = 0;
+    auto [stamp_end, stamp_error] = std::from_chars(rest.data(), rest.data() + rest.size(), store_stamp);
+    if (stamp_error != std::errc() || stamp_end == rest.data() + rest.size() || *stamp_end != ' ')
+        return false;
+    auto [count_end, count_error] = std::from_chars(stamp_end + 1, rest.data() + rest.size(), count);
+    if (count_error != std::errc() || store_stamp != directory_stamp(TEMPLATE_DIR))
+        return false;
+    rest.remove_prefix(count_end - rest.data());
+    names.clear();
+    for (size_t line_end = rest.find('\n'); line_end != std::string_view::npos && names.size() < count;
+         line_end = rest.find('\n')) {
+        rest.remove_prefix(line_end + 1);
+        size_t tab = rest.find('\t');
+        if (tab == 0 || tab == std::string_view::npos)
+            return false;
+        names.push_back(rest.substr(0, tab));
+    }
+    return names.size() == count;
+}
+
+// Commands offered for the first word, sorted for prefix search
+const std::string_view COMMANDS[] = {"bench", "daemon",  "delete", "files", "help",   "link",   "list",
+                                     "make",  "reindex", "save",   "tag",   "verify", "version"};
+
+/**
+ * @brief Prints the completions of the last word of a partial tmpl command line.
+ *
+ * Template names are looked up in the index with a binary search, reading
+ * nothing else while the index is current; tags come from its inverted tag
+ * index. Only the matching words are printed, one per line.
+ *
+ * @param words The words after "tmpl", ending with the word being completed (possibly empty).
+ * @return 0 if the word was completed here, or 1 if it is a path or option value the shell should complete.
+ */
+int complete_words(const std::vector<std::string_view>& words) {
+    std::string_view current = words.empty() ? std::string_view() : words.back();
+    std::vector<std::string_view> before; // Earlier words, without the global options
+    for (size_t i = 0; i + 1 < words.size(); ++i) {
+        if (words[i] == "--trace" && i + 2 == words.size())
+            return 1;
+        if (words[i] == "--trace")
+            ++i;
+        else if (words[i] != "--stats")
+            before.push_back(words[i]);
+    }
+    std::string_view command = before.empty() ? std::string_view() : before.front();
+    std::string_view previous = before.empty() ? std::string_view() : before.back();
+
+    std::vector<std::string_view> candidates; // Sorted
+    std::string_view lead;                    // Printed before every candidate, such as the tags before the last comma
+    std::string index_text;
+    TemplateIndex index;
+    if (before.empty()) {
+        candidates.assign(std::begin(COMMANDS), std::end(COMMANDS));
+    } else if (previous == "--tags" || previous == "--not") {
+        size_t comma = current.rfind(',');
+        if (comma != std::string_view::npos) {
+            lead = current.substr(0, comma + 1);
+            current.remove_prefix(comma + 1);
+        }
+        index = load_index();
+        for (const auto& [tag, list] : index.postings) {
+            if (!tag.empty())
+                candidates.push_back(tag);
+        }
+    } else if ((before.size() >= 1 && command == "verify" && current.substr(0, 1) != "-") ||
+               (before.size() == 1 && (command == "make" || command == "files" || command == "delete" || command == "link")) ||
+               (before.size() == 2 && command == "tag")) {
+        size_t plus = command == "make" ? current.rfind('+') : std::string_view::npos;
+        if (plus != std::string_view::npos) {
+            lead = current.substr(0, plus + 1); // The layers before the one being typed
+            current.remove_prefix(plus + 1);
+        }
+        if (!read_index_names(index_text, candidates)) {
+            index = load_index();
+            candidates.clear();
+            for (const auto& entry : index.entries)
+                candidates.push_back(entry.name);
+        }
+    } else if (before.size() == 1 && command == "tag") {
+        candidates = {"add", "remove"};
+    } else if (before.size() == 1 && command == "daemon") {
+        candidates = {"run", "start", "status", "stop"};
+    } else if (before.size() == 2 && command == "link") {
+        candidates = {"copy", "hard", "sym"};
+    } else {
+        return 1;
+    }
+
+    std::string out;
+    for (auto it = std::lower_bound(candidates.begin(), candidates.end(), current);
+         it != candidates.end() && it->substr(0, current.size()) == current; ++it) {
+        out.append(lead).append(*it) += '\n';
+    }
+    std::fwrite(out.data(), 1, out.size(), stdout);
+    return 0;
+}
+
+/**
+ * @brief Prints the completion script for a shell, which calls tmpl complete for each word.
+ *
+ * @param shell bash, zsh, fish or powershell.
+ * @return False if the shell is not supported.
+ */
+bool print_completion_script(std::string_view shell) {
+    if (shell == "bash") {
+        std::fputs(R"(_tmpl() {
+    local IFS=$'\n' out
+    out=$(tmpl complete "${COMP_WORDS[@]:1:COMP_CWORD}") || return 0
+    COMPREPLY=($out)
+}
+complete -o default -F _tmpl tmpl
+)", stdout);
+    } else if (shell == "zsh") {
+        std::fputs(R"(#compdef tmpl
+_tmpl() {
+    local out
+    if ! out=$(tmpl complete "${(@)words[2,CURRENT]}"); then
+        _files
+        return
+    fi
+    local -a items
+    items=(${(f)out})
+    compadd -Q -- $items
+}
+compdef _tmpl tmpl
+)", stdout);
+    } else if (shell == "fish") {
+        std::fputs(R"(function __tmpl_complete
+    set -l current (commandline -ct)
+    tmpl complete (commandline -opc)[2..-1] "$current"; or __fish_complete_path "$current"
+end
+complete -c tmpl -f -a '(__tmpl_complete)'
+)", stdout);
+    } else if (shell == "powershell") {
+        std::fputs(R"(Register-ArgumentCompleter -Native -CommandName tmpl -ScriptBlock {
+    param($wordToComplete, $commandAst, $cursorPosition)
+    $words = @($commandAst.CommandElements | Select-Object -Skip 1 |
+        Where-Object { $_.Extent.EndOffset -le $cursorPosition } | ForEach-Object { $_.ToString() })
+    if ($wordToComplete -eq '') {
+        # Before 7.3, PowerShell drops empty arguments to native commands
+        $words += if ($PSVersionTable.PSVersion -ge [version]'7.3') { '' } else { '""' }
+    }
+    $items = @(tmpl complete @words)
+    if ($LASTEXITCODE -ne 0) { return }
+    $items | ForEach-Object { [System.Management.Automation.CompletionResult]::new($_, $_, 'ParameterValue', $_) }
+}
+)", stdout);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+#ifdef TMPL_DAEMON
+/**
+ * @brief Keeps the template index and template listings in memory for tmpl daemon.
+ *
+ * inotify watches the store directory and the top directory of every indexed
+ * template. An event marks its template dirty: the next index lookup rescans
+ * only the dirty templates and writes the index back for other processes,
+ * and a cached listing of the template is dropped. Cached plain templates
+ * are watched down to every directory. Pending events are read before every
+ * lookup, so a lookup made after taking the template lock sees every change
+ * completed before the lock was granted.
+ */
+class WarmCache {
+public:
+    WarmCache() = default;
+    ~WarmCache() {
+        if (inotify_fd >= 0)
+            close(inotify_fd);
+    }
+    WarmCache(const WarmCache&) = delete;
+    WarmCache& operator=(const WarmCache&) = delete;
+
+    /**
+     * @brief Starts watching the store.
+     *
+     * @return False if inotify is not available.
+     */
+    bool open() {
+        inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (inotify_fd < 0)
+            return false;
+        std::error_code ec;
+        fs::create_directories(TEMPLATE_DIR, ec);
+        templates_watch = inotify_add_watch(inotify_fd, TEMPLATE_DIR.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        return templates_watch >= 0;
+    }
+
+    int fd() const { return inotify_fd; }
+
+    /**
+     * @brief Reads the pending change notifications and records what they invalidate.
+     */
+    void drain() {
+        alignas(inotify_event) char buffer[16 * 1024];
+        for (;;) {
+            ssize_t n = read(inotify_fd, buffer, sizeof(buffer));
+            if (n <= 0)
+                return; // EAGAIN: nothing is pending
+            for (char* p = buffer; p < buffer + n;) {
+                const inotify_event* event = reinterpret_cast<const inotify_event*>(p);
+                p += sizeof(inotify_event) + event->len;
+                std::string name = event->len > 0 ? event->name : "";
+                if (event->mask & IN_Q_OVERFLOW) {
+                    clear();
+                } else if (event->wd == templates_watch) {
+                    if (!name.empty() && name[0] != '.') {
+                        dirty.insert(name);
+                        forget(name);
+                    }
+                } else if (auto owner = watch_owners.find(event->wd); owner != watch_owners.end()) {
+                    std::string template_name = owner->second;
+                    dirty.insert(template_name);
+                    if (event->mask & IN_IGNORED) {
+                        // The directory is gone, so the kernel dropped the watch
+                        auto root = root_watches.find(template_name);
+                        if (root != root_watches.end() && root->second == event->wd)
+                            root_watches.erase(root);
+                        watch_owners.erase(owner);
+                    }
+                    // .meta holds tags, link policy and placeholders, which make reads fresh every time
+                    if (name == ".meta" || name.rfind(".meta.tmp", 0) == 0)
+                        continue;
+                    if (template_name == loading)
+                        loading_changed = true;
+                    else
+                        forget(template_name);
+                }
+            }
+        }
+    }
+
+    /**
+     * @brief Returns the template index, rescanning the templates that changed since the last lookup.
+     */
+    const TemplateIndex& templates() {
+        drain();
+        if (!index) {
+            index = load_index();
+            for (const auto& entry : index->entries)
+                watch_root(entry.name);
+            // Catches changes made between loading the index and watching the templates
+            if (refresh_index(*index))
+                persist();
+            dirty.clear();
+            drain();
+        }
+        if (!dirty.empty()) {
+            for (const auto& name : dirty) {
+                unwatch_root(name); // save --update swaps in a new directory
+                if (fs::is_directory(TEMPLATE_DIR / name)) {
+                    index->upsert(scan_template(name, index->find(name)));
+                    watch_root(name);
+                } else {
+                    index->erase(name);
+                }
+            }
+            dirty.clear();
+            index->build_postings();
+            persist();
+        } else if (unwatched && refresh_index(*index)) {
+            persist(); // Some templates could not be watched; check their stamps instead
+        }
+        return *index;
+    }
+
+    /**
+     * @brief Returns a template's listing, enumerating the template if it is not cached.
+     *
+     * @return Null if the template cannot be listed.
+     */
+    const TemplateListing* listing(const std::string& name, unsigned jobs) {
+        drain();
+        auto cached = listings.find(name);
+        if (cached != listings.end())
+            return &cached->second->listing;
+        fs::path template_path = TEMPLATE_DIR / name;
+        for (int attempt = 0; attempt < 3; ++attempt) {
+            auto entry = std::make_unique<Entry>();
+            loading = name;
+            loading_changed = false;
+            // Watch before listing, so that a change made while listing is noticed
+            bool watched = watch_root(name);
+            if (!load_template_listing(template_path, jobs, entry->listing)) {
+                loading.clear();
+                return nullptr;
+            }
+            if (!entry->listing.objects && !entry->listing.packed()) {
+                for (const auto& file : entry->listing.entries) {
+                    if (file.directory)
+                        watched = watched && watch(name, template_path / file.path, entry.get());
+                }
+            }
+            drain();
+            loading.clear();
+            if (watched && !loading_changed)
+                return &listings.emplace(name, std::move(entry)).first->second->listing;
+            unwatch(*entry);
+            // Out of watches, or still changing after a few tries: serve the listing once without caching it
+            if (!watched || attempt == 2) {
+                uncached = std::move(entry);
+                return &uncached->listing;
+            }
+        }
+        return nullptr;
+    }
+
+    size_t size() const { return listings.size(); }
+
+    /**
+     * @brief Counts makes in the index held in memory, which record_makes has already written to disk.
+     */
+    void note_makes(const std::string& name, uintmax_t count, int64_t when) {
+        if (!index)
+            return;
+        if (IndexEntry* entry = index->find(name)) {
+            entry->used = when;
+            entry->makes += count;
+        }
+    }
+
+private:
+    struct Entry {
+        TemplateListing listing;
+        std::vector<int> watches; // Below the template's top directory, which is watched for the index
+    };
+
+    // Watches a directory of a template; returns the watch, or -1 if none is left
+    int add_watch(const std::string& name, const fs::path& dir) {
+        int wd = inotify_add_watch(inotify_fd, dir.c_str(),
+                                   IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB |
+                                       IN_DELETE_SELF | IN_MOVE_SELF);
+        if (wd >= 0)
+            watch_owners[wd] = name;
+        return wd;
+    }
+
+    // Watches a directory below a template's top directory, for as long as the entry's listing is cached
+    bool watch(const std::string& name, const fs::path& dir, Entry* entry) {
+        int wd = add_watch(name, dir);
+        if (wd < 0)
+            return false;
+        entry->watches.push_back(wd);
+        return true;
+    }
+
+    bool watch_root(const std::string& name) {
+        if (root_watches.count(name))
+            return true;
+        int wd = add_watch(name, TEMPLATE_DIR / name);
+        if (wd < 0) {
+            unwatched = true;
+            return false;
+        }
+        root_watches[name] = wd;
+        return true;
+    }
+
+    // Stops watching a template's top directory, which may have been replaced or removed
+    void unwatch_root(const std::string& name) {
+        auto root = root_watches.find(name);
+        if (root == root_watches.end())
+            return;
+        inotify_rm_watch(inotify_fd, root->second);
+        watch_owners.erase(root->second);
+        root_watches.erase(root);
+    }
+
+    void unwatch(Entry& entry) {
+        for (int wd : entry.watches) {
+            inotify_rm_watch(inotify_fd, wd);
+            watch_owners.erase(wd);
+        }
+        entry.watches.clear();
+    }
+
+    void forget(const std::string& name) {
+        auto cached = listings.find(name);
+        if (cached == listings.end())
+            return;
+        unwatch(*cached->second);
+        listings.erase(cached);
+    }
+
+    void clear() {
+        index.reset();
+        dirty.clear();
+        while (!listings.empty())
+            forget(listings.begin()->first);
+    }
+
+    // Writes the in-memory index back, so processes that do not use the daemon see the rescans
+    void persist() {
+        StoreLock lock;
+        // Every make counts its use on disk, including makes that did not go through the daemon
+        TemplateIndex on_disk;
+        if (read_index(on_disk)) {
+            for (auto& entry : index->entries) {
+                if (const IndexEntry* counted = on_disk.find(entry.name)) {
+                    entry.used = counted->used;
+                    entry.makes = counted->makes;
+                }
+            }
+        }
+        write_index(*index);
+    }
+
+    int inotify_fd = -1;
+    int templates_watch = -1;
+    std::optional<TemplateIndex> index;
+    std::set<std::string> dirty;             // Templates to rescan on the next index lookup
+    bool unwatched = false;                  // Some template could not be watched
+    std::map<std::string, std::unique_ptr<Entry>> listings;
+    std::map<std::string, int> root_watches; // Template name to the watch of its top directory
+    std::map<int, std::string> watch_owners; // inotify watch to the template it belongs to
+    std::string loading;                     // Template being listed by listing()
+    bool loading_changed = false;            // An event arrived for it while it was listed
+    std::unique_ptr<Entry> uncached;         // The last listing that could not be cached
+};
+
+// Set while tmpl daemon serves requests; null in a normal run
+WarmCache* WARM_CACHE = nullptr;
+#endif
+
+/**
+ * @brief Returns the template index, from memory when running inside tmpl daemon.
+ *
+ * @param storage Receives the index when it is loaded from disk.
+ */
+const TemplateIndex& current_index(TemplateIndex& storage) {
+#ifdef TMPL_DAEMON
+    if (WARM_CACHE)
+        return WARM_CACHE->templates();
+#endif
+    storage = load_index();
+    return storage;
+}
+
+/**
+ * @brief Returns a template's listing kept in memory by tmpl daemon.
+ *
+ * @return Null outside the daemon, or if the template cannot be listed.
+ */
+const TemplateListing* cached_listing(const std::string& name, unsigned jobs) {
+#ifdef TMPL_DAEMON
+    if (WARM_CACHE)
+        return WARM_CACHE->listing(name, jobs);
+#endif
+    (void)name, (void)jobs;
+    return nullptr;
+}
+
+/**
+ * @brief Records in the index that projects were made from templates, for list --long.
+ *
+ * @param makes Number of projects made from each template.
+ */
+void record_makes(const std::map<std::string, uintmax_t>& makes) {
+    if (makes.empty())
+        return;
+    int64_t now = std::time(nullptr);
+    update_index(directory_stamp(TEMPLATE_DIR), [&](TemplateIndex& index) {
+        for (const auto& [name, count] : makes) {
+            if (IndexEntry* entry = index.find(name)) {
+                entry->used = now;
+                entry->makes += count;
+            }
+        }
+    });
+#ifdef TMPL_DAEMON
+    if (WARM_CACHE) {
+        for (const auto& [name, count] : makes)
+            WARM_CACHE->note_makes(name, count, now);
+    }
+#endif
+}
+
+/**
+ * @brief Options that only apply to save.
+ */
+struct SaveOptions {
+    bool dedup = false; // Store files in the shared object store instead of the template directory
+    bool pack = false;  // Store files in a single .pack file
+    Compression compression = Compression::None; // Per-blob compression inside the pack
+    bool update = false;   // Replace an existing template, copying only what changed
+    bool checksum = false; // With update, detect changes by content instead of modification time
+    bool gitignore = false; // Also skip .git and what the source's .gitignore ignores
+};
+
+/**
+ * @brief Swaps two directory entries, atomically where the platform supports it.
+ *
+ * Without an atomic exchange this falls back to three renames, which leaves a
+ * short window in which a does not exist.
+ *
+ * @param a First path.
+ * @param b Second path, on the same file system.
+ * @param ec Receives the error on failure.
+ * @return True if the entries were swapped.
+ */
+bool exchange_paths(const fs::path& a, const fs::path& b, std::error_code& ec) {
+    TraceScope scope("exchange");
+    ec.clear();
+#if defined(__linux__) && defined(SYS_renameat2) && defined(RENAME_EXCHANGE)
+    if (syscall(SYS_renameat2, AT_FDCWD, a.c_str(), AT_FDCWD, b.c_str(), RENAME_EXCHANGE) == 0)
+        return true;
+    if (!copy_unsupported(errno)) {
+        ec = std::error_code(errno, std::generic_category());
+        return false;
+    }
+#elif defined(__APPLE__)
+    if (renamex_np(a.c_str(), b.c_str(), RENAME_SWAP) == 0)
+        return true;
+    if (!copy_unsupported(errno)) {
+        ec = std::error_code(errno, std::generic_category());
+        return false;
+    }
+#endif
+    fs::path aside = b;
+    aside += ".old";
+    fs::rename(a, aside, ec);
+    if (ec)
+        return false;
+    fs::rename(b, a, ec);
+    if (ec) {
+        std::error_code restore_ec;
+        fs::rename(aside, a, restore_ec);
+        return false;
+    }
+    fs::rename(aside, b, ec);
+    return !ec;
+}
+
+// Ends the name of every staging directory, followed by the id of the process that owns it
+const std::string STAGING_MARK = ".tmpl-";
+
+/**
+ * @brief Returns a fresh staging directory path for building a template before it is published.
+ *
+ * Staging lives inside the store so the finished tree can be renamed into place.
+ */
+fs::path staging_path(const std::string& name) {
+    return STATE_DIR / "staging" / (name + STAGING_MARK + std::to_string(process_id()));
+}
+
+/**
+ * @brief Returns the hidden sibling directory make writes a project into before renaming it to dest.
+ */
+fs::path project_staging_path(const fs::path& dest) {
+    return dest.parent_path() / ("." + dest.filename().string() + STAGING_MARK + std::to_string(process_id()));
+}
+
+/**
+ * @brief Removes the staging directories in dir whose owning process is no longer running.
+ *
+ * They are what an interrupted save or make leaves behind.
+ */
+void remove_stale_staging(const fs::path& dir) {
+    TraceScope scope("remove stale staging", &dir);
+    std::error_code ec;
+    for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        size_t mark = name.rfind(STAGING_MARK);
+        if (mark == std::string::npos || mark + STAGING_MARK.size() == name.size())
+            continue;
+        std::string pid = name.substr(mark + STAGING_MARK.size());
+        if (pid.size() > 9 || pid.find_first_not_of("0123456789") != std::string::npos || process_alive(std::stoul(pid)))
+            continue;
+        std::error_code remove_ec;
+        fs::remove_all(it->path(), remove_ec);
+    }
+}
+
+/**
+ * @brief Renames a finished staging directory to its final path, failing if that path exists.
+ *
+ * Uses renameat2(RENAME_NOREPLACE) on Linux, renamex_np(RENAME_EXCL) on macOS
+ * and MoveFileEx on Windows, so a concurrent writer of the same path is never
+ * overwritten. Elsewhere the check and the rename are separate steps.
+ *
+ * @return False with ec set (to file_exists if the path is taken) on failure.
+ */
+bool publish_path(const fs::path& from, const fs::path& to, std::error_code& ec) {
+    TraceScope scope("publish", &to);
+    ec.clear();
+#ifdef OS_WINDOWS
+    if (MoveFileExW(from.c_str(), to.c_str(), 0))
+        return true;
+    DWORD error = GetLastError();
+    ec = error == ERROR_ALREADY_EXISTS || error == ERROR_FILE_EXISTS ? std::make_error_code(std::errc::file_exists)
+                                                                      : std::error_code(static_cast<int>(error), std::system_category());
+    return false;
+#else
+#if defined(__linux__) && defined(SYS_renameat2) && defined(RENAME_NOREPLACE)
+    if (syscall(SYS_renameat2, AT_FDCWD, from.c_str(), AT_FDCWD, to.c_str(), RENAME_NOREPLACE) == 0)
+        return true;
+    if (!copy_unsupported(errno)) {
+        ec = std::error_code(errno, std::generic_category());
+        return false;
+    }
+#elif defined(__APPLE__) && defined(RENAME_EXCL)
+    if (renamex_np(from.c_str(), to.c_str(), RENAME_EXCL) == 0)
+        return true;
+    if (!copy_unsupported(errno)) {
+        ec = std::error_code(errno, std::generic_category());
+        return false;
+    }
+#endif
+    if (fs::exists(fs::symlink_status(to, ec))) {
+        ec = std::make_error_code(std::errc::file_exists);
+        return false;
+    }
+    fs::rename(from, to, ec);
+    return !ec;
+#endif
+}
+
+/**
+ * @brief A template's files as a store lists them.
+ *
+ * Entries of packed templates carry the codec, offset and stored size of
+ * their blob in the pack; the others are stored whole (offset 0) under their
+ * hash or their path.
+ */
+using StoreListing = std::vector<PackEntry>;
+
+// The error a store reports for a template name it does not have
+const std::string NO_SUCH_TEMPLATE = "does not exist";
+
+/**
+ * @brief Where templates live, behind the operations the commands need.
+ *
+ * Commands reach templates through store() rather than TEMPLATE_DIR, so a
+ * backend named in TMPL_STORE can serve list, files, make, save and delete
+ * without changes to the command dispatch. Backends whose templates are not
+ * directories under TEMPLATE_DIR return an empty directory(); the commands
+ * that work on that layout in place (tag, link, verify, reindex and batch or
+ * layered make) refuse to run against them.
+ */
+class TemplateStore {
+public:
+    virtual ~TemplateStore() = default;
+
+    /**
+     * @brief Describes the store for messages: its directory or URL.
+     */
+    virtual std::string location() const = 0;
+
+    /**
+     * @brief Returns the directory holding the templates, or an empty path if they are not local.
+     */
+    virtual fs::path directory() const = 0;
+
+    /**
+     * @brief Lists every template with its tags, sizes and tag index.
+     *
+     * @param storage Holds the index if the store does not keep one in memory.
+     * @param error Receives the reason on failure.
+     * @return The index, or null if the templates cannot be listed.
+     */
+    virtual const TemplateIndex* enumerate(TemplateIndex& storage, std::string& error) const = 0;
+
+    /**
+     * @brief Reads a template's .meta.
+     *
+     * @param meta Receives the metadata; a template without a .meta gets an empty one.
+     * @param error Receives the reason on failure.
+     * @return False if the template does not exist or cannot be read.
+     */
+    virtual bool read_meta(const std::string& name, MetaView& meta, std::string& error) const = 0;
+
+    /**
+     * @brief Lists a template's directories and files, sorted so directories precede their contents.
+     *
+     * @param error Receives the reason on failure.
+     * @return False if the template does not exist or cannot be listed.
+     */
+    virtual bool read_listing(const std::string& name, StoreListing& listing, std::string& error) const = 0;
+
+    /**
+     * @brief Reads the contents of one file of a template.
+     *
+     * @param entry The file, as read_listing listed it.
+     * @param contents Receives the decoded contents.
+     * @param error Receives the reason on failure.
+     * @return False if the file cannot be read or does not match its hash.
+     */
+    virtual bool open_blob(const std::string& name, const PackEntry& entry, std::string& contents, std::string& error) const = 0;
+
+    /**
+     * @brief Makes a staged template visible under its name.
+     *
+     * @param staging The complete template, built by save in the store's staging area.
+     * @param replace Swap out an existing template of that name instead of failing.
+     * @param ec Receives the error; std::errc::file_exists if the name is taken and replace is unset.
+     * @return False if nothing was published; staging is left for the caller to remove.
+     */
+    virtual bool publish(const fs::path& staging, const std::string& name, bool replace, std::error_code& ec) = 0;
+
+    /**
+     * @brief Deletes a template.
+     *
+     * @param error Receives the reason on failure.
+     * @return False if the template does not exist or cannot be removed.
+     */
+    virtual bool remove(const std::string& name, std::string& error) = 0;
+};
+
+/**
+ * @brief The default store: one directory per template under TEMPLATE_DIR.
+ *
+ * A template keeps its files directly, in the shared object store (next to
+ * a .manifest) or in a .pack, as chosen when it was saved.
+ */
+class DirectoryStore : public TemplateStore {
+public:
+    std::string location() const override { return TEMPLATE_DIR.string(); }
+    fs::path directory() const override { return TEMPLATE_DIR; }
+
+    const TemplateIndex* enumerate(TemplateIndex& storage, std::string&) const override {
+        if (!fs::is_directory(TEMPLATE_DIR))
+            return &storage; // No store yet is an empty store
+        // Only the index is read, unless templates were added or removed behind tmpl's back
+        return &current_index(storage);
+    }
+
+    bool read_meta(const std::string& name, MetaView& meta, std::string& error) const override {
+        if (!exists(name, error))
+            return false;
+        meta = MetaView(TEMPLATE_DIR / name);
+        return true;
+    }
+
+    bool read_listing(const std::string& name, StoreListing& listing, std::string& error) const override {
+        if (!exists(name, error))
+            return false;
+        fs::path template_path = TEMPLATE_DIR / name;
+        if (read_pack_table(template_path / ".pack", listing))
+            return true;
+        Manifest manifest;
+        if (!read_manifest(template_path, manifest)) {
+            std::error_code ec;
+            for (fs::recursive_directory_iterator it(template_path, ec), end; !ec && it != end; it.increment(ec)) {
+                fs::path rel = it->path().lexically_relative(template_path);
+                // Links are listed as links, as plain templates keep them; stat_entry does not follow them
+                ManifestEntry entry;
+                std::error_code entry_ec;
+                if (is_template_metadata(rel) || !stat_entry(it->path(), entry, entry_ec))
+                    continue;
+                entry.directory = !entry.symlink && it->is_directory(entry_ec);
+                if (!entry.directory && !entry.symlink && !it->is_regular_file(entry_ec))
+                    continue;
+                entry.path = rel.generic_string();
+                manifest.push_back(std::move(entry));
+            }
+            std::sort(manifest.begin(), manifest.end(), [](const ManifestEntry& a, const ManifestEntry& b) { return a.path < b.path; });
+        }
+        for (auto& entry : manifest) {
+            PackEntry listed;
+            static_cast<ManifestEntry&>(listed) = std::move(entry);
+            listed.stored_size = listed.size;
+            listing.push_back(std::move(listed));
+        }
+        return true;
+    }
+
+    bool open_blob(const std::string& name, const PackEntry& entry, std::string& contents, std::string& error) const override {
+        fs::path template_path = TEMPLATE_DIR / name;
+        if (entry.offset == 0) {
+            bool objects = !entry.hash.empty() && fs::exists(template_path / ".manifest");
+            if (read_file(objects ? object_path(entry.hash) : template_path / entry.path, contents))
+                return true;
+            error = "cannot read " + entry.path;
+            return false;
+        }
+        std::ifstream pack(template_path / ".pack", std::ios::binary);
+        std::string stored(static_cast<size_t>(entry.stored_size), '\0');
+        pack.seekg(static_cast<std::streamoff>(entry.offset));
+        std::ostringstream out;
+        if (!pack.read(&stored[0], static_cast<std::streamsize>(stored.size())) || !pack_codec_available(entry.codec) ||
+            !decode_blob(entry.codec, reinterpret_cast<const unsigned char*>(stored.data()), stored.size(), out)) {
+            error = "cannot read " + entry.path + " from the pack";
+            return false;
+        }
+        contents = out.str();
+        return true;
+    }
+
+    bool publish(const fs::path& staging, const std::string& name, bool replace, std::error_code& ec) override {
+        fs::path template_path = TEMPLATE_DIR / name;
+        StoreLock lock(template_lock_path(name));
+        if (!replace)
+            return publish_path(staging, template_path, ec);
+        if (!exchange_paths(template_path, staging, ec))
+            return false;
+        fs::remove_all(staging, ec); // The previous version
+        ec.clear();
+        return true;
+    }
+
+    bool remove(const std::string& name, std::string& error) override {
+        if (!exists(name, error))
+            return false;
+        fs::path template_path = TEMPLATE_DIR / name;
+        bool deduplicated;
+        {
+            // Waits for makes still copying from the template; makes that start later find it gone.
+            // Released before collecting garbage, which a dedup save waits on while holding the objects lock.
+            StoreLock lock(template_lock_path(name));
+            if (!exists(name, error))
+                return false;
+            deduplicated = fs::exists(template_path / ".manifest");
+            int64_t stamp_before = directory_stamp(TEMPLATE_DIR);
+            std::error_code ec;
+            fs::remove_all(template_path, ec); // Remove directory and its contents
+            if (ec) {
+                error = ec.message();
+                return false;
+            }
+            fs::remove(PLANS_DIR / name, ec);
+            update_index(stamp_before, [&](TemplateIndex& index) { index.erase(name); });
+        }
+        if (deduplicated)
+            collect_garbage();
+        return true;
+    }
+
+private:
+    static bool exists(const std::string& name, std::string& error) {
+        if (!name.empty() && name[0] != '.' && fs::is_directory(TEMPLATE_DIR / name))
+            return true;
+        error = NO_SUCH_TEMPLATE;
+        return false;
+    }
+};
+
+#ifdef TMPL_REGISTRY
+/**
+ * @brief A read-only store served by a template registry over HTTP.
+ *
+ * The registry is laid out like ~/.templates, so it is listed from its own
+ * .tmpl/index and its packed and deduplicated templates are read with range
+ * requests. Blobs already in the object store or the blob cache are not
+ * fetched again, and fetched ones are checked against their hash.
+ */
+class RegistryStore : public TemplateStore {
+public:
+    RegistryStore(const RegistryUrl& url, std::string address) : url(url), address(std::move(address)) {}
+
+    std::string location() const override { return address; }
+    fs::path directory() const override { return fs::path(); }
+
+    const TemplateIndex* enumerate(TemplateIndex& storage, std::string& error) const override {
+        HttpConnection connection(url);
+        std::string body;
+        if (!connection.get(".tmpl/index", 0, std::nullopt, body, error)) {
+            if (error.empty())
+                error = "the registry has no .tmpl/index; run tmpl reindex in its directory";
+            return nullptr;
+        }
+        std::istringstream index_file(body);
+        if (!parse_index(index_file, storage)) {
+            error = "corrupt index";
+            return nullptr;
+        }
+        return &storage;
+    }
+
+    bool read_meta(const std::string& name, MetaView& meta, std::string& error) const override {
+        RemoteTemplate remote;
+        return valid_name(name, error) && fetch_remote_template(url, name, remote, meta, error);
+    }
+
+    bool read_listing(const std::string& name, StoreListing& listing, std::string& error) const override {
+        RemoteTemplate remote;
+        MetaView meta;
+        if (!valid_name(name, error) || !fetch_remote_template(url, name, remote, meta, error))
+            return false;
+        for (auto& file : remote.files)
+            listing.push_back(std::move(file.entry));
+        return true;
+    }
+
+    bool open_blob(const std::string& name, const PackEntry& entry, std::string& contents, std::string& error) const override {
+        fs::path cached = cached_blob(entry.hash); // Holds the decoded contents
+        if (cached.empty() || !read_file(cached, contents)) {
+            HttpConnection connection(url);
+            std::string source = entry.offset == 0 ? ".objects/" + entry.hash : name + "/.pack";
+            std::string stored;
+            if (!connection.get(source, entry.offset, entry.stored_size, stored, error)) {
+                if (error.empty())
+                    error = "not in the registry";
+                return false;
+            }
+            std::ostringstream out;
+            if (!pack_codec_available(entry.codec) ||
+                !decode_blob(entry.codec, reinterpret_cast<const unsigned char*>(stored.data()), stored.size(), out)) {
+                error = "cannot decode " + entry.path;
+                return false;
+            }
+            contents = out.str();
+        }
+        if (hash_text(contents) != entry.hash) {
+            error = "corrupt blob for " + entry.path;
+            return false;
+        }
+        return true;
+    }
+
+    bool publish(const fs::path&, const std::string&, bool, std::error_code& ec) override {
+        ec = std::make_error_code(std::errc::read_only_file_system);
+        return false;
+    }
+
+    bool remove(const std::string&, std::string& error) override {
+        error = "the registry is read-only";
+        return false;
+    }
+
+private:
+    static bool valid_name(const std::string& name, std::string& error) {
+        if (!name.empty() && name[0] != '.' && name.find_first_of("/\\") == std::string::npos)
+            return true;
+        error = "invalid template name";
+        return false;
+    }
+
+    RegistryUrl url;
+    std::string address; // TMPL_REGISTRY as given
+};
+#endif
+
+/**
+ * @brief A store that keeps templates in memory for the life of the process, for tests.
+ *
+ * publish reads a staged directory template into memory and removes the
+ * staging directory, as the rename into a directory store would. Nothing
+ * is kept once the process exits, so TMPL_STORE=memory only serves code
+ * that publishes and reads templates in one process, such as the unit tests.
+ */
+class MemoryStore : public TemplateStore {
+public:
+    std::string location() const override { return "memory"; }
+    fs::path directory() const override { return fs::path(); }
+
+    const TemplateIndex* enumerate(TemplateIndex& storage, std::string&) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (const auto& [name, stored] : templates) { // By name, as the index is sorted
+            IndexEntry entry;
+            entry.name = name;
+            entry.tags = read_tags(MetaView(stored.meta));
+            for (const auto& file : stored.listing) {
+                if (!file.directory && !file.symlink) {
+                    entry.files++;
+                    entry.bytes += file.size;
+                }
+            }
+            entry.stored = entry.bytes;
+            entry.saved = stored.saved;
+            storage.entries.push_back(std::move(entry));
+        }
+        storage.build_postings();
+        return &storage;
+    }
+
+    bool read_meta(const std::string& name, MetaView& meta, std::string& error) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Stored* stored = find(name, error);
+        if (stored)
+            meta = MetaView(stored->meta);
+        return stored != nullptr;
+    }
+
+    bool read_listing(const std::string& name, StoreListing& listing, std::string& error) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Stored* stored = find(name, error);
+        if (stored)
+            listing.insert(listing.end(), stored->listing.begin(), stored->listing.end());
+        return stored != nullptr;
+    }
+
+    bool open_blob(const std::string& name, const PackEntry& entry, std::string& contents, std::string& error) const override {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Stored* stored = find(name, error);
+        if (!stored)
+            return false;
+        auto file = stored->contents.find(entry.path);
+        if (file == stored->contents.end()) {
+            error = "no file " + entry.path;
+            return false;
+        }
+        contents = file->second;
+        return true;
+    }
+
+    bool publish(const fs::path& staging, const std::string& name, bool replace, std::error_code& ec) override {
+        if (fs::exists(staging / ".manifest") || fs::exists(staging / ".pack")) {
+            ec = std::make_error_code(std::errc::not_supported); // Only directory templates are read
+            return false;
+        }
+        Stored stored;
+        stored.saved = std::time(nullptr);
+        for (fs::recursive_directory_iterator it(staging, ec), end; !ec && it != end; it.increment(ec)) {
+            fs::path rel = it->path().lexically_relative(staging);
+            PackEntry entry;
+            std::error_code entry_ec;
+            if (is_template_metadata(rel))
+                continue;
+            if (!stat_entry(it->path(), entry, ec))
+                return false;
+            entry.directory = !entry.symlink && it->is_directory(entry_ec);
+            if (!entry.directory && !entry.symlink && !it->is_regular_file(entry_ec))
+                continue;
+            entry.path = rel.generic_string();
+            if (!entry.directory && !entry.symlink) {
+                std::string& contents = stored.contents[entry.path];
+                if (!read_file(it->path(), contents)) {
+                    ec = std::make_error_code(std::errc::io_error);
+                    return false;
+                }
+                entry.hash = hash_text(contents);
+                entry.stored_size = entry.size;
+            }
+            stored.listing.push_back(std::move(entry));
+        }
+        if (ec)
+            return false;
+        std::sort(stored.listing.begin(), stored.listing.end(), [](const PackEntry& a, const PackEntry& b) { return a.path < b.path; });
+        read_file(staging / ".meta", stored.meta); // A template without a .meta has no entries
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!replace && templates.count(name)) {
+                ec = std::make_error_code(std::errc::file_exists);
+                return false;
+            }
+            templates[name] = std::move(stored);
+        }
+        fs::remove_all(staging, ec);
+        ec.clear();
+        return true;
+    }
+
+    bool remove(const std::string& name, std::string& error) override {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (templates.erase(name) == 0) {
+            error = NO_SUCH_TEMPLATE;
+            return false;
+        }
+        return true;
+    }
+
+private:
+    struct Stored {
+        std::string meta;   // The .meta file's contents
+        StoreListing listing;
+        std::map<std::string, std::string> contents; // By path
+        int64_t saved = 0;  // Unix time it was published
+    };
+
+    const Stored* find(const std::string& name, std::string& error) const {
+        auto it = templates.find(name);
+        if (it != templates.end())
+            return &it->second;
+        error = NO_SUCH_TEMPLATE;
+        return nullptr;
+    }
+
+    mutable std::mutex mutex;
+    std::map<std::string, Stored> templates; // Guarded by mutex
+};
+
+/**
+ * @brief A storage backend that TMPL_STORE can name.
+ */
+struct StoreBackend {
+    const char* name;
+    // Creates the store, or returns null with the reason in error
+    std::unique_ptr<TemplateStore> (*open)(std::string& error);
+};
+
+// Backends selectable with TMPL_STORE; the first is the default
+const StoreBackend STORE_BACKENDS[] = {
+    {"dir", [](std::string&) -> std::unique_ptr<TemplateStore> { return std::make_unique<DirectoryStore>(); }},
+#ifdef TMPL_REGISTRY
+    {"registry",
+     [](std::string& error) -> std::unique_ptr<TemplateStore> {
+         const char* registry = getenv("TMPL_REGISTRY");
+         RegistryUrl url;
+         if (!registry || !parse_registry_url(registry, url)) {
+             error = "set TMPL_REGISTRY to the http:// URL of a registry";
+             return nullptr;
+         }
+         return std::make_unique<RegistryStore>(url, registry);
+     }},
+#endif
+    {"memory", [](std::string&) -> std::unique_ptr<TemplateStore> { return std::make_unique<MemoryStore>(); }},
+};
+
+/**
+ * @brief Returns the backend selected by TMPL_STORE, opened on first use.
+ *
+ * An unknown or unusable backend is reported and ends the process.
+ */
+TemplateStore& store() {
+    static const std::unique_ptr<TemplateStore> selected = [] {
+        const char* name = getenv("TMPL_STORE");
+        std::string_view wanted = name && *name ? name : STORE_BACKENDS[0].name;
+        std::string error;
+        for (const auto& backend : STORE_BACKENDS) {
+            if (wanted == backend.name) {
+                if (auto opened = backend.open(error))
+                    return opened;
+                break;
+            }
+        }
+        if (error.empty()) {
+            error = "unknown backend; use";
+            for (const auto& backend : STORE_BACKENDS)
+                error += std::string(" ") + backend.name + (&backend == std::end(STORE_BACKENDS) - 1 ? "" : ",");
+        }
+        std::cerr << "TMPL_STORE=" << wanted << ": " << error << std::endl;
+        exit(EXIT_FAILURE);
+    }();
+    return *selected;
+}
+
+/**
+ * @brief Checks that the selected store keeps its templates under TEMPLATE_DIR, for commands that work on them in place.
+ *
+ * @param what The command, for the message.
+ * @return False, after printing why, if the store is not local.
+ */
+bool require_local_store(const std::string& what) {
+    if (!store().directory().empty())
+        return true;
+    std::cout << what << " needs templates stored in a local directory; " << store().location()
+              << " is not one. Unset TMPL_STORE to use " << TEMPLATE_DIR.string() << ".\n";
+    return false;
+}
+
+/**
+ * @brief What a listing holds, by kind of entry.
+ */
+struct ListingTotals {
+    uintmax_t directories = 0;
+    uintmax_t files = 0;
+    uintmax_t links = 0;
+    uintmax_t bytes = 0; // In the files
+};
+
+ListingTotals count_listing(const TemplateListing& listing) {
+    ListingTotals totals;
+    auto add = [&](const ManifestEntry& entry) {
+        if (entry.directory) {
+            totals.directories++;
+        } else if (entry.symlink) {
+            totals.links++;
+        } else {
+            totals.files++;
+            totals.bytes += entry.size;
+        }
+    };
+    if (listing.packed())
+        std::for_each(listing.pack_entries.begin(), listing.pack_entries.end(), add);
+    else
+        std::for_each(listing.entries.begin(), listing.entries.end(), add);
+    return totals;
+}
+
+/**
+ * @brief Names how a make moves a template's data, so runs are compared with runs of the same kind.
+ */
+std::string make_kind(const TemplateListing& listing, const CopyOptions& options) {
+    if (listing.packed())
+        return "make pack";
+    return options.link.value_or(LinkMode::Copy) == LinkMode::Copy ? "make copy" : "make link";
+}
+
+// Recent make and save runs, from which --dry-run estimates durations
+const fs::path THROUGHPUT_PATH = STATE_DIR / "throughput";
+// Runs kept for each kind of work
+const size_t THROUGHPUT_SAMPLES = 32;
+
+/**
+ * @brief One finished make or save, as recorded in THROUGHPUT_PATH.
+ */
+struct ThroughputSample {
+    std::string kind; // The command and how it moved the data, such as "make copy" or "save dedup"
+    double files = 0;
+    double bytes = 0;
+    double seconds = 0;
+};
+
+std::vector<ThroughputSample> read_throughput() {
+    std::vector<ThroughputSample> samples;
+    std::ifstream in(THROUGHPUT_PATH);
+    std::string line;
+    if (!in || !std::getline(in, line) || line != "tmpl-throughput 1")
+        return samples;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        ThroughputSample sample;
+        std::string command, method;
+        fields >> command >> method >> sample.files >> sample.bytes >> sample.seconds;
+        if (fields && sample.seconds > 0) {
+            sample.kind = command + " " + method;
+            samples.push_back(std::move(sample));
+        }
+    }
+    return samples;
+}
+
+/**
+ * @brief Records how long a make or save took, keeping the last THROUGHPUT_SAMPLES runs of each kind.
+ *
+ * The log is only an aid to estimates: it is replaced with a rename, and a
+ * run that races another may drop that run's record.
+ *
+ * @param kind The command and method, such as "make copy".
+ * @param files Files written.
+ * @param bytes Bytes in those files.
+ * @param seconds Wall time of the run.
+ */
+void record_throughput(const std::string& kind, uintmax_t files, uintmax_t bytes, double seconds) {
+    std::vector<ThroughputSample> samples = read_throughput();
+    samples.push_back({kind, static_cast<double>(files), static_cast<double>(bytes), seconds});
+    std::map<std::string, size_t> kept;
+    std::vector<const ThroughputSample*> newest; // Newest first
+    for (auto it = samples.rbegin(); it != samples.rend(); ++it) {
+        if (++kept[it->kind] <= THROUGHPUT_SAMPLES)
+            newest.push_back(&*it);
+    }
+    std::ostringstream out;
+    out << "tmpl-throughput 1\n";
+    for (auto it = newest.rbegin(); it != newest.rend(); ++it)
+        out << (*it)->kind << " " << static_cast<uintmax_t>((*it)->files) << " " << static_cast<uintmax_t>((*it)->bytes) << " "
+            << (*it)->seconds << "\n";
+    std::error_code ec;
+    fs::create_directories(STATE_DIR, ec);
+    fs::path temp = THROUGHPUT_PATH;
+    temp += ".tmp" + std::to_string(process_id());
+    {
+        std::ofstream file(temp, std::ios::binary | std::ios::trunc);
+        file << out.str();
+        if (!file)
+            ec = std::make_error_code(std::errc::io_error);
+    }
+    if (!ec)
+        fs::rename(temp, THROUGHPUT_PATH, ec);
+    if (ec)
+        fs::remove(temp, ec);
+}
+
+/**
+ * @brief Estimates how long a make or save would take from the recorded runs of the same kind.
+ *
+ * Fits seconds = a * files + b * bytes to the runs by least squares, so that
+ * a template of many small files and one of a few big ones are both priced
+ * sensibly. With too few distinct runs for two terms, time scales with bytes
+ * (or files) alone.
+ *
+ * @param runs Receives the number of runs the estimate is based on.
+ * @return The estimate in seconds, or nullopt if no run of this kind was recorded.
+ */
+std::optional<double> estimate_seconds(const std::string& kind, uintmax_t files, uintmax_t bytes, size_t& runs) {
+    double ff = 0, fb = 0, bb = 0, fs = 0, bs = 0; // Sums of products of files, bytes and seconds
+    double total_files = 0, total_bytes = 0, total_seconds = 0;
+    runs = 0;
+    for (const auto& sample : read_throughput()) {
+        if (sample.kind != kind)
+            continue;
+        ++runs;
+        ff += sample.files * sample.files;
+        fb += sample.files * sample.bytes;
+        bb += sample.bytes * sample.bytes;
+        fs += sample.files * sample.seconds;
+        bs += sample.bytes * sample.seconds;
+        total_files += sample.files;
+        total_bytes += sample.bytes;
+        total_seconds += sample.seconds;
+    }
+    if (runs == 0)
+        return std::nullopt;
+    double determinant = ff * bb - fb * fb;
+    if (runs >= 2 && determinant > 1e-9 * ff * bb) {
+        double per_file = (fs * bb - bs * fb) / determinant;
+        double per_byte = (bs * ff - fs * fb) / determinant;
+        if (per_file >= 0 && per_byte >= 0)
+            return per_file * files + per_byte * bytes;
+    }
+    if (total_bytes > 0 && bytes > 0)
+        return total_seconds * bytes / total_bytes;
+    return total_files > 0 ? total_seconds * files / total_files : total_seconds / runs;
+}
+
+/**
+ * @brief Checks, without copying any data, whether files under src_dir can be reflinked into dst_dir.
+ *
+ * Clones at most one block of an existing file into an unnamed temporary
+ * file in dst_dir, which disappears when it is closed.
+ *
+ * @param src_file A regular file on the source file system.
+ * @param dst_dir An existing directory on the destination file system.
+ * @return Whether clones work, or nullopt where this cannot be probed.
+ */
+std::optional<bool> reflink_supported(const fs::path& src_file, const fs::path& dst_dir) {
+#if defined(__linux__) && defined(FICLONERANGE) && defined(O_TMPFILE)
+    FileDescriptor in(open(src_file.c_str(), O_RDONLY | O_CLOEXEC));
+    FileDescriptor out(open(dst_dir.c_str(), O_TMPFILE | O_WRONLY | O_CLOEXEC, 0600));
+    struct stat st;
+    if (in.fd < 0 || out.fd < 0 || fstat(in.fd, &st) != 0)
+        return std::nullopt;
+    file_clone_range range = {};
+    range.src_fd = in.fd;
+    range.src_length = st.st_size >= 4096 ? 4096 : 0; // One aligned block, or the whole (short) file
+    if (ioctl(out.fd, FICLONERANGE, &range) == 0)
+        return true;
+    if (copy_unsupported(errno))
+        return false;
+    return std::nullopt;
+#else
+    (void)src_file;
+    (void)dst_dir;
+    return std::nullopt;
+#endif
+}
+
+/**
+ * @brief Returns the deepest existing directory at or above path, where a dry run can probe its file system.
+ */
+fs::path existing_ancestor(fs::path path) {
+    std::error_code ec;
+    path = fs::absolute(path, ec);
+    while (!path.empty() && !fs::is_directory(path, ec) && path.has_parent_path() && path.parent_path() != path)
+        path = path.parent_path();
+    return path;
+}
+
+/**
+ * @brief Prints the closing lines of a dry run: the estimate and that nothing was written.
+ */
+void print_estimate(const std::string& kind, uintmax_t files, uintmax_t bytes) {
+    size_t runs = 0;
+    if (std::optional<double> seconds = estimate_seconds(kind, files, bytes, runs))
+        printf("  Estimate:    %.2f s, from %zu earlier %s run%s\n", *seconds, runs, kind.c_str(), runs == 1 ? "" : "s");
+    else
+        printf("  Estimate:    none yet; each %s run is timed for later estimates\n", kind.c_str());
+    printf("Dry run: nothing was written.\n");
+}
+
+/**
+ * @brief Builds the new version of a directory template, reusing the files that did not change.
+ *
+ * Unchanged files are hard-linked from the current version instead of being
+ * copied. A file is unchanged if its size, permissions and modification time
+ * match the stored copy, or with checksum, if its size and SHA-256 match.
+ *
+ * @param src Directory being saved.
+ * @param current The template as currently stored.
+ * @param staging Empty directory that receives the new version.
+ * @param options Copy options used for changed files; preserve_times should be set.
+ * @param checksum Compare contents instead of modification times.
+ * @return True if every file was staged; errors are reported on stderr.
+ */
+bool stage_template_update(const fs::path& src, const fs::path& current, const fs::path& staging, const CopyOptions& options,
+                           bool checksum) {
+    TraceScope scope("stage update");
+    ParallelWalker walker(options.jobs, options.filter);
+    std::atomic<size_t> unchanged{0}, copied{0}, existing{0};
+
+    // Decides whether the stored copy of a file can be reused as is
+    auto is_unchanged = [&](const fs::path& path, const fs::path& stored) {
+        std::error_code ec;
+        fs::file_status stored_status = fs::status(stored, ec);
+        if (ec || !fs::is_regular_file(stored_status))
+            return false;
+        existing++;
+        if (fs::status(path, ec).permissions() != stored_status.permissions() || fs::file_size(path, ec) != fs::file_size(stored, ec))
+            return false;
+        if (checksum) {
+            std::string hash = hash_file(path, ec);
+            return !ec && hash == hash_file(stored, ec) && !ec;
+        }
+        return !ec && fs::last_write_time(path, ec) == fs::last_write_time(stored, ec) && !ec;
+    };
+
+    // Links are recreated, as copy_template keeps them; one with the stored target counts as unchanged
+    walker.visit_links([&](const fs::path& path, const fs::path& rel) {
+        std::error_code ec;
+        fs::path link_target = fs::read_symlink(path, ec);
+        if (!ec)
+            fs::create_symlink(link_target, staging / rel, ec);
+        if (ec) {
+            walker.add_error("Cannot copy link " + path.string() + ": " + ec.message());
+            return;
+        }
+        std::error_code stored_ec;
+        fs::path stored_target = fs::read_symlink(current / rel, stored_ec);
+        if (!stored_ec && stored_target == link_target)
+            unchanged++;
+        else
+            copied++;
+    });
+    std::vector<std::string> errors = walker.run(
+        src,
+        [&](const fs::path&, const fs::path& rel) {
+            std::error_code ec;
+            fs::create_directories(staging / rel, ec);
+            if (ec)
+                walker.add_error("Cannot create " + (staging / rel).string() + ": " + ec.message());
+            return !ec;
+        },
+        [&](const fs::path& path, const fs::path& rel) {
+            fs::path stored = current / rel;
+            fs::path dst = staging / rel;
+            std::error_code ec;
+            if (is_unchanged(path, stored)) {
+                fs::create_hard_link(stored, dst, ec);
+                if (!ec) {
+                    unchanged++;
+                    return;
+                }
+                ec.clear(); // Fall back to copying the file again
+            }
+            copy_file_contents(path, dst, options.strategy, ec);
+            if (!ec)
+                fs::last_write_time(dst, fs::last_write_time(path, ec), ec);
+            if (ec) {
+                walker.add_error("Cannot copy " + path.string() + " (" + copy_strategy_name(options.strategy) + "): " + ec.message());
+                return;
+            }
+            copied++;
+        });
+    if (!report_copy_errors(errors))
+        return false;
+
+    uintmax_t removed = measure_template(current).files - existing;
+    std::cout << "Updated template: " << copied << " copied, " << unchanged << " unchanged, " << removed << " removed.\n";
+    return true;
+}
+
+/**
+ * @brief Compiles the paths save leaves out of a source directory.
+ *
+ * Ignore files are compiled once and applied by the walks; --exclude and
+ * --include given to save come last.
+ *
+ * @return The filter, or null if save keeps everything.
+ */
+std::shared_ptr<const PathFilter> save_filter(const std::string& src_dir, const CopyOptions& options, const SaveOptions& save_options) {
+    auto filter = std::make_shared<PathFilter>();
+    bool filtered = options.filter != nullptr;
+    if (save_options.gitignore) {
+        filter->add_rule(".git/");
+        filter->add_rules_file(fs::path(src_dir) / ".gitignore");
+        filtered = true;
+    }
+    filtered = filter->add_rules_file(fs::path(src_dir) / ".tmplignore") || filtered;
+    if (options.filter)
+        filter->add_filter(*options.filter);
+    return filtered ? filter : nullptr;
+}
+
+/**
+ * @brief Saves the contents of a directory as a new template with optional tags.
+ *
+ * With save_options.update an existing template is replaced instead: the new
+ * version is built in a staging directory and swapped in while holding the
+ * template's lock, so a concurrent make sees either the old or the new tree.
+ *
+ * @param t_name Name of the template to save.
+ * @param src_dir Path to the directory to be saved as a template.
+ * @param tags Optional vector of tags to associate with the template.
+ * @param options Copy options such as the number of worker threads and the copy strategy.
+ *        options.link and options.mutable_globs are stored as the template's link policy.
+ * @param save_options Options such as whether to use the object store.
+ */
+void save_template(const std::string& t_name, const std::string& src_dir, const std::vector<std::string>& tags = {},
+                   const CopyOptions& options = {}, const SaveOptions& save_options = {}) {
+    TraceScope scope("save template");
+    auto started = std::chrono::steady_clock::now();
+    if (t_name.empty() || t_name[0] == '.' || t_name.find_first_of("/\\") != std::string::npos) {
+        std::cerr << "Invalid template name: " << t_name << "\n";
+        return;
+    }
+
+    fs::path template_path = TEMPLATE_DIR / t_name;
+    bool updating = save_options.update && fs::is_directory(template_path);
+    if (fs::exists(template_path) && !updating) {
+        std::cerr << "Template with that name already exists!\n";
+        return;
+    }
+
+    if (!fs::is_directory(src_dir)) {
+        std::cerr << "Directory does not exist: " << src_dir << "\n";
+        return;
+    }
+
+    int64_t stamp_before = directory_stamp(TEMPLATE_DIR);
+
+    // The link policy applies to make; saving always copies, keeping modification times for later updates
+    CopyOptions copy_options = options;
+    copy_options.link.reset();
+    copy_options.mutable_globs.reset();
+    copy_options.preserve_times = true;
+
+    copy_options.filter = save_filter(src_dir, options, save_options);
+
+    // An update keeps the current layout and .meta entries unless told otherwise
+    bool dedup = save_options.dedup;
+    bool pack = save_options.pack;
+    bool was_deduplicated = updating && fs::exists(template_path / ".manifest");
+    MetaEntries entries;
+    if (updating) {
+        if (!dedup && !pack) {
+            dedup = fs::exists(template_path / ".manifest");
+            pack = fs::exists(template_path / ".pack");
+        }
+        entries = read_meta(template_path);
+    }
+
+    // Every save is built in staging and published with one rename, so an interrupted
+    // save leaves nothing in the store; the next save removes what it did leave in staging
+    remove_stale_staging(STATE_DIR / "staging");
+    fs::path target = staging_path(t_name);
+    {
+        std::error_code ec;
+        fs::remove_all(target, ec);
+        fs::create_directories(target, ec);
+        if (ec) {
+            std::cerr << "Cannot create " << target << ": " << ec.message() << "\n";
+            return;
+        }
+    }
+    // Keeps collect_garbage from removing the objects of this save until it is published
+    std::optional<StoreLock> objects_lock;
+    if (dedup)
+        objects_lock.emplace(OBJECTS_LOCK, true);
+
+    // Use custom copy function to exclude .meta files
+    bool plain_update = updating && !fs::exists(template_path / ".manifest") && !fs::exists(template_path / ".pack");
+    bool saved = dedup             ? store_objects(src_dir, target, copy_options)
+                 : pack            ? write_pack(src_dir, target, copy_options, save_options.compression)
+                 : plain_update    ? stage_template_update(src_dir, template_path, target, copy_options, save_options.checksum)
+                                   : copy_template(src_dir, target, copy_options);
+    // Directory templates record the hash of every file for verify; files the update shared keep theirs
+    if (saved && !dedup && !pack)
+        saved = write_checksums(target, copy_options.jobs, plain_update ? template_path : fs::path());
+    if (!saved) {
+        std::error_code ec;
+        fs::remove_all(target, ec);
+        std::cerr << "Template not saved; the store is unchanged.\n";
+        return;
+    }
+
+    if (!tags.empty())
+        set_meta_value(entries, "Tags", join_meta_list(tags));
+    // Placeholder offsets let make render files without searching them again
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [](const auto& entry) { return entry.first == "Render"; }),
+                  entries.end());
+    std::vector<std::pair<std::string, RenderEntry>> rendered;
+    if (!scan_placeholders(src_dir, copy_options.jobs, copy_options.filter, rendered)) {
+        // make would copy the files that were not scanned without rendering them
+        std::error_code ec;
+        fs::remove_all(target, ec);
+        std::cerr << "Template not saved; the store is unchanged.\n";
+        return;
+    }
+    for (const auto& [path, found] : rendered)
+        entries.emplace_back("Render", format_render_entry(path, found));
+    if (options.link)
+        set_meta_value(entries, "Link", *options.link == LinkMode::Copy ? "" : link_mode_name(*options.link));
+    if (options.mutable_globs)
+        set_meta_value(entries, "Mutable", join_meta_list(*options.mutable_globs));
+    if (std::any_of(entries.begin(), entries.end(), [](const auto& entry) { return !entry.second.empty(); }) &&
+        !write_meta(target, entries)) {
+        std::cerr << "Cannot write " << target / ".meta" << "\n";
+        std::error_code ec;
+        fs::remove_all(target, ec);
+        std::cerr << "Template not saved; the store is unchanged.\n";
+        return;
+    }
+
+    std::error_code ec;
+    if (!store().publish(target, t_name, updating, ec)) {
+        if (ec == std::errc::file_exists)
+            std::cerr << "Template with that name already exists!\n";
+        else
+            std::cerr << (updating ? "Cannot replace " : "Cannot create ") << template_path << ": " << ec.message() << "\n";
+        fs::remove_all(target, ec);
+        return;
+    }
+    objects_lock.reset();
+
+    fs::remove(PLANS_DIR / t_name, ec); // An older template of the same name may have left one
+    IndexEntry saved_entry;
+    update_index(stamp_before, [&](TemplateIndex& index) {
+        saved_entry = scan_template(t_name, index.find(t_name)); // An update keeps the template's usage
+        saved_entry.saved = std::time(nullptr);
+        index.upsert(saved_entry);
+    });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    record_throughput(dedup ? "save dedup" : pack ? "save pack" : plain_update ? "save update" : "save dir", saved_entry.files,
+                      saved_entry.bytes, elapsed.count());
+    std::cout << (updating ? "Template updated successfully!\n" : "Template saved successfully!\n");
+    if (was_deduplicated)
+        collect_garbage(); // Objects only the previous version used
+}
+
+/**
+ * @brief Fills unset link options from the Link and Mutable entries of a template's .meta.
+ *
+ * @param meta The template's .meta file.
+ * @param options Copy options to complete.
+ */
+void apply_link_policy(const MetaView& meta, CopyOptions& options) {
+    LinkMode mode;
+    if (!options.link && parse_link_mode(std::string(meta.value("Link")), mode))
+        options.link = mode;
+    if (!options.mutable_globs)
+        options.mutable_globs = parse_globs(std::string(meta.value("Mutable")));
+}
+
+/**
+ * @brief Fills unset link options from a template's Link and Mutable .meta entries.
+ *
+ * @param template_path Path to the template directory.
+ * @param options Copy options to complete.
+ */
+void apply_link_policy(const fs::path& template_path, CopyOptions& options) {
+    if (options.link && options.mutable_globs)
+        return;
+    apply_link_policy(MetaView(template_path), options);
+}
+
+/**
+ * @brief Sets the link policy make uses for a template.
+ *
+ * @param t_name Name of the template.
+ * @param mode How make materializes files not matched by the mutable globs.
+ * @param mutable_globs Files to always copy; unset keeps the current list.
+ */
+void set_link_policy(const std::string& t_name, LinkMode mode, const std::optional<std::vector<std::string>>& mutable_globs) {
+    fs::path template_path = TEMPLATE_DIR / t_name;
+    if (!fs::exists(template_path) || !fs::is_directory(template_path)) {
+        std::cout << "Template does not exist.\n";
+        return;
+    }
+    MetaEntries entries = read_meta(template_path);
+    set_meta_value(entries, "Link", mode == LinkMode::Copy ? "" : link_mode_name(mode));
+    if (mutable_globs)
+        set_meta_value(entries, "Mutable", join_meta_list(*mutable_globs));
+    if (!write_meta(template_path, entries)) {
+        std::cerr << "Cannot write " << template_path / ".meta" << "\n";
+        return;
+    }
+    std::cout << "Link policy updated.\n";
+}
+
+/**
+ * @brief Returns the absolute destination of a project, without a trailing separator.
+ */
+fs::path project_path(const std::string& dest) {
+    fs::path dest_path = (fs::current_path() / dest).lexically_normal();
+    return dest_path.has_filename() ? dest_path : dest_path.parent_path();
+}
+
+/**
+ * @brief Prepares the staging directory a project is written to before it appears at dest_path.
+ *
+ * Creates dest_path's parent if needed and removes the staging directories
+ * that interrupted makes left next to it.
+ *
+ * @return The staging path, or an empty path if the parent cannot be created (reported on stderr).
+ */
+fs::path begin_project(const fs::path& dest_path) {
+    std::error_code ec;
+    fs::create_directories(dest_path.parent_path(), ec);
+    if (ec) {
+        std::cerr << "Cannot create " << dest_path.parent_path() << ": " << ec.message() << "\n";
+        return {};
+    }
+    remove_stale_staging(dest_path.parent_path());
+    fs::path staging = project_staging_path(dest_path);
+    fs::remove_all(staging, ec);
+    return staging;
+}
+
+/**
+ * @brief Renames a project written to staging into place, or removes it if writing it failed.
+ *
+ * @param staging The staging directory from begin_project.
+ * @param dest_path The final path.
+ * @param created Whether every file was written.
+ * @return True if the project is now at dest_path; errors are reported on stderr.
+ */
+bool finish_project(const fs::path& staging, const fs::path& dest_path, bool created) {
+    std::error_code ec;
+    if (created && publish_path(staging, dest_path, ec))
+        return true;
+    if (ec == std::errc::file_exists)
+        std::cerr << "Folder already exists with the name: " << dest_path << "\n";
+    else if (ec)
+        std::cerr << "Cannot create " << dest_path << ": " << ec.message() << "\n";
+    fs::remove_all(staging, ec);
+    return false;
+}
+
+#ifdef TMPL_REGISTRY
+/**
+ * @brief Creates a new project from a template in the registry named by TMPL_REGISTRY.
+ *
+ * Only the blobs missing from the object store and the blob cache
+ * (~/.templates/.tmpl/blobs) are downloaded; they are written into the
+ * project as they arrive and kept in the blob cache for later makes.
+ *
+ * @param t_name Name of the template in the registry.
+ * @param dest Destination directory where the new project will be created.
+ * @param options Copy options such as the number of worker threads, which also fetch.
+ *        Unset link options fall back to the template's link policy.
+ * @param vars Placeholder values; files with placeholders are rendered.
+ */
+void make_from_registry(const std::string& t_name, const std::string& dest, const CopyOptions& options, const Variables& vars) {
+    TraceScope scope("make from registry");
+    const char* registry = getenv("TMPL_REGISTRY");
+    RegistryUrl url;
+    if (!registry || !*registry) {
+        std::cout << "Set TMPL_REGISTRY to the http:// URL of a registry to use registry:// templates.\n";
+        return;
+    }
+    if (!parse_registry_url(registry, url)) {
+        std::cout << "TMPL_REGISTRY must be an http:// URL; https is not supported.\n";
+        return;
+    }
+    if (t_name.empty() || t_name[0] == '.' || t_name.find_first_of("/\\") != std::string::npos) {
+        std::cout << "Invalid registry template name: " << t_name << "\n";
+        return;
+    }
+    if (fs::exists(dest)) {
+        std::cout << "Folder already exists with the name: " << dest << std::endl;
+        return;
+    }
+
+    RemoteTemplate remote;
+    MetaView meta;
+    std::string error;
+    if (!fetch_remote_template(url, t_name, remote, meta, error)) {
+        std::cout << "Cannot fetch template '" << t_name << "' from " << registry << ": " << error << "\n";
+        return;
+    }
+
+    fs::path dest_path = project_path(dest);
+    fs::path staging = begin_project(dest_path);
+    if (staging.empty())
+        return;
+    CopyOptions make_options = options;
+    apply_link_policy(meta, make_options);
+    RenderContext render;
+    if (!vars.empty()) {
+        render = {vars, read_render_entries(meta)};
+        make_options.render = &render;
+    }
+    std::error_code ec;
+    fs::create_directories(BLOB_CACHE_DIR, ec); // Without a cache the files are still written
+
+    TreeCopier copier(make_options);
+    std::vector<std::string> errors = copier.run(remote, staging);
+    if (make_options.report)
+        copier.print_report();
+    size_t files = std::count_if(remote.files.begin(), remote.files.end(), [](const RemoteFile& file) { return !file.entry.directory; });
+    std::cout << "Fetched " << copier.fetched_files() << " of " << files << " files (" << copier.fetched_bytes()
+              << " bytes); the rest came from the local cache.\n";
+    if (!finish_project(staging, dest_path, report_copy_errors(errors))) {
+        std::cerr << "Template not created; nothing was written to " << dest << ".\n";
+        return;
+    }
+    std::cout << "Template created successfully!\n";
+}
+#endif
+
+/**
+ * @brief Creates a new project from a template of a store that does not keep it in a local directory.
+ *
+ * The store's listing gives the directories, modes and links, and each file
+ * is read whole with open_blob and written in turn. Directory modes are set
+ * last, so read-only directories are filled first. The registry store has
+ * its own path, make_from_registry, which fetches blobs in parallel.
+ *
+ * @param t_name Name of the template in the store.
+ * @param dest Destination directory where the new project will be created.
+ * @param options Copy options; only the path filter applies, as there are no local files to link to.
+ * @param vars Placeholder values; files with placeholders are rendered.
+ */
+void make_from_store(const std::string& t_name, const std::string& dest, const CopyOptions& options, const Variables& vars) {
+    TraceScope scope("make from store");
+    if (fs::exists(dest)) {
+        std::cout << "Folder already exists with the name: " << dest << std::endl;
+        return;
+    }
+    MetaView meta;
+    StoreListing listing;
+    std::string error;
+    if (!store().read_meta(t_name, meta, error) || !store().read_listing(t_name, listing, error)) {
+        std::cout << (error == NO_SUCH_TEMPLATE ? "Template does not exist." : "Cannot read template '" + t_name + "': " + error) << "\n";
+        return;
+    }
+    std::map<std::string, RenderEntry> render_files;
+    if (!vars.empty())
+        render_files = read_render_entries(meta);
+
+    fs::path dest_path = project_path(dest);
+    fs::path staging = begin_project(dest_path);
+    if (staging.empty())
+        return;
+    {
+        std::error_code ec;
+        fs::create_directory(staging, ec);
+        if (ec) {
+            std::cerr << "Cannot create " << staging << ": " << ec.message() << "\n";
+            return;
+        }
+    }
+    std::vector<std::string> errors;
+    std::vector<std::pair<fs::path, fs::perms>> directory_modes;
+    for (const auto& entry : listing) {
+        if (options.filter && !options.filter->keeps(entry.path, entry.directory))
+            continue;
+        std::string path = vars.empty() ? entry.path : render_text(entry.path, vars);
+        if (!is_safe_relative_path(path)) {
+            errors.push_back("Cannot render " + entry.path + ": \"" + path + "\" is not a path inside the project");
+            continue;
+        }
+        fs::path dst = staging / path;
+        std::error_code ec;
+        if (entry.directory) {
+            fs::create_directories(dst, ec);
+            directory_modes.emplace_back(dst, entry.mode);
+        } else if (entry.symlink) {
+            fs::create_symlink(entry.link_target, dst, ec);
+        } else {
+            std::string contents;
+            if (!store().open_blob(t_name, entry, contents, error)) {
+                errors.push_back("Cannot read " + entry.path + ": " + error);
+                continue;
+            }
+            std::ofstream out(dst, std::ios::binary | std::ios::trunc);
+            if (render_files.count(entry.path)) {
+                std::vector<Placeholder> found = rescan_placeholders(contents);
+                PlaceholderFilter filter(out, found, vars);
+                filter.sputn(contents.data(), static_cast<std::streamsize>(contents.size()));
+            } else {
+                out.write(contents.data(), static_cast<std::streamsize>(contents.size()));
+            }
+            if (!out.flush())
+                ec = std::make_error_code(std::errc::io_error);
+            else
+                fs::permissions(dst, entry.mode, ec);
+        }
+        if (ec)
+            errors.push_back("Cannot write " + dst.string() + ": " + ec.message());
+    }
+    for (auto it = directory_modes.rbegin(); it != directory_modes.rend(); ++it) {
+        std::error_code ec;
+        fs::permissions(it->first, it->second, ec);
+    }
+    if (!finish_project(staging, dest_path, report_copy_errors(errors))) {
+        std::cerr << "Template not created; nothing was written to " << dest << ".\n";
+        return;
+    }
+    std::cout << "Template created successfully!\n";
+}
+
+/**
+ * @brief One template of a layered make, with the options and listing it is written with.
+ */
+struct Layer {
+    std::string name;
+    CopyOptions options;  // The make's options completed from the layer's own link policy
+    RenderContext render; // Its placeholder offsets, used when values are given
+    TemplateListing loaded;
+    const TemplateListing* listing = nullptr; // &loaded or the warm cache's copy
+    std::vector<char> mask;                   // The entries this layer writes, by listing position
+
+    size_t size() const { return listing->packed() ? listing->pack_entries.size() : listing->entries.size(); }
+    const ManifestEntry& entry(size_t i) const { return listing->packed() ? listing->pack_entries[i] : listing->entries[i]; }
+};
+
+/**
+ * @brief Splits a layered template name such as base+rust+gha into its layers.
+ */
+std::vector<std::string> split_layers(const std::string& t_name) {
+    std::vector<std::string> names;
+    for (size_t start = 0;;) {
+        size_t plus = t_name.find('+', start);
+        names.push_back(t_name.substr(start, plus - start));
+        if (plus == std::string::npos)
+            return names;
+        start = plus + 1;
+    }
+}
+
+/**
+ * @brief Whether a template name lays several templates over each other, rather than naming one.
+ */
+bool is_layered(const std::string& t_name) {
+    return t_name.find('+') != std::string::npos && !fs::exists(TEMPLATE_DIR / t_name);
+}
+
+/**
+ * @brief Reads one file of a layer, rendering its placeholders when values are given.
+ *
+ * @param contents Receives the file's contents.
+ * @return False if the file cannot be read.
+ */
+bool read_layer_file(const Layer& layer, size_t i, std::string& contents) {
+    const ManifestEntry& entry = layer.entry(i);
+    PackEntry blob;
+    if (layer.listing->packed())
+        blob = layer.listing->pack_entries[i];
+    else
+        static_cast<ManifestEntry&>(blob) = entry;
+    std::string raw, error;
+    if (!store().open_blob(layer.name, blob, raw, error))
+        return false;
+    auto found = layer.options.render ? layer.render.files.find(entry.path) : layer.render.files.end();
+    if (found == layer.render.files.end() || found->second.placeholders.empty()) {
+        contents = std::move(raw);
+        return true;
+    }
+    // The contents are at hand, so they are checked by hash whatever the template's layout
+    std::vector<Placeholder> rescanned;
+    bool stale = !found->second.describes(raw.size(), 0, hash_text(raw));
+    if (stale)
+        rescanned = rescan_placeholders(raw);
+    std::ostringstream rendered;
+    PlaceholderFilter filter(rendered, stale ? rescanned : found->second.placeholders, layer.render.vars);
+    filter.sputn(raw.data(), static_cast<std::streamsize>(raw.size()));
+    contents = rendered.str();
+    return true;
+}
+
+/**
+ * @brief Creates a new project from templates laid over each other, such as base+rust+gha.
+ *
+ * The listings of all layers are resolved in memory before anything is
+ * written: a file of a later layer replaces the same path of an earlier one,
+ * and a file replaces a directory (with its contents) or the other way round.
+ * Directories are merged. Files matching the merge globs that several layers
+ * have are concatenated in layer order instead. Every output file is then
+ * written once, by the layer that owns it, with that layer's link policy and
+ * placeholder offsets.
+ *
+ * @param names The layers, bottom first.
+ * @param dest Destination directory where the new project will be created.
+ * @param options Copy options such as the number of worker threads and the copy strategy.
+ *        Unset link options fall back to each layer's link policy.
+ * @param vars Placeholder values for every layer.
+ * @param merge_globs Files concatenated across layers rather than replaced.
+ * @return True if the project was created; errors are reported on stderr.
+ */
+bool make_layered(const std::vector<std::string>& names, const std::string& dest, const CopyOptions& options,
+                  const Variables& vars, const std::vector<std::string>& merge_globs) {
+    TraceScope scope("make layered");
+    for (const auto& name : names) {
+        if (name.empty() || name[0] == '.' || name.find_first_of("/\\") != std::string::npos ||
+            !fs::is_directory(TEMPLATE_DIR / name)) {
+            std::cout << "Template '" << name << "' does not exist.\n";
+            return false;
+        }
+    }
+    if (fs::exists(dest)) {
+        std::cout << "Folder already exists with the name: " << dest << std::endl;
+        return false;
+    }
+    fs::path dest_path = project_path(dest);
+    fs::path staging = begin_project(dest_path);
+    if (staging.empty())
+        return false;
+
+    // Keeps save --update from swapping in a new version of any layer halfway through
+    std::list<StoreLock> locks;
+    std::list<Layer> layers;
+    for (const auto& name : names) {
+        locks.emplace_back(template_lock_path(name), true);
+        Layer& layer = layers.emplace_back();
+        fs::path template_path = TEMPLATE_DIR / name;
+        layer.name = name;
+        layer.options = options;
+        apply_link_policy(template_path, layer.options);
+        if (!vars.empty()) {
+            layer.render = {vars, read_render_entries(MetaView(template_path))};
+            layer.options.render = &layer.render;
+        }
+        layer.listing = cached_listing(name, options.jobs);
+        if (!layer.listing) {
+            if (!load_template_listing(template_path, options.jobs, layer.loaded)) {
+                finish_project(staging, dest_path, false);
+                return false;
+            }
+            layer.listing = &layer.loaded;
+        }
+        layer.mask.assign(layer.size(), 0);
+    }
+
+    // The output tree by rendered path: which layer's entry ends up there, or for a merged
+    // file every layer's part. Listings put directories before their contents.
+    struct Output {
+        bool directory = false;
+        std::vector<std::pair<Layer*, size_t>> parts;
+    };
+    std::map<std::string, Output> tree;
+    {
+        TraceScope resolve_scope("resolve layers");
+        for (Layer& layer : layers) {
+            for (size_t i = 0; i < layer.size(); ++i) {
+                const ManifestEntry& entry = layer.entry(i);
+                std::string path = layer.options.render && entry.path.find("{{") != std::string::npos
+                                       ? render_text(entry.path, vars)
+                                       : entry.path;
+                if (!is_safe_relative_path(path)) {
+                    std::cerr << "Cannot render " << entry.path << " of template " << layer.name << ": \"" << path
+                              << "\" is not a path inside the project\n";
+                    finish_project(staging, dest_path, false);
+                    return false;
+                }
+                auto existing = tree.find(path);
+                if (existing != tree.end() && existing->second.directory != entry.directory) {
+                    // A file and a directory at one path: the later layer's kind wins, along with its contents
+                    std::string below = path + "/";
+                    tree.erase(tree.lower_bound(below), std::find_if(tree.lower_bound(below), tree.end(), [&](const auto& output) {
+                                   return output.first.compare(0, below.size(), below) != 0;
+                               }));
+                    existing->second.parts.clear();
+                }
+                Output& output = tree[path];
+                output.directory = entry.directory;
+                bool merged = !entry.directory && !entry.symlink && !output.parts.empty() &&
+                              !output.parts.back().first->entry(output.parts.back().second).symlink &&
+                              glob_match_any(merge_globs, path);
+                if (!entry.directory && !merged)
+                    output.parts.clear();
+                output.parts.emplace_back(&layer, i);
+            }
+        }
+    }
+
+    // Directories are created by every layer that has them, so its files have somewhere to go;
+    // fixups then leave each with the attributes of the topmost layer
+    std::vector<std::string> errors;
+    for (const auto& [path, output] : tree) {
+        if (output.directory) {
+            for (const auto& [layer, i] : output.parts)
+                layer->mask[i] = 1;
+        } else if (output.parts.size() == 1) {
+            output.parts.front().first->mask[output.parts.front().second] = 1;
+        } else {
+            TraceScope merge_scope("merge", &path);
+            std::string merged;
+            std::string part;
+            for (const auto& [layer, i] : output.parts) {
+                if (!read_layer_file(*layer, i, part)) {
+                    errors.push_back("Cannot read " + path + " of template " + layer->name);
+                    break;
+                }
+                merged += part;
+            }
+            fs::path target = staging / path;
+            std::error_code ec;
+            fs::create_directories(target.parent_path(), ec);
+            std::ofstream file(target, std::ios::binary | std::ios::trunc);
+            file.write(merged.data(), static_cast<std::streamsize>(merged.size()));
+            if (!file.flush()) {
+                errors.push_back("Cannot write " + target.string());
+                continue;
+            }
+            file.close();
+            const auto& [top, top_index] = output.parts.back();
+            if (top->entry(top_index).mode != fs::perms::none)
+                fs::permissions(target, top->entry(top_index).mode, ec);
+        }
+    }
+
+    bool created = report_copy_errors(errors);
+    for (Layer& layer : layers) {
+        if (created)
+            created = copy_listing(*layer.listing, staging, layer.options, &layer.mask);
+    }
+    if (!finish_project(staging, dest_path, created)) {
+        std::cerr << "Template not created; nothing was written to " << dest << ".\n";
+        return false;
+    }
+    std::cout << "Template created successfully from " << names.size() << " layers!\n";
+    return true;
+}
+
+/**
+ * @brief Creates a new project from a saved template.
+ *
+ * @param t_name Name of the template to use, registry://name for a template in the registry,
+ *        or layers joined by '+' such as base+rust+gha.
+ * @param dest Destination directory where the new project will be created.
+ * @param options Copy options such as the number of worker threads and the copy strategy.
+ *        Unset link options fall back to the template's link policy.
+ * @param vars Placeholder values; files with placeholders are rendered instead of copied or linked.
+ * @param merge_globs Files a layered make concatenates across layers rather than replaces.
+ */
+void make_project(const std::string& t_name, const std::string& dest, const CopyOptions& options = {}, const Variables& vars = {},
+                  const std::vector<std::string>& merge_globs = {}) {
+    TraceScope scope("make project");
+    auto started = std::chrono::steady_clock::now();
+    const std::string registry_scheme = "registry://";
+    if (t_name.compare(0, registry_scheme.size(), registry_scheme) == 0) {
+#ifdef TMPL_REGISTRY
+        make_from_registry(t_name.substr(registry_scheme.size()), dest, options, vars);
+#else
+        std::cout << "registry:// templates are not available on this platform.\n";
+#endif
+        return;
+    }
+    if (store().directory().empty()) {
+        if (t_name.find('+') != std::string::npos)
+            require_local_store("A layered make");
+#ifdef TMPL_REGISTRY
+        else if (dynamic_cast<RegistryStore*>(&store()))
+            make_from_registry(t_name, dest, options, vars); // Streams the blobs instead of copying a directory
+#endif
+        else
+            make_from_store(t_name, dest, options, vars);
+        return;
+    }
+    if (!fs::exists(TEMPLATE_DIR)) {
+        std::cout << "No templates found in: " << TEMPLATE_DIR << std::endl;
+        return;
+    }
+    if (is_layered(t_name)) {
+        std::vector<std::string> names = split_layers(t_name);
+        if (make_layered(names, dest, options, vars, merge_globs)) {
+            std::map<std::string, uintmax_t> makes;
+            for (const auto& name : names)
+                makes[name] = 1;
+            record_makes(makes);
+        }
+        return;
+    }
+
+    fs::path template_path = TEMPLATE_DIR / t_name;
+    if (!fs::exists(template_path)) {
+        std::cout << "Template '" << t_name << "' does not exist.\n";
+        return;
+    }
+
+    if (fs::exists(dest)) {
+        std::cout << "Folder already exists with the name: " << dest << std::endl;
+        return;
+    }
+
+    // The project is written to a hidden sibling and renamed into place once complete
+    fs::path dest_path = project_path(dest);
+    fs::path staging = begin_project(dest_path);
+    if (staging.empty())
+        return;
+
+    // Keeps save --update from swapping in a new version halfway through
+    StoreLock lock(template_lock_path(t_name), true);
+    CopyOptions make_options = options;
+    apply_link_policy(template_path, make_options);
+    RenderContext render;
+    if (!vars.empty()) {
+        render = {vars, read_render_entries(MetaView(template_path))};
+        make_options.render = &render;
+    }
+
+    // Templates in the object store are materialized from their manifest, packed ones from their pack
+    // and directory templates from their cached plan, so the template is only walked when it changed
+    const TemplateListing* listing = cached_listing(t_name, make_options.jobs);
+    TemplateListing loaded;
+    if (!listing && load_template_listing(template_path, make_options.jobs, loaded))
+        listing = &loaded;
+    bool created = listing && copy_listing(*listing, staging, make_options);
+    if (!finish_project(staging, dest_path, created)) {
+        std::cerr << "Template not created; nothing was written to " << dest << ".\n";
+        return;
+    }
+
+    ListingTotals totals = count_listing(*listing);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - started;
+    record_throughput(make_kind(*listing, make_options), totals.files, totals.bytes, elapsed.count());
+    record_makes({{t_name, 1}});
+    std::cout << "Template created successfully!\n";
+}
+
+/**
+ * @brief Identifies the file system holding a path, or nullopt where that is not known.
+ */
+std::optional<uint64_t> file_system_of(const fs::path& path) {
+#ifdef OS_WINDOWS
+    (void)path;
+    return std::nullopt;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return std::nullopt;
+    return static_cast<uint64_t>(st.st_dev);
+#endif
+}
+
+/**
+ * @brief Describes how files copied with a strategy would be written, probing reflinks without copying data.
+ *
+ * @param strategy The copy strategy given to the command.
+ * @param sample A file on the source file system, or empty if there is none to probe with.
+ * @param dst_dir An existing directory on the destination file system.
+ * @param bytes The bytes to be copied, for the reflink saving.
+ */
+std::string describe_copy(CopyStrategy strategy, const fs::path& sample, const fs::path& dst_dir, uintmax_t bytes) {
+    char saving[96];
+    snprintf(saving, sizeof(saving), "cloned with reflinks, sharing %.1f MB instead of copying them", bytes / 1048576.0);
+    if (strategy == CopyStrategy::Buffered)
+        return "read and written through user-space buffers (--copy-strategy=buffered)";
+    std::optional<bool> clones = strategy == CopyStrategy::Kernel || sample.empty() ? std::nullopt : reflink_supported(sample, dst_dir);
+    if (clones.value_or(false))
+        return saving;
+    if (strategy == CopyStrategy::Reflink)
+        return clones ? "would fail: --copy-strategy=reflink, but these file systems cannot clone" : "cloned with reflinks, if the file systems can";
+    if (strategy == CopyStrategy::Kernel)
+        return "copied in the kernel (--copy-strategy=kernel)";
+    return clones ? "copied in the kernel; these file systems cannot clone" : "cloned with reflinks where supported, else copied in the kernel";
+}
+
+/**
+ * @brief Prints what make would do, reading the template's listing but no file contents, and writing nothing.
+ *
+ * The listing is the one make uses: a directory template's plan is cached
+ * as make would cache it, so the make that follows does not walk it again.
+ *
+ * @param t_name Name of the template.
+ * @param dest Destination the project would be created in.
+ * @param options Copy options; unset link options fall back to the template's link policy.
+ * @param vars Placeholder values; files with placeholders would be rendered.
+ * @return False if the make would fail before writing anything.
+ */
+bool plan_make(const std::string& t_name, const std::string& dest, const CopyOptions& options, const Variables& vars) {
+    TraceScope scope("plan make");
+    if (t_name.compare(0, 11, "registry://") == 0 || is_layered(t_name) || store().directory().empty()) {
+        std::cout << "make --dry-run plans single templates of the local store only.\n";
+        return false;
+    }
+    fs::path template_path = TEMPLATE_DIR / t_name;
+    if (t_name.empty() || t_name[0] == '.' || !fs::is_directory(template_path)) {
+        std::cout << "Template '" << t_name << "' does not exist.\n";
+        return false;
+    }
+    fs::path dest_path = project_path(dest);
+    if (fs::exists(dest_path)) {
+        std::cout << "Folder already exists with the name: " << dest << std::endl;
+        return false;
+    }
+
+    CopyOptions make_options = options;
+    apply_link_policy(template_path, make_options);
+    std::map<std::string, RenderEntry> placeholders;
+    if (!vars.empty())
+        placeholders = read_render_entries(MetaView(template_path));
+    TemplateListing loaded;
+    const TemplateListing* listing = cached_listing(t_name, make_options.jobs);
+    if (!listing) {
+        if (!load_template_listing(template_path, make_options.jobs, loaded))
+            return false;
+        listing = &loaded;
+    }
+
+    // Sorts the files the way TreeCopier will handle them
+    LinkMode link = make_options.link.value_or(LinkMode::Copy);
+    std::vector<std::string> mutable_globs = make_options.mutable_globs.value_or(std::vector<std::string>{});
+    uintmax_t rendered = 0, rendered_bytes = 0, linked = 0, linked_bytes = 0, copied = 0, copied_bytes = 0;
+    fs::path sample; // A file to probe reflinks with
+    auto classify = [&](const ManifestEntry& entry) {
+        if (entry.directory || entry.symlink)
+            return;
+        auto found = placeholders.find(entry.path);
+        if (found != placeholders.end() && !found->second.placeholders.empty()) {
+            rendered++;
+            rendered_bytes += entry.size;
+        } else if (!listing->packed() && link != LinkMode::Copy && !glob_match_any(mutable_globs, entry.path)) {
+            linked++;
+            linked_bytes += entry.size;
+        } else {
+            copied++;
+            copied_bytes += entry.size;
+            if (sample.empty() && !listing->packed())
+                sample = listing->objects ? object_path(entry.hash) : template_path / entry.path;
+        }
+    };
+    if (listing->packed())
+        std::for_each(listing->pack_entries.begin(), listing->pack_entries.end(), classify);
+    else
+        std::for_each(listing->entries.begin(), listing->entries.end(), classify);
+
+    ListingTotals totals = count_listing(*listing);
+    fs::path dst_dir = existing_ancestor(dest_path.parent_path());
+    printf("Plan for make %s -> %s\n", t_name.c_str(), dest_path.string().c_str());
+    printf("  Template:    %s\n", listing->packed() ? "packed (.pack)" : listing->objects ? "in the object store (.manifest)" : "directory");
+    printf("  Entries:     %ju directories, %ju files (%.1f MB), %ju symbolic links\n", totals.directories, totals.files,
+           totals.bytes / 1048576.0, totals.links);
+    if (rendered > 0)
+        printf("  Rendered:    %ju files with placeholders (%.1f MB)\n", rendered, rendered_bytes / 1048576.0);
+    if (linked > 0) {
+        std::optional<uint64_t> from = file_system_of(listing->objects ? OBJECTS_DIR : template_path);
+        std::optional<uint64_t> to = file_system_of(dst_dir);
+        bool same_device = link == LinkMode::Symbolic || !from || !to || *from == *to;
+        printf("  Linked:      %ju files as %s links (%.1f MB not copied)%s\n", linked, link == LinkMode::Hard ? "hard" : "symbolic",
+               linked_bytes / 1048576.0, same_device ? "" : "; hard links cannot cross file systems, so they are copied");
+    }
+    if (copied > 0 && listing->packed())
+        printf("  Decoded:     %ju files (%.1f MB) from the pack\n", copied, copied_bytes / 1048576.0);
+    else if (copied > 0)
+        printf("  Copied:      %ju files (%.1f MB), %s\n", copied, copied_bytes / 1048576.0,
+               describe_copy(make_options.strategy, sample, dst_dir, copied_bytes).c_str());
+    print_estimate(make_kind(*listing, make_options), totals.files, totals.bytes);
+    return true;
+}
+
+/**
+ * @brief Prints what save would do, walking the source for names and sizes only and writing nothing.
+ *
+ * The walk applies the same ignore rules as save. Without reading contents,
+ * the object store saving of --dedup is an upper bound: the files whose size
+ * matches a stored object or another file of the tree.
+ *
+ * @param t_name Name the template would be saved under.
+ * @param src_dir Directory to save.
+ * @param options Copy options such as the number of threads.
+ * @param save_options Options such as whether to use the object store.
+ * @return False if the save would fail before writing anything.
+ */
+bool plan_save(const std::string& t_name, const std::string& src_dir, const CopyOptions& options, const SaveOptions& save_options) {
+    TraceScope scope("plan save");
+    if (t_name.empty() || t_name[0] == '.' || t_name.find_first_of("/\\") != std::string::npos) {
+        std::cerr << "Invalid template name: " << t_name << "\n";
+        return false;
+    }
+    fs::path template_path = TEMPLATE_DIR / t_name;
+    bool updating = save_options.update && fs::is_directory(template_path);
+    if (fs::exists(template_path) && !updating) {
+        std::cerr << "Template with that name already exists!\n";
+        return false;
+    }
+    if (!fs::is_directory(src_dir)) {
+        std::cerr << "Directory does not exist: " << src_dir << "\n";
+        return false;
+    }
+    bool dedup = save_options.dedup;
+    bool pack = save_options.pack;
+    if (updating && !dedup && !pack) {
+        dedup = fs::exists(template_path / ".manifest");
+        pack = fs::exists(template_path / ".pack");
+    }
+    bool plain_update = updating && !dedup && !pack && !fs::exists(template_path / ".manifest") && !fs::exists(template_path / ".pack");
+
+    ParallelWalker walker(options.jobs, save_filter(src_dir, options, save_options));
+    std::mutex entries_mutex;
+    Manifest entries;
+    std::atomic<uintmax_t> directories{0};
+    auto add_entry = [&](const fs::path& path, const fs::path& rel) {
+        ManifestEntry entry;
+        std::error_code ec;
+        if (!stat_entry(path, entry, ec)) {
+            walker.add_error("Cannot read " + path.string() + ": " + ec.message());
+            return;
+        }
+        entry.path = rel.generic_string();
+        std::lock_guard<std::mutex> lock(entries_mutex);
+        entries.push_back(std::move(entry));
+    };
+    // Only directory templates keep links; the object store and packs refuse them
+    if (dedup || pack)
+        walker.visit_links([&](const fs::path& path, const fs::path&) {
+            walker.add_error(std::string(pack ? "Cannot pack " : "Cannot store ") + path.string() +
+                             ": symbolic links are only kept by plain templates");
+        });
+    else
+        walker.visit_links(add_entry);
+    std::vector<std::string> errors = walker.run(
+        src_dir,
+        [&](const fs::path&, const fs::path& rel) {
+            if (!rel.empty())
+                directories++;
+            return true;
+        },
+        add_entry);
+    for (const auto& error : errors)
+        std::cerr << error << "\n";
+    if (!errors.empty())
+        return false;
+
+    uintmax_t files = 0, links = 0, bytes = 0, unchanged = 0, unchanged_bytes = 0;
+    fs::path sample; // A file to probe reflinks with
+    for (const auto& entry : entries) {
+        if (entry.symlink) {
+            links++;
+            continue;
+        }
+        files++;
+        bytes += entry.size;
+        if (sample.empty())
+            sample = fs::path(src_dir) / entry.path;
+        // What stage_template_update would hard-link from the current version rather than copy
+        ManifestEntry stored;
+        std::error_code ec;
+        if (plain_update && !save_options.checksum && stat_entry(template_path / entry.path, stored, ec) && !stored.symlink &&
+            stored.mode == entry.mode && stored.size == entry.size && stored.mtime == entry.mtime) {
+            unchanged++;
+            unchanged_bytes += entry.size;
+        }
+    }
+
+    printf("Plan for save %s <- %s\n", t_name.c_str(), src_dir.c_str());
+    printf("  Layout:      %s%s\n", pack ? "pack (.pack)" : dedup ? "object store (.manifest)" : "directory",
+           updating ? ", replacing the current version" : "");
+    printf("  Entries:     %ju directories, %ju files (%.1f MB), %ju symbolic links\n", directories.load(), files, bytes / 1048576.0,
+           links);
+    if (plain_update && save_options.checksum)
+        printf("  Update:      contents are compared at save time; nothing can be decided from sizes alone\n");
+    else if (plain_update)
+        printf("  Update:      %ju files (%.1f MB) unchanged and linked from the current version, %ju copied\n", unchanged,
+               unchanged_bytes / 1048576.0, files - unchanged);
+    if (dedup) {
+        // Sizes alone bound what is already stored: equal contents need equal sizes
+        std::set<uintmax_t> sizes;
+        std::error_code ec;
+        for (fs::directory_iterator it(OBJECTS_DIR, ec), end; !ec && it != end; it.increment(ec)) {
+            std::error_code size_ec;
+            uintmax_t size = it->file_size(size_ec);
+            if (!size_ec)
+                sizes.insert(size);
+        }
+        uintmax_t candidates = 0, candidate_bytes = 0;
+        for (const auto& entry : entries) {
+            if (!entry.symlink && !sizes.insert(entry.size).second) {
+                candidates++;
+                candidate_bytes += entry.size;
+            }
+        }
+        printf("  Dedup:       at most %ju files (%.1f MB) may already be stored; contents are hashed at save time\n", candidates,
+               candidate_bytes / 1048576.0);
+    }
+    if (pack)
+        printf("  Pack:        files are %s\n", save_options.compression == Compression::None ? "stored uncompressed"
+                                                : save_options.compression == Compression::Auto ? "compressed with a codec chosen per file"
+                                                                                                 : "compressed");
+    else if (files > unchanged)
+        printf("  Copied:      %ju files (%.1f MB), %s\n", files - unchanged, (bytes - unchanged_bytes) / 1048576.0,
+               describe_copy(options.strategy, sample, existing_ancestor(STATE_DIR), bytes - unchanged_bytes).c_str());
+    print_estimate(dedup ? "save dedup" : pack ? "save pack" : plain_update ? "save update" : "save dir", files, bytes);
+    return true;
+}
+
+/**
+ * @brief Creates many projects in one process from a list of template and destination pairs.
+ *
+ * Each line of the batch holds a template name and a destination separated
+ * by whitespace; blank lines and lines starting with '#' are skipped. Every
+ * distinct template is enumerated once, and all of its destinations are
+ * then written by one shared pool of workers.
+ *
+ * @param batch_path File with the pairs, or "-" for standard input.
+ * @param options Copy options such as the number of worker threads and the copy strategy.
+ *        Unset link options fall back to each template's link policy.
+ * @param vars Placeholder values for every project.
+ * @param merge_globs Files layered templates concatenate across layers.
+ * @return True if every project was created; errors are reported on stderr.
+ */
+bool make_batch(const std::string& batch_path, const CopyOptions& options = {}, const Variables& vars = {},
+                const std::vector<std::string>& merge_globs = {}) {
+    TraceScope scope("make batch");
+    std::ifstream batch_file;
+    if (batch_path != "-") {
+        batch_file.open(batch_path);
+        if (!batch_file) {
+            std::cerr << "Cannot read batch file: " << batch_path << "\n";
+            return false;
+        }
+    }
+    std::istream& in = batch_path == "-" ? std::cin : batch_file;
+
+    // Destinations grouped by template, in the order the templates first appear
+    std::vector<std::pair<std::string, std::vector<fs::path>>> groups;
+    std::set<fs::path> destinations;
+    bool ok = true;
+    std::string line;
+    for (size_t line_number = 1; std::getline(in, line); ++line_number) {
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == std::string::npos || line[start] == '#')
+            continue;
+        size_t name_end = line.find_first_of(" \t", start);
+        size_t dest_start = name_end == std::string::npos ? name_end : line.find_first_not_of(" \t", name_end);
+        if (dest_start == std::string::npos) {
+            std::cerr << batch_path << ":" << line_number << ": expected '<template> <destination>'\n";
+            ok = false;
+            continue;
+        }
+        std::string name = line.substr(start, name_end - start);
+        std::string dest = line.substr(dest_start, line.find_last_not_of(" \t\r") + 1 - dest_start);
+        fs::path dest_path = project_path(dest);
+        if (fs::exists(dest_path) || !destinations.insert(dest_path).second) {
+            std::cerr << batch_path << ":" << line_number << ": folder already exists with the name: " << dest << "\n";
+            ok = false;
+            continue;
+        }
+        auto group = std::find_if(groups.begin(), groups.end(), [&](const auto& g) { return g.first == name; });
+        if (group == groups.end())
+            group = groups.insert(groups.end(), {name, {}});
+        group->second.push_back(dest_path);
+    }
+
+    size_t created = 0;
+    std::map<std::string, uintmax_t> makes;
+    for (const auto& [name, dests] : groups) {
+        // Layers are resolved per project; each writes its own files once
+        if (is_layered(name)) {
+            std::vector<std::string> layers = split_layers(name);
+            for (const auto& dest : dests) {
+                if (make_layered(layers, dest.string(), options, vars, merge_globs)) {
+                    ++created;
+                    for (const auto& layer : layers)
+                        makes[layer]++;
+                } else {
+                    ok = false;
+                }
+            }
+            continue;
+        }
+        fs::path template_path = TEMPLATE_DIR / name;
+        if (!fs::is_directory(template_path)) {
+            std::cerr << "Template '" << name << "' does not exist.\n";
+            ok = false;
+            continue;
+        }
+        // Keeps save --update from swapping in a new version halfway through
+        StoreLock lock(template_lock_path(name), true);
+        CopyOptions make_options = options;
+        apply_link_policy(template_path, make_options);
+        RenderContext render;
+        if (!vars.empty()) {
+            render = {vars, read_render_entries(MetaView(template_path))};
+            make_options.render = &render;
+        }
+        TemplateListing loaded;
+        const TemplateListing* listing = cached_listing(name, make_options.jobs);
+        if (!listing) {
+            if (!load_template_listing(template_path, make_options.jobs, loaded)) {
+                ok = false;
+                continue;
+            }
+            listing = &loaded;
+        }
+        TreeCopier copier(make_options);
+        std::vector<std::pair<fs::path, fs::path>> staged; // Staging directory and final path
+        for (const auto& dest : dests) {
+            fs::path staging = begin_project(dest);
+            if (staging.empty()) {
+                ok = false;
+                continue;
+            }
+            copier.enqueue(*listing, staging, dest);
+            staged.emplace_back(staging, dest);
+        }
+        std::vector<std::string> errors = copier.finish();
+        if (make_options.report)
+            copier.print_report();
+        // A failed write leaves none of the template's projects behind
+        bool written = report_copy_errors(errors);
+        for (const auto& [staging, dest] : staged) {
+            if (finish_project(staging, dest, written)) {
+                ++created;
+                makes[name]++;
+            } else {
+                ok = false;
+            }
+        }
+    }
+    record_makes(makes);
+
+    std::cout << "Created " << created << " project" << (created == 1 ? "" : "s") << " from " << groups.size() << " template"
+              << (groups.size() == 1 ? "" : "s") << ".\n";
+    return ok;
+}
+
+/**
+ * @brief Which templates list shows, by tag.
+ */
+struct TagFilter {
+    std::vector<std::string> tags;    // Templates with any of these tags (all of them if match_all)
+    bool match_all = false;
+    std::vector<std::string> exclude; // Templates with none of these tags
+    std::string expression;           // Boolean query such as "cpp & (cmake | meson) & !deprecated"
+};
+
+/**
+ * @brief How list shows the templates it selected.
+ */
+struct ListOptions {
+    bool long_format = false; // One row of sizes and usage per template
+    std::string sort = "name"; // name, files, size, stored, saved, used or makes
+    bool reverse = false;
+};
+
+// Keys list can sort by; all but name put the largest or most recent first
+const char* const LIST_SORT_KEYS[] = {"name", "files", "size", "stored", "saved", "used", "makes"};
+
+/**
+ * @brief Formats a byte count with a binary unit, such as "1.4M".
+ */
+std::string format_size(uintmax_t bytes) {
+    const char* units[] = {"B", "K", "M", "G", "T"};
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while (value >= 1024 && unit + 1 < std::size(units)) {
+        value /= 1024;
+        unit++;
+    }
+    char text[32];
+    snprintf(text, sizeof(text), unit == 0 ? "%.0f%s" : "%.1f%s", value, units[unit]);
+    return text;
+}
+
+/**
+ * @brief Formats a Unix time as local "YYYY-MM-DD HH:MM", or "never" for 0.
+ */
+std::string format_time(int64_t when) {
+    if (when == 0)
+        return "never";
+    std::time_t time = static_cast<std::time_t>(when);
+    std::tm local{};
+#ifdef OS_WINDOWS
+    localtime_s(&local, &time);
+#else
+    localtime_r(&time, &local);
+#endif
+    char text[32];
+    std::strftime(text, sizeof(text), "%Y-%m-%d %H:%M", &local);
+    return text;
+}
+
+/**
+ * @brief Evaluates a boolean tag expression against the inverted tag index.
+ *
+ * Grammar: or := and ('|' and)*, and := unary ('&' unary)*,
+ * unary := '!' unary | '(' or ')' | tag. ',' is accepted as a synonym for '|'.
+ */
+class TagQuery {
+public:
+    TagQuery(const TemplateIndex& index, const std::string& expression) : index(index), text(expression) {}
+
+    /**
+     * @brief Evaluates the expression.
+     *
+     * @param result Receives the matching template IDs.
+     * @return False if the expression is malformed; error() describes the problem.
+     */
+    bool evaluate(PostingList& result) {
+        result = parse_or();
+        skip_space();
+        if (error_message.empty() && pos < text.size())
+            error_message = "unexpected '" + std::string(1, text[pos]) + "'";
+        return error_message.empty();
+    }
+
+    const std::string& error() const { return error_message; }
+
+private:
+    void skip_space() {
+        while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos])))
+            pos++;
+    }
+
+    bool accept(char c) {
+        skip_space();
+        if (pos < text.size() && text[pos] == c) {
+            pos++;
+            return true;
+        }
+        return false;
+    }
+
+    PostingList parse_or() {
+        PostingList result = parse_and();
+        while (error_message.empty() && (accept('|') || accept(',')))
+            result = posting_union(result, parse_and());
+        return result;
+    }
+
+    PostingList parse_and() {
+        PostingList result = parse_unary();
+        while (error_message.empty() && accept('&'))
+            result = posting_intersection(result, parse_unary());
+        return result;
+    }
+
+    PostingList parse_unary() {
+        if (accept('!'))
+            return posting_difference(index.all(), parse_unary());
+        if (accept('(')) {
+            PostingList result = parse_or();
+            if (error_message.empty() && !accept(')'))
+                error_message = "missing ')'";
+            return result;
+        }
+        skip_space();
+        size_t start = pos;
+        while (pos < text.size() && !std::isspace(static_cast<unsigned char>(text[pos])) &&
+               std::strchr("&|,!()", text[pos]) == nullptr)
+            pos++;
+        if (start == pos) {
+            error_message = pos < text.size() ? "unexpected '" + std::string(1, text[pos]) + "'" : "expected a tag";
+            return {};
+        }
+        return index.posting(text.substr(start, pos - start));
+    }
+
+    const TemplateIndex& index;
+    std::string text;
+    size_t pos = 0;
+    std::string error_message;
+};
+
+/**
+ * @brief Lists all saved templates, optionally filtering by tags.
+ *
+ * Sizes and usage come from the index, which save, make and delete keep up to
+ * date, so the long format reads no template.
+ *
+ * @param filter Optional tag filter, answered from the index's inverted tag index.
+ * @param list_options Format and order of the listing.
+ * @return False if the filter's expression is malformed.
+ */
+bool list_templates(const TagFilter& filter = {}, const ListOptions& list_options = {}) {
+    TraceScope scope("list templates");
+    TemplateIndex loaded;
+    std::string error;
+    const TemplateIndex* enumerated = store().enumerate(loaded, error);
+    if (!enumerated) {
+        std::cout << "Cannot list templates in \"" << store().location() << "\": " << error << "\n";
+        return false;
+    }
+    const TemplateIndex& index = *enumerated;
+    if (index.entries.empty()) {
+        std::cout << "No templates found in \"" << store().location() << "\"\n";
+        return true;
+    }
+
+    PostingList selected = index.all();
+    if (!filter.tags.empty()) {
+        PostingList tagged = filter.match_all ? index.all() : PostingList();
+        for (const auto& tag : filter.tags) {
+            tagged = filter.match_all ? posting_intersection(tagged, index.posting(tag)) : posting_union(tagged, index.posting(tag));
+        }
+        selected = posting_intersection(selected, tagged);
+    }
+    if (!filter.expression.empty()) {
+        TagQuery query(index, filter.expression);
+        PostingList matched;
+        if (!query.evaluate(matched)) {
+            std::cout << "Invalid tag query: " << query.error() << "\n";
+            return false;
+        }
+        selected = posting_intersection(selected, matched);
+    }
+    for (const auto& tag : filter.exclude)
+        selected = posting_difference(selected, index.posting(tag));
+
+    // IDs follow the names, so sorting by name is the index's own order
+    const std::string& key = list_options.sort;
+    auto value = [&](const IndexEntry& entry) -> uintmax_t {
+        return key == "files"    ? entry.files
+               : key == "size"   ? entry.bytes
+               : key == "stored" ? entry.stored
+               : key == "saved"  ? static_cast<uintmax_t>(entry.saved)
+               : key == "used"   ? static_cast<uintmax_t>(entry.used)
+                                 : entry.makes;
+    };
+    if (key != "name") {
+        std::stable_sort(selected.begin(), selected.end(),
+                         [&](uint32_t a, uint32_t b) { return value(index.entries[a]) > value(index.entries[b]); });
+    }
+    if (list_options.reverse)
+        std::reverse(selected.begin(), selected.end());
+
+    std::cout << "Available templates in \"" << store().location() << "\"\n";
+    if (list_options.long_format) {
+        size_t name_width = 4;
+        for (uint32_t id : selected)
+            name_width = std::max(name_width, index.entries[id].name.size());
+        printf("%-*s %8s %8s %8s  %-16s  %-16s %6s  %s\n", static_cast<int>(name_width), "NAME", "FILES", "SIZE", "STORED", "SAVED",
+               "LAST USED", "MAKES", "TAGS");
+        uintmax_t files = 0, bytes = 0, stored = 0;
+        for (uint32_t id : selected) {
+            const IndexEntry& entry = index.entries[id];
+            printf("%-*s %8ju %8s %8s  %-16s  %-16s %6ju  %s\n", static_cast<int>(name_width), entry.name.c_str(), entry.files,
+                   format_size(entry.bytes).c_str(), format_size(entry.stored).c_str(), format_time(entry.saved).c_str(),
+                   format_time(entry.used).c_str(), entry.makes, join_meta_list(entry.tags).c_str());
+            files += entry.files;
+            bytes += entry.bytes;
+            stored += entry.stored;
+        }
+        printf("%zu template%s, %ju files, %s, %s stored\n", selected.size(), selected.size() == 1 ? "" : "s", files,
+               format_size(bytes).c_str(), format_size(stored).c_str());
+        return true;
+    }
+    for (uint32_t id : selected) {
+        const IndexEntry& entry = index.entries[id];
+        const std::vector<std::string>& tags = entry.tags;
+        std::cout << "- " << entry.name;
+        if (!tags.empty()) {
+            std::cout << " [Tags: ";
+            for (size_t i = 0; i < tags.size(); ++i) {
+                std::cout << tags[i];
+                if (i < tags.size() - 1)
+                    std::cout << ", ";
+            }
+            std::cout << "]";
+        }
+        std::cout << std::endl;
+    }
+    return true;
+}
+
+/**
+ * @brief Rebuilds the template index, or only checks whether it is up to date.
+ *
+ * @param check_only Report staleness instead of rebuilding.
+ * @return False if check_only is set and the index is missing or stale.
+ */
+bool reindex_templates(bool check_only) {
+    TraceScope scope("reindex");
+    if (check_only) {
+        TemplateIndex index;
+        if (!read_index(index)) {
+            std::cout << "Index is missing.\n";
+            return false;
+        }
+        if (index_is_stale(index)) {
+            std::cout << "Index is stale.\n";
+            return false;
+        }
+        std::cout << "Index is up to date (" << index.entries.size() << " templates).\n";
+        return true;
+    }
+    if (!fs::is_directory(TEMPLATE_DIR)) {
+        std::cout << "No templates found in \"" << TEMPLATE_DIR.string() << "\"\n";
+        return true;
+    }
+    TemplateIndex index = rebuild_index();
+    std::error_code ec;
+    fs::remove_all(PLANS_DIR, ec); // Also forget plans that missed edits made in place
+    std::cout << "Indexed " << index.entries.size() << " templates.\n";
+    return true;
+}
+
+/**
+ * @brief A stream buffer that hashes and counts what is written to it.
+ */
+class HashingBuffer : public std::streambuf {
+public:
+    Sha256 sha;
+    uint64_t size = 0;
+
+protected:
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        sha.update(s, static_cast<size_t>(n));
+        size += static_cast<uint64_t>(n);
+        return n;
+    }
+
+    int_type overflow(int_type ch) override {
+        if (traits_type::eq_int_type(ch, traits_type::eof()))
+            return traits_type::not_eof(ch);
+        char c = traits_type::to_char_type(ch);
+        return xsputn(&c, 1) == 1 ? ch : traits_type::eof();
+    }
+};
+
+/**
+ * @brief Checks the files of a directory template against its .checksums.
+ *
+ * @param template_path Path to the template directory.
+ * @param quick Compare sizes and modification times only, without reading files.
+ * @param jobs Number of hashing threads.
+ * @param problems Receives one line per damaged, missing or unexpected entry.
+ * @return False if the template has no checksums.
+ */
+bool verify_directory(const fs::path& template_path, bool quick, unsigned jobs, std::vector<std::string>& problems) {
+    Manifest checksums;
+    if (!read_checksums(template_path, checksums))
+        return false;
+    std::unordered_map<std::string, size_t> positions;
+    for (size_t i = 0; i < checksums.size(); ++i)
+        positions.emplace(checksums[i].path, i);
+    std::vector<char> seen(checksums.size(), 0); // Each element is written by the one worker that finds its path
+
+    ParallelWalker walker(jobs);
+    auto check = [&](const fs::path& path, const fs::path& rel) {
+        std::string name = rel.generic_string();
+        auto it = positions.find(name);
+        if (it == positions.end()) {
+            walker.add_error("unexpected: " + name);
+            return;
+        }
+        const ManifestEntry& expected = checksums[it->second];
+        seen[it->second] = 1;
+        ManifestEntry entry;
+        std::error_code ec;
+        if (!stat_entry(path, entry, ec)) {
+            walker.add_error("unreadable: " + name + " (" + ec.message() + ")");
+            return;
+        }
+        bool intact;
+        if (entry.symlink || expected.symlink)
+            intact = entry.symlink && expected.symlink && hash_text(entry.link_target) == expected.hash;
+        else if (entry.size != expected.size)
+            intact = false;
+        else if (quick)
+            intact = entry.mtime == expected.mtime;
+        else
+            intact = hash_contents(path, entry.size, ec) == expected.hash;
+        if (ec)
+            walker.add_error("unreadable: " + name + " (" + ec.message() + ")");
+        else if (!intact)
+            walker.add_error("modified: " + name);
+    };
+    walker.visit_links(check);
+    problems = walker.run(template_path, [](const fs::path&, const fs::path&) { return true; }, check);
+    for (size_t i = 0; i < checksums.size(); ++i) {
+        if (!seen[i])
+            problems.push_back("missing: " + checksums[i].path);
+    }
+    return true;
+}
+
+/**
+ * @brief Checks that the store holds every object of a deduplicated template, with the right contents.
+ *
+ * @param template_path Path to the template directory.
+ * @param quick Compare object sizes only, without reading objects.
+ * @param jobs Number of hashing threads.
+ * @param problems Receives one line per missing or damaged object.
+ */
+void verify_objects(const fs::path& template_path, bool quick, unsigned jobs, std::vector<std::string>& problems) {
+    Manifest manifest;
+    read_manifest(template_path, manifest);
+    std::unordered_map<std::string, const ManifestEntry*> objects; // Each object is checked once, for its first path
+    for (const auto& entry : manifest) {
+        if (!entry.directory)
+            objects.emplace(entry.hash, &entry);
+    }
+    std::mutex problems_mutex;
+    {
+        WorkStealingPool pool(jobs);
+        for (const auto& [hash, entry] : objects) {
+            pool.submit([&, entry = entry] {
+                fs::path object = object_path(entry->hash);
+                std::error_code ec;
+                std::string problem;
+                uintmax_t size = fs::file_size(object, ec);
+                if (ec)
+                    problem = "missing: " + entry->path + " (object " + entry->hash + ")";
+                else if (size != entry->size || (!quick && hash_contents(object, size, ec) != entry->hash))
+                    problem = (ec ? "unreadable: " : "modified: ") + entry->path + " (object " + entry->hash + ")";
+                if (!problem.empty()) {
+                    std::lock_guard<std::mutex> lock(problems_mutex);
+                    problems.push_back(problem);
+                }
+            });
+        }
+        pool.wait();
+    }
+}
+
+/**
+ * @brief Checks the file table of a packed template and, unless quick, the contents of every blob.
+ *
+ * @param template_path Path to the template directory.
+ * @param quick Only check that the header and file table are sound.
+ * @param jobs Number of decoding threads.
+ * @param problems Receives one line per damaged or unreadable file.
+ */
+void verify_pack(const fs::path& template_path, bool quick, unsigned jobs, std::vector<std::string>& problems) {
+    MappedFile pack;
+    std::vector<PackEntry> entries;
+    if (!map_pack(template_path / ".pack", pack, entries)) {
+        problems.push_back("corrupt: .pack");
+        return;
+    }
+    if (quick)
+        return; // parse_pack_table has already checked that every blob lies inside the pack
+    std::mutex problems_mutex;
+    {
+        WorkStealingPool pool(jobs);
+        for (const auto& entry : entries) {
+            if (entry.directory)
+                continue;
+            pool.submit([&, entry = &entry] {
+                std::string problem;
+                if (!pack_codec_available(entry->codec)) {
+                    problem = std::string("unreadable: ") + entry->path + " (" + pack_codec_name(entry->codec) + " support not built in)";
+                } else {
+                    HashingBuffer hashed;
+                    std::ostream out(&hashed);
+                    if (!decode_blob(entry->codec, pack.data() + entry->offset, static_cast<size_t>(entry->stored_size), out) ||
+                        hashed.size != entry->size || hashed.sha.hex_digest() != entry->hash)
+                        problem = "modified: " + entry->path;
+                }
+                if (!problem.empty()) {
+                    std::lock_guard<std::mutex> lock(problems_mutex);
+                    problems.push_back(problem);
+                }
+            });
+        }
+        pool.wait();
+    }
+}
+
+/**
+ * @brief Checks one template for damaged, missing and unexpected files and prints the result.
+ *
+ * Directory templates are checked against the .checksums written by save,
+ * deduplicated templates against their manifest and packs against their file
+ * table; hashing runs on jobs threads.
+ *
+ * @param t_name Name of the template.
+ * @param quick Compare sizes and modification times instead of hashing contents.
+ * @param jobs Number of hashing threads.
+ * @return False if the template is missing or damaged.
+ */
+bool verify_template(const std::string& t_name, bool quick, unsigned jobs) {
+    TraceScope scope("verify");
+    fs::path template_path = TEMPLATE_DIR / t_name;
+    if (t_name.empty() || t_name[0] == '.' || !fs::is_directory(template_path)) {
+        std::cout << "Template does not exist: " << t_name << "\n";
+        return false;
+    }
+    std::vector<std::string> problems;
+    if (fs::exists(template_path / ".manifest")) {
+        verify_objects(template_path, quick, jobs, problems);
+    } else if (fs::exists(template_path / ".pack")) {
+        verify_pack(template_path, quick, jobs, problems);
+    } else if (!verify_directory(template_path, quick, jobs, problems)) {
+        std::cout << t_name << ": no checksums; save it again with --update to record them\n";
+        return true;
+    }
+    if (problems.empty()) {
+        std::cout << t_name << ": OK\n";
+        return true;
+    }
+    std::sort(problems.begin(), problems.end());
+    std::cout << t_name << ": " << problems.size() << " problem" << (problems.size() == 1 ? "" : "s") << "\n";
+    for (const auto& problem : problems)
+        std::cout << "  " << problem << "\n";
+    return false;
+}
+
+/**
+ * @brief Verifies the named templates, or every template in the store if names is empty.
+ *
+ * @return False if any template is missing or damaged.
+ */
+bool verify_templates(const std::vector<std::string>& names, bool quick, unsigned jobs) {
+    std::vector<std::string> targets = names;
+    if (targets.empty()) {
+        TemplateIndex storage;
+        for (const auto& entry : current_index(storage).entries)
+            targets.push_back(entry.name);
+        if (targets.empty()) {
+            std::cout << "No templates found in \"" << TEMPLATE_DIR.string() << "\"\n";
+            return true;
+        }
+    }
+    bool intact = true;
+    for (const auto& name : targets)
+        intact = verify_template(name, quick, jobs) && intact;
+    return intact;
+}
+
+/**
+ * @brief Lists the files of a template.
+ *
+ * Packed and deduplicated templates are listed from their file table or
+ * manifest alone.
+ *
+ * @param t_name Name of the template.
+ */
+void list_template_files(const std::string& t_name) {
+    TraceScope scope("list files");
+    StoreListing listing;
+    std::string error;
+    if (!store().read_listing(t_name, listing, error)) {
+        std::cout << (error == NO_SUCH_TEMPLATE ? "Template does not exist." : "Cannot list template '" + t_name + "': " + error) << "\n";
+        return;
+    }
+    for (const auto& entry : listing) {
+        printf("%04o %12ju %s%s%s\n", static_cast<unsigned>(entry.mode) & 07777, static_cast<uintmax_t>(entry.size),
+               entry.path.c_str(), entry.directory ? "/" : "", entry.symlink ? (" -> " + entry.link_target).c_str() : "");
+    }
+}
+
+/**
+ * @brief Deletes a specified template.
+ *
+ * @param template_n Name of the template to delete.
+ */
+void delete_template(const std::string& template_n) {
+    TraceScope scope("delete template");
+    std::string error;
+    if (!store().remove(template_n, error)) {
+        std::cout << (error == NO_SUCH_TEMPLATE ? "Template doesn't exist!" : "Cannot delete template '" + template_n + "': " + error) << "\n";
+        return;
+    }
+    std::cout << "Template deleted successfully!\n";
+}
+
+/**
+ * @brief Adds tags to an existing template.
+ *
+ * @param t_name Name of the template.
+ * @param tags Vector of tags to add.
+ */
+void add_tags_to_template(const std::string& t_name, const std::vector<std::string>& tags) {
+    fs::path template_path = TEMPLATE_DIR / t_name;
+    if (!fs::exists(template_path) || !fs::is_directory(template_path)) {
+        std::cout << "Template does not exist.\n";
+        return;
+    }
+    // Read existing tags
+    std::vector<std::string> existing_tags = read_tags(template_path);
+    // Add new tags if not already present
+    for (const auto& tag : tags) {
+        if (std::find(existing_tags.begin(), existing_tags.end(), tag) == existing_tags.end()) {
+            existing_tags.push_back(tag);
+        }
+    }
+    // Write back tags
+    if (!write_tags(template_path, existing_tags)) {
+        std::cerr << "Cannot write " << template_path / ".meta" << "\n";
+        return;
+    }
+    update_index(directory_stamp(TEMPLATE_DIR), [&](TemplateIndex& index) {
+        if (IndexEntry* entry = index.find(t_name)) {
+            entry->tags = existing_tags;
+            entry->stamp = template_stamp(template_path);
+        } else {
+            index.upsert(scan_template(t_name));
+        }
+    });
+    std::cout << "Tags added successfully.\n";
+}
+
+/**
+ * @brief Removes tags from an existing template.
+ *
+ * @param t_name Name of the template.
+ * @param tags Vector of tags to remove.
+ */
+void remove_tags_from_template(const std::string& t_name, const std::vector<std::string>& tags) {
+    fs::path template_path = TEMPLATE_DIR / t_name;
+    if (!fs::exists(template_path) || !fs::is_directory(template_path)) {
+        std::cout << "Template does not exist.\n";
+        return;
+    }
+    // Read existing tags
+    std::vector<std::string> existing_tags = read_tags(template_path);
+    // Remove tags if present
+    for (const auto& tag : tags) {
+        existing_tags.erase(std::remove(existing_tags.begin(), existing_tags.end(), tag), existing_tags.end());
+    }
+    // Write back tags
+    if (!write_tags(template_path, existing_tags)) {
+        std::cerr << "Cannot write " << template_path / ".meta" << "\n";
+        return;
+    }
+    update_index(directory_stamp(TEMPLATE_DIR), [&](TemplateIndex& index) {
+        if (IndexEntry* entry = index.find(t_name)) {
+            entry->tags = existing_tags;
+            entry->stamp = template_stamp(template_path);
+        } else {
+            index.upsert(scan_template(t_name));
+        }
+    });
+    std::cout << "Tags removed successfully.\n";
+}
+
+/**
+ * @brief Generates text that looks like template sources and lockfiles, with a few placeholders.
+ *
+ * @param size Approximate number of bytes to generate.
+ */
+std::string generate_scan_corpus(size_t size) {
+    static const char* const lines[] = {
+        "#include <vector>\n",
+        "int main(int argc, char** argv) {\n",
+        "    if (argc > 1) { return run(argv[1]); }\n",
+        "    for (auto& item : items) { total += item.size(); }\n",
+        "}\n",
+        "    \"dependencies\": { \"left-pad\": \"^1.3.0\", \"react\": { \"version\": \"18.2.0\" } },\n",
+        "  resolved \"https://registry.npmjs.org/lodash/-/lodash-4.17.21.tgz#679591c564c3bffaae8454cf0b3df370c3d6911c\"\n",
+        "  integrity sha512-v2kDEe57lecTulaDIuNTPy3Ry4gLGJ6Z1O3vE1krgXZNrsQ+LFTGHVxVjcXPs17LhbZVGedAJv8XZ1tvj5FvSg==\n",
+        "name = \"serde\"\nversion = \"1.0.188\"\nsource = \"registry+https://github.com/rust-lang/crates.io-index\"\n",
+        "    template <typename T> struct Wrapper { T value{}; };\n",
+        "\n",
+    };
+    const size_t line_count = sizeof(lines) / sizeof(lines[0]);
+    std::string corpus;
+    corpus.reserve(size + 128);
+    uint32_t state = 12345;
+    while (corpus.size() < size) {
+        state = state * 1103515245u + 12345u; // Fixed LCG so every run scans the same bytes
+        uint32_t pick = state >> 16;
+        if (pick % 200 == 0)
+            corpus += "// Copyright {{year}} {{author}}, project {{project_name}}\n";
+        else
+            corpus += lines[pick % line_count];
+    }
+    return corpus;
+}
+
+/**
+ * @brief Compares the placeholder scan kernels on generated or given content.
+ *
+ * @param size_mb Size of the generated corpus in MiB, used when no files are given.
+ * @param files Files to scan instead of the generated corpus.
+ * @return 0 if every kernel found the same placeholders, 1 otherwise.
+ */
+int bench_scan(size_t size_mb, const std::vector<std::string>& files) {
+    std::vector<std::string> inputs;
+    if (files.empty()) {
+        inputs.push_back(generate_scan_corpus(size_mb << 20));
+    } else {
+        for (const auto& file : files) {
+            std::ifstream in(file, std::ios::binary);
+            if (!in) {
+                std::cerr << "Cannot read " << file << "\n";
+                return 1;
+            }
+            inputs.emplace_back(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        }
+    }
+    uint64_t total = 0;
+    for (const auto& input : inputs)
+        total += input.size();
+    printf("Scanning %.1f MiB of %s\n", total / 1048576.0, files.empty() ? "generated template content" : "file content");
+    printf("%-8s %10s %14s\n", "kernel", "MiB/s", "placeholders");
+
+    size_t expected = 0;
+    bool consistent = true;
+    for (ScanKernel kernel : {ScanKernel::Scalar, ScanKernel::Memchr, ScanKernel::Sse2, ScanKernel::Avx2, ScanKernel::Neon}) {
+        if (!scan_kernel_supported(kernel))
+            continue;
+        // Best of several runs, at least a quarter of a second in total
+        double best = 0;
+        size_t count = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (int run = 0; run < 3 || std::chrono::steady_clock::now() - started < std::chrono::milliseconds(250); ++run) {
+            std::vector<Placeholder> found;
+            auto start = std::chrono::steady_clock::now();
+            for (const auto& input : inputs)
+                find_placeholders(input.data(), input.size(), 0, found, kernel);
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::max(best, total / 1048576.0 / std::max(elapsed.count(), 1e-9));
+            count = found.size();
+        }
+        if (kernel == ScanKernel::Scalar)
+            expected = count;
+        consistent = consistent && count == expected;
+        printf("%-8s %10.0f %14zu%s\n", scan_kernel_name(kernel), best, count, kernel == best_scan_kernel() ? "  (default)" : "");
+    }
+    if (!consistent) {
+        std::cerr << "Scan kernels disagree on the number of placeholders.\n";
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief A synthetic template layout for tmpl bench.
+ */
+struct BenchShape {
+    const char* name;
+    const char* description;
+    size_t files;      // Number of files at scale 1
+    uintmax_t bytes;   // Size of each file at scale 1
+    size_t fan_out;    // Files per directory
+    bool nested;       // Each directory lives inside the previous one instead of side by side
+};
+
+const BenchShape BENCH_SHAPES[] = {
+    {"tiny", "many tiny files", 10000, 512, 100, false},
+    {"huge", "a few huge files", 4, 32 << 20, 4, false},
+    {"deep", "deeply nested directories", 640, 4096, 10, true},
+    {"wide", "one wide directory", 5000, 4096, 5000, false},
+};
+
+/**
+ * @brief Writes a synthetic template.
+ *
+ * @param shape The layout to generate.
+ * @param scale Multiplies the number of files, or for shapes with fewer than ten files their size.
+ * @param root Directory to create.
+ * @param files Receives the number of files written.
+ * @param bytes Receives the number of bytes written.
+ * @return False if a file cannot be written.
+ */
+bool generate_bench_tree(const BenchShape& shape, double scale, const fs::path& root, uintmax_t& files, uintmax_t& bytes) {
+    bool scale_size = shape.files < 10;
+    files = scale_size ? shape.files : std::max<uintmax_t>(1, static_cast<uintmax_t>(shape.files * scale));
+    uintmax_t file_size = scale_size ? std::max<uintmax_t>(1, static_cast<uintmax_t>(shape.bytes * scale)) : shape.bytes;
+    bytes = files * file_size;
+
+    std::string block(COPY_BUFFER_SIZE, '\0');
+    uint32_t state = 2463534242u;
+    for (auto& c : block) {
+        state ^= state << 13, state ^= state >> 17, state ^= state << 5;
+        c = static_cast<char>('a' + state % 26);
+    }
+    fs::path dir = root;
+    for (uintmax_t i = 0; i < files; ++i) {
+        if (i % shape.fan_out == 0) {
+            size_t group = static_cast<size_t>(i / shape.fan_out);
+            dir = shape.nested ? dir / ("d" + std::to_string(group)) : root / ("d" + std::to_string(group));
+            std::error_code ec;
+            fs::create_directories(dir, ec);
+        }
+        std::ofstream out(dir / ("f" + std::to_string(i) + ".txt"), std::ios::binary);
+        for (uintmax_t left = file_size; left > 0;) {
+            size_t n = static_cast<size_t>(std::min<uintmax_t>(left, block.size()));
+            out.write(block.data(), static_cast<std::streamsize>(n));
+            left -= n;
+        }
+        if (!out)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Returns the path of the running executable, for starting child commands.
+ */
+fs::path self_executable(const char* argv0) {
+    std::error_code ec;
+#if defined(OS_WINDOWS)
+    wchar_t buffer[MAX_PATH];
+    DWORD length = GetModuleFileNameW(nullptr, buffer, MAX_PATH);
+    if (length > 0 && length < MAX_PATH)
+        return fs::path(buffer, buffer + length);
+#elif defined(__linux__)
+    fs::path self = fs::read_symlink("/proc/self/exe", ec);
+    if (!ec)
+        return self;
+#endif
+    fs::path path(argv0);
+    return path.has_parent_path() ? fs::absolute(path, ec) : path;
+}
+
+/**
+ * @brief Runs a command with its output discarded.
+ *
+ * @return True if it exited successfully.
+ */
+bool run_quietly(const std::string& command) {
+#ifdef OS_WINDOWS
+    return std::system(("\"" + command + " >NUL 2>&1\"").c_str()) == 0;
+#else
+    int status = std::system((command + " >/dev/null 2>&1").c_str());
+    return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#endif
+}
+
+std::string quote_argument(const fs::path& path) {
+    return "\"" + path.string() + "\"";
+}
+
+/**
+ * @brief Returns the nearest-rank percentile of sorted samples.
+ */
+double percentile(const std::vector<double>& sorted, double p) {
+    size_t rank = static_cast<size_t>(std::ceil(p / 100 * sorted.size()));
+    return sorted[std::min(sorted.size() - 1, rank == 0 ? 0 : rank - 1)];
+}
+
+/**
+ * @brief Settings for tmpl bench.
+ */
+struct BenchOptions {
+    std::vector<std::string> shapes;     // Names from BENCH_SHAPES; empty means all
+    std::vector<std::string> strategies; // Copy strategy names; empty means all
+    unsigned runs = 5;
+    double scale = 1.0;
+    bool keep = false; // Keep the scratch directory
+};
+
+/**
+ * @brief Times save, make and list on synthetic templates under every copy strategy.
+ *
+ * Every command runs as a child process against a scratch template store, so
+ * the numbers include process start-up like real use and the user's store is
+ * never touched. Progress goes to stderr and the results to stdout as JSON.
+ *
+ * @param argv0 argv[0], used to find the executable if the platform cannot say.
+ * @param options Shapes, strategies, runs and scale.
+ * @return 0 unless a template could not be generated; a strategy the file system
+ *         does not support is reported as a failed result instead.
+ */
+int bench_commands(const char* argv0, const BenchOptions& options) {
+    fs::path exe = self_executable(argv0);
+    std::error_code ec;
+    fs::path scratch = fs::temp_directory_path(ec) / ("tmpl-bench-" + std::to_string(process_id()));
+    fs::path home = scratch / "home";
+    fs::create_directories(home, ec);
+    if (ec) {
+        std::cerr << "Cannot create " << home << ": " << ec.message() << "\n";
+        return 1;
+    }
+    // Children read TEMPLATE_DIR from the home directory
+#ifdef OS_WINDOWS
+    _putenv_s("HOMEDRIVE", "");
+    _putenv_s("HOMEPATH", "");
+    _putenv_s("USERPROFILE", home.string().c_str());
+#else
+    setenv("HOME", home.c_str(), 1);
+#endif
+
+    std::vector<std::string> strategies = options.strategies;
+    if (strategies.empty()) {
+        for (CopyStrategy strategy : {CopyStrategy::Auto, CopyStrategy::Reflink, CopyStrategy::Kernel, CopyStrategy::Buffered})
+            strategies.push_back(copy_strategy_name(strategy));
+    }
+
+    std::ostringstream json;
+    json << "{\n  \"version\": \"" << VERSION << "\",\n  \"runs\": " << options.runs << ",\n  \"scale\": " << options.scale
+         << ",\n  \"results\": [";
+    bool first_result = true;
+    bool all_ok = true;
+    unsigned template_counter = 0;
+
+    // Runs one command options.runs times and records its timings
+    auto measure = [&](const BenchShape& shape, uintmax_t files, uintmax_t bytes, const char* command, const std::string& strategy,
+                       const std::function<std::string(unsigned)>& command_line, const std::function<void(unsigned)>& cleanup) {
+        std::vector<double> samples;
+        bool ok = true;
+        for (unsigned run = 0; run < options.runs && ok; ++run) {
+            auto start = std::chrono::steady_clock::now();
+            ok = run_quietly(command_line(run));
+            std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            samples.push_back(elapsed.count());
+            cleanup(run);
+        }
+        json << (first_result ? "\n" : ",\n") << "    {\"shape\": \"" << shape.name << "\", \"command\": \"" << command
+             << "\", \"strategy\": \"" << strategy << "\", \"files\": " << files << ", \"bytes\": " << bytes
+             << ", \"ok\": " << (ok ? "true" : "false");
+        first_result = false;
+        if (!ok) {
+            json << "}";
+            std::cerr << "  " << command << " " << strategy << ": failed\n";
+            return;
+        }
+        std::sort(samples.begin(), samples.end());
+        double mean = 0;
+        for (double sample : samples)
+            mean += sample / samples.size();
+        double median = percentile(samples, 50);
+        char line[512];
+        snprintf(line, sizeof(line),
+                 ", \"seconds\": {\"p50\": %.6f, \"p90\": %.6f, \"p99\": %.6f, \"max\": %.6f, \"mean\": %.6f}"
+                 ", \"files_per_second\": %.1f, \"mb_per_second\": %.2f}",
+                 median, percentile(samples, 90), percentile(samples, 99), samples.back(), mean, files / median,
+                 bytes / 1048576.0 / median);
+        json << line;
+        fprintf(stderr, "  %-5s %-9s p50 %8.2f ms  %10.0f files/s  %9.1f MB/s\n", command, strategy.c_str(), median * 1000,
+                files / median, bytes / 1048576.0 / median);
+    };
+
+    for (const BenchShape& shape : BENCH_SHAPES) {
+        if (!options.shapes.empty() &&
+            std::find(options.shapes.begin(), options.shapes.end(), shape.name) == options.shapes.end())
+            continue;
+        fs::path src = scratch / "src" / shape.name;
+        uintmax_t files = 0, bytes = 0;
+        if (!generate_bench_tree(shape, options.scale, src, files, bytes)) {
+            std::cerr << "Cannot generate the " << shape.name << " template in " << src << "\n";
+            all_ok = false;
+            continue;
+        }
+        fprintf(stderr, "%s: %s (%ju files, %.1f MB)\n", shape.name, shape.description, files, bytes / 1048576.0);
+
+        for (const std::string& strategy : strategies) {
+            std::string strategy_option = " --copy-strategy=" + strategy;
+            unsigned first = template_counter;
+            template_counter += options.runs;
+            measure(
+                shape, files, bytes, "save", strategy,
+                [&](unsigned run) {
+                    return quote_argument(exe) + " save bench" + std::to_string(first + run) + " " + quote_argument(src) + strategy_option;
+                },
+                [](unsigned) {});
+            fs::path out = scratch / "out";
+            measure(
+                shape, files, bytes, "make", strategy,
+                [&](unsigned run) {
+                    return quote_argument(exe) + " make bench" + std::to_string(first) + " " + quote_argument(out / std::to_string(run)) +
+                           strategy_option;
+                },
+                [&](unsigned run) {
+                    std::error_code remove_ec;
+                    fs::remove_all(out / std::to_string(run), remove_ec);
+                });
+        }
+        // list does not copy, so it is timed once per shape with every template saved so far in the store
+        measure(shape, files, bytes, "list", "none", [&](unsigned) { return quote_argument(exe) + " list"; }, [](unsigned) {});
+    }
+    json << "\n  ]\n}\n";
+    std::cout << json.str();
+
+    if (!options.keep)
+        fs::remove_all(scratch, ec);
+    else
+        std::cerr << "Scratch files kept in " << scratch << "\n";
+    return all_ok ? 0 : 1;
+}
+
+#ifdef TMPL_DAEMON
+int run_command(int argc, char* argv[]);
+
+// Where tmpl daemon listens; it lives in the store, so only clients of the same store find it
+const fs::path DAEMON_SOCKET = STATE_DIR / "daemon.sock";
+
+bool send_all(int fd, const void* data, size_t size) {
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
 }
 
-// Directory where templates are stored
-const fs::path TEMPLATE_DIR = get_home_directory() / ".templates";
-
-/**
- * @brief Reads tags from a template's .meta file.
- *
- * @param template_path Path to the template directory.
- * @return A vector of tags.
- */
-std::vector<std::string> read_tags(const fs::path& template_path) {
-    std::vector<std::string> tags;
-    std::ifstream meta_file(template_path / ".meta");
-    if (meta_file) {
-        std::string line;
-        while (std::getline(meta_file, line)) {
-            if (!line.empty() && line.substr(0, 5) == "Tags:") {
-                std::string tags_str = line.substr(5); // Remove "Tags:" prefix
-                std::stringstream ss(tags_str);
-                std::string tag;
-                while (std::getline(ss, tag, ',')) {
-                    tag.erase(std::remove_if(tag.begin(), tag.end(), ::isspace), tag.end()); // Trim whitespace
-                    tags.push_back(tag);
-                }
-            }
-        }
+bool recv_all(int fd, void* data, size_t size) {
+    char* p = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
     }
-    return tags;
+    return true;
+}
+
+void put_string(std::string& out, const std::string& value) {
+    put_le(out, value.size(), 4);
+    out += value;
+}
+
+// Reads a length-prefixed string written by put_string, advancing pos
+bool get_string(const std::string& in, size_t& pos, std::string& value) {
+    if (in.size() - pos < 4)
+        return false;
+    uint64_t length = get_le(reinterpret_cast<const unsigned char*>(in.data()) + pos, 4);
+    pos += 4;
+    if (in.size() - pos < length)
+        return false;
+    value = in.substr(pos, static_cast<size_t>(length));
+    pos += static_cast<size_t>(length);
+    return true;
+}
+
+bool daemon_address(sockaddr_un& address) {
+    address = {};
+    address.sun_family = AF_UNIX;
+    const std::string& path = DAEMON_SOCKET.native();
+    if (path.size() >= sizeof(address.sun_path))
+        return false;
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+    return true;
 }
 
 /**
- * @brief Writes tags to a template's .meta file.
+ * @brief Connects to tmpl daemon.
  *
- * @param template_path Path to the template directory.
- * @param tags A vector of tags to write.
+ * @return The connected socket, or -1 if no daemon is running.
  */
-void write_tags(const fs::path& template_path, const std::vector<std::string>& tags) {
-    std::ofstream meta_file(template_path / ".meta");
-    if (!tags.empty()) {
-        meta_file << "Tags:";
-        for (size_t i = 0; i < tags.size(); ++i) {
-            meta_file << tags[i];
-            if (i < tags.size() - 1)
-                meta_file << ",";
-        }
-        meta_file << std::endl;
+int connect_daemon() {
+    sockaddr_un address;
+    if (!daemon_address(address))
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0) {
+        close(fd);
+        return -1;
     }
+    return fd;
 }
 
 /**
- * @brief Custom recursive copy function that excludes .meta files.
+ * @brief Sends a command line to tmpl daemon, which runs it with this process's stdout and stderr.
  *
- * @param src Source path.
- * @param dst Destination path.
+ * The request is the protocol version, umask, working directory and
+ * arguments; stdout and stderr travel with it as SCM_RIGHTS descriptors. The
+ * daemon answers 'A' when it accepts the request, then the exit status.
+ *
+ * @return The command's exit status, or nullopt if the daemon refused the request.
  */
-void copy_template(const fs::path& src, const fs::path& dst) {
-    fs::create_directories(dst);
-    for (const auto& entry : fs::directory_iterator(src)) {
-        const auto& path = entry.path();
-        auto relative_path = fs::relative(path, src);
-        auto dst_path = dst / relative_path;
+std::optional<int> send_daemon_request(int fd, int argc, char* argv[]) {
+    std::string payload;
+    put_string(payload, "tmpl " VERSION);
+    put_le(payload, process_umask(), 4);
+    std::error_code ec;
+    put_string(payload, fs::current_path(ec).string());
+    if (ec)
+        return std::nullopt;
+    put_le(payload, static_cast<uint64_t>(argc), 4);
+    for (int i = 0; i < argc; ++i)
+        put_string(payload, argv[i]);
+    std::string message;
+    put_le(message, payload.size(), 4);
+    message += payload;
 
-        if (entry.is_directory()) {
-            copy_template(path, dst_path);
-        } else if (entry.is_regular_file()) {
-            if (path.filename() == ".meta") {
-                continue; // Skip copying .meta files
-            }
-            fs::copy_file(path, dst_path, fs::copy_options::overwrite_existing);
-        }
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov = {message.data(), message.size()};
+    msghdr header = {};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    cmsghdr* fd_message = CMSG_FIRSTHDR(&header);
+    fd_message->cmsg_level = SOL_SOCKET;
+    fd_message->cmsg_type = SCM_RIGHTS;
+    fd_message->cmsg_len = CMSG_LEN(sizeof(fds));
+    std::memcpy(CMSG_DATA(fd_message), fds, sizeof(fds));
+    // Everything goes in one message, so the descriptors arrive with the first byte
+    ssize_t sent = sendmsg(fd, &header, MSG_NOSIGNAL);
+    if (sent < 0)
+        return std::nullopt;
+    if (static_cast<size_t>(sent) < message.size() && !send_all(fd, message.data() + sent, message.size() - sent))
+        return std::nullopt;
+
+    char answer = 0;
+    if (!recv_all(fd, &answer, 1) || answer != 'A')
+        return std::nullopt;
+    unsigned char status[4];
+    if (!recv_all(fd, status, sizeof(status))) {
+        std::cerr << "tmpl daemon stopped before the command finished.\n";
+        return 1;
     }
+    return static_cast<int32_t>(get_le(status, 4));
 }
 
 /**
- * @brief Saves the contents of a directory as a new template with optional tags.
+ * @brief Runs list and make through tmpl daemon when one is running.
  *
- * @param t_name Name of the template to save.
- * @param src_dir Path to the directory to be saved as a template.
- * @param tags Optional vector of tags to associate with the template.
+ * Other commands, runs with TMPL_NO_DAEMON set and runs against a store other
+ * than the local directory always run in this process.
+ * make reading a batch from stdin stays local too, since only stdout and
+ * stderr are handed to the daemon.
+ *
+ * @return The exit status, or nullopt to run the command here.
  */
-void save_template(const std::string& t_name, const std::string& src_dir, const std::vector<std::string>& tags = {}) {
-    fs::path template_path = TEMPLATE_DIR / t_name;
-    if (fs::exists(template_path)) {
-        std::cerr << "Template with that name already exists!\n";
-        return;
+std::optional<int> run_in_daemon(int argc, char* argv[]) {
+    if (argc < 2 || getenv("TMPL_NO_DAEMON"))
+        return std::nullopt;
+    if (std::strcmp(argv[1], "list") != 0 && std::strcmp(argv[1], "make") != 0)
+        return std::nullopt;
+    if (store().directory().empty())
+        return std::nullopt;
+    // The daemon runs with its own environment, so makes that read TMPL_REGISTRY stay in the client
+    if (std::strcmp(argv[1], "make") == 0 && argc >= 3 && std::strncmp(argv[2], "registry://", 11) == 0)
+        return std::nullopt;
+    for (int i = 2; i < argc; ++i) {
+        if (std::strcmp(argv[i], "-") == 0)
+            return std::nullopt;
     }
+    int fd = connect_daemon();
+    if (fd < 0)
+        return std::nullopt;
+    std::optional<int> status = send_daemon_request(fd, argc, argv);
+    close(fd);
+    return status;
+}
 
-    // Use custom copy function to exclude .meta files
-    copy_template(src_dir, template_path);
-
-    if (!tags.empty()) {
-        write_tags(template_path, tags);
-    }
+volatile sig_atomic_t daemon_stopping = 0;
 
-    std::cout << "Template saved successfully!\n";
+void request_daemon_stop(int) {
+    daemon_stopping = 1;
 }
 
 /**
- * @brief Creates a new project from a saved template.
- *
- * @param t_name Name of the template to use.
- * @param dest Destination directory where the new project will be created.
+ * @brief Reads one request, runs it with the client's stdout, stderr, umask and working directory, and answers it.
  */
-void make_project(const std::string& t_name, const std::string& dest) {
-    if (!fs::exists(TEMPLATE_DIR)) {
-        std::cout << "No templates found in: " << TEMPLATE_DIR << std::endl;
-        return;
-    }
+void serve_daemon_client(int client, WarmCache& cache) {
+    timeval timeout = {5, 0}; // A client that connects and sends nothing must not stall the daemon
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
 
-    fs::path template_path = TEMPLATE_DIR / t_name;
-    if (!fs::exists(template_path)) {
-        std::cout << "Template '" << t_name << "' does not exist.\n";
-        return;
+    unsigned char length_bytes[4];
+    int fds[2] = {-1, -1};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(fds))] = {};
+    iovec iov = {length_bytes, sizeof(length_bytes)};
+    msghdr header = {};
+    header.msg_iov = &iov;
+    header.msg_iovlen = 1;
+    header.msg_control = control;
+    header.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(client, &header, MSG_CMSG_CLOEXEC);
+    for (cmsghdr* c = CMSG_FIRSTHDR(&header); c; c = CMSG_NXTHDR(&header, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && c->cmsg_len == CMSG_LEN(sizeof(fds)))
+            std::memcpy(fds, CMSG_DATA(c), sizeof(fds));
     }
+    auto close_fds = [&] {
+        for (int fd : fds) {
+            if (fd >= 0)
+                close(fd);
+        }
+    };
 
-    if (fs::exists(dest)) {
-        std::cout << "Folder already exists with the name: " << dest << std::endl;
+    std::string payload, version, cwd;
+    std::vector<std::string> args;
+    mode_t mask = 0;
+    bool valid = received > 0 && fds[0] >= 0 && fds[1] >= 0 &&
+                 (received == 4 || recv_all(client, length_bytes + received, 4 - static_cast<size_t>(received)));
+    if (valid) {
+        payload.resize(static_cast<size_t>(get_le(length_bytes, 4)));
+        size_t pos = 0;
+        valid = payload.size() < (1 << 20) && recv_all(client, payload.data(), payload.size()) &&
+                get_string(payload, pos, version) && version == "tmpl " VERSION && payload.size() - pos >= 4;
+        if (valid) {
+            mask = static_cast<mode_t>(get_le(reinterpret_cast<const unsigned char*>(payload.data()) + pos, 4)) & 0777;
+            pos += 4;
+            valid = get_string(payload, pos, cwd) && payload.size() - pos >= 4;
+        }
+        if (valid) {
+            uint64_t count = get_le(reinterpret_cast<const unsigned char*>(payload.data()) + pos, 4);
+            pos += 4;
+            for (uint64_t i = 0; valid && i < count; ++i) {
+                args.emplace_back();
+                valid = get_string(payload, pos, args.back());
+            }
+            valid = valid && args.size() >= 2;
+        }
+    }
+    // A client of another version runs the command itself
+    if (!valid || !send_all(client, valid ? "A" : "R", 1)) {
+        close_fds();
         return;
     }
 
-    fs::path dest_path = fs::current_path() / dest; // Destination path
+    std::cout.flush();
+    fflush(stdout);
+    int saved_out = dup(STDOUT_FILENO);
+    int saved_err = dup(STDERR_FILENO);
+    dup2(fds[0], STDOUT_FILENO);
+    dup2(fds[1], STDERR_FILENO);
+    close_fds();
+    mode_t saved_mask = process_umask();
+    set_process_umask(mask);
 
-    // Use custom copy function to exclude .meta files
-    copy_template(template_path, dest_path);
+    int status = 0;
+    if (chdir(cwd.c_str()) != 0) {
+        std::cerr << "tmpl daemon cannot enter " << cwd << ": " << std::strerror(errno) << "\n";
+        status = 1;
+    } else if (args[1] == "daemon") {
+        if (args.size() == 3 && args[2] == "stop") {
+            daemon_stopping = 1;
+            std::cout << "Stopped tmpl daemon.\n";
+        } else {
+            std::cout << "tmpl daemon " << VERSION << " is running (pid " << getpid() << ", " << cache.size()
+                      << " templates cached) for " << TEMPLATE_DIR << "\n";
+        }
+    } else {
+        std::vector<char*> argv;
+        for (auto& arg : args)
+            argv.push_back(arg.data());
+        argv.push_back(nullptr);
+        try {
+            status = run_command(static_cast<int>(args.size()), argv.data());
+        } catch (const std::exception& e) {
+            std::cerr << "tmpl daemon: " << e.what() << "\n";
+            status = 1;
+        }
+    }
 
-    std::cout << "Template created successfully!\n";
+    std::cout.flush();
+    fflush(stdout);
+    fflush(stderr);
+    dup2(saved_out, STDOUT_FILENO);
+    dup2(saved_err, STDERR_FILENO);
+    close(saved_out);
+    close(saved_err);
+    // A client that went away leaves the streams failed; the next one must start clean
+    std::cout.clear();
+    std::cerr.clear();
+    clearerr(stdout);
+    clearerr(stderr);
+    set_process_umask(saved_mask);
+
+    std::string answer;
+    put_le(answer, static_cast<uint32_t>(status), 4);
+    send_all(client, answer.data(), answer.size());
 }
 
 /**
- * @brief Lists all saved templates, optionally filtering by tags.
+ * @brief Serves list and make requests from memory until stopped.
  *
- * @param filter_tags Optional vector of tags to filter templates.
+ * @return 0 after a clean stop, 1 if the daemon cannot start.
  */
-void list_templates(const std::vector<std::string>& filter_tags = {}) {
-    if (!fs::exists(TEMPLATE_DIR) || !fs::is_directory(TEMPLATE_DIR) || fs::is_empty(TEMPLATE_DIR)) {
-        std::cout << "No templates found in \"" << TEMPLATE_DIR.string() << "\"\n";
-        return;
+int serve_daemon() {
+    WarmCache cache;
+    if (!cache.open()) {
+        std::cerr << "Cannot watch " << TEMPLATE_DIR << ": " << std::strerror(errno) << "\n";
+        return 1;
+    }
+    sockaddr_un address;
+    if (!daemon_address(address)) {
+        std::cerr << "The socket path " << DAEMON_SOCKET << " is too long.\n";
+        return 1;
+    }
+    int running = connect_daemon();
+    if (running >= 0) {
+        close(running);
+        std::cerr << "tmpl daemon is already running.\n";
+        return 1;
+    }
+    unlink(DAEMON_SOCKET.c_str()); // Left behind by a daemon that did not stop cleanly
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t old_mask = umask(077); // Only the owner of the store may connect
+    bool bound = listener >= 0 && bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0;
+    umask(old_mask);
+    if (!bound || listen(listener, 64) != 0) {
+        std::cerr << "Cannot listen on " << DAEMON_SOCKET << ": " << std::strerror(errno) << "\n";
+        if (listener >= 0)
+            close(listener);
+        return 1;
     }
 
-    std::cout << "Available templates in \"" << TEMPLATE_DIR.string() << "\"\n";
-    for (const auto& entry : fs::directory_iterator(TEMPLATE_DIR)) {
-        if (entry.is_directory()) {
-            std::string template_name = entry.path().filename().string();
-            std::vector<std::string> tags = read_tags(entry.path());
+    struct sigaction action = {};
+    action.sa_handler = request_daemon_stop; // No SA_RESTART, so poll returns when the daemon is asked to stop
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
 
-            // If filter_tags is not empty, check if template has any of the tags
-            bool show_template = true;
-            if (!filter_tags.empty()) {
-                // Check if any of the filter_tags are in tags
-                show_template = false;
-                for (const auto& tag : filter_tags) {
-                    if (std::find(tags.begin(), tags.end(), tag) != tags.end()) {
-                        show_template = true;
-                        break;
-                    }
-                }
-            }
-            if (show_template) {
-                std::cout << "- " << template_name;
-                if (!tags.empty()) {
-                    std::cout << " [Tags: ";
-                    for (size_t i = 0; i < tags.size(); ++i) {
-                        std::cout << tags[i];
-                        if (i < tags.size() - 1)
-                            std::cout << ", ";
-                    }
-                    std::cout << "]";
-                }
-                std::cout << std::endl;
+    WARM_CACHE = &cache;
+    while (!daemon_stopping) {
+        pollfd fds[2] = {{listener, POLLIN, 0}, {cache.fd(), POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[1].revents & POLLIN)
+            cache.drain();
+        if (fds[0].revents & POLLIN) {
+            int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client >= 0) {
+                serve_daemon_client(client, cache);
+                close(client);
             }
         }
     }
+    WARM_CACHE = nullptr;
+    close(listener);
+    unlink(DAEMON_SOCKET.c_str());
+    return 0;
 }
 
 /**
- * @brief Deletes a specified template.
+ * @brief Starts tmpl daemon in the background and waits until it accepts connections.
  *
- * @param template_n Name of the template to delete.
+ * @return 0 once the daemon is running, 1 if it could not start.
  */
-void delete_template(const std::string& template_n) {
-    if (!fs::exists(TEMPLATE_DIR / template_n) || !fs::is_directory(TEMPLATE_DIR / template_n)) {
-        std::cout << "Template doesn't exist!\n";
-        return;
+int start_daemon() {
+    int running = connect_daemon();
+    if (running >= 0) {
+        close(running);
+        std::cout << "tmpl daemon is already running.\n";
+        return 0;
     }
-    fs::remove_all(TEMPLATE_DIR / template_n); // Remove directory and its contents
-    std::cout << "Template deleted successfully!\n";
-}
-
-/**
- * @brief Adds tags to an existing template.
- *
- * @param t_name Name of the template.
- * @param tags Vector of tags to add.
- */
-void add_tags_to_template(const std::string& t_name, const std::vector<std::string>& tags) {
-    fs::path template_path = TEMPLATE_DIR / t_name;
-    if (!fs::exists(template_path) || !fs::is_directory(template_path)) {
-        std::cout << "Template does not exist.\n";
-        return;
+    std::cout.flush();
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::cerr << "Cannot start tmpl daemon: " << std::strerror(errno) << "\n";
+        return 1;
     }
-    // Read existing tags
-    std::vector<std::string> existing_tags = read_tags(template_path);
-    // Add new tags if not already present
-    for (const auto& tag : tags) {
-        if (std::find(existing_tags.begin(), existing_tags.end(), tag) == existing_tags.end()) {
-            existing_tags.push_back(tag);
+    if (pid == 0) {
+        setsid();
+        if (chdir("/") != 0)
+            std::exit(1);
+        int null = open("/dev/null", O_RDWR);
+        for (int fd : {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO})
+            dup2(null, fd);
+        if (null > STDERR_FILENO)
+            close(null);
+        std::exit(serve_daemon());
+    }
+    for (int attempt = 0; attempt < 500; ++attempt) {
+        int fd = connect_daemon();
+        if (fd >= 0) {
+            close(fd);
+            std::cout << "Started tmpl daemon (pid " << pid << ").\n";
+            return 0;
         }
+        if (waitpid(pid, nullptr, WNOHANG) == pid)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
-    // Write back tags
-    write_tags(template_path, existing_tags);
-    std::cout << "Tags added successfully.\n";
+    std::cerr << "tmpl daemon did not start; run 'tmpl daemon run' to see why.\n";
+    return 1;
 }
 
 /**
- * @brief Removes tags from an existing template.
- *
- * @param t_name Name of the template.
- * @param tags Vector of tags to remove.
+ * @brief Sends stop or status to the running daemon.
  */
-void remove_tags_from_template(const std::string& t_name, const std::vector<std::string>& tags) {
-    fs::path template_path = TEMPLATE_DIR / t_name;
-    if (!fs::exists(template_path) || !fs::is_directory(template_path)) {
-        std::cout << "Template does not exist.\n";
-        return;
+int control_daemon(int argc, char* argv[]) {
+    int fd = connect_daemon();
+    if (fd < 0) {
+        std::cout << "tmpl daemon is not running.\n";
+        return 1;
     }
-    // Read existing tags
-    std::vector<std::string> existing_tags = read_tags(template_path);
-    // Remove tags if present
-    for (const auto& tag : tags) {
-        existing_tags.erase(std::remove(existing_tags.begin(), existing_tags.end(), tag), existing_tags.end());
+    std::optional<int> status = send_daemon_request(fd, argc, argv);
+    close(fd);
+    if (!status) {
+        std::cerr << "The running tmpl daemon is a different version; stop it with kill.\n";
+        return 1;
     }
-    // Write back tags
-    write_tags(template_path, existing_tags);
-    std::cout << "Tags removed successfully.\n";
+    return *status;
 }
+#endif
 
 /**
  * @brief Prints the help menu for the program.
  */
 void print_help() {
     printf("Usage:\n");
-    printf("  save                  tmpl save <template_name> <directory_to_save> [--tags tag1,tag2,...]\n");
-    printf("  make                  tmpl make <template_name> <new_directory_name>\n");
-    printf("  list                  tmpl list [--tags tag1,tag2,...]\n");
+    printf("  save                  tmpl save <template_name> <directory_to_save> [--tags tag1,tag2,...] [--dedup|--pack] [--compress[=codec]] [--update [--checksum]] [--gitignore] [--dry-run] [copy options]\n");
+    printf("  make                  tmpl make <template_name> <new_directory_name> [--set key=value]... [--vars file] [--dry-run] [copy options]\n");
+    printf("                        tmpl make registry://<template_name> <new_directory_name> [...]   (TMPL_REGISTRY=http://host/path)\n");
+    printf("                        tmpl make <base+layer+...> <new_directory_name> [--merge glob1,...] [...]\n");
+    printf("                        tmpl make --batch <file|-> [--set key=value]... [--vars file] [copy options]\n");
+    printf("  list                  tmpl list [--tags tag1,tag2,... [--all]] [--not tag1,...] [--query EXPR] [--long] [--sort=KEY [--reverse]]\n");
+    printf("  files                 tmpl files <template_name>\n");
     printf("  delete                tmpl delete <template_name>\n");
+    printf("  reindex               tmpl reindex [--check]\n");
+    printf("  verify                tmpl verify <template_name>...|--all [--quick] [--jobs N]\n");
     printf("  tag                   tmpl tag add|remove <template_name> <tag1,tag2,...>\n");
+    printf("  link                  tmpl link <template_name> copy|hard|sym [--mutable glob1,glob2,...]\n");
+    printf("  bench                 tmpl bench [--shapes tiny,huge,deep,wide] [--strategies s1,s2,...] [--runs N] [--scale F] [--keep]\n");
+    printf("                        tmpl bench scan [--size MiB] [file...]\n");
+    printf("  daemon                tmpl daemon start|run|stop|status\n");
+    printf("  complete              tmpl complete --script bash|zsh|fish|powershell\n");
     printf("  help                  tmpl help\n");
     printf("  version               tmpl version\n");
+    printf("\nCopy options:\n");
+    printf("  --jobs N              Number of copy threads (default: hardware concurrency)\n");
+    printf("  --copy-strategy=S     auto, reflink, kernel or buffered (default: auto)\n");
+    printf("  --report              Print the strategy used for each file\n");
+    printf("  --io=B                auto, pool, uring or iocp (default: auto)\n");
+    printf("  --link=copy|hard|sym  Link immutable files to the stored template (save: store as policy)\n");
+    printf("  --mutable=globs       Files that are always copied when linking\n");
+    printf("  --exclude=rules       Leave out paths matching these .gitignore-style rules\n");
+    printf("  --include=globs       Keep only files matching these globs (or in matching directories)\n");
+    printf("\nGlobal options:\n");
+    printf("  --stats               Print time per phase, I/O counts and copy methods to stderr\n");
+    printf("  --trace FILE          Write Chrome trace events (for Perfetto) to FILE\n");
+    printf("\nEnvironment:\n");
+    printf("  TMPL_STORE=B          dir (~/.templates, the default), registry (TMPL_REGISTRY, read-only) or memory (tests)\n");
 }
 
 /**
@@ -335,34 +10384,279 @@ std::vector<std::string> parse_tags(const std::string& tags_arg) {
 }
 
 /**
- * @brief Main entry point of the program.
+ * @brief Parses a --jobs value.
+ *
+ * @param jobs_arg String containing the number of threads.
+ * @return The number of threads, or 0 if the value is not a positive integer.
  */
-int main(int argc, char* argv[]) {
+unsigned parse_jobs(const char* jobs_arg) {
+    char* end = nullptr;
+    unsigned long jobs = std::strtoul(jobs_arg, &end, 10);
+    if (end == jobs_arg || *end != '\0' || jobs == 0 || jobs > 1024)
+        return 0;
+    return static_cast<unsigned>(jobs);
+}
+
+/**
+ * @brief Matches a command-line option given as "--name value" or "--name=value".
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @param i Index of the current argument; advanced past the value if it is a separate argument.
+ * @param name Option name including the leading dashes.
+ * @return The option value, or nullptr if argv[i] is not this option.
+ */
+const char* option_value(int argc, char* argv[], int& i, const char* name) {
+    size_t length = std::strlen(name);
+    if (std::strncmp(argv[i], name, length) != 0)
+        return nullptr;
+    if (argv[i][length] == '=')
+        return argv[i] + length + 1;
+    if (argv[i][length] == '\0' && i + 1 < argc)
+        return argv[++i];
+    return nullptr;
+}
+
+/**
+ * @brief Returns a copy of a filter with comma-separated exclude rules or include globs added.
+ *
+ * @param filter The current filter; may be null.
+ * @param globs_arg The rules or globs.
+ * @param include Whether globs_arg holds include globs rather than exclude rules.
+ */
+std::shared_ptr<const PathFilter> extend_filter(const std::shared_ptr<const PathFilter>& filter, const std::string& globs_arg,
+                                                bool include) {
+    auto extended = filter ? std::make_shared<PathFilter>(*filter) : std::make_shared<PathFilter>();
+    for (const auto& glob : parse_globs(globs_arg)) {
+        if (include)
+            extended->add_include(glob);
+        else
+            extended->add_rule(glob);
+    }
+    return extended;
+}
+
+/**
+ * @brief Parses one of the copy options shared by save and make.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @param i Index of the current argument; advanced past the option's value.
+ * @param options Receives the parsed option.
+ * @return 1 if argv[i] is a copy option, 0 if it is not, -1 if its value is invalid.
+ */
+int parse_copy_option(int argc, char* argv[], int& i, CopyOptions& options) {
+    if (const char* value = option_value(argc, argv, i, "--jobs")) {
+        if ((options.jobs = parse_jobs(value)) == 0) {
+            std::cout << "Invalid value for --jobs: " << value << "\n";
+            return -1;
+        }
+    } else if (const char* value = option_value(argc, argv, i, "--copy-strategy")) {
+        if (!parse_copy_strategy(value, options.strategy)) {
+            std::cout << "Invalid value for --copy-strategy: " << value << "\n";
+            return -1;
+        }
+    } else if (std::strcmp(argv[i], "--report") == 0) {
+        options.report = true;
+    } else if (const char* value = option_value(argc, argv, i, "--io")) {
+        if (!parse_io_backend(value, options.io)) {
+            std::cout << "Invalid value for --io: " << value << "\n";
+            return -1;
+        }
+    } else if (const char* value = option_value(argc, argv, i, "--link")) {
+        LinkMode mode;
+        if (!parse_link_mode(value, mode)) {
+            std::cout << "Invalid value for --link: " << value << "\n";
+            return -1;
+        }
+        options.link = mode;
+    } else if (const char* value = option_value(argc, argv, i, "--mutable")) {
+        options.mutable_globs = parse_globs(value);
+    } else if (const char* value = option_value(argc, argv, i, "--exclude")) {
+        options.filter = extend_filter(options.filter, value, false);
+    } else if (const char* value = option_value(argc, argv, i, "--include")) {
+        options.filter = extend_filter(options.filter, value, true);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Parses one of make's own options, --set and --vars.
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @param i Index of the current argument; advanced past the option's value.
+ * @param vars Receives the placeholder values; later values replace earlier ones.
+ * @return 1 if argv[i] is a make option, 0 if it is not, -1 if its value is invalid.
+ */
+int parse_render_option(int argc, char* argv[], int& i, Variables& vars) {
+    if (const char* value = option_value(argc, argv, i, "--set")) {
+        const char* equals = std::strchr(value, '=');
+        if (!equals || equals == value) {
+            std::cout << "Invalid value for --set (expected key=value): " << value << "\n";
+            return -1;
+        }
+        vars[std::string(value, equals)] = equals + 1;
+    } else if (const char* value = option_value(argc, argv, i, "--vars")) {
+        if (!read_vars_file(value, vars))
+            return -1;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Runs the command named by argv[1].
+ *
+ * @return The process exit status.
+ */
+int run_command(int argc, char* argv[]) {
     if (argc <= 1) {
         printf("Invalid usage. For help, run:\ntmpl help\n");
         return -1;
     }
 
+    // These commands work on the template directories in place
+    for (const char* command : {"save", "reindex", "verify", "tag", "link"}) {
+        if (std::strcmp(argv[1], command) == 0 && !require_local_store(std::string("tmpl ") + command))
+            return -1;
+    }
+
     if (std::strcmp(argv[1], "save") == 0) {
         if (argc >= 4) {
             std::string template_name = argv[2];
             std::string directory_to_save = argv[3];
             std::vector<std::string> tags;
-            if (argc >= 6 && std::strcmp(argv[4], "--tags") == 0) {
-                tags = parse_tags(argv[5]);
+            CopyOptions options;
+            SaveOptions save_options;
+            bool dry_run = false;
+            for (int i = 4; i < argc; ++i) {
+                if (const char* value = option_value(argc, argv, i, "--tags")) {
+                    tags = parse_tags(value);
+                } else if (std::strcmp(argv[i], "--dry-run") == 0) {
+                    dry_run = true;
+                } else if (std::strcmp(argv[i], "--dedup") == 0) {
+                    save_options.dedup = true;
+                } else if (std::strcmp(argv[i], "--pack") == 0) {
+                    save_options.pack = true;
+                } else if (std::strcmp(argv[i], "--update") == 0) {
+                    save_options.update = true;
+                } else if (std::strcmp(argv[i], "--checksum") == 0) {
+                    save_options.checksum = true;
+                } else if (std::strcmp(argv[i], "--gitignore") == 0) {
+                    save_options.gitignore = true;
+                } else if (std::strcmp(argv[i], "--compress") == 0 || std::strncmp(argv[i], "--compress=", 11) == 0) {
+                    if (!parse_compression(argv[i][10] == '=' ? argv[i] + 11 : "auto", save_options.compression)) {
+                        std::cout << "Invalid value for --compress: " << argv[i] + 11 << "\n";
+                        return -1;
+                    }
+                    if (save_options.compression != Compression::None)
+                        save_options.pack = true;
+                } else if (int parsed = parse_copy_option(argc, argv, i, options)) {
+                    if (parsed < 0)
+                        return -1;
+                } else {
+                    std::cout << "Unknown option for 'save': " << argv[i] << "\n";
+                    return -1;
+                }
             }
-            save_template(template_name, directory_to_save, tags);
+            if (save_options.dedup && save_options.pack) {
+                std::cout << "--dedup and --pack cannot be combined.\n";
+                return -1;
+            }
+            if (dry_run)
+                return plan_save(template_name, directory_to_save, options, save_options) ? 0 : 1;
+            save_template(template_name, directory_to_save, tags, options, save_options);
         } else {
             printf("Invalid number of arguments for 'save'.\n");
             return -1;
         }
 
     } else if (std::strcmp(argv[1], "list") == 0) {
-        std::vector<std::string> filter_tags;
-        if (argc >= 4 && std::strcmp(argv[2], "--tags") == 0) {
-            filter_tags = parse_tags(argv[3]);
+        TagFilter filter;
+        ListOptions list_options;
+        for (int i = 2; i < argc; ++i) {
+            if (const char* value = option_value(argc, argv, i, "--tags")) {
+                filter.tags = parse_tags(value);
+            } else if (std::strcmp(argv[i], "--all") == 0) {
+                filter.match_all = true;
+            } else if (const char* value = option_value(argc, argv, i, "--not")) {
+                std::vector<std::string> excluded = parse_tags(value);
+                filter.exclude.insert(filter.exclude.end(), excluded.begin(), excluded.end());
+            } else if (const char* value = option_value(argc, argv, i, "--query")) {
+                filter.expression = value;
+            } else if (std::strcmp(argv[i], "--long") == 0 || std::strcmp(argv[i], "-l") == 0) {
+                list_options.long_format = true;
+            } else if (const char* value = option_value(argc, argv, i, "--sort")) {
+                if (std::find_if(std::begin(LIST_SORT_KEYS), std::end(LIST_SORT_KEYS),
+                                 [&](const char* key) { return std::strcmp(key, value) == 0; }) == std::end(LIST_SORT_KEYS)) {
+                    std::cout << "Invalid value for --sort. Use name, files, size, stored, saved, used or makes.\n";
+                    return -1;
+                }
+                list_options.sort = value;
+            } else if (std::strcmp(argv[i], "--reverse") == 0) {
+                list_options.reverse = true;
+            } else {
+                std::cout << "Unknown option for 'list': " << argv[i] << "\n";
+                return -1;
+            }
+        }
+        if (!list_templates(filter, list_options))
+            return -1;
+
+    } else if (std::strcmp(argv[1], "files") == 0) {
+        if (argc == 3) {
+            list_template_files(argv[2]);
+        } else {
+            std::cout << "Invalid number of arguments for 'files'.\n";
+            return -1;
         }
-        list_templates(filter_tags);
+
+    } else if (std::strcmp(argv[1], "reindex") == 0) {
+        bool check_only = argc >= 3 && std::strcmp(argv[2], "--check") == 0;
+        if (!reindex_templates(check_only))
+            return 1;
+
+    } else if (std::strcmp(argv[1], "verify") == 0) {
+        std::vector<std::string> names;
+        bool all = false;
+        bool quick = false;
+        unsigned jobs = default_jobs();
+        for (int i = 2; i < argc; ++i) {
+            if (std::strcmp(argv[i], "--all") == 0) {
+                all = true;
+            } else if (std::strcmp(argv[i], "--quick") == 0) {
+                quick = true;
+            } else if (const char* value = option_value(argc, argv, i, "--jobs")) {
+                if ((jobs = parse_jobs(value)) == 0) {
+                    std::cout << "Invalid value for --jobs: " << value << "\n";
+                    return -1;
+                }
+            } else if (argv[i][0] == '-') {
+                std::cout << "Unknown option for 'verify': " << argv[i] << "\n";
+                return -1;
+            } else {
+                names.push_back(argv[i]);
+            }
+        }
+        if (all == !names.empty()) {
+            std::cout << "Usage: tmpl verify <template_name>...|--all [--quick] [--jobs N]\n";
+            return -1;
+        }
+        if (!verify_templates(names, quick, jobs))
+            return 1;
+
+    } else if (std::strcmp(argv[1], "complete") == 0) {
+        if (argc >= 3 && std::strcmp(argv[2], "--script") == 0) {
+            if (argc == 4 && print_completion_script(argv[3]))
+                return 0;
+            std::cout << "Usage: tmpl complete --script bash|zsh|fish|powershell\n";
+            return -1;
+        }
+        return complete_words(std::vector<std::string_view>(argv + 2, argv + argc));
 
     } else if (std::strcmp(argv[1], "help") == 0) {
         print_help();
@@ -370,9 +10664,118 @@ int main(int argc, char* argv[]) {
     } else if (std::strcmp(argv[1], "version") == 0) {
         std::cout << "Version: " << VERSION << "\n";
 
+    } else if (std::strcmp(argv[1], "bench") == 0) {
+        if (argc >= 3 && std::strcmp(argv[2], "scan") == 0) {
+            size_t size_mb = 64;
+            std::vector<std::string> files;
+            for (int i = 3; i < argc; ++i) {
+                if (const char* value = option_value(argc, argv, i, "--size")) {
+                    size_mb = std::strtoul(value, nullptr, 10);
+                    if (size_mb == 0 || size_mb > 4096) {
+                        std::cout << "Invalid value for --size: " << value << "\n";
+                        return -1;
+                    }
+                } else {
+                    files.push_back(argv[i]);
+                }
+            }
+            return bench_scan(size_mb, files);
+        }
+        BenchOptions bench;
+        for (int i = 2; i < argc; ++i) {
+            if (const char* value = option_value(argc, argv, i, "--shapes")) {
+                bench.shapes = parse_tags(value);
+                for (const auto& shape : bench.shapes) {
+                    if (std::none_of(std::begin(BENCH_SHAPES), std::end(BENCH_SHAPES),
+                                     [&](const BenchShape& known) { return shape == known.name; })) {
+                        std::cout << "Unknown shape: " << shape << ". Use tiny, huge, deep or wide.\n";
+                        return -1;
+                    }
+                }
+            } else if (const char* value = option_value(argc, argv, i, "--strategies")) {
+                bench.strategies = parse_tags(value);
+                for (const auto& strategy : bench.strategies) {
+                    CopyStrategy parsed;
+                    if (!parse_copy_strategy(strategy, parsed)) {
+                        std::cout << "Invalid copy strategy: " << strategy << "\n";
+                        return -1;
+                    }
+                }
+            } else if (const char* value = option_value(argc, argv, i, "--runs")) {
+                bench.runs = static_cast<unsigned>(std::strtoul(value, nullptr, 10));
+                if (bench.runs == 0 || bench.runs > 1000) {
+                    std::cout << "Invalid value for --runs: " << value << "\n";
+                    return -1;
+                }
+            } else if (const char* value = option_value(argc, argv, i, "--scale")) {
+                bench.scale = std::strtod(value, nullptr);
+                if (!(bench.scale > 0) || bench.scale > 100) {
+                    std::cout << "Invalid value for --scale: " << value << "\n";
+                    return -1;
+                }
+            } else if (std::strcmp(argv[i], "--keep") == 0) {
+                bench.keep = true;
+            } else {
+                std::cout << "Unknown benchmark option: " << argv[i] << ". Use 'tmpl help'.\n";
+                return -1;
+            }
+        }
+        return bench_commands(argv[0], bench);
+
+    } else if (std::strcmp(argv[1], "daemon") == 0) {
+        std::string action = argc == 3 ? argv[2] : "";
+#ifdef TMPL_DAEMON
+        if (action == "run")
+            return serve_daemon();
+        if (action == "start")
+            return start_daemon();
+        if (action == "stop" || action == "status")
+            return control_daemon(argc, argv);
+#else
+        if (action == "run" || action == "start" || action == "stop" || action == "status") {
+            std::cout << "tmpl daemon is not available on this platform.\n";
+            return -1;
+        }
+#endif
+        std::cout << "Unknown action for 'daemon'. Use 'start', 'run', 'stop' or 'status'.\n";
+        return -1;
+
     } else if (std::strcmp(argv[1], "make") == 0) {
-        if (argc == 4) {
-            make_project(argv[2], argv[3]);
+        int i = 2;
+        const char* batch = argc >= 3 ? option_value(argc, argv, i, "--batch") : nullptr;
+        if (batch || argc >= 4) {
+            CopyOptions options;
+            Variables vars;
+            std::vector<std::string> merge_globs;
+            bool dry_run = false;
+            for (i = batch ? i + 1 : 4; i < argc; ++i) {
+                if (const char* value = option_value(argc, argv, i, "--merge")) {
+                    merge_globs = parse_globs(value);
+                    continue;
+                }
+                if (std::strcmp(argv[i], "--dry-run") == 0) {
+                    dry_run = true;
+                    continue;
+                }
+                int parsed = parse_render_option(argc, argv, i, vars);
+                if (parsed == 0)
+                    parsed = parse_copy_option(argc, argv, i, options);
+                if (parsed < 0)
+                    return -1;
+                if (parsed == 0) {
+                    std::cout << "Unknown option for 'make': " << argv[i] << "\n";
+                    return -1;
+                }
+            }
+            if (batch && dry_run) {
+                std::cout << "--dry-run and --batch cannot be combined.\n";
+                return -1;
+            }
+            if (batch)
+                return require_local_store("make --batch") && make_batch(batch, options, vars, merge_globs) ? 0 : 1;
+            if (dry_run)
+                return plan_make(argv[2], argv[3], options, vars) ? 0 : 1;
+            make_project(argv[2], argv[3], options, vars, merge_globs);
         } else {
             std::cout << "Invalid number of arguments for 'make'.\n";
             return -1;
@@ -386,6 +10789,28 @@ int main(int argc, char* argv[]) {
             return -1;
         }
 
+    } else if (std::strcmp(argv[1], "link") == 0) {
+        if (argc >= 4) {
+            LinkMode mode;
+            if (!parse_link_mode(argv[3], mode)) {
+                std::cout << "Unknown link mode. Use 'copy', 'hard' or 'sym'.\n";
+                return -1;
+            }
+            std::optional<std::vector<std::string>> mutable_globs;
+            for (int i = 4; i < argc; ++i) {
+                if (const char* value = option_value(argc, argv, i, "--mutable")) {
+                    mutable_globs = parse_globs(value);
+                } else {
+                    std::cout << "Unknown option for 'link': " << argv[i] << "\n";
+                    return -1;
+                }
+            }
+            set_link_policy(argv[2], mode, mutable_globs);
+        } else {
+            std::cout << "Invalid number of arguments for 'link'.\n";
+            return -1;
+        }
+
     } else if (std::strcmp(argv[1], "tag") == 0) {
         if (argc == 5) {
             std::string action = argv[2];
@@ -412,3 +10837,49 @@ int main(int argc, char* argv[]) {
 
     return 0;
 }
+
+#ifndef TMPL_NO_MAIN // Defined by the unit tests, which include this file
+/**
+ * @brief Main entry point of the program.
+ *
+ * --stats and --trace apply to every command, so they are taken out of argv
+ * here and the command sees the remaining arguments.
+ */
+int main(int argc, char* argv[]) {
+    // The words given to complete are a command line being typed, not options for this run
+    if (argc > 1 && std::strcmp(argv[1], "complete") == 0)
+        return run_command(argc, argv);
+
+    bool stats = false;
+    fs::path trace;
+    int kept = 1;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--stats") == 0) {
+            stats = true;
+        } else if (const char* value = option_value(argc, argv, i, "--trace")) {
+            trace = value;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = nullptr;
+    if (!stats && trace.empty()) {
+#ifdef TMPL_DAEMON
+        if (std::optional<int> status = run_in_daemon(kept, argv))
+            return *status;
+#endif
+        return run_command(kept, argv);
+    }
+
+    instrumentation().enable(stats, trace);
+    int status;
+    {
+        TraceScope scope(kept > 1 ? argv[1] : "tmpl");
+        status = run_command(kept, argv);
+    }
+    instrumentation().print_stats(std::cerr);
+    if (!instrumentation().write_trace() && status == 0)
+        status = 1;
+    return status;
+}
+#endif